@@ -30,6 +30,16 @@ int ConfigurationManager::add(const ConfigurationEntry& entry) {
     return 0;
 }
 
+int ConfigurationManager::splice(ConfigurationManager* other) {
+    while (!other->_configurations.empty()) {
+        if (add(other->_configurations.front()) != 0) {
+            return -1;
+        }
+        other->_configurations.pop_front();
+    }
+    return 0;
+}
+
 void ConfigurationManager::truncate_prefix(const int64_t first_index_kept) {
     while (!_configurations.empty()
             && _configurations.front().id.index < first_index_kept) {
@@ -56,6 +56,10 @@ public:
     // add new configuration at index
     int add(const ConfigurationEntry& entry);
 
+    // move all the configurations of |other|, which are after the ones of
+    // this manager, to the end
+    int splice(ConfigurationManager* other);
+
     // [1, first_index_kept) are being discarded
     void truncate_prefix(int64_t first_index_kept);
 
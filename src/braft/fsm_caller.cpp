@@ -38,6 +38,11 @@ DEFINE_int32(raft_fsm_caller_commit_batch, 512,
              "Max numbers of logs for the state machine to commit in a single batch");
 BRPC_VALIDATE_GFLAG(raft_fsm_caller_commit_batch, brpc::PositiveInteger);
 
+DEFINE_int32(raft_fsm_caller_prefetch_bytes, 1024 * 1024,
+             "Max bytes of committed logs read ahead at a time for the state"
+             " machine to apply");
+BRPC_VALIDATE_GFLAG(raft_fsm_caller_prefetch_bytes, brpc::PositiveInteger);
+
 FSMCaller::FSMCaller()
     : _log_manager(NULL)
     , _fsm(NULL)
@@ -563,9 +568,26 @@ IteratorImpl::IteratorImpl(StateMachine* sm, LogManager* lm,
         , _cur_index(last_applied_index)
         , _committed_index(committed_index)
         , _cur_entry(NULL)
+        , _prefetch_pos(0)
         , _applying_index(applying_index)
 { next(); }
 
+IteratorImpl::~IteratorImpl() {
+    if (_cur_entry) {
+        _cur_entry->Release();
+        _cur_entry = NULL;
+    }
+    release_prefetched();
+}
+
+void IteratorImpl::release_prefetched() {
+    for (size_t i = _prefetch_pos; i < _prefetched.size(); ++i) {
+        _prefetched[i]->Release();
+    }
+    _prefetched.clear();
+    _prefetch_pos = 0;
+}
+
 void IteratorImpl::next() {
     if (_cur_entry) {
         _cur_entry->Release();
@@ -574,7 +596,16 @@ void IteratorImpl::next() {
     if (_cur_index <= _committed_index) {
         ++_cur_index;
         if (_cur_index <= _committed_index) {
-            _cur_entry = _lm->get_entry(_cur_index);
+            if (_prefetch_pos == _prefetched.size()) {
+                _prefetched.clear();
+                _prefetch_pos = 0;
+                _lm->get_entries(_cur_index, _committed_index,
+                                 FLAGS_raft_fsm_caller_prefetch_bytes,
+                                 &_prefetched);
+            }
+            if (_prefetch_pos < _prefetched.size()) {
+                _cur_entry = _prefetched[_prefetch_pos++];
+            }
             if (_cur_entry == NULL) {
                 _error.set_type(ERROR_TYPE_LOG);
                 _error.status().set_error(-1,
@@ -609,6 +640,7 @@ void IteratorImpl::set_error_and_rollback(
         _cur_entry->Release();
         _cur_entry = NULL;
     }
+    release_prefetched();
     _error.set_type(ERROR_TYPE_STATE_MACHINE);
     _error.status().set_error(ESTATEMACHINE, 
             "StateMachine meet critical error when applying one "
@@ -59,7 +59,8 @@ private:
                  int64_t last_applied_index,
                  int64_t committed_index,
                  butil::atomic<int64_t>* applying_index);
-    ~IteratorImpl() {}
+    ~IteratorImpl();
+    void release_prefetched();
 friend class FSMCaller;
     StateMachine* _sm;
     LogManager* _lm;
@@ -68,6 +69,9 @@ friend class FSMCaller;
     int64_t _cur_index;
     int64_t _committed_index;
     LogEntry* _cur_entry;
+    // Entries read ahead from LogManager in a single range read
+    std::vector<LogEntry*> _prefetched;
+    size_t _prefetch_pos;
     butil::atomic<int64_t>* _applying_index;
     Error _error;
 };
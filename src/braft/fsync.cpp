@@ -15,7 +15,21 @@
 // Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
 
 #include "braft/fsync.h"
+#include <sys/stat.h>                                // fstat
+#include <sys/utsname.h>                             // uname
+#include <stdio.h>                                   // sscanf
+#include <errno.h>
+#include <map>
+#include <vector>
+#include <butil/time.h>
+#include <butil/atomicops.h>
+#include <butil/logging.h>
+#include <butil/memory/singleton_on_pthread_once.h>  // butil::get_leaky_singleton
+#include <bthread/countdown_event.h>                 // bthread::CountdownEvent
+#include <bthread/condition_variable.h>
+#include <bvar/bvar.h>
 #include <brpc/reloadable_flags.h>  //BRPC_VALIDATE_GFLAG
+#include "braft/macros.h"
 
 namespace braft {
 
@@ -28,4 +42,226 @@ DEFINE_bool(raft_use_bthread_fsync, true, "Use iouring to submit fsync which onl
 BRPC_VALIDATE_GFLAG(raft_use_fsync_rather_than_fdatasync,
                          brpc::PassValidate);
 
+DEFINE_bool(raft_sync_coordinator, false,
+            "Delegate the sync of segments to a process-wide coordinator which"
+            " collects the segments of all the raft groups and syncs them"
+            " together, each file only once per round, see"
+            " raft_sync_coordinator_use_syncfs");
+BRPC_VALIDATE_GFLAG(raft_sync_coordinator, brpc::PassValidate);
+
+DEFINE_int32(raft_sync_coordinator_window_us, 200,
+             "Time the sync coordinator waits to collect more files after"
+             " the first one arrives");
+BRPC_VALIDATE_GFLAG(raft_sync_coordinator_window_us, brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_sync_coordinator_use_syncfs, false,
+            "Flush all the collected files on the same filesystem with a single"
+            " syncfs() instead of syncing them one by one. It only takes effect"
+            " on linux >= 5.8 where syncfs() reports write errors. NOTE:"
+            " syncfs() flushes all the dirty data of the filesystem, so the"
+            " latency depends on the other writers, and the errors are those"
+            " of the whole filesystem seen since the first collected file was"
+            " opened: an error of another writer fails all the groups, while"
+            " one of another segment before that open is missed");
+BRPC_VALIDATE_GFLAG(raft_sync_coordinator_use_syncfs, brpc::PassValidate);
+
+static bvar::Adder<int64_t> g_coordinated_fsync_count(
+        "raft_sync_coordinator_fsync_count");
+static bvar::PerSecond<bvar::Adder<int64_t> > g_coordinated_fsync_second(
+        "raft_sync_coordinator_fsync_second", &g_coordinated_fsync_count);
+static bvar::CounterRecorder g_coordinated_sync_batch(
+        "raft_sync_coordinator_batch");
+static bvar::LatencyRecorder g_coordinated_sync_latency(
+        "raft_sync_coordinator_wait");
+
+// syncfs() reports the write errors of the filesystem since linux 5.8,
+// before that it may return 0 while some data was never written.
+static bool syncfs_reports_errors() {
+#ifdef __linux__
+    struct utsname u;
+    int major = 0;
+    int minor = 0;
+    if (uname(&u) != 0 || sscanf(u.release, "%d.%d", &major, &minor) != 2) {
+        return false;
+    }
+    return major > 5 || (major == 5 && minor >= 8);
+#else
+    return false;
+#endif
+}
+
+class SyncCoordinator {
+public:
+    struct Request {
+        Request(int fd_) : fd(fd_), rc(0), error(0) {}
+        int fd;
+        int rc;
+        int error;
+        bthread::CountdownEvent done;
+    };
+
+    SyncCoordinator() : _syncfs_usable(syncfs_reports_errors()), _started(false) {}
+
+    int sync(int fd) {
+        const int64_t start_us = butil::cpuwide_time_us();
+        Request req(fd);
+        {
+            std::unique_lock<raft_mutex_t> lck(_mutex);
+            if (!_started) {
+                bthread_t tid;
+                if (bthread_start_background(&tid, NULL, run, this) != 0) {
+                    lck.unlock();
+                    return raft_fsync(fd);
+                }
+                _started = true;
+            }
+            _pending.push_back(&req);
+            if (_pending.size() == 1) {
+                _cond.notify_one();
+            }
+        }
+        req.done.wait();
+        g_coordinated_sync_latency << butil::cpuwide_time_us() - start_us;
+        if (req.rc != 0) {
+            errno = req.error;
+        }
+        return req.rc;
+    }
+
+private:
+    // The requests of the same file
+    struct FileSync {
+        int fd;
+        std::vector<Request*> requests;
+    };
+
+    static void finish(const std::vector<Request*>& requests, int rc, int error) {
+        for (size_t i = 0; i < requests.size(); ++i) {
+            requests[i]->rc = rc;
+            requests[i]->error = error;
+            requests[i]->done.signal();
+        }
+    }
+
+    static void* sync_file(void* arg) {
+        FileSync* f = (FileSync*)arg;
+        const int rc = raft_fsync(f->fd);
+        finish(f->requests, rc, errno);
+        return NULL;
+    }
+
+    static void* run(void* arg) {
+        SyncCoordinator* c = (SyncCoordinator*)arg;
+        std::vector<Request*> batch;
+        while (true) {
+            {
+                std::unique_lock<raft_mutex_t> lck(c->_mutex);
+                while (c->_pending.empty()) {
+                    c->_cond.wait(lck);
+                }
+            }
+            if (FLAGS_raft_sync_coordinator_window_us > 0) {
+                bthread_usleep(FLAGS_raft_sync_coordinator_window_us);
+            }
+            {
+                BAIDU_SCOPED_LOCK(c->_mutex);
+                batch.swap(c->_pending);
+            }
+            c->flush(batch);
+            batch.clear();
+        }
+        return NULL;
+    }
+
+    void flush(const std::vector<Request*>& batch) {
+        g_coordinated_sync_batch << batch.size();
+        // All the requesters are blocked and hold their fds, so the same fd
+        // refers to the same file and has to be synced only once
+        std::map<int, FileSync> files;
+        for (size_t i = 0; i < batch.size(); ++i) {
+            FileSync& f = files[batch[i]->fd];
+            f.fd = batch[i]->fd;
+            f.requests.push_back(batch[i]);
+        }
+        std::vector<FileSync*> to_sync;
+        to_sync.reserve(files.size());
+        if (FLAGS_raft_sync_coordinator_use_syncfs
+                && _syncfs_usable.load(butil::memory_order_relaxed)) {
+            sync_filesystems(&files, &to_sync);
+        } else {
+            for (std::map<int, FileSync>::iterator
+                    it = files.begin(); it != files.end(); ++it) {
+                to_sync.push_back(&it->second);
+            }
+        }
+        if (to_sync.empty()) {
+            return;
+        }
+        // Sync the files concurrently, each signals its requesters as soon
+        // as it's done
+        g_coordinated_fsync_count << to_sync.size();
+        std::vector<bthread_t> tids(to_sync.size(), INVALID_BTHREAD);
+        for (size_t i = 1; i < to_sync.size(); ++i) {
+            if (bthread_start_background(&tids[i], NULL, sync_file,
+                                         to_sync[i]) != 0) {
+                tids[i] = INVALID_BTHREAD;
+                sync_file(to_sync[i]);
+            }
+        }
+        sync_file(to_sync[0]);
+        for (size_t i = 1; i < tids.size(); ++i) {
+            if (tids[i] != INVALID_BTHREAD) {
+                bthread_join(tids[i], NULL);
+            }
+        }
+    }
+
+    // One syncfs() per filesystem, the files not synced by it are pushed
+    // into |to_sync|
+    void sync_filesystems(std::map<int, FileSync>* files,
+                          std::vector<FileSync*>* to_sync) {
+        std::map<dev_t, std::vector<FileSync*> > filesystems;
+        for (std::map<int, FileSync>::iterator
+                it = files->begin(); it != files->end(); ++it) {
+            struct stat st;
+            if (fstat(it->first, &st) == 0) {
+                filesystems[st.st_dev].push_back(&it->second);
+            } else {
+                to_sync->push_back(&it->second);
+            }
+        }
+        for (std::map<dev_t, std::vector<FileSync*> >::iterator
+                it = filesystems.begin(); it != filesystems.end(); ++it) {
+            const std::vector<FileSync*>& fs_files = it->second;
+            int rc = -1;
+            int error = ENOSYS;
+#ifdef __linux__
+            rc = syncfs(fs_files[0]->fd);
+            error = errno;
+#endif
+            if (rc != 0 && error == ENOSYS) {
+                LOG_ONCE(WARNING) << "syncfs is not supported, sync the files"
+                                     " one by one";
+                _syncfs_usable.store(false, butil::memory_order_relaxed);
+                to_sync->insert(to_sync->end(), fs_files.begin(), fs_files.end());
+                continue;
+            }
+            g_coordinated_fsync_count << 1;
+            for (size_t i = 0; i < fs_files.size(); ++i) {
+                finish(fs_files[i]->requests, rc, error);
+            }
+        }
+    }
+
+    butil::atomic<bool> _syncfs_usable;
+    raft_mutex_t _mutex;
+    bthread::ConditionVariable _cond;
+    std::vector<Request*> _pending;
+    bool _started;
+};
+
+int coordinated_fsync(int fd) {
+    return butil::get_leaky_singleton<SyncCoordinator>()->sync(fd);
+}
+
 }  //  namespace braft
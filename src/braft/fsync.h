@@ -28,6 +28,7 @@ namespace braft {
 
 DECLARE_bool(raft_use_fsync_rather_than_fdatasync);
 DECLARE_bool(raft_use_bthread_fsync);
+DECLARE_bool(raft_sync_coordinator);
 
 inline int raft_fsync(int fd) {
     if (FLAGS_raft_use_fsync_rather_than_fdatasync) {
@@ -54,6 +55,15 @@ inline bool raft_sync_meta() {
     return FLAGS_raft_sync || FLAGS_raft_sync_meta;
 }
 
+// Sync |fd| through the process-wide sync coordinator, which collects the
+// files to be synced by all the raft groups within raft_sync_coordinator_window_us
+// and flushes them together in a background bthread: each distinct file is
+// synced once and concurrently, or with a single syncfs() per filesystem if
+// raft_sync_coordinator_use_syncfs is set.
+// Blocks until |fd| is durable, returns 0 on success, -1 otherwise with
+// errno set.
+int coordinated_fsync(int fd);
+
 }  //  namespace braft
 
 #endif  //BRAFT_FSYNC_H
@@ -18,6 +18,8 @@
 
 #include "braft/log.h"
 
+#include <sys/mman.h>                                 // mmap
+#include <set>
 #include <gflags/gflags.h>
 #include <butil/files/dir_reader_posix.h>            // butil::DirReaderPosix
 #include <butil/file_util.h>                         // butil::CreateDirectory
@@ -25,10 +27,15 @@
 #include <butil/time.h>
 #include <butil/raw_pack.h>                          // butil::RawPacker
 #include <butil/fd_utility.h>                        // butil::make_close_on_exec
+#include <butil/memory/singleton_on_pthread_once.h>  // butil::get_leaky_singleton
+#include <bthread/execution_queue.h>                 // bthread::ExecutionQueueId
 #include <brpc/reloadable_flags.h>             // 
+#include <brpc/policy/snappy_compress.h>       // brpc::policy::SnappyCompress
+#include <brpc/policy/gzip_compress.h>         // brpc::policy::ZlibCompress
 
 #include "braft/local_storage.pb.h"
 #include "braft/log_entry.h"
+#include "braft/log_entry_cache.h"
 #include "braft/protobuf_file.h"
 #include "braft/util.h"
 #include "braft/fsync.h"
@@ -38,6 +45,8 @@
 #define BRAFT_SEGMENT_OPEN_PATTERN "log_inprogress_%020" PRId64
 #define BRAFT_SEGMENT_CLOSED_PATTERN "log_%020" PRId64 "_%020" PRId64
 #define BRAFT_SEGMENT_META_FILE  "log_meta"
+#define BRAFT_SEGMENT_POOL_PATTERN "log_pool_%020" PRId64
+#define BRAFT_SEGMENT_INDEX_PATTERN "log_index_%020" PRId64 "_%020" PRId64
 
 namespace braft {
 
@@ -54,9 +63,119 @@ BRPC_VALIDATE_GFLAG(raft_sync_segments, ::brpc::PassValidate);
 
 DEFINE_int32(log_segment_data_list_batch_size, 256, "Size of log segment data list batch");
 
+DEFINE_bool(raft_segment_use_io_uring, false,
+            "Submit the batched segment writes to io_uring so that the next batch"
+            " can be serialized while the previous one is being written, only"
+            " works with log_storage_append_entries_in_batch");
+DEFINE_int32(raft_segment_io_uring_depth, 64, "Queue depth of the io_uring of segment writes");
+BRPC_VALIDATE_GFLAG(raft_segment_io_uring_depth, brpc::PositiveInteger);
+
+DEFINE_int32(raft_segment_pool_size, 0,
+             "Number of segment files preallocated in background, the files of"
+             " the segments removed by truncate_prefix are recycled into the pool"
+             " as well. 0 disables the pool");
+BRPC_VALIDATE_GFLAG(raft_segment_pool_size, brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_segment_pool_zero_fill, true,
+            "Write zeros to the whole pooled segment file rather than fallocate"
+            " it, so that fdatasync doesn't have to update the metadata of"
+            " unwritten extents when the segment is appended");
+BRPC_VALIDATE_GFLAG(raft_segment_pool_zero_fill, ::brpc::PassValidate);
+
+DEFINE_bool(raft_segment_direct_io, false,
+            "Write the open segments with O_DIRECT to keep raft logs out of the"
+            " page cache, takes effect on the segments opened afterwards");
+BRPC_VALIDATE_GFLAG(raft_segment_direct_io, ::brpc::PassValidate);
+
+DEFINE_bool(raft_segment_mmap_read, false,
+            "Map the closed segments into memory and read entries from the"
+            " mapped pages without copying, takes effect on the segments"
+            " read afterwards");
+BRPC_VALIDATE_GFLAG(raft_segment_mmap_read, ::brpc::PassValidate);
+
+DEFINE_bool(raft_segment_index_file, false,
+            "Save the offsets and terms of a segment into an index file when"
+            " it's closed, so that loading the closed segment doesn't have to"
+            " scan all the entries");
+BRPC_VALIDATE_GFLAG(raft_segment_index_file, ::brpc::PassValidate);
+
+DEFINE_int32(raft_load_segment_concurrency, 4,
+             "Max number of closed segments of one log storage loaded in"
+             " parallel at startup");
+BRPC_VALIDATE_GFLAG(raft_load_segment_concurrency, brpc::PositiveInteger);
+
+DEFINE_string(raft_segment_compress_type, "none",
+              "Compression of the data entries appended to the segments, one of"
+              " none, snappy and zlib. Can be overridden per log storage with"
+              " local://{path}&&compress={type}");
+
+DEFINE_int64(raft_segment_reclaim_bytes_per_second, 0,
+             "Max bytes per second of the removed segment files freed by the"
+             " background reclaimer, 0 means no limit");
+BRPC_VALIDATE_GFLAG(raft_segment_reclaim_bytes_per_second, brpc::NonNegativeInteger);
+
+DEFINE_int64(raft_segment_reclaim_truncate_step, 0,
+             "Shrink the removed segment files by this many bytes at a time"
+             " before unlinking them, so that the filesystem frees the blocks"
+             " gradually, 0 to unlink them directly");
+BRPC_VALIDATE_GFLAG(raft_segment_reclaim_truncate_step, brpc::NonNegativeInteger);
+
+DEFINE_bool(raft_segment_batch_header, false,
+            "Pack the small entries flushed together into one batch record"
+            " with a single header and checksum (segment format v2), only"
+            " works with log_storage_append_entries_in_batch. Segments with"
+            " batch records can't be read by the older versions");
+BRPC_VALIDATE_GFLAG(raft_segment_batch_header, ::brpc::PassValidate);
+
+DEFINE_int32(raft_segment_batch_max_bytes, 32 * 1024,
+             "Max bytes of the entries packed in one batch record, larger"
+             " entries are written on their own");
+BRPC_VALIDATE_GFLAG(raft_segment_batch_max_bytes, brpc::PositiveInteger);
+
+DEFINE_int32(raft_segment_compress_min_bytes, 512,
+             "Data entries smaller than this are never compressed");
+BRPC_VALIDATE_GFLAG(raft_segment_compress_min_bytes, brpc::NonNegativeInteger);
+
+DEFINE_int64(raft_segment_cold_index_distance, 0,
+             "Move the closed segments whose last index is this far behind the"
+             " last log index to the cold path of the log storage, see"
+             " local://{path}&&cold_path={cold_path}. 0 to disable");
+BRPC_VALIDATE_GFLAG(raft_segment_cold_index_distance, brpc::NonNegativeInteger);
+
+DEFINE_int32(raft_segment_cold_age_s, 0,
+             "Move the closed segments which haven't been modified for this"
+             " many seconds to the cold path of the log storage. 0 to disable");
+BRPC_VALIDATE_GFLAG(raft_segment_cold_age_s, brpc::NonNegativeInteger);
+
+DEFINE_int64(raft_segment_migrate_bytes_per_second, 32 * 1024 * 1024,
+             "Max bytes per second of the segments copied to the cold path by"
+             " each log storage, 0 means no limit");
+BRPC_VALIDATE_GFLAG(raft_segment_migrate_bytes_per_second, brpc::NonNegativeInteger);
+
 static bvar::LatencyRecorder g_open_segment_latency("raft_open_segment");
 static bvar::LatencyRecorder g_segment_append_entry_latency("raft_segment_append_entry");
 static bvar::LatencyRecorder g_sync_segment_latency("raft_sync_segment");
+static bvar::LatencyRecorder g_fill_segment_pool_latency("raft_fill_segment_pool");
+static bvar::Adder<int64_t> g_segment_pool_hit("raft_segment_pool_hit");
+static bvar::Adder<int64_t> g_segment_pool_miss("raft_segment_pool_miss");
+static bvar::Adder<int64_t> g_direct_io_padding_bytes("raft_segment_direct_io_padding_bytes");
+static bvar::Adder<int64_t> g_mapped_segment_count("raft_mapped_segment_count");
+static bvar::Adder<int64_t> g_segment_index_loaded("raft_segment_index_loaded");
+static bvar::Adder<int64_t> g_segment_reclaim_pending("raft_segment_reclaim_pending");
+static bvar::LatencyRecorder g_segment_reclaim_latency("raft_segment_reclaim");
+static bvar::LatencyRecorder g_segment_migrate_latency("raft_segment_migrate");
+static bvar::Adder<int64_t> g_segment_migrated_bytes("raft_segment_migrated_bytes");
+static bvar::Adder<int64_t> g_compress_input_bytes("raft_segment_compress_input_bytes");
+static bvar::Adder<int64_t> g_compress_output_bytes("raft_segment_compress_output_bytes");
+static bvar::LatencyRecorder g_compress_latency("raft_segment_compress");
+static bvar::LatencyRecorder g_decompress_latency("raft_segment_decompress");
+
+static double get_compress_ratio(void*) {
+    const int64_t output = g_compress_output_bytes.get_value();
+    return output > 0 ? (double)g_compress_input_bytes.get_value() / output : 0;
+}
+static bvar::PassiveStatus<double> g_compress_ratio(
+        "raft_segment_compress_ratio", get_compress_ratio, NULL);
 
 int ftruncate_uninterrupted(int fd, off_t length) {
     int rc = 0;
@@ -71,24 +190,104 @@ enum CheckSumType {
     CHECKSUM_CRC32 = 1,   
 };
 
-enum RaftSyncPolicy {
-    RAFT_SYNC_IMMEDIATELY = 0,
-    RAFT_SYNC_BY_BYTES = 1,
+enum SegmentCompressType {
+    COMPRESS_NONE = 0,
+    COMPRESS_SNAPPY = 1,
+    COMPRESS_ZLIB = 2,
 };
 
+static int compress_type_from_name(const std::string& name) {
+    if (name == "none" || name.empty()) {
+        return COMPRESS_NONE;
+    } else if (name == "snappy") {
+        return COMPRESS_SNAPPY;
+    } else if (name == "zlib") {
+        return COMPRESS_ZLIB;
+    }
+    return -1;
+}
+
+// Replace |data| of a DATA entry with the compressed one if it's large enough
+// and actually shrinks, returns the compress type stored in the header
+static int compress_data(int compress_type, butil::IOBuf* data) {
+    if (compress_type == COMPRESS_NONE
+            || data->length() < (size_t)FLAGS_raft_segment_compress_min_bytes) {
+        return COMPRESS_NONE;
+    }
+    const int64_t start_us = butil::cpuwide_time_us();
+    butil::IOBuf out;
+    bool ok = false;
+    switch (compress_type) {
+    case COMPRESS_SNAPPY:
+        ok = brpc::policy::SnappyCompress(*data, &out);
+        break;
+    case COMPRESS_ZLIB:
+        ok = brpc::policy::ZlibCompress(*data, &out, NULL);
+        break;
+    default:
+        break;
+    }
+    g_compress_latency << butil::cpuwide_time_us() - start_us;
+    g_compress_input_bytes << data->length();
+    if (!ok || out.length() >= data->length()) {
+        g_compress_output_bytes << data->length();
+        return COMPRESS_NONE;
+    }
+    g_compress_output_bytes << out.length();
+    data->swap(out);
+    return compress_type;
+}
+
+static int decompress_data(int compress_type, butil::IOBuf* data) {
+    const int64_t start_us = butil::cpuwide_time_us();
+    butil::IOBuf out;
+    bool ok = false;
+    switch (compress_type) {
+    case COMPRESS_SNAPPY:
+        ok = brpc::policy::SnappyDecompress(*data, &out);
+        break;
+    case COMPRESS_ZLIB:
+        ok = brpc::policy::ZlibDecompress(*data, &out);
+        break;
+    default:
+        break;
+    }
+    if (!ok) {
+        return -1;
+    }
+    g_decompress_latency << butil::cpuwide_time_us() - start_us;
+    data->swap(out);
+    return 0;
+}
+
 
 // Format of Header, all fields are in network order
 // | -------------------- term (64bits) -------------------------  |
-// | entry-type (8bits) | checksum_type (8bits) | reserved(16bits) |
+// | entry-type (8bits) | checksum_type (8bits) | compress_type (8bits) | reserved(8bits) |
 // | ------------------ data len (32bits) -----------------------  |
 // | data_checksum (32bits) | header checksum (32bits)             |
 
 const static size_t ENTRY_HEADER_SIZE = 24;
 
+// Segment format v2 packs the small entries of one flush into a batch record,
+// whose header is the same as above with entry-type = SEGMENT_BATCH_TYPE and
+// the checksum covering all the packed entries. Each packed entry is
+// | entry-type (8bits) | compress_type (8bits) | reserved (16bits) |
+// | data len (32bits) | data                                       |
+// All the entries of a batch have the term in the header. The offset of the
+// first entry is the offset of the batch record and the offsets of the others
+// are where they are packed, so the offsets are still distinct and truncating
+// to an entry keeps exactly the bytes before it.
+const static int SEGMENT_BATCH_TYPE = 0xFF;
+const static size_t BATCH_ENTRY_HEADER_SIZE = 8;
+
 struct Segment::EntryHeader {
     int64_t term;
     int type;
     int checksum_type;
+    // the data of DATA entries may be compressed, data_len and data_checksum
+    // are about the stored bytes
+    int compress_type;
     uint32_t data_len;
     uint32_t data_checksum;
 };
@@ -96,25 +295,319 @@ struct Segment::EntryHeader {
 std::ostream& operator<<(std::ostream& os, const Segment::EntryHeader& h) {
     os << "{term=" << h.term << ", type=" << h.type << ", data_len="
        << h.data_len << ", checksum_type=" << h.checksum_type
+       << ", compress_type=" << h.compress_type
        << ", data_checksum=" << h.data_checksum << '}';
     return os;
 }
 
-int Segment::create() {
+struct Segment::PendingWrite {
+    PendingWrite()
+        : offset(0), bytes(0), sync(false)
+        , nreq(0), written(0), sync_rc(0), failed(false)
+    {}
+    std::vector<butil::IOBuf> data_list;
+    std::vector<std::pair<int64_t/*offset*/, int64_t/*term*/> > offset_and_term;
+    std::vector<std::pair<uint32_t/*start*/, uint32_t/*end*/> > batches;
+    std::vector<struct iovec> iov;
+    off_t offset;
+    size_t bytes;
+    bool sync;
+    // number of completions not reaped yet
+    int nreq;
+    int64_t written;
+    int sync_rc;
+    bool failed;
+};
+
+// Read-only mapping of a closed segment. Besides the owner segment, every
+// IOBuf block built on the mapped pages holds a reference, so the pages stay
+// valid after the segment is unlinked or truncated.
+class SegmentMapping : public butil::RefCountedThreadSafe<SegmentMapping> {
+public:
+    SegmentMapping(char* addr, size_t size) : _addr(addr), _size(size) {
+        g_mapped_segment_count << 1;
+    }
+
+    const char* data() const { return _addr; }
+    size_t size() const { return _size; }
+
+    // Reference [offset, offset + len) of the mapped pages in |buf|
+    void append_to(butil::IOBuf* buf, size_t offset, size_t len) {
+        AddRef();
+        SegmentMapping* self = this;
+        if (buf->append_user_data(_addr + offset, len,
+                                  [self](void*) { self->Release(); }) != 0) {
+            Release();
+            buf->append(_addr + offset, len);
+        }
+    }
+
+private:
+friend class butil::RefCountedThreadSafe<SegmentMapping>;
+    ~SegmentMapping() {
+        munmap(_addr, _size);
+        g_mapped_segment_count << -1;
+    }
+
+    char* _addr;
+    size_t _size;
+};
+
+Segment::~Segment() {
+    // Only left by a failed io_uring, the pending writes are leaked on purpose
+    // as the kernel may still reference their buffers
+    LOG_IF(ERROR, !_inflight.empty()) << "Destroying segment with "
+            << _inflight.size() << " writes in flight, path: " << _path;
+    _close_direct_io();
+    if (_mapping) {
+        _mapping->Release();
+        _mapping = NULL;
+    }
+    if (_fd >= 0) {
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+// Logical block size that O_DIRECT writes must be aligned to, 4K covers both
+// 512e and 4Kn devices
+const static size_t DIRECT_IO_ALIGNMENT = 4096;
+const static size_t DIRECT_IO_CHUNK_SIZE = 64 * DIRECT_IO_ALIGNMENT;
+
+// Aligned staging buffers shared by all the segments, a few chunks are cached
+// to avoid calling posix_memalign on each batch
+class DirectIOArena {
+public:
+    DirectIOArena() {}
+    ~DirectIOArena() {
+        for (size_t i = 0; i < _free.size(); ++i) {
+            free(_free[i]);
+        }
+    }
+
+    char* get() {
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            if (!_free.empty()) {
+                char* chunk = _free.back();
+                _free.pop_back();
+                return chunk;
+            }
+        }
+        void* chunk = NULL;
+        if (posix_memalign(&chunk, DIRECT_IO_ALIGNMENT, DIRECT_IO_CHUNK_SIZE) != 0) {
+            return NULL;
+        }
+        return (char*)chunk;
+    }
+
+    void put(char* chunk) {
+        {
+            BAIDU_SCOPED_LOCK(_mutex);
+            if (_free.size() < MAX_FREE_CHUNKS) {
+                _free.push_back(chunk);
+                return;
+            }
+        }
+        free(chunk);
+    }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(DirectIOArena);
+    const static size_t MAX_FREE_CHUNKS = 64;
+
+    raft_mutex_t _mutex;
+    std::vector<char*> _free;
+};
+
+static DirectIOArena* get_direct_io_arena() {
+    return butil::get_leaky_singleton<DirectIOArena>();
+}
+
+int Segment::_open_direct_io() {
+#if defined(O_DIRECT)
+    std::string path(dir());
+    butil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN, _first_index);
+    const int fd = ::open(path.c_str(), O_WRONLY | O_DIRECT);
+    if (fd < 0) {
+        PLOG(WARNING) << "Fail to open " << path << " with O_DIRECT, fallback"
+                         " to buffered write";
+        return -1;
+    }
+    butil::make_close_on_exec(fd);
+    void* tail = NULL;
+    if (posix_memalign(&tail, DIRECT_IO_ALIGNMENT, DIRECT_IO_ALIGNMENT) != 0) {
+        ::close(fd);
+        return -1;
+    }
+    _direct_fd = fd;
+    _direct_tail = (char*)tail;
+    if (_load_direct_tail() != 0) {
+        _close_direct_io();
+        return -1;
+    }
+    return 0;
+#else
+    LOG_ONCE(WARNING) << "O_DIRECT is not supported on this platform";
+    return -1;
+#endif
+}
+
+void Segment::_close_direct_io() {
+    if (_direct_fd >= 0) {
+        ::close(_direct_fd);
+        _direct_fd = -1;
+    }
+    free(_direct_tail);
+    _direct_tail = NULL;
+}
+
+int Segment::_load_direct_tail() {
+    const off_t base = _bytes & ~(off_t)(DIRECT_IO_ALIGNMENT - 1);
+    const size_t tail = _bytes - base;
+    memset(_direct_tail, 0, DIRECT_IO_ALIGNMENT);
+    size_t nread = 0;
+    while (nread < tail) {
+        const ssize_t n = ::pread(_fd, _direct_tail + nread, tail - nread,
+                                  base + nread);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            PLOG(ERROR) << "Fail to read the last block of segment, path: "
+                        << _path << " offset: " << base + nread;
+            return -1;
+        }
+        nread += n;
+    }
+    return 0;
+}
+
+// Stage |pieces| after the partial last block into aligned chunks and write
+// them at the block boundary, the zero padding after the data is recognized
+// as the end of the segment by load() and cut by close().
+int Segment::_direct_write(butil::IOBuf* const* pieces, size_t npieces,
+                           size_t bytes) {
+    if (bytes == 0) {
+        return 0;
+    }
+    DirectIOArena* arena = get_direct_io_arena();
+    const off_t base = _bytes & ~(off_t)(DIRECT_IO_ALIGNMENT - 1);
+    const size_t tail = _bytes - base;
+    const size_t total = tail + bytes;
+    std::vector<char*> chunks;
+    chunks.reserve(total / DIRECT_IO_CHUNK_SIZE + 1);
+    char* dst = NULL;
+    size_t left = 0;
+    int ret = 0;
+    // the tail is smaller than a chunk
+    for (size_t i = 0; i < npieces + 1 && ret == 0; ++i) {
+        butil::IOBuf* piece = (i == 0) ? NULL : pieces[i - 1];
+        size_t piece_left = (i == 0) ? tail : piece->length();
+        while (piece_left > 0) {
+            if (left == 0) {
+                dst = arena->get();
+                if (dst == NULL) {
+                    LOG(ERROR) << "Fail to allocate aligned buffer, path: " << _path;
+                    ret = -1;
+                    break;
+                }
+                chunks.push_back(dst);
+                left = DIRECT_IO_CHUNK_SIZE;
+            }
+            size_t n = 0;
+            if (piece == NULL) {
+                n = tail;
+                memcpy(dst, _direct_tail, n);
+            } else {
+                n = piece->cutn(dst, left);
+            }
+            dst += n;
+            left -= n;
+            piece_left -= n;
+        }
+    }
+    const size_t last_len = total - (chunks.size() - 1) * DIRECT_IO_CHUNK_SIZE;
+    const size_t last_padded = (last_len + DIRECT_IO_ALIGNMENT - 1)
+                                & ~(DIRECT_IO_ALIGNMENT - 1);
+    if (ret == 0) {
+        memset(dst, 0, last_padded - last_len);
+        g_direct_io_padding_bytes << (last_padded - last_len);
+    }
+    off_t offset = base;
+    for (size_t i = 0; i < chunks.size() && ret == 0; ++i) {
+        const size_t len = (i + 1 == chunks.size()) ? last_padded
+                                                    : DIRECT_IO_CHUNK_SIZE;
+        size_t written = 0;
+        while (written < len) {
+            const ssize_t n = ::pwrite(_direct_fd, chunks[i] + written,
+                                       len - written, offset + written);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                PLOG(ERROR) << "Fail to write to fd=" << _direct_fd
+                            << ", path: " << _path;
+                ret = -1;
+                break;
+            }
+            written += n;
+        }
+        offset += len;
+    }
+    if (ret == 0) {
+        // keep the new partial block for the next write
+        const size_t new_tail = total & (DIRECT_IO_ALIGNMENT - 1);
+        memset(_direct_tail, 0, DIRECT_IO_ALIGNMENT);
+        if (new_tail > 0) {
+            memcpy(_direct_tail, chunks.back() + last_padded - DIRECT_IO_ALIGNMENT,
+                   new_tail);
+        }
+        _preallocated = true;
+    }
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        arena->put(chunks[i]);
+    }
+    return ret;
+}
+
+int Segment::create(const std::string& pooled_file) {
     if (!_is_open) {
         CHECK(false) << "Create on a closed segment at first_index=" 
                      << _first_index << " in " << _path;
         return -1;
     }
 
-    std::string path(_path);
+    std::string path(dir());
     butil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN, _first_index);
+    if (!pooled_file.empty()) {
+        // The pooled file is filled with zeros (or fallocated), which are
+        // recognized as the end of the segment by load()
+        if (::rename(pooled_file.c_str(), path.c_str()) == 0) {
+            _fd = ::open(path.c_str(), O_RDWR);
+            if (_fd >= 0) {
+                butil::make_close_on_exec(_fd);
+                _preallocated = true;
+                LOG(INFO) << "Created new segment `" << path << "' from `"
+                          << pooled_file << "' with fd=" << _fd;
+                if (FLAGS_raft_segment_direct_io) {
+                    _open_direct_io();
+                }
+                return 0;
+            }
+        }
+        PLOG(WARNING) << "Fail to reuse pooled file `" << pooled_file
+                      << "', create `" << path << "' instead";
+    }
     _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
     if (_fd >= 0) {
         butil::make_close_on_exec(_fd);
     }
     LOG_IF(INFO, _fd >= 0) << "Created new segment `" << path 
                            << "' with fd=" << _fd ;
+    if (_fd >= 0 && FLAGS_raft_segment_direct_io) {
+        _open_direct_io();
+    }
     return _fd >= 0 ? 0 : -1;
 }
 
@@ -170,16 +663,13 @@ inline uint32_t get_checksum(int checksum_type, const butil::IOBuf& data) {
     }
 }
 
-int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
-                         size_t size_hint) const {
-    butil::IOPortal buf;
-    size_t to_read = std::max(size_hint, ENTRY_HEADER_SIZE);
-    const ssize_t n = file_pread(&buf, _fd, offset, to_read);
-    if (n != (ssize_t)to_read) {
-        return n < 0 ? -1 : 1;
+// Returns 0 on success, 1 if |p| points to the unwritten area of a
+// preallocated segment, -1 if the header is corrupted
+static int parse_entry_header(const char* p, Segment::EntryHeader* h) {
+    if (is_zero(p, ENTRY_HEADER_SIZE)) {
+        // a valid header always contains a positive term
+        return 1;
     }
-    char header_buf[ENTRY_HEADER_SIZE];
-    const char *p = (const char *)buf.fetch(header_buf, ENTRY_HEADER_SIZE);
     int64_t term = 0;
     uint32_t meta_field;
     uint32_t data_len = 0;
@@ -190,18 +680,132 @@ int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
                   .unpack32(data_len)
                   .unpack32(data_checksum)
                   .unpack32(header_checksum);
-    EntryHeader tmp;
-    tmp.term = term;
-    tmp.type = meta_field >> 24;
-    tmp.checksum_type = (meta_field << 8) >> 24;
-    tmp.data_len = data_len;
-    tmp.data_checksum = data_checksum;
-    if (!verify_checksum(tmp.checksum_type, 
+    h->term = term;
+    h->type = meta_field >> 24;
+    h->checksum_type = (meta_field << 8) >> 24;
+    h->compress_type = (meta_field << 16) >> 24;
+    h->data_len = data_len;
+    h->data_checksum = data_checksum;
+    if (!verify_checksum(h->checksum_type, 
                         p, ENTRY_HEADER_SIZE - 4, header_checksum)) {
+        return -1;
+    }
+    return 0;
+}
+
+static void pack_entry_header(char* buf, int64_t term, int type,
+                              int checksum_type, int compress_type,
+                              const butil::IOBuf& data) {
+    const uint32_t meta_field = (type << 24) | (checksum_type << 16)
+                                | (compress_type << 8);
+    RawPacker packer(buf);
+    packer.pack64(term)
+          .pack32(meta_field)
+          .pack32((uint32_t)data.length())
+          .pack32(get_checksum(checksum_type, data));
+    packer.pack32(get_checksum(checksum_type, buf, ENTRY_HEADER_SIZE - 4));
+}
+
+// Serialize |entry| as a record with its own header, which doesn't depend on
+// where it's written. |payload| is the data of a data entry, compressed with
+// |compress_type|
+static int encode_record(const LogEntry* entry, const butil::IOBuf& payload,
+                         int checksum_type, int compress_type,
+                         butil::IOBuf* record) {
+    butil::IOBuf conf_data;
+    const butil::IOBuf* data = &conf_data;
+    switch (entry->type) {
+    case ENTRY_TYPE_DATA:
+        data = &payload;
+        break;
+    case ENTRY_TYPE_NO_OP:
+        break;
+    case ENTRY_TYPE_CONFIGURATION:
+        if (!serialize_configuration_meta(entry, conf_data).ok()) {
+            LOG(ERROR) << "Fail to serialize ConfigurationPBMeta";
+            return -1;
+        }
+        break;
+    default:
+        LOG(FATAL) << "unknow entry type: " << entry->type;
+        return -1;
+    }
+    CHECK_LE(data->length(), 1ul << 56ul);
+    char header_buf[ENTRY_HEADER_SIZE];
+    pack_entry_header(header_buf, entry->id.term, entry->type,
+                      checksum_type, compress_type, *data);
+    record->append(header_buf, ENTRY_HEADER_SIZE);
+    record->append(*data);
+    return 0;
+}
+
+// Compress and serialize |entry| as a record, see encode_record
+static int encode_entry(const LogEntry* entry, int checksum_type,
+                        int compress_type, butil::IOBuf* record) {
+    butil::IOBuf data;
+    int data_compress_type = COMPRESS_NONE;
+    if (entry->type == ENTRY_TYPE_DATA) {
+        data.append(entry->data);
+        data_compress_type = compress_data(compress_type, &data);
+    }
+    return encode_record(entry, data, checksum_type, data_compress_type, record);
+}
+
+// LogEntry::encoded_format of the records encoded by encode_entry
+static int encoded_format(int checksum_type, int compress_type) {
+    return 0x10000 | (checksum_type << 8) | compress_type;
+}
+
+// Cut the next packed entry from |body| of the batch record |batch|, the data
+// is dropped if |data| is NULL
+static int cut_batch_entry(butil::IOBuf* body, const Segment::EntryHeader& batch,
+                           Segment::EntryHeader* h, butil::IOBuf* data) {
+    char buf[BATCH_ENTRY_HEADER_SIZE];
+    const char* p = (const char*)body->fetch(buf, sizeof(buf));
+    if (p == NULL) {
+        return -1;
+    }
+    uint32_t meta_field = 0;
+    uint32_t data_len = 0;
+    RawUnpacker(p).unpack32(meta_field).unpack32(data_len);
+    if (body->length() < BATCH_ENTRY_HEADER_SIZE + (size_t)data_len) {
+        return -1;
+    }
+    body->pop_front(BATCH_ENTRY_HEADER_SIZE);
+    if (data) {
+        body->cutn(data, data_len);
+    } else {
+        body->pop_front(data_len);
+    }
+    *h = batch;
+    h->type = meta_field >> 24;
+    h->compress_type = (meta_field << 8) >> 24;
+    h->data_len = data_len;
+    h->data_checksum = 0;
+    return (h->type == ENTRY_TYPE_DATA || h->type == ENTRY_TYPE_NO_OP) ? 0 : -1;
+}
+
+int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
+                         size_t size_hint) const {
+    butil::IOPortal buf;
+    size_t to_read = std::max(size_hint, ENTRY_HEADER_SIZE);
+    const ssize_t n = file_pread(&buf, _fd, offset, to_read);
+    if (n != (ssize_t)to_read) {
+        return n < 0 ? -1 : 1;
+    }
+    char header_buf[ENTRY_HEADER_SIZE];
+    const char *p = (const char *)buf.fetch(header_buf, ENTRY_HEADER_SIZE);
+    EntryHeader tmp;
+    const int rc = parse_entry_header(p, &tmp);
+    if (rc > 0) {
+        return rc;
+    }
+    if (rc < 0) {
         LOG(ERROR) << "Found corrupted header at offset=" << offset
                    << ", header=" << tmp << ", path: " << _path;
         return -1;
     }
+    const uint32_t data_len = tmp.data_len;
     if (head != NULL) {
         *head = tmp;
     }
@@ -230,72 +834,506 @@ int Segment::_load_entry(off_t offset, EntryHeader* head, butil::IOBuf* data,
     return 0;
 }
 
-int Segment::_get_meta(int64_t index, LogMeta* meta) const {
-    BAIDU_SCOPED_LOCK(_mutex);
-    if (index > _last_index.load(butil::memory_order_relaxed) 
-                    || index < _first_index) {
-        // out of range
-        BRAFT_VLOG << "_last_index=" << _last_index.load(butil::memory_order_relaxed)
-                  << " _first_index=" << _first_index;
+int Segment::_load_mapped_entry(SegmentMapping* mapping, off_t offset,
+                                EntryHeader* head, butil::IOBuf* data) const {
+    if (offset + ENTRY_HEADER_SIZE > mapping->size()) {
+        return 1;
+    }
+    const char* p = mapping->data() + offset;
+    EntryHeader tmp;
+    const int rc = parse_entry_header(p, &tmp);
+    if (rc > 0) {
+        return rc;
+    }
+    if (rc < 0) {
+        LOG(ERROR) << "Found corrupted header at offset=" << offset
+                   << ", header=" << tmp << ", path: " << _path;
         return -1;
-    } else if (_last_index == _first_index - 1) {
-        BRAFT_VLOG << "_last_index=" << _last_index.load(butil::memory_order_relaxed)
-                  << " _first_index=" << _first_index;
-        // empty
+    }
+    if (offset + ENTRY_HEADER_SIZE + tmp.data_len > mapping->size()) {
+        return 1;
+    }
+    if (!verify_checksum(tmp.checksum_type, p + ENTRY_HEADER_SIZE,
+                         tmp.data_len, tmp.data_checksum)) {
+        LOG(ERROR) << "Found corrupted data at offset="
+                   << offset + ENTRY_HEADER_SIZE
+                   << " header=" << tmp
+                   << " path: " << _path;
         return -1;
     }
-    int64_t meta_index = index - _first_index;
-    int64_t entry_cursor = _offset_and_term[meta_index].first;
-    int64_t next_cursor = (index < _last_index.load(butil::memory_order_relaxed))
-                          ? _offset_and_term[meta_index + 1].first : _bytes;
-    DCHECK_LT(entry_cursor, next_cursor);
-    meta->offset = entry_cursor;
-    meta->term = _offset_and_term[meta_index].second;
-    meta->length = next_cursor - entry_cursor;
+    if (head != NULL) {
+        *head = tmp;
+    }
+    if (data != NULL && tmp.data_len > 0) {
+        mapping->append_to(data, offset + ENTRY_HEADER_SIZE, tmp.data_len);
+    }
     return 0;
 }
 
-int Segment::load(ConfigurationManager* configuration_manager) {
-    int ret = 0;
+SegmentMapping* Segment::_acquire_mapping() const {
+    if (!FLAGS_raft_segment_mmap_read) {
+        return NULL;
+    }
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_mapping == NULL) {
+        if (!_mappable || _bytes <= 0) {
+            return NULL;
+        }
+        void* addr = mmap(NULL, _bytes, PROT_READ, MAP_SHARED, _fd, 0);
+        if (addr == MAP_FAILED) {
+            PLOG(WARNING) << "Fail to mmap segment, path: " << _path
+                          << " first_index: " << _first_index;
+            return NULL;
+        }
+        _mapping = new SegmentMapping((char*)addr, _bytes);
+        _mapping->AddRef();
+    }
+    _mapping->AddRef();
+    return _mapping;
+}
 
-    std::string path(_path);
-    // create fd
-    if (_is_open) {
-        butil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN, _first_index);
-    } else {
-        butil::string_appendf(&path, "/" BRAFT_SEGMENT_CLOSED_PATTERN, 
-                             _first_index, _last_index.load());
+bool Segment::_unmap() {
+    SegmentMapping* mapping = NULL;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _mappable = false;
+        std::swap(mapping, _mapping);
     }
-    _fd = ::open(path.c_str(), O_RDWR);
-    if (_fd < 0) {
-        LOG(ERROR) << "Fail to open " << path << ", " << berror();
-        return -1;
+    if (mapping == NULL) {
+        return false;
     }
-    butil::make_close_on_exec(_fd);
+    // no one is able to acquire the mapping now
+    const bool in_use = !mapping->HasOneRef();
+    mapping->Release();
+    return in_use;
+}
 
-    // get file size
-    struct stat st_buf;
-    if (fstat(_fd, &st_buf) != 0) {
-        LOG(ERROR) << "Fail to get the stat of " << path << ", " << berror();
-        ::close(_fd);
-        _fd = -1;
+// Readers may still access the mapped pages beyond |truncate_size|, which
+// would raise SIGBUS if the file was truncated in place. Copy the kept part
+// into a new file and replace the current one instead, the mapped pages of
+// the old file are released with the last reference.
+// |tail| is appended after the kept part if it's not NULL, which replaces a
+// batch record cut in the middle atomically.
+int Segment::_copy_on_truncate(int64_t truncate_size, const butil::IOBuf* tail) {
+    std::string path(dir());
+    butil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN, _first_index);
+    std::string tmp_path(path);
+    tmp_path.append(".tmp");
+    int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open " << tmp_path;
         return -1;
     }
-
-    // load entry index
-    int64_t file_size = st_buf.st_size;
-    int64_t entry_off = 0;
-    int64_t actual_last_index = _first_index - 1;
-    for (int64_t i = _first_index; entry_off < file_size; i++) {
-        EntryHeader header;
-        const int rc = _load_entry(entry_off, &header, NULL, ENTRY_HEADER_SIZE);
-        if (rc > 0) {
-            // The last log was not completely written, which should be truncated
-            break;
-        }
-        if (rc < 0) {
-            ret = rc;
-            break;
+    int ret = 0;
+    const int64_t block_size = 1024 * 1024;
+    for (int64_t off = 0; off < truncate_size && ret == 0; off += block_size) {
+        const size_t len = std::min(block_size, truncate_size - off);
+        butil::IOPortal buf;
+        if (file_pread(&buf, _fd, off, len) != (ssize_t)len ||
+                file_pwrite(buf, fd, off) != (ssize_t)len) {
+            PLOG(ERROR) << "Fail to copy " << path << " to " << tmp_path;
+            ret = -1;
+        }
+    }
+    if (ret == 0 && tail != NULL && !tail->empty() &&
+            file_pwrite(*tail, fd, truncate_size) != (ssize_t)tail->length()) {
+        PLOG(ERROR) << "Fail to write " << tmp_path;
+        ret = -1;
+    }
+    if (ret == 0 && raft_fsync(fd) != 0) {
+        PLOG(ERROR) << "Fail to sync " << tmp_path;
+        ret = -1;
+    }
+    if (ret == 0 && ::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        PLOG(ERROR) << "Fail to rename " << tmp_path << " to " << path;
+        ret = -1;
+    }
+    // Concurrent readers see either the old file or the new one through _fd,
+    // which have the same content before truncate_size
+    if (ret == 0 && ::dup2(fd, _fd) < 0) {
+        PLOG(ERROR) << "Fail to dup2 fd=" << fd << " to fd=" << _fd;
+        ret = -1;
+    }
+    ::close(fd);
+    if (ret != 0) {
+        ::unlink(tmp_path.c_str());
+    }
+    LOG_IF(INFO, ret == 0) << "Copied the first " << truncate_size
+                           << " bytes of mapped segment " << path;
+    return ret;
+}
+
+// Format of the index file, all fields are in network order
+// | magic (32bits) | version (32bits) | first_index (64bits)                |
+// | last_index (64bits) | segment_size (64bits)                             |
+// | entry_count (32bits) | term_count (32bits) | conf_count (32bits)        |
+// | batch_count (32bits)                                                    |
+// | entry offsets (32bits * entry_count)                                    |
+// | term changes: index - first_index (32bits), term (64bits) * term_count  |
+// | configuration entries: index - first_index (32bits) * conf_count        |
+// | batch records: start (32bits), end (32bits) * batch_count               |
+// | checksum of all the above (32bits)                                      |
+// Version 1 has neither batch_count nor the batch records.
+const static uint32_t SEGMENT_INDEX_MAGIC = 0x42524958;  // "BRIX"
+const static uint32_t SEGMENT_INDEX_VERSION = 2;
+const static size_t SEGMENT_INDEX_HEADER_SIZE = 48;
+const static size_t SEGMENT_INDEX_V1_HEADER_SIZE = 44;
+
+std::string Segment::_index_path() const {
+    std::string path(dir());
+    butil::string_appendf(&path, "/" BRAFT_SEGMENT_INDEX_PATTERN,
+                          _first_index, _last_index.load());
+    return path;
+}
+
+int Segment::_save_index() {
+    // Only the writer modifies the closed segment, it's safe to read the
+    // offsets without the lock
+    const size_t entry_count = _offset_and_term.size();
+    if (entry_count == 0 || _bytes > (int64_t)UINT32_MAX) {
+        return 0;
+    }
+    const std::vector<std::pair<uint32_t, int64_t> >& term_changes =
+            _offset_and_term.term_changes();
+    const int64_t last_index = _last_index.load(butil::memory_order_relaxed);
+    std::vector<uint32_t> confs;
+    for (size_t i = 0; i < _conf_indexes.size(); ++i) {
+        if (_conf_indexes[i] >= _first_index && _conf_indexes[i] <= last_index) {
+            confs.push_back(_conf_indexes[i] - _first_index);
+        }
+    }
+    const size_t size = SEGMENT_INDEX_HEADER_SIZE + entry_count * 4
+                        + term_changes.size() * 12 + confs.size() * 4
+                        + _batches.size() * 8 + 4;
+    std::string buf;
+    buf.resize(size);
+    RawPacker packer(&buf[0]);
+    packer.pack32(SEGMENT_INDEX_MAGIC)
+          .pack32(SEGMENT_INDEX_VERSION)
+          .pack64(_first_index)
+          .pack64(last_index)
+          .pack64(_bytes)
+          .pack32(entry_count)
+          .pack32(term_changes.size())
+          .pack32(confs.size())
+          .pack32(_batches.size());
+    for (size_t i = 0; i < entry_count; ++i) {
+        packer.pack32(_offset_and_term.offset(i));
+    }
+    for (size_t i = 0; i < term_changes.size(); ++i) {
+        packer.pack32(term_changes[i].first)
+              .pack64(term_changes[i].second);
+    }
+    for (size_t i = 0; i < confs.size(); ++i) {
+        packer.pack32(confs[i]);
+    }
+    for (size_t i = 0; i < _batches.size(); ++i) {
+        packer.pack32(_batches[i].first)
+              .pack32(_batches[i].second);
+    }
+    packer.pack32(crc32(buf.data(), size - 4));
+
+    const std::string path = _index_path();
+    std::string tmp_path(path);
+    tmp_path.append(".tmp");
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        PLOG(WARNING) << "Fail to open " << tmp_path;
+        return -1;
+    }
+    butil::IOBuf data;
+    data.append(buf);
+    const ssize_t n = file_pwrite(data, fd, 0);
+    ::close(fd);
+    // The checksum detects a torn index file, no need to fsync it
+    if (n != (ssize_t)size || ::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        PLOG(WARNING) << "Fail to save index file " << path;
+        ::unlink(tmp_path.c_str());
+        return -1;
+    }
+    BRAFT_VLOG << "Saved index file " << path << " entry_count: " << entry_count
+               << " term_count: " << term_changes.size();
+    return 0;
+}
+
+int Segment::_load_index(ConfigurationManager* configuration_manager,
+                         int64_t file_size) {
+    const std::string path = _index_path();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        PLOG_IF(WARNING, errno != ENOENT) << "Fail to open " << path;
+        return -1;
+    }
+    butil::IOPortal portal;
+    struct stat st_buf;
+    ssize_t n = -1;
+    if (fstat(fd, &st_buf) == 0) {
+        n = file_pread(&portal, fd, 0, st_buf.st_size);
+    }
+    ::close(fd);
+    if (n < 0 || n != (ssize_t)st_buf.st_size) {
+        LOG(WARNING) << "Fail to read " << path;
+        return -1;
+    }
+    const std::string buf = portal.to_string();
+    const size_t size = buf.size();
+    if (size < SEGMENT_INDEX_V1_HEADER_SIZE + 4) {
+        LOG(WARNING) << "Invalid index file " << path << " size: " << size;
+        return -1;
+    }
+    uint32_t checksum = 0;
+    RawUnpacker(buf.data() + size - 4).unpack32(checksum);
+    if (checksum != crc32(buf.data(), size - 4)) {
+        LOG(WARNING) << "Found corrupted index file " << path;
+        return -1;
+    }
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    int64_t first_index = 0;
+    int64_t last_index = 0;
+    int64_t segment_size = 0;
+    uint32_t entry_count = 0;
+    uint32_t term_count = 0;
+    uint32_t conf_count = 0;
+    uint32_t batch_count = 0;
+    RawUnpacker unpacker(buf.data());
+    unpacker.unpack32(magic)
+            .unpack32(version)
+            .unpack64((uint64_t&)first_index)
+            .unpack64((uint64_t&)last_index)
+            .unpack64((uint64_t&)segment_size)
+            .unpack32(entry_count)
+            .unpack32(term_count)
+            .unpack32(conf_count);
+    size_t header_size = SEGMENT_INDEX_V1_HEADER_SIZE;
+    if (version == SEGMENT_INDEX_VERSION && size >= SEGMENT_INDEX_HEADER_SIZE + 4) {
+        unpacker.unpack32(batch_count);
+        header_size = SEGMENT_INDEX_HEADER_SIZE;
+    }
+    // The index is only trusted if it describes exactly the segment file
+    if (magic != SEGMENT_INDEX_MAGIC
+            || (version != 1 && version != SEGMENT_INDEX_VERSION)
+            || first_index != _first_index
+            || last_index != _last_index.load(butil::memory_order_relaxed)
+            || segment_size != file_size
+            || entry_count != (uint64_t)(last_index - first_index + 1)
+            || term_count == 0 || term_count > entry_count
+            || size != header_size + (size_t)entry_count * 4
+                       + (size_t)term_count * 12 + (size_t)conf_count * 4
+                       + (size_t)batch_count * 8 + 4) {
+        LOG(WARNING) << "Mismatched index file " << path << " first_index: "
+                     << first_index << " last_index: " << last_index
+                     << " segment_size: " << segment_size
+                     << " file_size: " << file_size;
+        return -1;
+    }
+    std::vector<std::pair<int64_t, int64_t> > offset_and_term;
+    offset_and_term.resize(entry_count);
+    for (uint32_t i = 0; i < entry_count; ++i) {
+        uint32_t offset = 0;
+        unpacker.unpack32(offset);
+        // an entry packed in a batch record is shorter than a header
+        if ((i == 0 && offset != 0) || (i > 0 && offset <= offset_and_term[i - 1].first)
+                || (int64_t)offset + (int64_t)BATCH_ENTRY_HEADER_SIZE > file_size) {
+            LOG(WARNING) << "Invalid offset in index file " << path;
+            return -1;
+        }
+        offset_and_term[i].first = offset;
+    }
+    std::vector<std::pair<uint32_t, int64_t> > term_changes(term_count);
+    for (uint32_t i = 0; i < term_count; ++i) {
+        unpacker.unpack32(term_changes[i].first)
+                .unpack64((uint64_t&)term_changes[i].second);
+        if ((i == 0 && term_changes[i].first != 0) ||
+                (i > 0 && term_changes[i].first <= term_changes[i - 1].first) ||
+                term_changes[i].first >= entry_count) {
+            LOG(WARNING) << "Invalid term change in index file " << path;
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < term_count; ++i) {
+        const uint32_t end = (i + 1 < term_count) ? term_changes[i + 1].first
+                                                  : entry_count;
+        for (uint32_t j = term_changes[i].first; j < end; ++j) {
+            offset_and_term[j].second = term_changes[i].second;
+        }
+    }
+    std::vector<ConfigurationEntry> conf_entries;
+    std::vector<int64_t> conf_indexes;
+    for (uint32_t i = 0; i < conf_count; ++i) {
+        uint32_t delta = 0;
+        unpacker.unpack32(delta);
+        if (delta >= entry_count) {
+            LOG(WARNING) << "Invalid configuration in index file " << path;
+            return -1;
+        }
+        const int64_t entry_off = offset_and_term[delta].first;
+        const int64_t next_off = (delta + 1 < entry_count)
+                ? offset_and_term[delta + 1].first : file_size;
+        EntryHeader header;
+        butil::IOBuf data;
+        if (_load_entry(entry_off, &header, &data, next_off - entry_off) != 0
+                || header.type != ENTRY_TYPE_CONFIGURATION) {
+            LOG(WARNING) << "Fail to load configuration at offset " << entry_off
+                         << " described by index file " << path;
+            return -1;
+        }
+        scoped_refptr<LogEntry> entry = new LogEntry();
+        entry->id.index = _first_index + delta;
+        entry->id.term = header.term;
+        butil::Status status = parse_configuration_meta(data, entry);
+        if (!status.ok()) {
+            LOG(WARNING) << "Fail to parse configuration meta, path: " << _path
+                         << " entry_off " << entry_off;
+            return -1;
+        }
+        conf_entries.push_back(ConfigurationEntry(*entry));
+        conf_indexes.push_back(entry->id.index);
+    }
+    std::vector<std::pair<uint32_t, uint32_t> > batches(batch_count);
+    for (uint32_t i = 0; i < batch_count; ++i) {
+        unpacker.unpack32(batches[i].first)
+                .unpack32(batches[i].second);
+        if (batches[i].first >= batches[i].second
+                || (int64_t)batches[i].second > file_size
+                || (i > 0 && batches[i].first < batches[i - 1].second)) {
+            LOG(WARNING) << "Invalid batch record in index file " << path;
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < conf_entries.size(); ++i) {
+        configuration_manager->add(conf_entries[i]);
+    }
+    SegmentOffsetIndex index;
+    for (uint32_t i = 0; i < entry_count; ++i) {
+        index.push_back(offset_and_term[i].first, offset_and_term[i].second);
+    }
+    index.shrink_to_fit();
+    _conf_indexes.swap(conf_indexes);
+    _offset_and_term.swap(index);
+    _batches.swap(batches);
+    return 0;
+}
+
+void Segment::_remove_index() {
+    const std::string path = _index_path();
+    if (::unlink(path.c_str()) != 0 && errno != ENOENT) {
+        PLOG(WARNING) << "Fail to unlink " << path;
+    }
+}
+
+int Segment::_get_meta(int64_t index, LogMeta* meta) const {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (index > _last_index.load(butil::memory_order_relaxed) 
+                    || index < _first_index) {
+        // out of range
+        BRAFT_VLOG << "_last_index=" << _last_index.load(butil::memory_order_relaxed)
+                  << " _first_index=" << _first_index;
+        return -1;
+    } else if (_last_index == _first_index - 1) {
+        BRAFT_VLOG << "_last_index=" << _last_index.load(butil::memory_order_relaxed)
+                  << " _first_index=" << _first_index;
+        // empty
+        return -1;
+    }
+    int64_t meta_index = index - _first_index;
+    int64_t entry_cursor = _offset_and_term.offset(meta_index);
+    int64_t next_cursor = (index < _last_index.load(butil::memory_order_relaxed))
+                          ? _offset_and_term.offset(meta_index + 1) : _bytes;
+    DCHECK_LT(entry_cursor, next_cursor);
+    meta->offset = entry_cursor;
+    meta->term = _offset_and_term.term(meta_index);
+    meta->length = next_cursor - entry_cursor;
+    int64_t batch_start = 0;
+    int64_t batch_end = 0;
+    if (_find_batch(entry_cursor, &batch_start, &batch_end)) {
+        meta->batch_offset = batch_start;
+        meta->batch_length = batch_end - batch_start;
+    } else {
+        meta->batch_offset = -1;
+        meta->batch_length = 0;
+    }
+    return 0;
+}
+
+bool Segment::_find_batch(int64_t offset, int64_t* start, int64_t* end) const {
+    if (_batches.empty() || offset >= (int64_t)_batches.back().second) {
+        return false;
+    }
+    std::vector<std::pair<uint32_t, uint32_t> >::const_iterator it =
+            std::upper_bound(_batches.begin(), _batches.end(),
+                             std::make_pair((uint32_t)offset, UINT32_MAX));
+    if (it == _batches.begin()) {
+        return false;
+    }
+    --it;
+    if (offset >= (int64_t)it->second) {
+        return false;
+    }
+    *start = it->first;
+    *end = it->second;
+    return true;
+}
+
+int Segment::load(ConfigurationManager* configuration_manager) {
+    int ret = 0;
+
+    std::string path(dir());
+    // create fd
+    if (_is_open) {
+        butil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN, _first_index);
+    } else {
+        butil::string_appendf(&path, "/" BRAFT_SEGMENT_CLOSED_PATTERN, 
+                             _first_index, _last_index.load());
+    }
+    _fd = ::open(path.c_str(), O_RDWR);
+    if (_fd < 0) {
+        LOG(ERROR) << "Fail to open " << path << ", " << berror();
+        return -1;
+    }
+    butil::make_close_on_exec(_fd);
+
+    // get file size
+    struct stat st_buf;
+    if (fstat(_fd, &st_buf) != 0) {
+        LOG(ERROR) << "Fail to get the stat of " << path << ", " << berror();
+        ::close(_fd);
+        _fd = -1;
+        return -1;
+    }
+
+    // load entry index
+    int64_t file_size = st_buf.st_size;
+    if (!_is_open && FLAGS_raft_segment_index_file &&
+            _load_index(configuration_manager, file_size) == 0) {
+        g_segment_index_loaded << 1;
+        _bytes = file_size;
+        _mappable = true;
+        return 0;
+    }
+    // An open segment may be preallocated or padded by direct io, so the file
+    // size doesn't tell where the last write ends and a torn write shows up as
+    // a broken record rather than a short one. The data of every record is
+    // verified and the first broken record is taken as the end of the log.
+    const bool torn_tail = _is_open;
+    int64_t entry_off = 0;
+    int64_t actual_last_index = _first_index - 1;
+    while (entry_off < file_size) {
+        const int64_t i = actual_last_index + 1;
+        EntryHeader header;
+        const int rc = _load_entry(entry_off, &header, NULL, ENTRY_HEADER_SIZE);
+        if (rc > 0) {
+            // The last log was not completely written, which should be truncated
+            break;
+        }
+        if (rc < 0) {
+            if (torn_tail) {
+                LOG(WARNING) << "Take the broken header at offset=" << entry_off
+                             << " as the end of the open segment, path: " << _path;
+                break;
+            }
+            ret = rc;
+            break;
         }
         // rc == 0
         const int64_t skip_len = ENTRY_HEADER_SIZE + header.data_len;
@@ -304,6 +1342,51 @@ int Segment::load(ConfigurationManager* configuration_manager) {
             // truncated
             break;
         }
+        if (torn_tail && header.type != SEGMENT_BATCH_TYPE
+                && header.type != ENTRY_TYPE_CONFIGURATION) {
+            // batch records and configurations are verified when loaded below
+            butil::IOBuf data;
+            if (_load_entry(entry_off, NULL, &data, skip_len) != 0) {
+                LOG(WARNING) << "Take the broken entry at offset=" << entry_off
+                             << " as the end of the open segment, path: " << _path;
+                break;
+            }
+        }
+        if (header.type == SEGMENT_BATCH_TYPE) {
+            if (entry_off + skip_len > (int64_t)UINT32_MAX) {
+                LOG(ERROR) << "Found batch record beyond 4GB at offset="
+                           << entry_off << ", path: " << _path;
+                ret = -1;
+                break;
+            }
+            butil::IOBuf body;
+            if (_load_entry(entry_off, NULL, &body, skip_len) != 0) {
+                break;
+            }
+            int64_t packed_off = entry_off + ENTRY_HEADER_SIZE;
+            while (!body.empty()) {
+                EntryHeader packed;
+                const int64_t off = (packed_off == entry_off + (int64_t)ENTRY_HEADER_SIZE)
+                                    ? entry_off : packed_off;
+                if (cut_batch_entry(&body, header, &packed, NULL) != 0) {
+                    LOG(ERROR) << "Found corrupted batch record at offset="
+                               << entry_off << ", header=" << header
+                               << ", path: " << _path;
+                    ret = -1;
+                    break;
+                }
+                _offset_and_term.push_back(off, header.term);
+                ++actual_last_index;
+                packed_off += BATCH_ENTRY_HEADER_SIZE + packed.data_len;
+            }
+            if (ret != 0) {
+                break;
+            }
+            _batches.push_back(std::make_pair((uint32_t)entry_off,
+                                              (uint32_t)(entry_off + skip_len)));
+            entry_off += skip_len;
+            continue;
+        }
         if (header.type == ENTRY_TYPE_CONFIGURATION) {
             butil::IOBuf data;
             // Header will be parsed again but it's fine as configuration
@@ -318,6 +1401,7 @@ int Segment::load(ConfigurationManager* configuration_manager) {
             if (status.ok()) {
                 ConfigurationEntry conf_entry(*entry);
                 configuration_manager->add(conf_entry); 
+                _conf_indexes.push_back(i);
             } else {
                 LOG(ERROR) << "fail to parse configuration meta, path: " << _path
                     << " entry_off " << entry_off;
@@ -325,7 +1409,7 @@ int Segment::load(ConfigurationManager* configuration_manager) {
                 break;
             }
         }
-        _offset_and_term.push_back(std::make_pair(entry_off, header.term));
+        _offset_and_term.push_back(entry_off, header.term);
         ++actual_last_index;
         entry_off += skip_len;
     }
@@ -365,6 +1449,10 @@ int Segment::load(ConfigurationManager* configuration_manager) {
     ::lseek(_fd, entry_off, SEEK_SET);
 
     _bytes = entry_off;
+    if (ret == 0 && _is_open && FLAGS_raft_segment_direct_io) {
+        _open_direct_io();
+    }
+    _mappable = (ret == 0 && !_is_open);
     return ret;
 }
 
@@ -380,44 +1468,24 @@ int Segment::append(const LogEntry* entry) {
         return ERANGE;
     }
 
-    butil::IOBuf data;
-    switch (entry->type) {
-    case ENTRY_TYPE_DATA:
-        data.append(entry->data);
-        break;
-    case ENTRY_TYPE_NO_OP:
-        break;
-    case ENTRY_TYPE_CONFIGURATION: 
-        {
-            butil::Status status = serialize_configuration_meta(entry, data);
-            if (!status.ok()) {
-                LOG(ERROR) << "Fail to serialize ConfigurationPBMeta, path: " 
-                           << _path;
-                return -1; 
-            }
-        }
-        break;
-    default:
-        LOG(FATAL) << "unknow entry type: " << entry->type
-                   << ", path: " << _path;
+    butil::IOBuf record;
+    if (entry->encoded_format == encoded_format(_checksum_type, _compress_type)) {
+        // serialized by the encode stage, see raft_log_encode_stage
+        record = entry->encoded;
+    } else if (encode_entry(entry, _checksum_type, _compress_type, &record) != 0) {
+        LOG(ERROR) << "Fail to serialize entry, path: " << _path;
         return -1;
     }
-    CHECK_LE(data.length(), 1ul << 56ul);
-    char header_buf[ENTRY_HEADER_SIZE];
-    const uint32_t meta_field = (entry->type << 24 ) | (_checksum_type << 16);
-    RawPacker packer(header_buf);
-    packer.pack64(entry->id.term)
-          .pack32(meta_field)
-          .pack32((uint32_t)data.length())
-          .pack32(get_checksum(_checksum_type, data));
-    packer.pack32(get_checksum(
-                  _checksum_type, header_buf, ENTRY_HEADER_SIZE - 4));
-    butil::IOBuf header;
-    header.append(header_buf, ENTRY_HEADER_SIZE);
-    const size_t to_write = header.length() + data.length();
-    butil::IOBuf* pieces[2] = { &header, &data };
+    const size_t to_write = record.length();
+    butil::IOBuf* pieces[1] = { &record };
     size_t start = 0;
     ssize_t written = 0;
+    if (_direct_fd >= 0) {
+        if (_direct_write(pieces, ARRAY_SIZE(pieces), to_write) != 0) {
+            return -1;
+        }
+        written = to_write;
+    }
     while (written < (ssize_t)to_write) {
         const ssize_t n = butil::IOBuf::cut_multiple_into_file_descriptor(
                 _fd, pieces + start, ARRAY_SIZE(pieces) - start);
@@ -429,8 +1497,11 @@ int Segment::append(const LogEntry* entry) {
         written += n;
         for (;start < ARRAY_SIZE(pieces) && pieces[start]->empty(); ++start) {}
     }
+    if (entry->type == ENTRY_TYPE_CONFIGURATION) {
+        _conf_indexes.push_back(entry->id.index);
+    }
     BAIDU_SCOPED_LOCK(_mutex);
-    _offset_and_term.push_back(std::make_pair(_bytes, entry->id.term));
+    _offset_and_term.push_back(_bytes, entry->id.term);
     _last_index.fetch_add(1, butil::memory_order_relaxed);
     _bytes += to_write;
     _unsynced_bytes += to_write;
@@ -448,72 +1519,123 @@ int Segment::prepare_data(const LogEntry* entry) {
     }
 
     butil::IOBuf head_and_data;
+    if (entry->encoded_format == encoded_format(_checksum_type, _compress_type)
+            && !FLAGS_raft_segment_batch_header) {
+        // serialized by the encode stage, see raft_log_encode_stage
+        head_and_data = entry->encoded;
+        return _stash_record(entry, &head_and_data);
+    }
+
+    butil::IOBuf compressed;
+    const butil::IOBuf* payload = &entry->data;
+    int compress_type = COMPRESS_NONE;
+    if (entry->type == ENTRY_TYPE_DATA && _compress_type != COMPRESS_NONE) {
+        compressed.append(entry->data);
+        compress_type = compress_data(_compress_type, &compressed);
+        if (compress_type != COMPRESS_NONE) {
+            payload = &compressed;
+        }
+    }
 
-    char header_buf[ENTRY_HEADER_SIZE];
-    const uint32_t meta_field = (entry->type << 24 ) | (_checksum_type << 16);
-    RawPacker packer(header_buf);
-    packer.pack64(entry->id.term)
-          .pack32(meta_field)
-          .pack32((uint32_t)entry->data.length())
-          .pack32(get_checksum(_checksum_type, entry->data));
-    packer.pack32(get_checksum(
-                  _checksum_type, header_buf, ENTRY_HEADER_SIZE - 4));
-
-    head_and_data.append(header_buf, ENTRY_HEADER_SIZE);
-
-    switch (entry->type) {
-    case ENTRY_TYPE_DATA:
-        head_and_data.append(entry->data);
-        break;
-    case ENTRY_TYPE_NO_OP:
-        break;
-    case ENTRY_TYPE_CONFIGURATION:
-        {
-            head_and_data.clear();
-            butil::IOBuf data;
-            butil::Status status = serialize_configuration_meta(entry, data);
-            if (!status.ok()) {
-                LOG(ERROR) << "Fail to serialize ConfigurationPBMeta, path: "
-                           << _path;
-                return -1;
+    const size_t packed_len = BATCH_ENTRY_HEADER_SIZE
+            + (entry->type == ENTRY_TYPE_DATA ? payload->length() : 0);
+    if (FLAGS_raft_segment_batch_header
+            && (entry->type == ENTRY_TYPE_DATA || entry->type == ENTRY_TYPE_NO_OP)
+            && packed_len <= (size_t)FLAGS_raft_segment_batch_max_bytes) {
+        if (_batch_offset >= 0 && (entry->id.term != _batch_term ||
+                _batch_body.length() + packed_len
+                        > (size_t)FLAGS_raft_segment_batch_max_bytes)) {
+            _seal_batch();
+        }
+        // Batch records are indexed with 32-bit offsets, don't start one
+        // which may end beyond 4GB of a huge segment
+        const int64_t next_offset = _bytes + _inflight_bytes + _to_write;
+        if (_batch_offset >= 0 || next_offset + (int64_t)ENTRY_HEADER_SIZE
+                + FLAGS_raft_segment_batch_max_bytes <= (int64_t)UINT32_MAX) {
+            int64_t offset = 0;
+            if (_batch_offset < 0) {
+                _batch_offset = next_offset;
+                _batch_term = entry->id.term;
+                offset = _batch_offset;
+            } else {
+                offset = _batch_offset + ENTRY_HEADER_SIZE + _batch_body.length();
+            }
+            char packed_header[BATCH_ENTRY_HEADER_SIZE];
+            RawPacker(packed_header)
+                    .pack32((entry->type << 24) | (compress_type << 16))
+                    .pack32(packed_len - BATCH_ENTRY_HEADER_SIZE);
+            _batch_body.append(packed_header, BATCH_ENTRY_HEADER_SIZE);
+            if (entry->type == ENTRY_TYPE_DATA) {
+                _batch_body.append(*payload);
             }
-            RawPacker packer(header_buf);
-            packer.pack64(entry->id.term).pack32(meta_field).pack32((uint32_t)data.length())
-                .pack32(get_checksum(_checksum_type, data));
-            packer.pack32(get_checksum(
-                _checksum_type, header_buf, ENTRY_HEADER_SIZE - 4));
-            head_and_data.append(header_buf, ENTRY_HEADER_SIZE);
-            head_and_data.append(data);
+            _offset_and_term_stashed.emplace_back(offset, entry->id.term);
+            return 0;
         }
-        break;
-    default:
-        LOG(FATAL) << "unknow entry type: " << entry->type
-                   << ", path: " << _path;
+    }
+    _seal_batch();
+
+    if (encode_record(entry, *payload, _checksum_type, compress_type,
+                      &head_and_data) != 0) {
+        LOG(ERROR) << "Fail to serialize entry, path: " << _path;
         return -1;
     }
+    return _stash_record(entry, &head_and_data);
+}
 
-    CHECK_LE(head_and_data.length(), 1ul << 56ul);
-    _data_list.emplace_back(std::move(head_and_data));
+int Segment::_stash_record(const LogEntry* entry, butil::IOBuf* record) {
+    if (entry->type == ENTRY_TYPE_CONFIGURATION) {
+        _conf_indexes.push_back(entry->id.index);
+    }
+    _offset_and_term_stashed.emplace_back(
+            _bytes + _inflight_bytes + _to_write, entry->id.term);
+    _data_list.emplace_back(std::move(*record));
     _pieces[_data_list.size() - 1] = &_data_list.back();
     _to_write += _data_list.back().length();
-    _offset_and_term_stashed.emplace_back(_bytes, entry->id.term);
 
     return 0;
 }
 
+void Segment::_seal_batch() {
+    if (_batch_offset < 0) {
+        return;
+    }
+    char header_buf[ENTRY_HEADER_SIZE];
+    pack_entry_header(header_buf, _batch_term, SEGMENT_BATCH_TYPE,
+                      _checksum_type, COMPRESS_NONE, _batch_body);
+    butil::IOBuf batch;
+    batch.append(header_buf, ENTRY_HEADER_SIZE);
+    batch.append(_batch_body);
+    _batch_body.clear();
+    _batches_stashed.push_back(std::make_pair(
+                (uint32_t)_batch_offset, (uint32_t)(_batch_offset + batch.length())));
+    _batch_offset = -1;
+    _data_list.emplace_back(std::move(batch));
+    _pieces[_data_list.size() - 1] = &_data_list.back();
+    _to_write += _data_list.back().length();
+}
+
 bool Segment::buffer_full() const {
-    return _data_list.size() == FLAGS_log_segment_data_list_batch_size;
+    // counted by entries as many of them may be packed in one batch record
+    return _offset_and_term_stashed.size() == FLAGS_log_segment_data_list_batch_size;
 }
 
 bool Segment::need_flush() const {
-    return _to_write > 0;
+    return _to_write > 0 || _batch_offset >= 0;
 }
 
 int Segment::flush_data() {
-    int data_cnt = _data_list.size();
+    _seal_batch();
+    const int data_cnt = _data_list.size();
+    const int entry_cnt = _offset_and_term_stashed.size();
     const size_t to_write = _to_write;
     size_t start = 0;
     ssize_t written = 0;
+    if (_direct_fd >= 0) {
+        if (_direct_write(_pieces, data_cnt, to_write) != 0) {
+            return -1;
+        }
+        written = to_write;
+    }
     while (written < (ssize_t)to_write) {
         const ssize_t n = butil::IOBuf::cut_multiple_into_file_descriptor(
                 _fd, _pieces + start, data_cnt - start);
@@ -529,14 +1651,172 @@ int Segment::flush_data() {
     _to_write = 0;
 
     BAIDU_SCOPED_LOCK(_mutex);
-    _offset_and_term.insert(_offset_and_term.end(),
-        _offset_and_term_stashed.begin(), _offset_and_term_stashed.end());
+    for (size_t i = 0; i < _offset_and_term_stashed.size(); ++i) {
+        _offset_and_term.push_back(_offset_and_term_stashed[i].first,
+                                   _offset_and_term_stashed[i].second);
+    }
     _offset_and_term_stashed.clear();
-    _last_index.fetch_add(data_cnt, butil::memory_order_relaxed);
+    _batches.insert(_batches.end(), _batches_stashed.begin(), _batches_stashed.end());
+    _batches_stashed.clear();
+    _last_index.fetch_add(entry_cnt, butil::memory_order_relaxed);
     _bytes += to_write;
     _unsynced_bytes += to_write;
 
-    return data_cnt;
+    return entry_cnt;
+}
+
+int Segment::flush_data_async(UringWriter* writer, bool sync) {
+    _seal_batch();
+    if (_data_list.empty() && !sync) {
+        return 0;
+    }
+    PendingWrite* pw = new PendingWrite;
+    pw->data_list.swap(_data_list);
+    pw->offset_and_term.swap(_offset_and_term_stashed);
+    pw->batches.swap(_batches_stashed);
+    pw->offset = _bytes + _inflight_bytes;
+    pw->bytes = _to_write;
+    pw->sync = sync;
+    for (size_t i = 0; i < pw->data_list.size(); ++i) {
+        const butil::IOBuf& buf = pw->data_list[i];
+        const size_t block_num = buf.backing_block_num();
+        for (size_t j = 0; j < block_num; ++j) {
+            butil::StringPiece sp = buf.backing_block(j);
+            if (!sp.empty()) {
+                struct iovec vec;
+                vec.iov_base = const_cast<char*>(sp.data());
+                vec.iov_len = sp.size();
+                pw->iov.push_back(vec);
+            }
+        }
+    }
+    _to_write = 0;
+    _inflight_bytes += pw->bytes;
+    _inflight.push_back(pw);
+    const int nreq = writer->submit(_fd, pw->offset, 
+                                    pw->iov.empty() ? NULL : &pw->iov[0],
+                                    pw->iov.size(), sync, pw);
+    if (nreq < 0) {
+        // Write it synchronously in reap_data
+        pw->failed = true;
+        return 0;
+    }
+    pw->nreq = nreq;
+    return 0;
+}
+
+int Segment::_finish_write(PendingWrite* pw, bool* rewritten) {
+    if (!pw->failed && pw->written == (int64_t)pw->bytes
+            && (!pw->sync || pw->sync_rc == 0)) {
+        if (pw->sync && *rewritten) {
+            // The fsync may be done before the former batches were rewritten
+            if (raft_fsync(_fd) != 0) {
+                PLOG(ERROR) << "Fail to sync fd=" << _fd << ", path: " << _path;
+                return -1;
+            }
+        }
+        return 0;
+    }
+    *rewritten = true;
+    // Short write, error or cancelled fsync, rewrite the whole batch in place
+    // synchronously which is idempotent.
+    LOG(WARNING) << "Fallback to sync write, path: " << _path
+                 << " offset: " << pw->offset << " bytes: " << pw->bytes
+                 << " written: " << pw->written << " sync_rc: " << pw->sync_rc;
+    std::vector<butil::IOBuf*> pieces;
+    pieces.reserve(pw->data_list.size());
+    for (size_t i = 0; i < pw->data_list.size(); ++i) {
+        pieces.push_back(&pw->data_list[i]);
+    }
+    size_t start = 0;
+    int64_t written = 0;
+    while (written < (int64_t)pw->bytes) {
+        const ssize_t n = butil::IOBuf::pcut_multiple_into_file_descriptor(
+                _fd, pw->offset + written, &pieces[start], pieces.size() - start);
+        if (n < 0) {
+            LOG(ERROR) << "Fail to write to fd=" << _fd
+                       << ", path: " << _path << berror();
+            return -1;
+        }
+        written += n;
+        for (; start < pieces.size() && pieces[start]->empty(); ++start) {}
+    }
+    if (pw->sync && raft_fsync(_fd) != 0) {
+        PLOG(ERROR) << "Fail to sync fd=" << _fd << ", path: " << _path;
+        return -1;
+    }
+    return 0;
+}
+
+int Segment::reap_data(UringWriter* writer) {
+    int nentries = 0;
+    bool ok = true;
+    bool rewritten = false;
+    while (!_inflight.empty()) {
+        PendingWrite* pw = _inflight.front();
+        while (pw->nreq > 0) {
+            UringWriter::Completion c;
+            if (writer->wait(&c) != 0) {
+                // The kernel may still reference the buffers of the pending
+                // writes, keep them and fail the storage
+                PLOG(ERROR) << "Fail to reap the writes of segment, path: "
+                            << _path;
+                return -1;
+            }
+            // Completions may arrive out of order, but they all belong to
+            // this segment as the previous segments were reaped before closed
+            // NOTE: bytes of a batch are published only after all the former
+            // batches are finished, so readers never see a hole.
+            PendingWrite* owner = static_cast<PendingWrite*>(c.data);
+            --owner->nreq;
+            if (c.is_sync) {
+                owner->sync_rc = c.res;
+            } else if (c.res < 0) {
+                owner->failed = true;
+            } else {
+                owner->written += c.res;
+            }
+        }
+        _inflight.pop_front();
+        _inflight_bytes -= pw->bytes;
+        if (ok && _finish_write(pw, &rewritten) != 0) {
+            ok = false;
+        }
+        if (ok) {
+            BAIDU_SCOPED_LOCK(_mutex);
+            for (size_t i = 0; i < pw->offset_and_term.size(); ++i) {
+                _offset_and_term.push_back(pw->offset_and_term[i].first,
+                                           pw->offset_and_term[i].second);
+            }
+            _batches.insert(_batches.end(), pw->batches.begin(),
+                            pw->batches.end());
+            _last_index.fetch_add(pw->offset_and_term.size(),
+                                  butil::memory_order_relaxed);
+            _bytes += pw->bytes;
+            _unsynced_bytes = pw->sync ? 0 : _unsynced_bytes + pw->bytes;
+            nentries += pw->offset_and_term.size();
+        }
+        delete pw;
+    }
+    // Keep the file offset consistent with the synchronous write path
+    ::lseek(_fd, _bytes, SEEK_SET);
+    return ok ? nentries : -1;
+}
+
+bool Segment::need_sync(bool will_sync) const {
+    if (!will_sync || !FLAGS_raft_sync) {
+        return false;
+    }
+    // synced by LogManager through sync_data
+    if (FLAGS_raft_sync_policy == RaftSyncPolicy::RAFT_SYNC_BY_TIME) {
+        return false;
+    }
+    if (FLAGS_raft_sync_policy == RaftSyncPolicy::RAFT_SYNC_BY_BYTES
+        && FLAGS_raft_sync_per_bytes > 
+                _unsynced_bytes + (int64_t)(_inflight_bytes + _to_write)) {
+        return false;
+    }
+    return true;
 }
 
 int Segment::sync(bool will_sync) {
@@ -544,18 +1824,74 @@ int Segment::sync(bool will_sync) {
         return 0;
     }
     //CHECK(_is_open);
-    if (will_sync) {
-        if (!FLAGS_raft_sync) {
-            return 0;
+    if (!need_sync(will_sync)) {
+        return 0;
+    }
+    return sync_data();
+}
+
+int Segment::sync_data() {
+    if (_last_index < _first_index) {
+        return 0;
+    }
+    _unsynced_bytes = 0;
+    if (_direct_fd >= 0) {
+        // The data has bypassed the page cache, only the metadata (e.g. the
+        // file size) and the volatile cache of the device have to be flushed
+#ifdef __APPLE__
+        return fcntl(_fd, F_FULLFSYNC);
+#else
+        return fdatasync(_direct_fd);
+#endif
+    }
+    if (FLAGS_raft_sync_coordinator) {
+        return coordinated_fsync(_fd);
+    }
+    return raft_fsync(_fd);
+}
+
+LogEntry* Segment::_build_entry(const EntryHeader& header, butil::IOBuf* data,
+                                int64_t index) const {
+    if (header.compress_type != COMPRESS_NONE) {
+        if (header.type != ENTRY_TYPE_DATA
+                || decompress_data(header.compress_type, data) != 0) {
+            LOG(ERROR) << "Fail to decompress entry " << index << " " << header
+                       << ", path: " << _path;
+            return NULL;
         }
-        if (FLAGS_raft_sync_policy == RaftSyncPolicy::RAFT_SYNC_BY_BYTES
-            && FLAGS_raft_sync_per_bytes > _unsynced_bytes) {
-            return 0;
+    }
+    LogEntry* entry = new LogEntry();
+    entry->AddRef();
+    bool ok = true;
+    switch (header.type) {
+    case ENTRY_TYPE_DATA:
+        entry->data.swap(*data);
+        break;
+    case ENTRY_TYPE_NO_OP:
+        CHECK(data->empty()) << "Data of NO_OP must be empty";
+        break;
+    case ENTRY_TYPE_CONFIGURATION:
+        {
+            butil::Status status = parse_configuration_meta(*data, entry); 
+            if (!status.ok()) {
+                LOG(WARNING) << "Fail to parse ConfigurationPBMeta, path: "
+                             << _path;
+                ok = false;
+            }
         }
-        _unsynced_bytes = 0;
-        return raft_fsync(_fd);
+        break;
+    default:
+        CHECK(false) << "Unknown entry type, path: " << _path;
+        break;
     }
-    return 0;
+    if (!ok) {
+        entry->Release();
+        return NULL;
+    }
+    entry->id.index = index;
+    entry->id.term = header.term;
+    entry->type = (EntryType)header.type;
+    return entry;
 }
 
 LogEntry* Segment::get(const int64_t index) const {
@@ -565,56 +1901,160 @@ LogEntry* Segment::get(const int64_t index) const {
         return NULL;
     }
 
-    bool ok = true;
-    LogEntry* entry = NULL;
-    do {
-        ConfigurationPBMeta configuration_meta;
+    EntryHeader header;
+    butil::IOBuf data;
+    const off_t offset = meta.batch_offset >= 0 ? meta.batch_offset : meta.offset;
+    const size_t length = meta.batch_offset >= 0 ? meta.batch_length : meta.length;
+    SegmentMapping* mapping = _acquire_mapping();
+    const int rc = mapping
+            ? _load_mapped_entry(mapping, offset, &header, &data)
+            : _load_entry(offset, &header, &data, length);
+    if (mapping) {
+        mapping->Release();
+    }
+    if (rc != 0) {
+        return NULL;
+    }
+    CHECK_EQ(meta.term, header.term);
+    if (meta.batch_offset < 0) {
+        return _build_entry(header, &data, index);
+    }
+    // skip the entries packed before
+    const off_t packed_off = std::max(meta.offset,
+                                      meta.batch_offset + (off_t)ENTRY_HEADER_SIZE);
+    EntryHeader packed;
+    butil::IOBuf packed_data;
+    if (header.type != SEGMENT_BATCH_TYPE
+            || data.pop_front(packed_off - meta.batch_offset - ENTRY_HEADER_SIZE)
+                    != (size_t)(packed_off - meta.batch_offset - ENTRY_HEADER_SIZE)
+            || cut_batch_entry(&data, header, &packed, &packed_data) != 0) {
+        LOG(ERROR) << "Fail to find entry " << index << " in batch record at offset="
+                   << meta.batch_offset << ", header=" << header << ", path: " << _path;
+        return NULL;
+    }
+    return _build_entry(packed, &packed_data, index);
+}
+
+int Segment::get_entries(const int64_t first_index, const int64_t last_index,
+                         size_t max_bytes, std::vector<LogEntry*>* entries) const {
+    int64_t start_offset = 0;
+    int64_t end_offset = 0;
+    int64_t end_index = first_index - 1;
+    // offset of first_index, the batch records are read as a whole
+    int64_t first_offset = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        const int64_t seg_last_index = _last_index.load(butil::memory_order_relaxed);
+        if (first_index < _first_index || first_index > seg_last_index) {
+            return 0;
+        }
+        const int64_t last = std::min(last_index, seg_last_index);
+        start_offset = _offset_and_term.offset(first_index - _first_index);
+        // take the whole entries until max_bytes is reached
+        for (end_index = first_index; end_index <= last; ++end_index) {
+            end_offset = (end_index < seg_last_index)
+                    ? _offset_and_term.offset(end_index + 1 - _first_index) : _bytes;
+            if (end_offset - start_offset >= (int64_t)max_bytes) {
+                break;
+            }
+        }
+        end_index = std::min(end_index, last);
+        first_offset = start_offset;
+        int64_t batch_start = 0;
+        int64_t batch_end = 0;
+        if (_find_batch(start_offset, &batch_start, &batch_end)) {
+            start_offset = batch_start;
+        }
+        if (_find_batch(end_offset, &batch_start, &batch_end)
+                && batch_start < end_offset) {
+            end_offset = batch_end;
+        }
+    }
+    SegmentMapping* mapping = _acquire_mapping();
+    butil::IOPortal buf;
+    if (mapping == NULL) {
+        // one read for the whole range
+        const ssize_t len = end_offset - start_offset;
+        if (file_pread(&buf, _fd, start_offset, len) != len) {
+            LOG(ERROR) << "Fail to read entries [" << first_index << ", "
+                       << end_index << "], path: " << _path;
+            return 0;
+        }
+    }
+    int64_t offset = start_offset;
+    int64_t index = first_index;
+    while (index <= end_index) {
         EntryHeader header;
         butil::IOBuf data;
-        if (_load_entry(meta.offset, &header, &data, 
-                        meta.length) != 0) {
-            ok = false;
-            break;
+        if (mapping) {
+            if (_load_mapped_entry(mapping, offset, &header, &data) != 0) {
+                break;
+            }
+        } else {
+            char header_buf[ENTRY_HEADER_SIZE];
+            const char* p = (const char*)buf.fetch(header_buf, ENTRY_HEADER_SIZE);
+            if (p == NULL || parse_entry_header(p, &header) != 0
+                    || buf.size() < ENTRY_HEADER_SIZE + header.data_len) {
+                LOG(ERROR) << "Found corrupted header at offset=" << offset
+                           << ", path: " << _path;
+                break;
+            }
+            buf.pop_front(ENTRY_HEADER_SIZE);
+            buf.cutn(&data, header.data_len);
+            if (!verify_checksum(header.checksum_type, data, header.data_checksum)) {
+                LOG(ERROR) << "Found corrupted data at offset="
+                           << offset + ENTRY_HEADER_SIZE
+                           << " header=" << header
+                           << " path: " << _path;
+                break;
+            }
         }
-        CHECK_EQ(meta.term, header.term);
-        entry = new LogEntry();
-        entry->AddRef();
-        switch (header.type) {
-        case ENTRY_TYPE_DATA:
-            entry->data.swap(data);
-            break;
-        case ENTRY_TYPE_NO_OP:
-            CHECK(data.empty()) << "Data of NO_OP must be empty";
-            break;
-        case ENTRY_TYPE_CONFIGURATION:
-            {
-                butil::Status status = parse_configuration_meta(data, entry); 
-                if (!status.ok()) {
-                    LOG(WARNING) << "Fail to parse ConfigurationPBMeta, path: "
-                                 << _path;
-                    ok = false;
-                    break;
-                }
+        const int64_t record_off = offset;
+        offset += ENTRY_HEADER_SIZE + header.data_len;
+        if (header.type != SEGMENT_BATCH_TYPE) {
+            LogEntry* entry = _build_entry(header, &data, index);
+            if (entry == NULL) {
+                break;
             }
-            break;
-        default:
-            CHECK(false) << "Unknown entry type, path: " << _path;
-            break;
+            entries->push_back(entry);
+            ++index;
+            continue;
         }
-
-        if (!ok) { 
+        bool ok = true;
+        int64_t packed_off = record_off + ENTRY_HEADER_SIZE;
+        while (!data.empty() && index <= end_index) {
+            const int64_t entry_off =
+                    (packed_off == record_off + (int64_t)ENTRY_HEADER_SIZE)
+                    ? record_off : packed_off;
+            EntryHeader packed;
+            butil::IOBuf packed_data;
+            if (cut_batch_entry(&data, header, &packed, &packed_data) != 0) {
+                LOG(ERROR) << "Found corrupted batch record at offset="
+                           << record_off << ", header=" << header
+                           << ", path: " << _path;
+                ok = false;
+                break;
+            }
+            packed_off += BATCH_ENTRY_HEADER_SIZE + packed.data_len;
+            if (entry_off < first_offset) {
+                continue;
+            }
+            LogEntry* entry = _build_entry(packed, &packed_data, index);
+            if (entry == NULL) {
+                ok = false;
+                break;
+            }
+            entries->push_back(entry);
+            ++index;
+        }
+        if (!ok) {
             break;
         }
-        entry->id.index = index;
-        entry->id.term = header.term;
-        entry->type = (EntryType)header.type;
-    } while (0);
-
-    if (!ok && entry != NULL) {
-        entry->Release();
-        entry = NULL;
     }
-    return entry;
+    if (mapping) {
+        mapping->Release();
+    }
+    return index - first_index;
 }
 
 int64_t Segment::get_term(const int64_t index) const {
@@ -628,25 +2068,53 @@ int64_t Segment::get_term(const int64_t index) const {
 int Segment::close(bool will_sync) {
     CHECK(_is_open);
     
-    std::string old_path(_path);
+    std::string old_path(dir());
     butil::string_appendf(&old_path, "/" BRAFT_SEGMENT_OPEN_PATTERN,
                          _first_index);
-    std::string new_path(_path);
+    std::string new_path(dir());
     butil::string_appendf(&new_path, "/" BRAFT_SEGMENT_CLOSED_PATTERN, 
                          _first_index, _last_index.load());
 
-    // TODO: optimize index memory usage by reconstruct vector
     LOG(INFO) << "close a full segment. Current first_index: " << _first_index 
               << " last_index: " << _last_index 
               << " raft_sync_segments: " << FLAGS_raft_sync_segments 
               << " will_sync: " << will_sync 
               << " path: " << new_path;
     int ret = 0;
+    if (_preallocated) {
+        // cut the unused preallocated space (or the padding of direct io) so
+        // that the closed segment ends exactly at the last entry
+        ret = ftruncate_uninterrupted(_fd, _bytes);
+        if (ret != 0) {
+            PLOG(ERROR) << "Fail to truncate " << old_path << " to " << _bytes;
+            return ret;
+        }
+        _preallocated = false;
+    }
+    if (_direct_fd >= 0) {
+        _close_direct_io();
+#if defined(POSIX_FADV_DONTNEED)
+        // drop the pages of the closed segment cached by the former reads
+        posix_fadvise(_fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    }
+    bool synced = false;
     if (_last_index > _first_index) {
         if (FLAGS_raft_sync_segments && will_sync) {
             ret = raft_fsync(_fd);
+            synced = true;
         }
     }
+    if (!synced && will_sync && FLAGS_raft_sync && _unsynced_bytes > 0
+            && FLAGS_raft_sync_policy == RaftSyncPolicy::RAFT_SYNC_BY_TIME) {
+        // LogManager only syncs the open segment
+        ret = raft_fsync(_fd);
+        synced = true;
+    }
+    if (ret == 0 && FLAGS_raft_segment_index_file && !synced) {
+        // The index file must not describe entries which are not durable yet
+        ret = raft_fsync(_fd);
+    }
     if (ret == 0) {
         _is_open = false;
         const int rc = ::rename(old_path.c_str(), new_path.c_str());
@@ -655,6 +2123,16 @@ int Segment::close(bool will_sync) {
         LOG_IF(ERROR, rc != 0) << "Fail to rename `" << old_path
                                << "' to `" << new_path <<"\', "
                                << berror();
+        if (rc == 0) {
+            BAIDU_SCOPED_LOCK(_mutex);
+            _mappable = true;
+            // the index doesn't grow any more
+            _offset_and_term.shrink_to_fit();
+        }
+        if (rc == 0 && FLAGS_raft_segment_index_file) {
+            // Loading falls back to scanning the segment without the index
+            _save_index();
+        }
         return rc;
     }
     return ret;
@@ -668,22 +2146,100 @@ std::string Segment::file_name() {
     }
 }
 
-static void* run_unlink(void* arg) {
-    std::string* file_path = (std::string*) arg;
-    butil::Timer timer;
-    timer.start();
-    int ret = ::unlink(file_path->c_str());
-    timer.stop();
-    BRAFT_VLOG << "unlink " << *file_path << " ret " << ret << " time: " << timer.u_elapsed();
-    delete file_path;
+// Frees the files of the removed segments off the disk thread. All the
+// segments of this process go through one queue, so that the unlinks are
+// serialized and throttled by raft_segment_reclaim_bytes_per_second.
+class SegmentReclaimer {
+public:
+    SegmentReclaimer() : _started(false) {
+        bthread::ExecutionQueueOptions options;
+        _started = bthread::execution_queue_start(
+                &_queue_id, &options, run, this) == 0;
+        LOG_IF(WARNING, !_started) << "Fail to start segment reclaimer,"
+                                      " segments are unlinked synchronously";
+    }
+
+    static SegmentReclaimer* GetInstance() {
+        return butil::get_leaky_singleton<SegmentReclaimer>();
+    }
+
+    // Unlink |path| in background. |segment| is released before that so
+    // that closing the fd and unmapping happen in background as well
+    void reclaim(Segment* segment, const std::string& path) {
+        Task task;
+        task.segment = segment;
+        task.path = path;
+        g_segment_reclaim_pending << 1;
+        if (!_started || bthread::execution_queue_execute(_queue_id, task) != 0) {
+            remove(&task);
+        }
+    }
 
-    return NULL;
-}
+private:
+    struct Task {
+        scoped_refptr<Segment> segment;
+        std::string path;
+    };
+
+    static int run(void* meta, bthread::TaskIterator<Task>& iter) {
+        if (iter.is_queue_stopped()) {
+            return 0;
+        }
+        for (; iter; ++iter) {
+            remove(&*iter);
+        }
+        return 0;
+    }
+
+    static void throttle(int64_t bytes) {
+        const int64_t rate = FLAGS_raft_segment_reclaim_bytes_per_second;
+        if (rate > 0 && bytes > 0) {
+            bthread_usleep(bytes * 1000000L / rate);
+        }
+    }
+
+    static void remove(Task* task) {
+        butil::Timer timer;
+        timer.start();
+        task->segment = NULL;
+        int64_t size = 0;
+        struct stat st_buf;
+        if (::stat(task->path.c_str(), &st_buf) == 0) {
+            size = st_buf.st_size;
+        }
+        const int64_t step = FLAGS_raft_segment_reclaim_truncate_step;
+        if (step > 0 && size > step) {
+            int fd = ::open(task->path.c_str(), O_WRONLY);
+            if (fd >= 0) {
+                while (size > step) {
+                    if (ftruncate_uninterrupted(fd, size - step) != 0) {
+                        PLOG(WARNING) << "Fail to truncate " << task->path;
+                        break;
+                    }
+                    size -= step;
+                    throttle(step);
+                }
+                ::close(fd);
+            }
+        }
+        const int ret = ::unlink(task->path.c_str());
+        PLOG_IF(WARNING, ret != 0) << "Fail to unlink " << task->path;
+        throttle(size);
+        timer.stop();
+        g_segment_reclaim_latency << timer.u_elapsed();
+        g_segment_reclaim_pending << -1;
+        BRAFT_VLOG << "unlink " << task->path << " ret " << ret
+                   << " time: " << timer.u_elapsed();
+    }
+
+    bthread::ExecutionQueueId<Task> _queue_id;
+    bool _started;
+};
 
 int Segment::unlink() {
     int ret = 0;
     do {
-        std::string path(_path);
+        std::string path(dir());
         if (_is_open) {
             butil::string_appendf(&path, "/" BRAFT_SEGMENT_OPEN_PATTERN,
                                  _first_index);
@@ -699,13 +2255,18 @@ int Segment::unlink() {
             PLOG(ERROR) << "Fail to rename " << path << " to " << tmp_path;
             break;
         }
+        if (!_is_open) {
+            _remove_index();
+        }
 
-        // start bthread to unlink
-        // TODO unlink follow control
-        std::string* file_path = new std::string(tmp_path);
-        bthread_t tid;
-        if (bthread_start_background(&tid, &BTHREAD_ATTR_NORMAL, run_unlink, file_path) != 0) {
-            run_unlink(file_path);
+        // The pages mapped by readers must not be truncated by the reclaimer,
+        // see commit_migration
+        if (_unmap()) {
+            ret = ::unlink(tmp_path.c_str());
+            PLOG_IF(WARNING, ret != 0) << "Fail to unlink " << tmp_path;
+            ret = 0;
+        } else {
+            SegmentReclaimer::GetInstance()->reclaim(this, tmp_path);
         }
 
         LOG(INFO) << "Unlinked segment `" << path << '\'';
@@ -714,6 +2275,27 @@ int Segment::unlink() {
     return ret;
 }
 
+int Segment::recycle(const std::string& pool_file) {
+    CHECK(!_is_open);
+    if (_unmap()) {
+        // The file is about to be overwritten by the pool
+        BRAFT_VLOG << "Segment " << _path << " first_index: " << _first_index
+                   << " is still mapped by readers, skip recycling";
+        return -1;
+    }
+    std::string path(dir());
+    butil::string_appendf(&path, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
+                          _first_index, _last_index.load());
+    const int ret = ::rename(path.c_str(), pool_file.c_str());
+    if (ret != 0) {
+        PLOG(ERROR) << "Fail to rename " << path << " to " << pool_file;
+        return ret;
+    }
+    _remove_index();
+    LOG(INFO) << "Recycled segment `" << path << "' to `" << pool_file << '\'';
+    return 0;
+}
+
 int Segment::truncate(const int64_t last_index_kept) {
     int64_t truncate_size = 0;
     int64_t first_truncate_in_offset = 0;
@@ -722,20 +2304,57 @@ int Segment::truncate(const int64_t last_index_kept) {
         return 0;
     }
     first_truncate_in_offset = last_index_kept + 1 - _first_index;
-    truncate_size = _offset_and_term[first_truncate_in_offset].first;
+    truncate_size = _offset_and_term.offset(first_truncate_in_offset);
+    // A batch record cut in the middle is rewritten with the kept entries,
+    // its range is shrunk in advance as readers are able to read the kept
+    // entries from either the old record or the new one.
+    int64_t batch_start = 0;
+    int64_t batch_end = 0;
+    const bool cut_batch = _find_batch(truncate_size, &batch_start, &batch_end)
+                           && batch_start < truncate_size;
+    while (!_batches.empty() && _batches.back().first >= truncate_size) {
+        _batches.pop_back();
+    }
+    if (cut_batch) {
+        _batches.back().second = truncate_size;
+    }
     BRAFT_VLOG << "Truncating " << _path << " first_index: " << _first_index
               << " last_index from " << _last_index << " to " << last_index_kept
               << " truncate size to " << truncate_size;
     lck.unlock();
+    butil::IOBuf rewritten_batch;
+    if (cut_batch) {
+        EntryHeader header;
+        butil::IOBuf body;
+        if (_load_entry(batch_start, &header, &body, batch_end - batch_start) != 0) {
+            LOG(ERROR) << "Fail to load batch record at offset=" << batch_start
+                       << ", path: " << _path;
+            return -1;
+        }
+        body.pop_back(batch_end - truncate_size);
+        char header_buf[ENTRY_HEADER_SIZE];
+        pack_entry_header(header_buf, header.term, SEGMENT_BATCH_TYPE,
+                          header.checksum_type, COMPRESS_NONE, body);
+        rewritten_batch.append(header_buf, ENTRY_HEADER_SIZE);
+        rewritten_batch.append(body);
+    }
+    const bool mapped_by_readers = _unmap();
+
+    while (!_conf_indexes.empty() && _conf_indexes.back() > last_index_kept) {
+        _conf_indexes.pop_back();
+    }
 
     // Truncate on a full segment need to rename back to inprogess segment again,
     // because the node may crash before truncate.
     if (!_is_open) {
-        std::string old_path(_path);
+        // The index is removed first, a crash in the middle leaves a closed
+        // segment without index which is loaded by scanning
+        _remove_index();
+        std::string old_path(dir());
         butil::string_appendf(&old_path, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
                              _first_index, _last_index.load());
 
-        std::string new_path(_path);
+        std::string new_path(dir());
         butil::string_appendf(&new_path, "/" BRAFT_SEGMENT_OPEN_PATTERN,
                              _first_index);
         int ret = ::rename(old_path.c_str(), new_path.c_str());
@@ -748,30 +2367,199 @@ int Segment::truncate(const int64_t last_index_kept) {
         }
         _is_open = true;
     }
-
-    // truncate fd
-    int ret = ftruncate_uninterrupted(_fd, truncate_size);
-    if (ret < 0) {
+
+    // truncate fd
+    int ret = 0;
+    if (cut_batch) {
+        // Rewriting the header in place could lose the kept entries of the
+        // batch on crash, replace the file instead
+        _close_direct_io();
+        ret = _copy_on_truncate(batch_start, &rewritten_batch);
+    } else if (mapped_by_readers) {
+        ret = _copy_on_truncate(truncate_size, NULL);
+    } else {
+        ret = ftruncate_uninterrupted(_fd, truncate_size);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    // seek fd
+    off_t ret_off = ::lseek(_fd, truncate_size, SEEK_SET);
+    if (ret_off < 0) {
+        PLOG(ERROR) << "Fail to lseek fd=" << _fd << " to size=" << truncate_size
+                    << " path: " << _path;
+        return -1;
+    }
+
+    lck.lock();
+    // update memory var
+    _preallocated = false;
+    _offset_and_term.resize(first_truncate_in_offset);
+    _last_index.store(last_index_kept, butil::memory_order_relaxed);
+    _bytes = truncate_size;
+    lck.unlock();
+
+    if (_direct_fd >= 0) {
+        ret = _load_direct_tail();
+    } else if (FLAGS_raft_segment_direct_io) {
+        _open_direct_io();
+    }
+    return ret;
+}
+
+int64_t Segment::idle_seconds() const {
+    struct stat st_buf;
+    if (_fd < 0 || ::fstat(_fd, &st_buf) != 0) {
+        return 0;
+    }
+    return ::time(NULL) - st_buf.st_mtime;
+}
+
+int Segment::prepare_migration(const std::string& cold_path,
+                               std::string* tmp_path) {
+    int64_t size = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        size = _bytes;
+    }
+    *tmp_path = cold_path;
+    butil::string_appendf(tmp_path, "/" BRAFT_SEGMENT_CLOSED_PATTERN ".tmp",
+                          _first_index, _last_index.load());
+    butil::Timer timer;
+    timer.start();
+    int fd = ::open(tmp_path->c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open " << *tmp_path;
+        return -1;
+    }
+    int ret = 0;
+    const int64_t block_size = 1024 * 1024;
+    for (int64_t off = 0; off < size && ret == 0; off += block_size) {
+        const size_t len = std::min(block_size, size - off);
+        butil::IOPortal buf;
+        if (file_pread(&buf, _fd, off, len) != (ssize_t)len ||
+                file_pwrite(buf, fd, off) != (ssize_t)len) {
+            PLOG(ERROR) << "Fail to copy segment " << _first_index
+                        << " in " << _path << " to " << *tmp_path;
+            ret = -1;
+            break;
+        }
+        const int64_t rate = FLAGS_raft_segment_migrate_bytes_per_second;
+        // interrupted with ESTOP when the storage is being destroyed
+        if (rate > 0 && bthread_usleep(len * 1000000L / rate) != 0
+                && errno == ESTOP) {
+            ret = -1;
+        }
+    }
+    if (ret == 0 && raft_fsync(fd) != 0) {
+        PLOG(ERROR) << "Fail to sync " << *tmp_path;
+        ret = -1;
+    }
+    ::close(fd);
+    if (ret != 0) {
+        ::unlink(tmp_path->c_str());
+        return ret;
+    }
+    timer.stop();
+    g_segment_migrate_latency << timer.u_elapsed();
+    g_segment_migrated_bytes << size;
+    return 0;
+}
+
+int Segment::commit_migration(const std::string& cold_path,
+                              const std::string& tmp_path) {
+    std::string path(_path);
+    butil::string_appendf(&path, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
+                          _first_index, _last_index.load());
+    std::string cold_file(cold_path);
+    butil::string_appendf(&cold_file, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
+                          _first_index, _last_index.load());
+    int64_t size = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        size = _bytes;
+    }
+    int fd = ::open(tmp_path.c_str(), O_RDWR);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open " << tmp_path;
+        ::unlink(tmp_path.c_str());
+        return -1;
+    }
+    struct stat st_buf;
+    if (::fstat(fd, &st_buf) != 0 || st_buf.st_size != size) {
+        LOG(WARNING) << "Segment " << path << " was modified during migration";
+        ::close(fd);
+        ::unlink(tmp_path.c_str());
+        return -1;
+    }
+    if (::rename(tmp_path.c_str(), cold_file.c_str()) != 0) {
+        PLOG(ERROR) << "Fail to rename " << tmp_path << " to " << cold_file;
+        ::close(fd);
+        ::unlink(tmp_path.c_str());
+        return -1;
+    }
+    // The index is written again in cold_path, a crash in the middle leaves
+    // a closed segment without index which is loaded by scanning
+    _remove_index();
+    int ret = 0;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        // Concurrent readers see either the old file or the new one through
+        // _fd, which have the same content
+        ret = ::dup2(fd, _fd) < 0 ? -1 : 0;
+        PLOG_IF(ERROR, ret != 0) << "Fail to dup2 fd=" << fd << " to fd=" << _fd;
+        if (ret == 0) {
+            set_migrated(cold_path);
+        }
+    }
+    ::close(fd);
+    if (ret != 0) {
+        ::unlink(cold_file.c_str());
         return ret;
     }
-
-    // seek fd
-    off_t ret_off = ::lseek(_fd, truncate_size, SEEK_SET);
-    if (ret_off < 0) {
-        PLOG(ERROR) << "Fail to lseek fd=" << _fd << " to size=" << truncate_size
-                    << " path: " << _path;
-        return -1;
+    if (FLAGS_raft_segment_index_file) {
+        _save_index();
+    }
+    // Both files are kept if the rename fails, the one in path is removed
+    // at the next startup
+    std::string tmp_file(path);
+    tmp_file.append(".tmp");
+    if (::rename(path.c_str(), tmp_file.c_str()) != 0) {
+        PLOG(WARNING) << "Fail to rename " << path << " to " << tmp_file;
+        return 0;
+    }
+    // The pages mapped from the former file are still accessed by readers,
+    // which must not be truncated by the reclaimer. Cold segments are always
+    // read through _fd afterwards.
+    if (_unmap()) {
+        ::unlink(tmp_file.c_str());
+    } else {
+        SegmentReclaimer::GetInstance()->reclaim(this, tmp_file);
     }
+    LOG(INFO) << "Migrated segment `" << path << "' to `" << cold_file << '\'';
+    return 0;
+}
 
-    lck.lock();
-    // update memory var
-    _offset_and_term.resize(first_truncate_in_offset);
-    _last_index.store(last_index_kept, butil::memory_order_relaxed);
-    _bytes = truncate_size;
-    return ret;
+SegmentLogStorage::~SegmentLogStorage() {
+    _migrate_stopped.store(true, butil::memory_order_relaxed);
+    if (_migrate_tid != 0) {
+        bthread_stop(_migrate_tid);
+        bthread_join(_migrate_tid, NULL);
+    }
+    bthread_t tid = 0;
+    {
+        BAIDU_SCOPED_LOCK(_pool_mutex);
+        _pool_stopped = true;
+        tid = _pool_tid;
+    }
+    if (tid != 0) {
+        bthread_join(tid, NULL);
+    }
 }
 
 int SegmentLogStorage::init(ConfigurationManager* configuration_manager) {
+    renew_cache_owner();
     if (FLAGS_raft_max_segment_size < 0) {
         LOG(FATAL) << "FLAGS_raft_max_segment_size " << FLAGS_raft_max_segment_size  
                    << " must be greater than or equal to 0 ";
@@ -784,6 +2572,23 @@ int SegmentLogStorage::init(ConfigurationManager* configuration_manager) {
         LOG(ERROR) << "Fail to create " << dir_path.value() << " : " << e;
         return -1;
     }
+    if (!_cold_path.empty() && !butil::CreateDirectoryAndGetError(
+                butil::FilePath(_cold_path), &e,
+                FLAGS_raft_create_parent_directories)) {
+        LOG(ERROR) << "Fail to create " << _cold_path << " : " << e;
+        return -1;
+    }
+
+    if (FLAGS_raft_segment_use_io_uring && !_uring_writer) {
+        std::unique_ptr<UringWriter> writer(new UringWriter);
+        if (writer->init(FLAGS_raft_segment_io_uring_depth) == 0) {
+            _uring_writer.swap(writer);
+            LOG(INFO) << "Use io_uring to write segments, path: " << _path;
+        } else {
+            LOG(WARNING) << "Fail to init io_uring, fallback to sync write, path: "
+                         << _path;
+        }
+    }
 
     if (butil::crc32c::IsFastCrc32Supported()) {
         _checksum_type = CHECKSUM_CRC32;
@@ -793,6 +2598,15 @@ int SegmentLogStorage::init(ConfigurationManager* configuration_manager) {
         LOG_ONCE(INFO) << "Use murmurhash32 as the checksum type of appending entries";
     }
 
+    if (_compress_type < 0) {
+        _compress_type = compress_type_from_name(FLAGS_raft_segment_compress_type);
+        if (_compress_type < 0) {
+            LOG(ERROR) << "Unknown raft_segment_compress_type="
+                       << FLAGS_raft_segment_compress_type << ", path: " << _path;
+            return -1;
+        }
+    }
+
     int ret = 0;
     bool is_empty = false;
     do {
@@ -815,6 +2629,11 @@ int SegmentLogStorage::init(ConfigurationManager* configuration_manager) {
         }
     } while (0);
 
+    if (ret == 0) {
+        fill_segment_pool();
+        start_migration();
+    }
+
     if (is_empty) {
         _first_log_index.store(1);
         _last_log_index.store(0);
@@ -827,6 +2646,26 @@ int64_t SegmentLogStorage::last_log_index() {
     return _last_log_index.load(butil::memory_order_acquire);
 }
 
+void SegmentLogStorage::encode_entries(const std::vector<LogEntry*>& entries) {
+    // The packed entries of a batch record depend on their neighbours
+    if (FLAGS_raft_segment_batch_header) {
+        return;
+    }
+    const int format = encoded_format(_checksum_type, _compress_type);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        LogEntry* entry = entries[i];
+        entry->encoded.clear();
+        entry->encoded_format = 0;
+        if (encode_entry(entry, _checksum_type, _compress_type,
+                         &entry->encoded) != 0) {
+            // Leave it to the appending which reports the error
+            entry->encoded.clear();
+            continue;
+        }
+        entry->encoded_format = format;
+    }
+}
+
 int SegmentLogStorage::append_entries(const std::vector<LogEntry*>& entries, IOMetric* metric) {
     if (entries.empty()) {
         return 0;
@@ -885,11 +2724,13 @@ int SegmentLogStorage::append_entries_in_batch(const std::vector<LogEntry*>& ent
                    << " path: " << _path;
         return -1;
     }
+    const int64_t first_index = entries.front()->id.index;
+    UringWriter* writer = _uring_writer.get();
     scoped_refptr<Segment> last_segment = NULL;
     int64_t now = 0;
     int64_t delta_time_us = 0;
 
-    int last_success = 0;
+    bool ok = true;
     for (size_t i = 0; i < entries.size(); i++) {
         now = butil::cpuwide_time_us();
         LogEntry* entry = entries[i];
@@ -901,19 +2742,28 @@ int SegmentLogStorage::append_entries_in_batch(const std::vector<LogEntry*>& ent
             g_open_segment_latency << delta_time_us;
         }
         if (NULL == segment) {
-            return last_success;
+            ok = false;
+            break;
         }
-        int ret = segment->prepare_data(entry);
-        if (0 != ret) {
-            return last_success;
+        last_segment = segment;
+        if (0 != segment->prepare_data(entry)) {
+            ok = false;
+            break;
         }
         if (segment->buffer_full()) {
-            int ret = segment->flush_data();
-            if (ret < 0) {
-                return last_success;
+            // direct io segments are staged and written synchronously
+            if (writer && !segment->is_direct_io()) {
+                // Keep serializing the following entries while the kernel is
+                // writing this batch
+                segment->flush_data_async(writer, false);
+            } else {
+                int ret = segment->flush_data();
+                if (ret < 0) {
+                    ok = false;
+                    break;
+                }
+                _last_log_index.fetch_add(ret, butil::memory_order_release);
             }
-            _last_log_index.fetch_add(ret, butil::memory_order_release);
-            last_success = i;
         }
 
         if (FLAGS_raft_trace_append_entry_latency && metric) {
@@ -921,20 +2771,40 @@ int SegmentLogStorage::append_entries_in_batch(const std::vector<LogEntry*>& ent
             metric->append_entry_time_us += delta_time_us;
             g_segment_append_entry_latency << delta_time_us;
         }
-        last_segment = segment;
     }
-    int ret = last_segment->flush_data();
-    if (ret < 0) {
-        return last_success;
+    if (last_segment == NULL) {
+        return 0;
     }
-    _last_log_index.fetch_add(ret, butil::memory_order_release);
     now = butil::cpuwide_time_us();
-    last_segment->sync(_enable_sync);
+    if (writer && !last_segment->is_direct_io()) {
+        // The submitted batches must be reaped even if some entry failed
+        const bool sync = ok && last_segment->need_sync(_enable_sync);
+        if (ok) {
+            last_segment->flush_data_async(writer, sync);
+        }
+        const int ret = last_segment->reap_data(writer);
+        if (ret < 0) {
+            ok = false;
+        } else {
+            _last_log_index.fetch_add(ret, butil::memory_order_release);
+        }
+    } else if (ok) {
+        int ret = last_segment->flush_data();
+        if (ret < 0) {
+            ok = false;
+        } else {
+            _last_log_index.fetch_add(ret, butil::memory_order_release);
+            last_segment->sync(_enable_sync);
+        }
+    }
     if (FLAGS_raft_trace_append_entry_latency && metric) {
         delta_time_us = butil::cpuwide_time_us() - now;
         metric->sync_segment_time_us += delta_time_us;
         g_sync_segment_latency << delta_time_us;
     }
+    if (!ok) {
+        return _last_log_index.load(butil::memory_order_relaxed) - first_index + 1;
+    }
     return entries.size();
 }
 
@@ -956,11 +2826,19 @@ int SegmentLogStorage::append_entry(const LogEntry* entry) {
 }
 
 LogEntry* SegmentLogStorage::get_entry(const int64_t index) {
+    // Load the owner before looking up the segment, so that an entry read
+    // before truncate_suffix is never kept under the renewed owner
+    const uint64_t owner = _cache_owner.load(butil::memory_order_acquire);
     scoped_refptr<Segment> ptr;
     if (get_segment(index, &ptr) != 0) {
         return NULL;
     }
-    return ptr->get(index);
+    if (!LogEntryCache::enabled()) {
+        return ptr->get(index);
+    }
+    return LogEntryCache::GetInstance()->get(owner, index, [&ptr, index] {
+        return ptr->get(index);
+    });
 }
 
 int64_t SegmentLogStorage::get_term(const int64_t index) {
@@ -1002,6 +2880,52 @@ void SegmentLogStorage::pop_segments(
     }
 }
 
+int SegmentLogStorage::get_entries(const int64_t first_index,
+                                   const int64_t last_index, size_t max_bytes,
+                                   std::vector<LogEntry*>* entries) {
+    const uint64_t owner = _cache_owner.load(butil::memory_order_acquire);
+    LogEntryCache* cache = LogEntryCache::enabled()
+            ? LogEntryCache::GetInstance() : NULL;
+    int64_t index = first_index;
+    size_t bytes = 0;
+    while (index <= last_index && bytes < max_bytes) {
+        scoped_refptr<Segment> ptr;
+        if (get_segment(index, &ptr) != 0) {
+            break;
+        }
+        if (cache) {
+            LogEntry* entry = cache->lookup(owner, index);
+            if (entry) {
+                bytes += entry->data.length();
+                entries->push_back(entry);
+                ++index;
+                continue;
+            }
+        }
+        const size_t old_size = entries->size();
+        const int n = ptr->get_entries(index, last_index, max_bytes - bytes,
+                                       entries);
+        if (n <= 0) {
+            break;
+        }
+        for (size_t i = old_size; i < entries->size(); ++i) {
+            bytes += (*entries)[i]->data.length();
+            if (cache) {
+                cache->insert(owner, (*entries)[i]);
+            }
+        }
+        index += n;
+    }
+    return index - first_index;
+}
+
+void SegmentLogStorage::renew_cache_owner() {
+    // Always allocated even if the cache is disabled, as it can be enabled
+    // at runtime
+    _cache_owner.store(LogEntryCache::GetInstance()->new_owner(),
+                       butil::memory_order_release);
+}
+
 int SegmentLogStorage::truncate_prefix(const int64_t first_index_kept) {
     // segment files
     if (_first_log_index.load(butil::memory_order_acquire) >= first_index_kept) {
@@ -1021,10 +2945,18 @@ int SegmentLogStorage::truncate_prefix(const int64_t first_index_kept) {
     }
     std::vector<scoped_refptr<Segment> > popped;
     pop_segments(first_index_kept, &popped);
+    bool recycled = false;
     for (size_t i = 0; i < popped.size(); ++i) {
-        popped[i]->unlink();
+        if (recycle_segment(popped[i])) {
+            recycled = true;
+        } else {
+            popped[i]->unlink();
+        }
         popped[i] = NULL;
     }
+    if (recycled) {
+        fill_segment_pool();
+    }
     return 0;
 }
 
@@ -1110,6 +3042,8 @@ int SegmentLogStorage::truncate_suffix(const int64_t last_index_kept) {
             _open_segment.swap(last_segment);
         }
     }
+    // The logs after |last_index_kept| are going to be rewritten
+    renew_cache_owner();
 
     return ret;
 }
@@ -1144,14 +3078,17 @@ int SegmentLogStorage::reset(const int64_t next_log_index) {
         popped[i]->unlink();
         popped[i] = NULL;
     }
+    renew_cache_owner();
     return 0;
 }
 
-int SegmentLogStorage::list_segments(bool is_empty) {
-    butil::DirReaderPosix dir_reader(_path.c_str());
+int SegmentLogStorage::list_segments_in(const std::string& path, bool cold,
+                                        bool is_empty,
+                                        std::vector<std::string>* index_files) {
+    butil::DirReaderPosix dir_reader(path.c_str());
     if (!dir_reader.IsValid()) {
         LOG(WARNING) << "directory reader failed, maybe NOEXIST or PERMISSION."
-                     << " path: " << _path;
+                     << " path: " << path;
         return -1;
     }
 
@@ -1161,7 +3098,7 @@ int SegmentLogStorage::list_segments(bool is_empty) {
         if ((is_empty && 0 == strncmp(dir_reader.name(), "log_", strlen("log_"))) ||
             (0 == strncmp(dir_reader.name() + (strlen(dir_reader.name()) - strlen(".tmp")),
                           ".tmp", strlen(".tmp")))) {
-            std::string segment_path(_path);
+            std::string segment_path(path);
             segment_path.append("/");
             segment_path.append(dir_reader.name());
             ::unlink(segment_path.c_str());
@@ -1177,29 +3114,88 @@ int SegmentLogStorage::list_segments(bool is_empty) {
         match = sscanf(dir_reader.name(), BRAFT_SEGMENT_CLOSED_PATTERN, 
                        &first_index, &last_index);
         if (match == 2) {
-            LOG(INFO) << "restore closed segment, path: " << _path
+            LOG(INFO) << "restore closed segment, path: " << path
                       << " first_index: " << first_index
                       << " last_index: " << last_index;
+            SegmentMap::iterator it = _segments.find(first_index);
+            if (it != _segments.end()) {
+                // The process crashed after the segment was copied to the
+                // cold path, drop the one left in the primary path
+                if (!cold || it->second->last_index() != last_index) {
+                    LOG(WARNING) << "closed segment conflict, path: " << path
+                                 << " first_index: " << first_index
+                                 << " last_index: " << last_index;
+                    return -1;
+                }
+                std::string primary_path(_path);
+                butil::string_appendf(&primary_path, "/" BRAFT_SEGMENT_CLOSED_PATTERN,
+                                      first_index, last_index);
+                ::unlink(primary_path.c_str());
+                LOG(WARNING) << "unlink migrated segment, path: " << primary_path;
+            }
             Segment* segment = new Segment(_path, first_index, last_index, _checksum_type);
+            if (cold) {
+                segment->set_migrated(path);
+            }
             _segments[first_index] = segment;
             continue;
         }
 
+        match = sscanf(dir_reader.name(), BRAFT_SEGMENT_INDEX_PATTERN,
+                       &first_index, &last_index);
+        if (match == 2) {
+            std::string index_path(path);
+            index_path.append("/");
+            index_path.append(dir_reader.name());
+            index_files->push_back(index_path);
+            continue;
+        }
+
+        int64_t pool_id = 0;
+        match = sscanf(dir_reader.name(), BRAFT_SEGMENT_POOL_PATTERN, &pool_id);
+        if (match == 1 && !cold) {
+            // The content is unknown, prepare it again
+            std::string pool_path(path);
+            pool_path.append("/");
+            pool_path.append(dir_reader.name());
+            BAIDU_SCOPED_LOCK(_pool_mutex);
+            _pool_pending.push_back(pool_path);
+            _next_pool_id = std::max(_next_pool_id, pool_id + 1);
+            continue;
+        }
+
+        // A cold segment reopened by truncate_suffix stays in the cold path
         match = sscanf(dir_reader.name(), BRAFT_SEGMENT_OPEN_PATTERN, 
                        &first_index);
         if (match == 1) {
-            BRAFT_VLOG << "restore open segment, path: " << _path
+            BRAFT_VLOG << "restore open segment, path: " << path
                 << " first_index: " << first_index;
             if (!_open_segment) {
                 _open_segment = new Segment(_path, first_index, _checksum_type);
+                _open_segment->set_compress_type(_compress_type);
+                if (cold) {
+                    _open_segment->set_migrated(path);
+                }
                 continue;
             } else {
-                LOG(WARNING) << "open segment conflict, path: " << _path
+                LOG(WARNING) << "open segment conflict, path: " << path
                     << " first_index: " << first_index;
                 return -1;
             }
         }
     }
+    return 0;
+}
+
+int SegmentLogStorage::list_segments(bool is_empty) {
+    std::vector<std::string> index_files;
+    if (list_segments_in(_path, false, is_empty, &index_files) != 0) {
+        return -1;
+    }
+    if (!_cold_path.empty() &&
+            list_segments_in(_cold_path, true, is_empty, &index_files) != 0) {
+        return -1;
+    }
 
     // check segment
     int64_t last_log_index = -1;
@@ -1239,6 +3235,22 @@ int SegmentLogStorage::list_segments(bool is_empty) {
         last_log_index = segment->last_index();
         ++it;
     }
+    // remove the index files left by the segments removed, truncated or
+    // migrated
+    std::set<std::string> used_index_files;
+    for (it = _segments.begin(); it != _segments.end(); ++it) {
+        std::string index_path(it->second->dir());
+        butil::string_appendf(&index_path, "/" BRAFT_SEGMENT_INDEX_PATTERN,
+                              it->second->first_index(), it->second->last_index());
+        used_index_files.insert(index_path);
+    }
+    for (size_t i = 0; i < index_files.size(); ++i) {
+        if (used_index_files.count(index_files[i]) != 0) {
+            continue;
+        }
+        ::unlink(index_files[i].c_str());
+        LOG(WARNING) << "unlink unused index file, path: " << index_files[i];
+    }
     if (_open_segment) {
         if (last_log_index == -1 &&
                 _first_log_index.load(butil::memory_order_relaxed) < _open_segment->first_index()) {
@@ -1256,21 +3268,73 @@ int SegmentLogStorage::list_segments(bool is_empty) {
     return 0;
 }
 
-int SegmentLogStorage::load_segments(ConfigurationManager* configuration_manager) {
-    int ret = 0;
+struct LoadSegmentsTask {
+    std::vector<Segment*> segments;
+    // configurations found in each segment, merged in order afterwards
+    std::vector<ConfigurationManager> managers;
+    std::vector<int> rets;
+    butil::atomic<size_t> next;
+    std::string path;
+};
 
-    // closed segments
-    SegmentMap::iterator it;
-    for (it = _segments.begin(); it != _segments.end(); ++it) {
-        Segment* segment = it->second.get();
-        LOG(INFO) << "load closed segment, path: " << _path
+static void* run_load_segments(void* arg) {
+    LoadSegmentsTask* task = (LoadSegmentsTask*)arg;
+    while (true) {
+        const size_t i = task->next.fetch_add(1, butil::memory_order_relaxed);
+        if (i >= task->segments.size()) {
+            break;
+        }
+        Segment* segment = task->segments[i];
+        LOG(INFO) << "load closed segment, path: " << task->path
             << " first_index: " << segment->first_index()
             << " last_index: " << segment->last_index();
-        ret = segment->load(configuration_manager);
+        task->rets[i] = segment->load(&task->managers[i]);
+    }
+    return NULL;
+}
+
+int SegmentLogStorage::load_segments(ConfigurationManager* configuration_manager) {
+    int ret = 0;
+
+    // closed segments are independent from each other, verify them in
+    // parallel and check the results in order
+    LoadSegmentsTask task;
+    task.segments.reserve(_segments.size());
+    for (SegmentMap::iterator it = _segments.begin(); it != _segments.end(); ++it) {
+        task.segments.push_back(it->second.get());
+    }
+    task.managers.resize(task.segments.size());
+    task.rets.resize(task.segments.size(), 0);
+    task.next.store(0, butil::memory_order_relaxed);
+    task.path = _path;
+    const size_t concurrency = std::min(task.segments.size(),
+                            (size_t)std::max(FLAGS_raft_load_segment_concurrency, 1));
+    std::vector<bthread_t> tids;
+    // the calling thread works as well
+    for (size_t i = 1; i < concurrency; ++i) {
+        bthread_t tid;
+        if (bthread_start_background(&tid, &BTHREAD_ATTR_NORMAL,
+                                     run_load_segments, &task) != 0) {
+            PLOG(WARNING) << "Fail to start bthread to load segments, path: "
+                          << _path;
+            break;
+        }
+        tids.push_back(tid);
+    }
+    run_load_segments(&task);
+    for (size_t i = 0; i < tids.size(); ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    for (size_t i = 0; i < task.segments.size(); ++i) {
+        ret = task.rets[i];
         if (ret != 0) {
             return ret;
-        } 
-        _last_log_index.store(segment->last_index(), butil::memory_order_release);
+        }
+        if (configuration_manager->splice(&task.managers[i]) != 0) {
+            return -1;
+        }
+        _last_log_index.store(task.segments[i]->last_index(),
+                              butil::memory_order_release);
     }
 
     // open segment
@@ -1346,7 +3410,8 @@ scoped_refptr<Segment> SegmentLogStorage::open_segment() {
         BAIDU_SCOPED_LOCK(_mutex);
         if (!_open_segment) {
             _open_segment = new Segment(_path, last_log_index() + 1, _checksum_type);
-            if (_open_segment->create() != 0) {
+            _open_segment->set_compress_type(_compress_type);
+            if (_open_segment->create(take_pool_file()) != 0) {
                 _open_segment = NULL;
                 return NULL;
             }
@@ -1359,6 +3424,14 @@ scoped_refptr<Segment> SegmentLogStorage::open_segment() {
     do {
         // flush the unwritten data before closing a segment
         if (prev_open_segment) {
+            if (prev_open_segment->has_inflight()) {
+                int ret = prev_open_segment->reap_data(_uring_writer.get());
+                if (ret < 0) {
+                    LOG(ERROR) << "fail to write segment data";
+                    return nullptr;
+                }
+                _last_log_index.fetch_add(ret, butil::memory_order_release);
+            }
             if (prev_open_segment->need_flush()) {
                 int ret = prev_open_segment->flush_data();
                 if (ret < 0) {
@@ -1368,10 +3441,13 @@ scoped_refptr<Segment> SegmentLogStorage::open_segment() {
                 _last_log_index.fetch_add(ret, butil::memory_order_release);
             }
             if (prev_open_segment->close(_enable_sync) == 0) {
-                BAIDU_SCOPED_LOCK(_mutex);
+                std::unique_lock<raft_mutex_t> lck(_mutex);
                 _open_segment = new Segment(_path, last_log_index() + 1, _checksum_type);
-                if (_open_segment->create() == 0) {
-                    // success
+                _open_segment->set_compress_type(_compress_type);
+                if (_open_segment->create(take_pool_file()) == 0) {
+                    lck.unlock();
+                    // success, prepare the next segment file in background
+                    fill_segment_pool();
                     break;
                 }
             }
@@ -1387,6 +3463,253 @@ scoped_refptr<Segment> SegmentLogStorage::open_segment() {
     return _open_segment;
 }
 
+std::string SegmentLogStorage::take_pool_file() {
+    if (FLAGS_raft_segment_pool_size <= 0) {
+        return std::string();
+    }
+    std::string pool_file;
+    BAIDU_SCOPED_LOCK(_pool_mutex);
+    if (_pool_ready.empty()) {
+        g_segment_pool_miss << 1;
+        return pool_file;
+    }
+    g_segment_pool_hit << 1;
+    pool_file.swap(_pool_ready.front());
+    _pool_ready.pop_front();
+    return pool_file;
+}
+
+bool SegmentLogStorage::recycle_segment(const scoped_refptr<Segment>& segment) {
+    // Files in the cold path can't be renamed into the pool
+    if (FLAGS_raft_segment_pool_size <= 0 || segment->is_open()
+            || segment->is_migrated()) {
+        return false;
+    }
+    // Readers may still be holding the segment, which should be unlinked as
+    // usual
+    if (!segment->HasOneRef()) {
+        return false;
+    }
+    BAIDU_SCOPED_LOCK(_pool_mutex);
+    if (_pool_stopped || _pool_ready.size() + _pool_pending.size()
+                            >= (size_t)FLAGS_raft_segment_pool_size) {
+        return false;
+    }
+    std::string pool_file(_path);
+    butil::string_appendf(&pool_file, "/" BRAFT_SEGMENT_POOL_PATTERN,
+                          _next_pool_id);
+    if (segment->recycle(pool_file) != 0) {
+        return false;
+    }
+    ++_next_pool_id;
+    _pool_pending.push_back(pool_file);
+    return true;
+}
+
+void SegmentLogStorage::fill_segment_pool() {
+    if (FLAGS_raft_segment_pool_size <= 0) {
+        return;
+    }
+    bthread_t old_tid = 0;
+    {
+        BAIDU_SCOPED_LOCK(_pool_mutex);
+        if (_pool_filling || _pool_stopped) {
+            return;
+        }
+        if (_pool_pending.empty() &&
+                _pool_ready.size() >= (size_t)FLAGS_raft_segment_pool_size) {
+            return;
+        }
+        _pool_filling = true;
+        old_tid = _pool_tid;
+    }
+    if (old_tid != 0) {
+        // The previous filler has quit the loop, wait until it's completely done
+        bthread_join(old_tid, NULL);
+    }
+    bthread_t tid;
+    if (bthread_start_background(&tid, &BTHREAD_ATTR_NORMAL,
+                                 run_fill_segment_pool, this) != 0) {
+        PLOG(WARNING) << "Fail to start bthread to fill segment pool, path: "
+                      << _path;
+        BAIDU_SCOPED_LOCK(_pool_mutex);
+        _pool_filling = false;
+        _pool_tid = 0;
+        return;
+    }
+    BAIDU_SCOPED_LOCK(_pool_mutex);
+    _pool_tid = tid;
+}
+
+void* SegmentLogStorage::run_fill_segment_pool(void* arg) {
+    SegmentLogStorage* storage = (SegmentLogStorage*)arg;
+    storage->do_fill_segment_pool();
+    return NULL;
+}
+
+static int prepare_pool_file(const std::string& path, int64_t size) {
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to open " << path;
+        return -1;
+    }
+    int ret = 0;
+    do {
+        // drop the stale entries of a recycled segment first
+        ret = ftruncate_uninterrupted(fd, 0);
+        if (ret != 0) {
+            PLOG(ERROR) << "Fail to truncate " << path;
+            break;
+        }
+        if (FLAGS_raft_segment_pool_zero_fill) {
+            butil::IOBuf zeros;
+            const size_t block_size = 1024 * 1024;
+            std::unique_ptr<char[]> block(new char[block_size]());
+            for (int64_t off = 0; off < size; off += block_size) {
+                const size_t len = std::min((int64_t)block_size, size - off);
+                zeros.append(block.get(), len);
+                if (file_pwrite(zeros, fd, off) != (ssize_t)len) {
+                    PLOG(ERROR) << "Fail to write zeros to " << path;
+                    ret = -1;
+                    break;
+                }
+                zeros.clear();
+            }
+            if (ret != 0) {
+                break;
+            }
+        } else {
+#if defined(__linux__)
+            ret = ::fallocate(fd, 0, 0, size);
+#else
+            ret = ftruncate_uninterrupted(fd, size);
+#endif
+            if (ret != 0) {
+                PLOG(ERROR) << "Fail to allocate " << size << " bytes for " << path;
+                break;
+            }
+        }
+        ret = raft_fsync(fd);
+        if (ret != 0) {
+            PLOG(ERROR) << "Fail to sync " << path;
+        }
+    } while (0);
+    ::close(fd);
+    return ret;
+}
+
+void SegmentLogStorage::do_fill_segment_pool() {
+    while (true) {
+        std::string pool_file;
+        {
+            BAIDU_SCOPED_LOCK(_pool_mutex);
+            if (_pool_stopped) {
+                _pool_filling = false;
+                return;
+            }
+            if (!_pool_pending.empty()) {
+                pool_file.swap(_pool_pending.front());
+                _pool_pending.pop_front();
+            } else if (_pool_ready.size() < (size_t)FLAGS_raft_segment_pool_size) {
+                pool_file = _path;
+                butil::string_appendf(&pool_file, "/" BRAFT_SEGMENT_POOL_PATTERN,
+                                      _next_pool_id++);
+            } else {
+                _pool_filling = false;
+                return;
+            }
+        }
+        butil::Timer timer;
+        timer.start();
+        // Segments exceed raft_max_segment_size with the last entry, reserve
+        // one more block for it
+        const int64_t size = FLAGS_raft_max_segment_size + 4096;
+        if (prepare_pool_file(pool_file, size) != 0) {
+            ::unlink(pool_file.c_str());
+            BAIDU_SCOPED_LOCK(_pool_mutex);
+            _pool_filling = false;
+            return;
+        }
+        timer.stop();
+        g_fill_segment_pool_latency << timer.u_elapsed();
+        BRAFT_VLOG << "Prepared segment pool file " << pool_file
+                   << " size: " << size << " time: " << timer.u_elapsed();
+        BAIDU_SCOPED_LOCK(_pool_mutex);
+        _pool_ready.push_back(pool_file);
+    }
+}
+
+void SegmentLogStorage::start_migration() {
+    if (_cold_path.empty() || _migrate_tid != 0) {
+        return;
+    }
+    if (bthread_start_background(&_migrate_tid, &BTHREAD_ATTR_NORMAL,
+                                 run_migrate_segments, this) != 0) {
+        PLOG(WARNING) << "Fail to start bthread to migrate segments, path: "
+                      << _path;
+        _migrate_tid = 0;
+    }
+}
+
+void* SegmentLogStorage::run_migrate_segments(void* arg) {
+    SegmentLogStorage* storage = (SegmentLogStorage*)arg;
+    storage->do_migrate_segments();
+    return NULL;
+}
+
+scoped_refptr<Segment> SegmentLogStorage::pick_cold_segment() {
+    const int64_t distance = FLAGS_raft_segment_cold_index_distance;
+    const int32_t age = FLAGS_raft_segment_cold_age_s;
+    if (distance <= 0 && age <= 0) {
+        return NULL;
+    }
+    const int64_t last_index = last_log_index();
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_segments.empty()) {
+        return NULL;
+    }
+    // The last closed segment is kept as it's truncated by truncate_suffix
+    // without the lock
+    SegmentMap::iterator last = _segments.end();
+    --last;
+    for (SegmentMap::iterator it = _segments.begin(); it != last; ++it) {
+        Segment* segment = it->second.get();
+        if (segment->is_migrated()) {
+            continue;
+        }
+        if ((distance > 0 && last_index - segment->last_index() >= distance) ||
+                (age > 0 && segment->idle_seconds() >= age)) {
+            return it->second;
+        }
+        // the later segments are even hotter
+        break;
+    }
+    return NULL;
+}
+
+void SegmentLogStorage::do_migrate_segments() {
+    while (!_migrate_stopped.load(butil::memory_order_relaxed)) {
+        scoped_refptr<Segment> segment = pick_cold_segment();
+        std::string tmp_path;
+        if (!segment || segment->prepare_migration(_cold_path, &tmp_path) != 0) {
+            // woken up by bthread_stop
+            bthread_usleep(1000 * 1000);
+            continue;
+        }
+        BAIDU_SCOPED_LOCK(_mutex);
+        // The segment may be removed, or be the last one truncated by
+        // the disk thread, during the copy
+        SegmentMap::iterator it = _segments.find(segment->first_index());
+        if (it != _segments.end() && it->second.get() == segment.get()
+                && it->first != _segments.rbegin()->first
+                && !_migrate_stopped.load(butil::memory_order_relaxed)) {
+            segment->commit_migration(_cold_path, tmp_path);
+        } else {
+            ::unlink(tmp_path.c_str());
+        }
+    }
+}
+
 int SegmentLogStorage::get_segment(int64_t index, scoped_refptr<Segment>* ptr) {
     BAIDU_SCOPED_LOCK(_mutex);
     int64_t first_index = first_log_index();
@@ -1429,6 +3752,18 @@ void SegmentLogStorage::list_files(std::vector<std::string>* seg_files) {
     }
 }
 
+int SegmentLogStorage::sync_appended() {
+    scoped_refptr<Segment> segment;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        segment = _open_segment;
+    }
+    if (!segment || !_enable_sync) {
+        return 0;
+    }
+    return segment->sync_data();
+}
+
 void SegmentLogStorage::sync() {
     std::vector<scoped_refptr<Segment> > segments;
     {
@@ -1443,13 +3778,59 @@ void SegmentLogStorage::sync() {
     }
 }
 
+// uri = {path}[&&compress={none|snappy|zlib}][&&cold_path={cold_path}]
+static int parse_local_uri(const std::string& uri, std::string* path,
+                           int* compress_type, std::string* cold_path) {
+    *compress_type = -1;
+    cold_path->clear();
+    size_t pos = uri.find("&&");
+    *path = uri.substr(0, pos);
+    while (pos != std::string::npos) {
+        const size_t begin = pos + 2;
+        pos = uri.find("&&", begin);
+        const std::string option = uri.substr(
+                begin, pos == std::string::npos ? pos : pos - begin);
+        const size_t eq = option.find('=');
+        if (eq == std::string::npos) {
+            return -1;
+        }
+        const std::string value = option.substr(eq + 1);
+        if (option.compare(0, eq, "compress") == 0) {
+            *compress_type = compress_type_from_name(value);
+            if (*compress_type < 0) {
+                return -1;
+            }
+        } else if (option.compare(0, eq, "cold_path") == 0 && !value.empty()) {
+            *cold_path = value;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 LogStorage* SegmentLogStorage::new_instance(const std::string& uri) const {
-    return new SegmentLogStorage(uri);
+    std::string path;
+    int compress_type = -1;
+    std::string cold_path;
+    if (parse_local_uri(uri, &path, &compress_type, &cold_path) != 0) {
+        LOG(ERROR) << "Invalid log storage uri=`" << uri << '\'';
+        return NULL;
+    }
+    SegmentLogStorage* storage = new SegmentLogStorage(path);
+    storage->_compress_type = compress_type;
+    storage->_cold_path = cold_path;
+    return storage;
 }
 
 butil::Status SegmentLogStorage::gc_instance(const std::string& uri) const {
     butil::Status status;
-    if (gc_dir(uri) != 0) {
+    std::string path;
+    int compress_type = -1;
+    std::string cold_path;
+    if (parse_local_uri(uri, &path, &compress_type, &cold_path) != 0
+            || gc_dir(path) != 0
+            || (!cold_path.empty() && gc_dir(cold_path) != 0)) {
         LOG(WARNING) << "Failed to gc log storage from path " << _path;
         status.set_error(EINVAL, "Failed to gc log storage from path %s", 
                          uri.c_str());
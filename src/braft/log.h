@@ -21,6 +21,9 @@
 
 #include <vector>
 #include <map>
+#include <algorithm>
+#include <deque>
+#include <memory>
 #include <butil/memory/ref_counted.h>
 #include <butil/atomicops.h>
 #include <butil/iobuf.h>
@@ -28,9 +31,99 @@
 #include "braft/log_entry.h"
 #include "braft/storage.h"
 #include "braft/util.h"
+#include "braft/uring_writer.h"
 
 namespace braft {
 
+class SegmentMapping;
+
+// Offsets and terms of the entries in a segment. The offsets are kept in 32
+// bits as a segment is rolled around raft_max_segment_size, unless a large
+// entry pushes one over 4GB, in which case the segment falls back to 64 bits.
+// The terms are kept only at the entries where the term changes.
+class SegmentOffsetIndex {
+public:
+    SegmentOffsetIndex() : _wide(false) {}
+
+    size_t size() const { return _wide ? _wide_offsets.size() : _offsets.size(); }
+    bool empty() const { return size() == 0; }
+
+    void push_back(int64_t offset, int64_t term) {
+        DCHECK_GE(offset, 0);
+        if (_terms.empty() || _terms.back().second != term) {
+            _terms.push_back(std::make_pair((uint32_t)size(), term));
+        }
+        if (!_wide && offset > (int64_t)UINT32_MAX) {
+            _wide_offsets.assign(_offsets.begin(), _offsets.end());
+            std::vector<uint32_t>().swap(_offsets);
+            _wide = true;
+        }
+        if (_wide) {
+            _wide_offsets.push_back(offset);
+        } else {
+            _offsets.push_back((uint32_t)offset);
+        }
+    }
+
+    int64_t offset(size_t i) const {
+        return _wide ? _wide_offsets[i] : (int64_t)_offsets[i];
+    }
+
+    // O(log(number of term changes))
+    int64_t term(size_t i) const {
+        std::vector<std::pair<uint32_t, int64_t> >::const_iterator it =
+                std::upper_bound(_terms.begin(), _terms.end(),
+                                 std::make_pair((uint32_t)i, INT64_MAX));
+        DCHECK(it != _terms.begin());
+        return (--it)->second;
+    }
+
+    // entries where the term changes, as <position, term>
+    const std::vector<std::pair<uint32_t, int64_t> >& term_changes() const {
+        return _terms;
+    }
+
+    void resize(size_t n) {
+        if (n >= size()) {
+            return;
+        }
+        if (_wide) {
+            _wide_offsets.resize(n);
+        } else {
+            _offsets.resize(n);
+        }
+        while (!_terms.empty() && _terms.back().first >= n) {
+            _terms.pop_back();
+        }
+    }
+
+    void shrink_to_fit() {
+        std::vector<uint32_t>(_offsets).swap(_offsets);
+        std::vector<int64_t>(_wide_offsets).swap(_wide_offsets);
+        std::vector<std::pair<uint32_t, int64_t> >(_terms).swap(_terms);
+    }
+
+    void swap(SegmentOffsetIndex& rhs) {
+        _offsets.swap(rhs._offsets);
+        _wide_offsets.swap(rhs._wide_offsets);
+        _terms.swap(rhs._terms);
+        std::swap(_wide, rhs._wide);
+    }
+
+    size_t memory_usage() const {
+        return _offsets.capacity() * sizeof(uint32_t)
+                + _wide_offsets.capacity() * sizeof(int64_t)
+                + _terms.capacity() * sizeof(_terms[0]);
+    }
+
+private:
+    std::vector<uint32_t> _offsets;
+    // used instead of _offsets once an offset is over 32 bits
+    std::vector<int64_t> _wide_offsets;
+    bool _wide;
+    std::vector<std::pair<uint32_t/*position*/, int64_t/*term*/> > _terms;
+};
+
 class BAIDU_CACHELINE_ALIGNMENT Segment 
         : public butil::RefCountedThreadSafe<Segment> {
 public:
@@ -50,8 +143,9 @@ public:
 
     struct EntryHeader;
 
-    // create open segment
-    int create();
+    // create open segment, reuse |pooled_file| prepared by the segment pool
+    // if it's not empty
+    int create(const std::string& pooled_file = std::string());
 
     // load open or closed segment
     // open fd, load index, truncate uncompleted entry
@@ -65,9 +159,27 @@ public:
     bool need_flush() const;
     int flush_data();
 
+    // Submit the buffered data to |writer| without waiting for the kernel,
+    // an fsync is linked after the write if |sync| is true
+    int flush_data_async(UringWriter* writer, bool sync);
+
+    // Wait until all the writes submitted by flush_data_async are done and
+    // make the written entries visible.
+    // Returns the number of the entries written, -1 on error
+    int reap_data(UringWriter* writer);
+
+    bool has_inflight() const {
+        return !_inflight.empty();
+    }
+
     // get entry by index
     LogEntry* get(const int64_t index) const;
 
+    // get the entries in [first_index, last_index] of this segment with one
+    // read, see LogStorage::get_entries
+    int get_entries(const int64_t first_index, const int64_t last_index,
+                    size_t max_bytes, std::vector<LogEntry*>* entries) const;
+
     // get entry's term by index
     int64_t get_term(const int64_t index) const;
 
@@ -77,18 +189,66 @@ public:
     // sync open segment
     int sync(bool will_sync);
 
+    // Whether sync() would call fsync according to the sync policy
+    bool need_sync(bool will_sync) const;
+
+    // fsync the written data regardless of the sync policy
+    int sync_data();
+
     // unlink segment
     int unlink();
 
+    // rename the closed segment to |pool_file| so that the segment pool can
+    // reuse the file instead of allocating a new one
+    int recycle(const std::string& pool_file);
+
     // truncate segment to last_index_kept
     int truncate(const int64_t last_index_kept);
 
+    // Copy the closed segment into |cold_path| as the temporary file
+    // |tmp_path|, throttled by raft_segment_migrate_bytes_per_second
+    int prepare_migration(const std::string& cold_path, std::string* tmp_path);
+
+    // Replace the file with the copy made by prepare_migration and reclaim
+    // the former one. Must be called with the lock of the storage held, so
+    // that the file isn't unlinked or truncated by the disk thread meanwhile
+    int commit_migration(const std::string& cold_path, const std::string& tmp_path);
+
+    // the segment file was found in |cold_path| at startup
+    void set_migrated(const std::string& cold_path) {
+        _cold_path = cold_path;
+        _migrated.store(true, butil::memory_order_release);
+    }
+
+    bool is_migrated() const {
+        return _migrated.load(butil::memory_order_acquire);
+    }
+
+    // directory of the segment file
+    const std::string& dir() const {
+        return is_migrated() ? _cold_path : _path;
+    }
+
+    // seconds since the segment file was modified
+    int64_t idle_seconds() const;
+
     bool is_open() const {
         return _is_open;
     }
 
+    // compress the data entries appended afterwards with |compress_type|,
+    // see raft_segment_compress_type
+    void set_compress_type(int compress_type) {
+        _compress_type = compress_type;
+    }
+
+    // whether the data is written with O_DIRECT, see raft_segment_direct_io
+    bool is_direct_io() const {
+        return _direct_fd >= 0;
+    }
+
     int64_t bytes() const {
-        return _bytes + _to_write;
+        return _bytes + _inflight_bytes + _to_write + _batch_body.length();
     }
 
     int64_t first_index() const {
@@ -102,27 +262,62 @@ public:
     std::string file_name();
 private:
 friend class butil::RefCountedThreadSafe<Segment>;
-    ~Segment() {
-        if (_fd >= 0) {
-            ::close(_fd);
-            _fd = -1;
-        }
-    }
+    ~Segment();
 
     struct LogMeta {
         off_t offset;
         size_t length;
         int64_t term;
+        // the batch record containing the entry, -1 if it's written on its own
+        off_t batch_offset;
+        size_t batch_length;
     };
 
     int _load_entry(off_t offset, EntryHeader *head, butil::IOBuf *body, 
                     size_t size_hint) const;
+    int _load_mapped_entry(SegmentMapping* mapping, off_t offset,
+                           EntryHeader* head, butil::IOBuf* body) const;
+    LogEntry* _build_entry(const EntryHeader& header, butil::IOBuf* data,
+                           int64_t index) const;
+
+    // Returns the mapping of the closed segment with a reference added, NULL
+    // if mmap is disabled or fails
+    SegmentMapping* _acquire_mapping() const;
+    // Stop mapping the segment, returns true if the former mapping is still
+    // referenced by readers
+    bool _unmap();
+    int _copy_on_truncate(int64_t truncate_size, const butil::IOBuf* tail);
+
+    // index file of the closed segment, see raft_segment_index_file
+    std::string _index_path() const;
+    int _save_index();
+    int _load_index(ConfigurationManager* configuration_manager, int64_t file_size);
+    void _remove_index();
 
     int _get_meta(int64_t index, LogMeta* meta) const;
 
+    // Find the batch record containing |offset|, must be called with _mutex
+    // held
+    bool _find_batch(int64_t offset, int64_t* start, int64_t* end) const;
+    // Write the packed entries as one batch record, see raft_segment_batch_header
+    void _seal_batch();
+    // Stash a serialized record to be written by flush_data or flush_data_async
+    int _stash_record(const LogEntry* entry, butil::IOBuf* record);
+
     int _truncate_meta_and_get_last(int64_t last);
 
+    struct PendingWrite;
+    int _finish_write(PendingWrite* pw, bool* rewritten);
+
+    int _open_direct_io();
+    void _close_direct_io();
+    int _load_direct_tail();
+    int _direct_write(butil::IOBuf* const* pieces, size_t npieces, size_t bytes);
+
     std::string _path;
+    // set before _migrated, see raft_segment_cold_index_distance
+    std::string _cold_path;
+    butil::atomic<bool> _migrated{false};
     int64_t _bytes;
     int64_t _unsynced_bytes;
     mutable raft_mutex_t _mutex;
@@ -131,13 +326,36 @@ friend class butil::RefCountedThreadSafe<Segment>;
     const int64_t _first_index;
     butil::atomic<int64_t> _last_index;
     int _checksum_type;
-    std::vector<std::pair<int64_t/*offset*/, int64_t/*term*/> > _offset_and_term;
+    int _compress_type{};
+    // the file is allocated (or padded) ahead of the written data
+    bool _preallocated{};
+    // O_DIRECT fd for writes, reads still go through _fd
+    int _direct_fd{-1};
+    // the partial last block which is rewritten by the next direct write
+    char* _direct_tail{};
+    // whether the file is immutable and can be mapped, guarded by _mutex
+    bool _mappable{};
+    mutable SegmentMapping* _mapping{};
+    SegmentOffsetIndex _offset_and_term;
     std::vector<std::pair<int64_t/*offset*/, int64_t/*term*/> > _offset_and_term_stashed;
+    // ranges of the batch records in the file, guarded by _mutex
+    std::vector<std::pair<uint32_t/*start*/, uint32_t/*end*/> > _batches;
+    std::vector<std::pair<uint32_t/*start*/, uint32_t/*end*/> > _batches_stashed;
+    // the entries being packed by prepare_data into the batch at _batch_offset
+    butil::IOBuf _batch_body;
+    int64_t _batch_offset{-1};
+    int64_t _batch_term{};
+    // indexes of the configuration entries, only accessed by the writer
+    std::vector<int64_t> _conf_indexes;
 
     size_t _to_write{};
     std::vector<butil::IOBuf> _data_list;
     // TODO(zkl): use vector
     butil::IOBuf *_pieces[1024];
+
+    // writes submitted by flush_data_async but not reaped yet
+    std::deque<PendingWrite*> _inflight;
+    size_t _inflight_bytes{};
 };
 
 // LogStorage use segmented append-only file, all data in disk, all index in memory.
@@ -147,6 +365,12 @@ friend class butil::RefCountedThreadSafe<Segment>;
 //      log_meta: record start_log
 //      log_000001-0001000: closed segment
 //      log_inprogress_0001001: open segment
+//
+// With local://{path}&&cold_path={cold_path}, the closed segments which are
+// far behind the last log (see raft_segment_cold_index_distance and
+// raft_segment_cold_age_s) are moved to cold_path in background, which is
+// expected to be on a cheaper device. They are read from there transparently,
+// while the open segment and the recent closed ones stay in path.
 class SegmentLogStorage : public LogStorage {
 public:
     typedef std::map<int64_t, scoped_refptr<Segment> > SegmentMap;
@@ -166,7 +390,7 @@ public:
         , _enable_sync(true)
     {}
 
-    virtual ~SegmentLogStorage() {}
+    virtual ~SegmentLogStorage();
 
     // init logstorage, check consistency and integrity
     virtual int init(ConfigurationManager* configuration_manager);
@@ -185,6 +409,10 @@ public:
     // get logentry's term by index
     virtual int64_t get_term(const int64_t index);
 
+    // get logentries in [first_index, last_index] by segments
+    virtual int get_entries(const int64_t first_index, const int64_t last_index,
+                            size_t max_bytes, std::vector<LogEntry*>* entries);
+
     // append entry to log
     int append_entry(const LogEntry* entry);
 
@@ -192,6 +420,13 @@ public:
     virtual int append_entries(const std::vector<LogEntry*>& entries, IOMetric* metric);
     virtual int append_entries_in_batch(const std::vector<LogEntry*>& entries, IOMetric* metric);
 
+    // serialize the entries as records of the segments ahead, unless the
+    // entries are packed by raft_segment_batch_header
+    virtual void encode_entries(const std::vector<LogEntry*>& entries);
+
+    // sync the open segment, the closed ones are synced when closing
+    virtual int sync_appended();
+
     // delete logs from storage's head, [1, first_index_kept) will be discarded
     virtual int truncate_prefix(const int64_t first_index_kept);
 
@@ -227,15 +462,53 @@ private:
             std::vector<scoped_refptr<Segment> >* popped,
             scoped_refptr<Segment>* last_segment);
 
+    // segment pool, see raft_segment_pool_size
+    std::string take_pool_file();
+    bool recycle_segment(const scoped_refptr<Segment>& segment);
+    void fill_segment_pool();
+    static void* run_fill_segment_pool(void* arg);
+    void do_fill_segment_pool();
+
+    void renew_cache_owner();
+
+    // cold segments, see raft_segment_cold_index_distance
+    int list_segments_in(const std::string& dir, bool cold, bool is_empty,
+                         std::vector<std::string>* index_files);
+    void start_migration();
+    static void* run_migrate_segments(void* arg);
+    void do_migrate_segments();
+    scoped_refptr<Segment> pick_cold_segment();
 
     std::string _path;
+    // empty if the segments are never migrated
+    std::string _cold_path;
     butil::atomic<int64_t> _first_log_index;
     butil::atomic<int64_t> _last_log_index;
     raft_mutex_t _mutex;
     SegmentMap _segments;
+    // only used by the disk thread when raft_segment_use_io_uring is set
+    std::unique_ptr<UringWriter> _uring_writer;
     scoped_refptr<Segment> _open_segment;
     int _checksum_type;
+    // -1 to follow raft_segment_compress_type
+    int _compress_type{-1};
     bool _enable_sync;
+    // owner of the entries in LogEntryCache, renewed after the logs are
+    // rewritten, see raft_log_entry_cache_bytes
+    butil::atomic<uint64_t> _cache_owner{};
+
+    raft_mutex_t _pool_mutex;
+    // preallocated files ready to be used as the open segment
+    std::deque<std::string> _pool_ready;
+    // recycled (or left by the previous process) files to be cleaned
+    std::deque<std::string> _pool_pending;
+    int64_t _next_pool_id{};
+    bool _pool_filling{};
+    bool _pool_stopped{};
+    bthread_t _pool_tid{};
+
+    butil::atomic<bool> _migrate_stopped{false};
+    bthread_t _migrate_tid{};
 };
 
 }  //  namespace braft
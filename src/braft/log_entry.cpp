@@ -15,13 +15,45 @@
 // Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
 
 #include "braft/log_entry.h"
+
+#include <type_traits>
+#include <butil/object_pool.h>                   // butil::get_object
 #include "braft/local_storage.pb.h"
 
 namespace braft {
 
 bvar::Adder<int64_t> g_nentries("raft_num_log_entries");
 
-LogEntry::LogEntry(): type(ENTRY_TYPE_UNKNOWN), peers(NULL), old_peers(NULL) {
+// The memory of a LogEntry in the object pool, which never constructs or
+// destroys the LogEntry itself
+struct LogEntryStorage {
+    std::aligned_storage<sizeof(LogEntry), alignof(LogEntry)>::type buf;
+};
+
+void* LogEntry::operator new(size_t size) {
+    if (size != sizeof(LogEntry)) {
+        return ::operator new(size);
+    }
+    LogEntryStorage* p = butil::get_object<LogEntryStorage>();
+    if (BAIDU_UNLIKELY(p == NULL)) {
+        PLOG(FATAL) << "Fail to new LogEntry";
+        abort();
+    }
+    return p;
+}
+
+void LogEntry::operator delete(void* p, size_t size) {
+    if (p == NULL) {
+        return;
+    }
+    if (size != sizeof(LogEntry)) {
+        return ::operator delete(p);
+    }
+    butil::return_object(static_cast<LogEntryStorage*>(p));
+}
+
+LogEntry::LogEntry()
+    : type(ENTRY_TYPE_UNKNOWN), peers(NULL), old_peers(NULL), encoded_format(0) {
     g_nentries << 1;
 }
 
@@ -42,9 +42,19 @@ public:
     std::vector<PeerId>* peers; // peers
     std::vector<PeerId>* old_peers; // peers
     butil::IOBuf data;
+    // The entry serialized by LogStorage::encode_entries before it reaches
+    // the disk thread, only understood by the storage which set the
+    // non-zero |encoded_format|
+    butil::IOBuf encoded;
+    int encoded_format;
 
     LogEntry();
 
+    // LogEntry is created and destroyed at the rate of the logs, its memory
+    // is recycled by a thread-local cached pool instead of malloc
+    static void* operator new(size_t size);
+    static void operator delete(void* p, size_t size);
+
 private:
     DISALLOW_COPY_AND_ASSIGN(LogEntry);
     friend class butil::RefCountedThreadSafe<LogEntry>;
@@ -0,0 +1,150 @@
+// Copyright (c) 2026 Baidu.com, Inc. All Rights Reserved
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
+
+#include "braft/log_entry_cache.h"
+
+#include <bvar/bvar.h>
+#include <brpc/reloadable_flags.h>
+
+namespace braft {
+
+DEFINE_int64(raft_log_entry_cache_bytes, 0,
+             "Max bytes of the log entries read from disk to be cached and"
+             " shared by all the raft groups of this process, 0 to disable");
+BRPC_VALIDATE_GFLAG(raft_log_entry_cache_bytes, brpc::NonNegativeInteger);
+
+static bvar::Adder<int64_t> g_log_entry_cache_hit("raft_log_entry_cache_hit");
+static bvar::Adder<int64_t> g_log_entry_cache_miss("raft_log_entry_cache_miss");
+static bvar::Adder<int64_t> g_log_entry_cache_evict("raft_log_entry_cache_evict");
+static bvar::Adder<int64_t> g_log_entry_cache_bytes("raft_log_entry_cache_used_bytes");
+
+LogEntryCache::LogEntryCache() : _next_owner(1) {}
+
+LogEntryCache::~LogEntryCache() {
+    for (size_t i = 0; i < SHARD_NUM; ++i) {
+        Shard& shard = _shards[i];
+        for (LRUList::iterator it = shard.lru.begin();
+                it != shard.lru.end(); ++it) {
+            it->second->Release();
+        }
+    }
+}
+
+uint64_t LogEntryCache::new_owner() {
+    return _next_owner.fetch_add(1, butil::memory_order_relaxed);
+}
+
+LogEntry* LogEntryCache::lookup_locked(Shard& shard, const Key& key) {
+    std::unordered_map<Key, LRUList::iterator, KeyHasher>::iterator
+            it = shard.map.find(key);
+    if (it == shard.map.end()) {
+        return NULL;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    LogEntry* entry = it->second->second;
+    entry->AddRef();
+    return entry;
+}
+
+void LogEntryCache::insert_locked(Shard& shard, const Key& key,
+                                  LogEntry* entry) {
+    const size_t capacity = FLAGS_raft_log_entry_cache_bytes / SHARD_NUM;
+    const size_t size = charge(entry);
+    if (size > capacity || shard.map.find(key) != shard.map.end()) {
+        return;
+    }
+    entry->AddRef();
+    shard.lru.push_front(std::make_pair(key, entry));
+    shard.map[key] = shard.lru.begin();
+    shard.bytes += size;
+    g_log_entry_cache_bytes << size;
+    while (shard.bytes > capacity) {
+        LogEntry* victim = shard.lru.back().second;
+        const size_t victim_size = charge(victim);
+        shard.map.erase(shard.lru.back().first);
+        shard.lru.pop_back();
+        shard.bytes -= victim_size;
+        g_log_entry_cache_bytes << -(int64_t)victim_size;
+        g_log_entry_cache_evict << 1;
+        victim->Release();
+    }
+}
+
+LogEntry* LogEntryCache::lookup(uint64_t owner, int64_t index) {
+    const Key key = { owner, index };
+    Shard& shard = shard_of(key);
+    BAIDU_SCOPED_LOCK(shard.mutex);
+    LogEntry* entry = lookup_locked(shard, key);
+    if (entry) {
+        g_log_entry_cache_hit << 1;
+    } else {
+        g_log_entry_cache_miss << 1;
+    }
+    return entry;
+}
+
+void LogEntryCache::insert(uint64_t owner, LogEntry* entry) {
+    const Key key = { owner, entry->id.index };
+    Shard& shard = shard_of(key);
+    BAIDU_SCOPED_LOCK(shard.mutex);
+    insert_locked(shard, key, entry);
+}
+
+size_t LogEntryCache::bytes() const {
+    size_t total = 0;
+    for (size_t i = 0; i < SHARD_NUM; ++i) {
+        BAIDU_SCOPED_LOCK(_shards[i].mutex);
+        total += _shards[i].bytes;
+    }
+    return total;
+}
+
+LogEntry* LogEntryCache::begin_load(const Key& key, bool* loading) {
+    Shard& shard = shard_of(key);
+    std::unique_lock<raft_mutex_t> lck(shard.mutex);
+    while (true) {
+        LogEntry* entry = lookup_locked(shard, key);
+        if (entry) {
+            g_log_entry_cache_hit << 1;
+            *loading = false;
+            return entry;
+        }
+        if (shard.loading.find(key) == shard.loading.end()) {
+            break;
+        }
+        // Someone else is reading the same entry, wait for it. If the load
+        // fails the entry is still missing and we load it by ourselves.
+        shard.cond.wait(lck);
+    }
+    shard.loading.insert(key);
+    g_log_entry_cache_miss << 1;
+    *loading = true;
+    return NULL;
+}
+
+void LogEntryCache::end_load(const Key& key, LogEntry* entry) {
+    Shard& shard = shard_of(key);
+    {
+        BAIDU_SCOPED_LOCK(shard.mutex);
+        shard.loading.erase(key);
+        if (entry) {
+            insert_locked(shard, key, entry);
+        }
+    }
+    shard.cond.notify_all();
+}
+
+}  //  namespace braft
@@ -0,0 +1,133 @@
+// Copyright (c) 2026 Baidu.com, Inc. All Rights Reserved
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
+
+#ifndef  BRAFT_LOG_ENTRY_CACHE_H
+#define  BRAFT_LOG_ENTRY_CACHE_H
+
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <gflags/gflags.h>
+#include <butil/macros.h>
+#include <butil/memory/singleton_on_pthread_once.h>
+#include <bthread/condition_variable.h>
+#include "braft/macros.h"                     // raft_mutex_t
+#include "braft/log_entry.h"
+
+namespace braft {
+
+DECLARE_int64(raft_log_entry_cache_bytes);
+
+// A process-wide cache of the decoded LogEntry read from disk, shared by all
+// the log storages. Entries are keyed by (owner, index) where |owner| is a
+// version allocated by the storage with new_owner(). A storage switches to
+// a new owner whenever the logs at some indexes may be rewritten
+// (truncate_suffix, reset), so the stale entries are never hit again and
+// just age out of the LRU.
+//
+// The cache is split into shards, each of which has its own LRU and an equal
+// part of raft_log_entry_cache_bytes. Concurrent misses on the same key are
+// loaded only once, the others wait for the result.
+class LogEntryCache {
+public:
+    static LogEntryCache* GetInstance() {
+        return butil::get_leaky_singleton<LogEntryCache>();
+    }
+
+    static bool enabled() { return FLAGS_raft_log_entry_cache_bytes > 0; }
+
+    uint64_t new_owner();
+
+    // Get the entry at |index| of |owner|, call |loader| to read it on miss
+    // and keep the result. The returned entry is referenced by the caller,
+    // NULL if |loader| fails.
+    template <typename Loader>
+    LogEntry* get(uint64_t owner, int64_t index, const Loader& loader);
+
+    // Returns the cached entry referenced by the caller or NULL, no loading
+    LogEntry* lookup(uint64_t owner, int64_t index);
+
+    // Put |entry| into the cache unless it's already there
+    void insert(uint64_t owner, LogEntry* entry);
+
+    size_t bytes() const;
+
+    LogEntryCache();
+    ~LogEntryCache();
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LogEntryCache);
+
+    struct Key {
+        uint64_t owner;
+        int64_t index;
+        bool operator==(const Key& rhs) const {
+            return owner == rhs.owner && index == rhs.index;
+        }
+    };
+    struct KeyHasher {
+        size_t operator()(const Key& key) const {
+            return key.owner * 0x9E3779B97F4A7C15ULL ^ (uint64_t)key.index;
+        }
+    };
+    typedef std::list<std::pair<Key, LogEntry*> > LRUList;
+    struct Shard {
+        Shard() : bytes(0) {}
+        mutable raft_mutex_t mutex;
+        bthread::ConditionVariable cond;
+        // most recently used first
+        LRUList lru;
+        std::unordered_map<Key, LRUList::iterator, KeyHasher> map;
+        // keys being loaded by some reader
+        std::unordered_set<Key, KeyHasher> loading;
+        size_t bytes;
+    };
+    static const size_t SHARD_NUM = 16;
+
+    Shard& shard_of(const Key& key) {
+        return _shards[KeyHasher()(key) % SHARD_NUM];
+    }
+    static size_t charge(const LogEntry* entry) {
+        return sizeof(LogEntry) + entry->data.length();
+    }
+    // Both called with shard.mutex held
+    LogEntry* lookup_locked(Shard& shard, const Key& key);
+    void insert_locked(Shard& shard, const Key& key, LogEntry* entry);
+
+    LogEntry* begin_load(const Key& key, bool* loading);
+    void end_load(const Key& key, LogEntry* entry);
+
+    butil::atomic<uint64_t> _next_owner;
+    Shard _shards[SHARD_NUM];
+};
+
+template <typename Loader>
+LogEntry* LogEntryCache::get(uint64_t owner, int64_t index,
+                             const Loader& loader) {
+    const Key key = { owner, index };
+    bool loading = false;
+    LogEntry* entry = begin_load(key, &loading);
+    if (!loading) {
+        return entry;
+    }
+    entry = loader();
+    end_load(key, entry);
+    return entry;
+}
+
+}  //  namespace braft
+
+#endif  //BRAFT_LOG_ENTRY_CACHE_H
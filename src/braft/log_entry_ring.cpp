@@ -0,0 +1,275 @@
+// Copyright (c) 2026 Baidu.com, Inc. All Rights Reserved
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
+
+#include <sched.h>
+#include <algorithm>
+#include <memory>
+#include <butil/logging.h>
+#include <butil/thread_local.h>
+#include "braft/log_entry_ring.h"
+
+namespace braft {
+
+struct LogEntryRing::Ring {
+    explicit Ring(size_t capacity)
+        : mask(capacity - 1)
+        , slots(new butil::atomic<LogEntry*>[capacity]) {
+        for (size_t i = 0; i < capacity; ++i) {
+            slots[i].store(NULL, butil::memory_order_relaxed);
+        }
+    }
+    size_t capacity() const { return mask + 1; }
+    butil::atomic<LogEntry*>& slot(int64_t index) {
+        return slots[index & mask];
+    }
+
+    const size_t mask;
+    std::unique_ptr<butil::atomic<LogEntry*>[]> slots;
+};
+
+static const size_t INITIAL_RING_CAPACITY = 1024;
+
+// Spread the reader counts of different threads to different cachelines
+static BAIDU_THREAD_LOCAL int tls_reader_shard = -1;
+static butil::atomic<int> g_next_reader_shard(0);
+
+// Marks the reader in the current epoch. A reader which has incremented the
+// count of an epoch before the writer moves to the next one is waited by
+// synchronize(), otherwise it sees the new epoch and retries with it.
+class LogEntryRing::ReadGuard {
+public:
+    explicit ReadGuard(LogEntryRing* ring) {
+        if (tls_reader_shard < 0) {
+            tls_reader_shard = g_next_reader_shard.fetch_add(
+                    1, butil::memory_order_relaxed) % READER_SHARDS;
+        }
+        while (true) {
+            const uint64_t epoch = ring->_epoch.load(butil::memory_order_seq_cst);
+            _count = &ring->_readers[epoch & 1][tls_reader_shard].value;
+            _count->fetch_add(1, butil::memory_order_seq_cst);
+            if (ring->_epoch.load(butil::memory_order_seq_cst) == epoch) {
+                break;
+            }
+            _count->fetch_sub(1, butil::memory_order_release);
+        }
+    }
+    ~ReadGuard() {
+        _count->fetch_sub(1, butil::memory_order_release);
+    }
+private:
+    butil::atomic<int64_t>* _count;
+};
+
+LogEntryRing::LogEntryRing()
+    : _first_index(1)
+    , _last_index(0)
+    , _ring(new Ring(INITIAL_RING_CAPACITY))
+    , _epoch(0)
+{}
+
+LogEntryRing::~LogEntryRing() {
+    std::vector<LogEntry*> popped;
+    take_entries(_first_index.load(butil::memory_order_relaxed),
+                 _last_index.load(butil::memory_order_relaxed), &popped);
+    for (size_t i = 0; i < popped.size(); ++i) {
+        popped[i]->Release();
+    }
+    delete _ring.load(butil::memory_order_relaxed);
+}
+
+LogEntry* LogEntryRing::find_entry(const int64_t index) {
+    while (true) {
+        // Load the ring before the indexes, so that the ring covers the
+        // indexes unless it's replaced meanwhile
+        Ring* ring = _ring.load(butil::memory_order_acquire);
+        if (index < _first_index.load(butil::memory_order_acquire)
+                || index > _last_index.load(butil::memory_order_acquire)) {
+            return NULL;
+        }
+        LogEntry* entry = ring->slot(index).load(butil::memory_order_acquire);
+        if (entry != NULL && entry->id.index == index) {
+            return entry;
+        }
+        // Either the entry is removed concurrently or the ring has grown
+        if (ring == _ring.load(butil::memory_order_acquire)) {
+            return NULL;
+        }
+    }
+}
+
+LogEntry* LogEntryRing::get_entry(const int64_t index) {
+    ReadGuard guard(this);
+    LogEntry* entry = find_entry(index);
+    if (entry) {
+        entry->AddRef();
+    }
+    return entry;
+}
+
+int64_t LogEntryRing::get_term(const int64_t index) {
+    ReadGuard guard(this);
+    LogEntry* entry = find_entry(index);
+    return entry ? entry->id.term : 0;
+}
+
+int LogEntryRing::get_entries(const int64_t first_index, const int64_t last_index,
+                              size_t max_bytes, std::vector<LogEntry*>* entries) {
+    ReadGuard guard(this);
+    size_t bytes = 0;
+    int64_t index = first_index;
+    for (; index <= last_index && bytes < max_bytes; ++index) {
+        LogEntry* entry = find_entry(index);
+        if (!entry) {
+            break;
+        }
+        entry->AddRef();
+        bytes += entry->data.length();
+        entries->push_back(entry);
+    }
+    return index - first_index;
+}
+
+LogEntry* LogEntryRing::unsafe_get_entry(const int64_t index) const {
+    if (index < _first_index.load(butil::memory_order_relaxed)
+            || index > _last_index.load(butil::memory_order_relaxed)) {
+        return NULL;
+    }
+    return _ring.load(butil::memory_order_relaxed)->slot(index).load(
+            butil::memory_order_relaxed);
+}
+
+void LogEntryRing::reserve(size_t count) {
+    Ring* ring = _ring.load(butil::memory_order_relaxed);
+    const int64_t first = _first_index.load(butil::memory_order_relaxed);
+    const int64_t last = _last_index.load(butil::memory_order_relaxed);
+    const size_t size = last - first + 1;
+    if (size + count <= ring->capacity()) {
+        return;
+    }
+    size_t capacity = ring->capacity();
+    while (capacity < size + count) {
+        capacity *= 2;
+    }
+    Ring* new_ring = new Ring(capacity);
+    for (int64_t index = first; index <= last; ++index) {
+        new_ring->slot(index).store(
+                ring->slot(index).load(butil::memory_order_relaxed),
+                butil::memory_order_relaxed);
+    }
+    _ring.store(new_ring, butil::memory_order_release);
+    // Growing is rare, just wait for the readers of the old ring here
+    synchronize();
+    delete ring;
+}
+
+void LogEntryRing::take_entries(int64_t first, int64_t last,
+                                std::vector<LogEntry*>* taken) {
+    Ring* ring = _ring.load(butil::memory_order_relaxed);
+    for (int64_t index = first; index <= last; ++index) {
+        LogEntry* entry = ring->slot(index).exchange(
+                NULL, butil::memory_order_relaxed);
+        if (entry) {
+            taken->push_back(entry);
+        }
+    }
+}
+
+void LogEntryRing::synchronize() {
+    BAIDU_SCOPED_LOCK(_sync_mutex);
+    const uint64_t epoch = _epoch.load(butil::memory_order_relaxed);
+    _epoch.store(epoch + 1, butil::memory_order_seq_cst);
+    ReaderCount* counts = _readers[epoch & 1];
+    for (size_t i = 0; i < READER_SHARDS; ++i) {
+        // Readers hold the guard for a few instructions
+        while (counts[i].value.load(butil::memory_order_seq_cst) != 0) {
+            sched_yield();
+        }
+    }
+}
+
+void LogEntryRing::append(LogEntry* const* entries, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    const int64_t first_index = entries[0]->id.index;
+    if (empty()) {
+        _first_index.store(first_index, butil::memory_order_release);
+        _last_index.store(first_index - 1, butil::memory_order_release);
+    }
+    const int64_t last_index = _last_index.load(butil::memory_order_relaxed);
+    CHECK_EQ(last_index + 1, first_index) << "Appending entries are not consecutive";
+    reserve(count);
+    Ring* ring = _ring.load(butil::memory_order_relaxed);
+    for (size_t i = 0; i < count; ++i) {
+        CHECK_EQ(first_index + (int64_t)i, entries[i]->id.index);
+        ring->slot(entries[i]->id.index).store(
+                entries[i], butil::memory_order_relaxed);
+    }
+    // Publish the slots along with the last index
+    _last_index.store(last_index + count, butil::memory_order_release);
+}
+
+void LogEntryRing::pop_front(const int64_t first_index_kept,
+                             std::vector<LogEntry*>* popped) {
+    const int64_t first = _first_index.load(butil::memory_order_relaxed);
+    const int64_t last = _last_index.load(butil::memory_order_relaxed);
+    if (first_index_kept <= first) {
+        return;
+    }
+    _first_index.store(first_index_kept, butil::memory_order_release);
+    if (first_index_kept > last) {
+        _last_index.store(first_index_kept - 1, butil::memory_order_release);
+    }
+    take_entries(first, std::min(last, first_index_kept - 1), popped);
+}
+
+void LogEntryRing::pop_back(const int64_t last_index_kept,
+                            std::vector<LogEntry*>* popped) {
+    const int64_t first = _first_index.load(butil::memory_order_relaxed);
+    const int64_t last = _last_index.load(butil::memory_order_relaxed);
+    if (last_index_kept >= last) {
+        return;
+    }
+    _last_index.store(last_index_kept, butil::memory_order_release);
+    if (first > last_index_kept) {
+        _first_index.store(last_index_kept + 1, butil::memory_order_release);
+    }
+    take_entries(std::max(first, last_index_kept + 1), last, popped);
+}
+
+void LogEntryRing::reset(const int64_t next_index,
+                         std::vector<LogEntry*>* popped) {
+    const int64_t first = _first_index.load(butil::memory_order_relaxed);
+    const int64_t last = _last_index.load(butil::memory_order_relaxed);
+    // Empty the window before moving it, readers never see a window mixing
+    // the old and the new indexes
+    _last_index.store(first - 1, butil::memory_order_release);
+    take_entries(first, last, popped);
+    _first_index.store(next_index, butil::memory_order_release);
+    _last_index.store(next_index - 1, butil::memory_order_release);
+}
+
+void LogEntryRing::release(const std::vector<LogEntry*>& popped) {
+    if (popped.empty()) {
+        return;
+    }
+    synchronize();
+    for (size_t i = 0; i < popped.size(); ++i) {
+        popped[i]->Release();
+    }
+}
+
+}  //  namespace braft
@@ -0,0 +1,127 @@
+// Copyright (c) 2026 Baidu.com, Inc. All Rights Reserved
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
+
+#ifndef  BRAFT_LOG_ENTRY_RING_H
+#define  BRAFT_LOG_ENTRY_RING_H
+
+#include <vector>
+#include <butil/atomicops.h>
+#include <butil/macros.h>
+#include "braft/macros.h"                     // raft_mutex_t
+#include "braft/log_entry.h"
+
+namespace braft {
+
+// A window of consecutive log entries [first_index(), last_index()] kept in
+// a ring indexed by log index, which grows on demand.
+//
+// Readers never lock: they find the entries through the atomic indexes and
+// the slots of the ring, and access them inside an epoch so that a removed
+// entry is not released until all the readers which may still see it have
+// left. Writers must be serialized by the caller, they never wait for other
+// writers but release() waits for the readers of the current epoch, which
+// only hold it for a few instructions.
+class LogEntryRing {
+public:
+    LogEntryRing();
+    ~LogEntryRing();
+
+    int64_t first_index() const {
+        return _first_index.load(butil::memory_order_acquire);
+    }
+    int64_t last_index() const {
+        return _last_index.load(butil::memory_order_acquire);
+    }
+    // Only stable for the writers
+    bool empty() const { return first_index() > last_index(); }
+    size_t size() const {
+        return empty() ? 0 : last_index() - first_index() + 1;
+    }
+
+    // Returns the entry at |index| referenced by the caller, NULL if it's
+    // not in the window
+    LogEntry* get_entry(const int64_t index);
+
+    // Returns the term of the entry at |index|, 0 if it's not in the window
+    int64_t get_term(const int64_t index);
+
+    // Append the entries from |first_index| on until |last_index|, the end
+    // of the window or the total size exceeds |max_bytes| to |entries|, each
+    // referenced by the caller.
+    // Returns the number of the entries appended, 0 if |first_index| is not
+    // in the window
+    int get_entries(const int64_t first_index, const int64_t last_index,
+                    size_t max_bytes, std::vector<LogEntry*>* entries);
+
+    // Returns the entry at |index| without referencing it, only callers
+    // holding the lock of the writers may call this
+    LogEntry* unsafe_get_entry(const int64_t index) const;
+
+    // Append |count| consecutive entries after last_index(), or anywhere if
+    // the window is empty. The ring takes over one reference of each entry.
+    void append(LogEntry* const* entries, size_t count);
+
+    // Remove the entries before |first_index_kept| to |popped|, the window
+    // starts at |first_index_kept| afterwards
+    void pop_front(const int64_t first_index_kept, std::vector<LogEntry*>* popped);
+
+    // Remove the entries after |last_index_kept| to |popped|, the window
+    // ends at |last_index_kept| afterwards
+    void pop_back(const int64_t last_index_kept, std::vector<LogEntry*>* popped);
+
+    // Remove all the entries to |popped| and move the empty window to
+    // |next_index|
+    void reset(const int64_t next_index, std::vector<LogEntry*>* popped);
+
+    // Release the entries popped before once no reader can see them. It's
+    // fine to call this without the lock of the writers.
+    void release(const std::vector<LogEntry*>& popped);
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(LogEntryRing);
+
+    struct Ring;
+    class ReadGuard;
+
+    struct BAIDU_CACHELINE_ALIGNMENT ReaderCount {
+        ReaderCount() : value(0) {}
+        butil::atomic<int64_t> value;
+    };
+    static const size_t READER_SHARDS = 16;
+
+    // Returns the entry at |index| which is safe to access until the
+    // ReadGuard of the caller is destroyed, NULL if it doesn't exist
+    LogEntry* find_entry(const int64_t index);
+    // Make room for |count| more entries
+    void reserve(size_t count);
+    void take_entries(int64_t first, int64_t last, std::vector<LogEntry*>* taken);
+    // Wait until the readers entered before are all gone
+    void synchronize();
+
+    butil::atomic<int64_t> _first_index;
+    butil::atomic<int64_t> _last_index;
+    butil::atomic<Ring*> _ring;
+    // the readers entered in the even and the odd epochs
+    butil::atomic<uint64_t> _epoch;
+    ReaderCount _readers[2][READER_SHARDS];
+    // serializes synchronize() which may be called by the writers and by
+    // release() out of their lock
+    raft_mutex_t _sync_mutex;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_LOG_ENTRY_RING_H
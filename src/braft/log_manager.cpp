@@ -36,6 +36,12 @@ namespace braft {
 DEFINE_int32(raft_leader_batch, 256, "max leader io batch");
 BRPC_VALIDATE_GFLAG(raft_leader_batch, ::brpc::PositiveInteger);
 
+DEFINE_bool(raft_notify_waiters_in_batch, false,
+            "Run the waiters woken up by new logs one after another in a "
+            "single bthread instead of a bthread for each, which saves the "
+            "scheduling on the leader with many replicators");
+BRPC_VALIDATE_GFLAG(raft_notify_waiters_in_batch, ::brpc::PassValidate);
+
 static bvar::Adder<int64_t> g_read_entry_from_storage
             ("raft_read_entry_from_storage_count");
 static bvar::PerSecond<bvar::Adder<int64_t> > g_read_entry_from_storage_second
@@ -55,6 +61,50 @@ static bvar::Adder<int64_t> g_storage_append_entries_concurrency(
 
 static bvar::CounterRecorder g_storage_flush_batch_counter(
                                         "raft_storage_flush_batch_counter");
+static bvar::CounterRecorder g_storage_sync_batch_counter(
+                                        "raft_storage_sync_batch_counter");
+static bvar::LatencyRecorder g_storage_sync_latency("raft_storage_sync");
+
+DEFINE_bool(raft_log_encode_stage, false,
+            "Serialize the appended logs in a stage before the disk thread, "
+            "overlapping with the writing and syncing of the former logs. "
+            "Takes effect for the LogManagers created afterwards");
+DEFINE_int32(raft_disk_queue_max_batches, 256,
+             "Max appending tasks encoded but not yet taken by the disk "
+             "thread, the encode stage waits beyond it");
+BRPC_VALIDATE_GFLAG(raft_disk_queue_max_batches, ::brpc::PositiveInteger);
+
+static bvar::LatencyRecorder g_log_encode_latency("raft_log_encode");
+static bvar::Adder<int64_t> g_log_encode_queue_depth(
+                                    "raft_log_encode_queue_depth");
+static bvar::Adder<int64_t> g_disk_queue_depth("raft_disk_queue_depth");
+
+DEFINE_int64(raft_max_memory_log_bytes, 0,
+             "Max data bytes of the logs kept in memory by each group, beyond "
+             "which the logs on disk are dropped from memory even if not "
+             "applied and the new user logs are rejected, 0 for no limit");
+BRPC_VALIDATE_GFLAG(raft_max_memory_log_bytes, ::brpc::NonNegativeInteger);
+DEFINE_int64(raft_max_total_memory_log_bytes, 0,
+             "Max data bytes of the logs kept in memory by all the groups "
+             "in the process, see raft_max_memory_log_bytes");
+BRPC_VALIDATE_GFLAG(raft_max_total_memory_log_bytes, ::brpc::NonNegativeInteger);
+
+static butil::atomic<int64_t> g_memory_log_bytes(0);
+static int64_t get_memory_log_bytes(void*) {
+    return g_memory_log_bytes.load(butil::memory_order_relaxed);
+}
+static bvar::PassiveStatus<int64_t> g_memory_log_bytes_var(
+                "raft_memory_log_bytes", get_memory_log_bytes, NULL);
+static bvar::Adder<int64_t> g_memory_log_rejected("raft_memory_log_rejected_count");
+
+// The appenders waiting for the logs in memory of any group to shrink
+static raft_mutex_t g_memory_budget_mutex;
+static bthread::ConditionVariable g_memory_budget_cond;
+static butil::atomic<int> g_memory_budget_waiters(0);
+
+static bool sync_by_time() {
+    return FLAGS_raft_sync && FLAGS_raft_sync_policy == RAFT_SYNC_BY_TIME;
+}
 
 
 void LogManager::StableClosure::update_metric(IOMetric* m) {
@@ -75,8 +125,22 @@ LogManager::LogManager()
     , _stopped(false)
     , _has_error(false)
     , _next_wait_id(0)
+    , _written_index(0)
+    , _written_index_cap(INT64_MAX)
+    , _pending_truncations(0)
+    , _memory_log_bytes(0)
+    , _memory_log_rejected(0)
     , _first_log_index(0)
     , _last_log_index(0)
+    , _rewrite_seq(0)
+    , _encode_stage(false)
+    , _disk_queue_depth(0)
+    , _first_unsynced_us(0)
+    , _sync_timer_armed(false)
+    , _sync_timer(0)
+    , _append_batcher(NULL)
+    , _linger_timer_armed(false)
+    , _linger_timer(0)
 {
     CHECK_EQ(0, start_disk_thread());
 }
@@ -96,64 +160,164 @@ int LogManager::init(const LogManagerOptions &options) {
     if (ret != 0) {
         return ret;
     }
-    _first_log_index = _log_storage->first_log_index();
-    _last_log_index = _log_storage->last_log_index();
-    _disk_id.index = _last_log_index;
+    _first_log_index.store(_log_storage->first_log_index(),
+                           butil::memory_order_release);
+    _last_log_index.store(_log_storage->last_log_index(),
+                          butil::memory_order_release);
+    _disk_id.index = _last_log_index.load(butil::memory_order_relaxed);
     // Term will be 0 if the node has no logs, and we will correct the value
     // after snapshot load finish.
-    _disk_id.term = _log_storage->get_term(_last_log_index);
+    _disk_id.term = _log_storage->get_term(_disk_id.index);
+    _term_starts.clear();
+    const int64_t first_log_index = _first_log_index.load(butil::memory_order_relaxed);
+    if (_disk_id.index >= first_log_index) {
+        const int64_t first_term = _log_storage->get_term(first_log_index);
+        _term_starts.push_back(TermStart(first_log_index, first_term));
+        load_term_starts(first_log_index, first_term,
+                         _disk_id.index, _disk_id.term);
+    }
+    unsafe_publish_term_starts();
+    _durable_id = _disk_id;
+    _written_index = _disk_id.index;
     _fsm_caller = options.fsm_caller;
     return 0;
 }
 
 LogManager::~LogManager() {
     stop_disk_thread();
-    for (size_t i = 0; i < _logs_in_memory.size(); ++i) {
-        _logs_in_memory[i]->Release();
-    }
-    _logs_in_memory.clear();
+    // The logs left in memory are released along with _logs_in_memory
+    g_memory_log_bytes.fetch_sub(
+            _memory_log_bytes.load(butil::memory_order_relaxed),
+            butil::memory_order_relaxed);
 }
 
 int LogManager::start_disk_thread() {
     bthread::ExecutionQueueOptions queue_options;
     queue_options.bthread_attr = BTHREAD_ATTR_NORMAL;
-    return bthread::execution_queue_start(&_disk_queue,
+    const int rc = bthread::execution_queue_start(&_disk_queue,
                                    &queue_options,
                                    disk_thread,
                                    this);
+    if (rc != 0 || !FLAGS_raft_log_encode_stage) {
+        return rc;
+    }
+    _encode_stage = true;
+    return bthread::execution_queue_start(&_encode_queue,
+                                   &queue_options,
+                                   encode_thread,
+                                   this);
 }
 
 int LogManager::stop_disk_thread() {
+    if (_encode_stage) {
+        // Pass the pending tasks to the disk queue before stopping it
+        bthread::execution_queue_stop(_encode_queue);
+        bthread::execution_queue_join(_encode_queue);
+    }
     bthread::execution_queue_stop(_disk_queue);
-    return bthread::execution_queue_join(_disk_queue);
+    const int rc = bthread::execution_queue_join(_disk_queue);
+    if (_sync_timer_armed) {
+        // It's fine if the timer is running, see on_disk_timer
+        bthread_timer_del(_sync_timer);
+        _sync_timer_armed = false;
+    }
+    if (_linger_timer_armed) {
+        bthread_timer_del(_linger_timer);
+        _linger_timer_armed = false;
+    }
+    return rc;
 }
 
 void LogManager::clear_memory_logs(const LogId& id) {
-    LogEntry* entries_to_clear[256];
-    size_t nentries = 0;
-    do {
-        nentries = 0;
-        {
-            BAIDU_SCOPED_LOCK(_mutex);
-            while (!_logs_in_memory.empty() 
-                    && nentries < ARRAY_SIZE(entries_to_clear)) {
-                LogEntry* entry = _logs_in_memory.front();
-                if (entry->id > id) {
-                    break;
-                }
-                entries_to_clear[nentries++] = entry;
-                _logs_in_memory.pop_front();
+    std::vector<LogEntry*> entries_to_clear;
+    // The readers missing the memory must find the logs in the storage
+    const int64_t storage_last_index = _log_storage->last_log_index();
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+    int64_t first_index_kept = _logs_in_memory.first_index();
+    const int64_t last_index = _logs_in_memory.last_index();
+    const int64_t last_index_cleared = std::min(
+            last_index, std::min(_written_index, storage_last_index));
+    for (; first_index_kept <= last_index_cleared; ++first_index_kept) {
+        if (_logs_in_memory.unsafe_get_entry(first_index_kept)->id > id) {
+            break;
+        }
+    }
+    _logs_in_memory.pop_front(first_index_kept, &entries_to_clear);
+    lck.unlock();
+    // Readers don't take _mutex, release the entries once they are gone
+    release_memory_logs(entries_to_clear);
+}
+
+static int64_t data_bytes(const std::vector<LogEntry*>& entries) {
+    int64_t bytes = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        bytes += entries[i]->data.length();
+    }
+    return bytes;
+}
+
+void LogManager::release_memory_logs(const std::vector<LogEntry*>& entries) {
+    return_memory_log_bytes(entries);
+    _logs_in_memory.release(entries);
+}
+
+void LogManager::return_memory_log_bytes(const std::vector<LogEntry*>& entries) {
+    if (entries.empty()) {
+        return;
+    }
+    const int64_t bytes = data_bytes(entries);
+    _memory_log_bytes.fetch_sub(bytes, butil::memory_order_relaxed);
+    g_memory_log_bytes.fetch_sub(bytes, butil::memory_order_seq_cst);
+    // Pairs with the waiter which counts itself before checking the bytes
+    if (g_memory_budget_waiters.load(butil::memory_order_seq_cst) > 0) {
+        BAIDU_SCOPED_LOCK(g_memory_budget_mutex);
+        g_memory_budget_cond.notify_all();
+    }
+}
+
+bool LogManager::memory_logs_full() const {
+    const int64_t max_bytes = FLAGS_raft_max_memory_log_bytes;
+    const int64_t max_total_bytes = FLAGS_raft_max_total_memory_log_bytes;
+    return (max_bytes > 0 && _memory_log_bytes.load(
+                    butil::memory_order_seq_cst) >= max_bytes)
+        || (max_total_bytes > 0 && g_memory_log_bytes.load(
+                    butil::memory_order_seq_cst) >= max_total_bytes);
+}
+
+LogId LogManager::unsafe_memory_logs_clear_id() const {
+    if (memory_logs_full()) {
+        // Readers fall back to the log storage, clear_memory_logs keeps the
+        // logs not written yet, e.g. the ones after a truncate_suffix
+        return _disk_id;
+    }
+    return std::min(_disk_id, _applied_id);
+}
+
+int LogManager::wait_for_memory_budget(int64_t timeout_ms) {
+    if (!memory_logs_full()) {
+        return 0;
+    }
+    if (timeout_ms > 0) {
+        const timespec deadline = butil::milliseconds_from_now(timeout_ms);
+        std::unique_lock<raft_mutex_t> lck(g_memory_budget_mutex);
+        g_memory_budget_waiters.fetch_add(1, butil::memory_order_seq_cst);
+        while (memory_logs_full()) {
+            if (g_memory_budget_cond.wait_until(lck, deadline) == ETIMEDOUT) {
+                break;
             }
-        }  // out of _mutex
-        for (size_t i = 0; i < nentries; ++i) {
-            entries_to_clear[i]->Release();
         }
-    } while (nentries == ARRAY_SIZE(entries_to_clear));
+        g_memory_budget_waiters.fetch_sub(1, butil::memory_order_relaxed);
+        if (!memory_logs_full()) {
+            return 0;
+        }
+    }
+    _memory_log_rejected.fetch_add(1, butil::memory_order_relaxed);
+    g_memory_log_rejected << 1;
+    return EBUSY;
 }
 
 int64_t LogManager::first_log_index() {
-    BAIDU_SCOPED_LOCK(_mutex);
-    return _first_log_index;
+    return _first_log_index.load(butil::memory_order_acquire);
 }
 
 class LastLogIdClosure : public LogManager::StableClosure {
@@ -178,15 +342,17 @@ private:
 };
 
 int64_t LogManager::last_log_index(bool is_flush) {
-    std::unique_lock<raft_mutex_t> lck(_mutex);
     if (!is_flush) {
-        return _last_log_index;
+        return _last_log_index.load(butil::memory_order_acquire);
     } else {
-        if (_last_log_index == _last_snapshot_id.index) {
-            return _last_log_index;
+        std::unique_lock<raft_mutex_t> lck(_mutex);
+        const int64_t last_log_index =
+                _last_log_index.load(butil::memory_order_relaxed);
+        if (last_log_index == _last_snapshot_id.index) {
+            return last_log_index;
         }
         LastLogIdClosure c;
-        CHECK_EQ(0, bthread::execution_queue_execute(_disk_queue, &c));
+        CHECK_EQ(0, enqueue(&c));
         lck.unlock();
         c.wait();
         return c.last_log_id().index;
@@ -195,17 +361,18 @@ int64_t LogManager::last_log_index(bool is_flush) {
 
 LogId LogManager::last_log_id(bool is_flush) {
     std::unique_lock<raft_mutex_t> lck(_mutex);
+    const int64_t last_log_index = _last_log_index.load(butil::memory_order_relaxed);
     if (!is_flush) {
-        if (_last_log_index >= _first_log_index) {
-            return LogId(_last_log_index, unsafe_get_term(_last_log_index));
+        if (last_log_index >= _first_log_index.load(butil::memory_order_relaxed)) {
+            return LogId(last_log_index, unsafe_get_term(last_log_index));
         }
         return _last_snapshot_id;
     } else {
-        if (_last_log_index == _last_snapshot_id.index) {
+        if (last_log_index == _last_snapshot_id.index) {
             return _last_snapshot_id;
         }
         LastLogIdClosure c;
-        CHECK_EQ(0, bthread::execution_queue_execute(_disk_queue, &c));
+        CHECK_EQ(0, enqueue(&c));
         lck.unlock();
         c.wait();
         return c.last_log_id();
@@ -256,37 +423,44 @@ private:
 
 int LogManager::truncate_prefix(const int64_t first_index_kept,
                                 std::unique_lock<raft_mutex_t>& lck) {
-    std::deque<LogEntry*> saved_logs_in_memory;
     // As the duration between two snapshot (which leads to truncate_prefix at
     // last) is likely to be a long period, _logs_in_memory is likely to
-    // contain a large amount of logs to release, which holds the mutex so that
-    // all the replicator/application are blocked.
-    // FIXME(chenzhangyi01): to resolve this issue, we have to build a data
-    // structure which is able to pop_front/pop_back N elements into another
-    // container in O(1) time, one solution is a segmented double-linked list
-    // along with a bounded queue as the indexer, of which the payoff is that
-    // _logs_in_memory has to be bounded.
-    while (!_logs_in_memory.empty()) {
-        LogEntry* entry = _logs_in_memory.front();
-        if (entry->id.index < first_index_kept) {
-            saved_logs_in_memory.push_back(entry);
-            _logs_in_memory.pop_front();
-        } else {
-            break;
-        }
-    }
-    CHECK_GE(first_index_kept, _first_log_index);
-    _first_log_index = first_index_kept;
-    if (first_index_kept > _last_log_index) {
+    // contain a large amount of logs to release. They are released by the
+    // disk thread, and the readers of _logs_in_memory are never blocked.
+    std::vector<LogEntry*> saved_logs_in_memory;
+    _logs_in_memory.pop_front(first_index_kept, &saved_logs_in_memory);
+    CHECK_GE(first_index_kept, _first_log_index.load(butil::memory_order_relaxed));
+    begin_rewrite_logs();
+    _first_log_index.store(first_index_kept, butil::memory_order_release);
+    if (first_index_kept > _last_log_index.load(butil::memory_order_relaxed)) {
         // The entrie log is dropped
-        _last_log_index = first_index_kept - 1;
+        _last_log_index.store(first_index_kept - 1, butil::memory_order_release);
+        _term_starts.clear();
+        unsafe_publish_term_starts();
+    } else {
+        // Keep the term which |first_index_kept| belongs to
+        size_t ndropped = 0;
+        while (ndropped + 1 < _term_starts.size()
+                && _term_starts[ndropped + 1].index <= first_index_kept) {
+            ++ndropped;
+        }
+        if (ndropped > 0) {
+            _term_starts.erase(_term_starts.begin(),
+                               _term_starts.begin() + ndropped);
+            unsafe_publish_term_starts();
+        }
     }
+    end_rewrite_logs();
     _config_manager->truncate_prefix(first_index_kept);
     TruncatePrefixClosure* c = new TruncatePrefixClosure(first_index_kept);
-    const int rc = bthread::execution_queue_execute(_disk_queue, c);
+    return_memory_log_bytes(saved_logs_in_memory);
+    c->_dropped_entries.swap(saved_logs_in_memory);
+    const int rc = enqueue(c);
     lck.unlock();
-    for (size_t i = 0; i < saved_logs_in_memory.size(); ++i) {
-        saved_logs_in_memory[i]->Release();
+    if (rc != 0) {
+        // Nothing is written any more
+        _logs_in_memory.release(c->_dropped_entries);
+        delete c;
     }
     return rc;
 }
@@ -294,19 +468,25 @@ int LogManager::truncate_prefix(const int64_t first_index_kept,
 int LogManager::reset(const int64_t next_log_index,
                       std::unique_lock<raft_mutex_t>& lck) {
     CHECK(lck.owns_lock());
-    std::deque<LogEntry*> saved_logs_in_memory;
-    saved_logs_in_memory.swap(_logs_in_memory);
-    _first_log_index = next_log_index;
-    _last_log_index = next_log_index - 1;
-    _config_manager->truncate_prefix(_first_log_index);
-    _config_manager->truncate_suffix(_last_log_index);
+    std::vector<LogEntry*> saved_logs_in_memory;
+    _logs_in_memory.reset(next_log_index, &saved_logs_in_memory);
+    begin_rewrite_logs();
+    _first_log_index.store(next_log_index, butil::memory_order_release);
+    _last_log_index.store(next_log_index - 1, butil::memory_order_release);
+    _term_starts.clear();
+    unsafe_publish_term_starts();
+    end_rewrite_logs();
+    _config_manager->truncate_prefix(next_log_index);
+    _config_manager->truncate_suffix(next_log_index - 1);
+    _written_index = std::min(_written_index, next_log_index - 1);
+    _written_index_cap = std::min(_written_index_cap, next_log_index - 1);
+    ++_pending_truncations;
     ResetClosure* c = new ResetClosure(next_log_index);
-    const int ret = bthread::execution_queue_execute(_disk_queue, c);
+    return_memory_log_bytes(saved_logs_in_memory);
+    c->_dropped_entries.swap(saved_logs_in_memory);
+    const int ret = enqueue(c);
     lck.unlock();
     CHECK_EQ(0, ret) << "execq execute failed, ret: " << ret << " err: " << berror();
-    for (size_t i = 0; i < saved_logs_in_memory.size(); ++i) {
-        saved_logs_in_memory[i]->Release();
-    }
     return 0;
 }
 
@@ -318,23 +498,30 @@ void LogManager::unsafe_truncate_suffix(const int64_t last_index_kept) {
         return;
     }
 
-    while (!_logs_in_memory.empty()) {
-        LogEntry* entry = _logs_in_memory.back();
-        if (entry->id.index > last_index_kept) {
-            entry->Release();
-            _logs_in_memory.pop_back();
-        } else {
-            break;
-        }
+    std::vector<LogEntry*> popped;
+    _logs_in_memory.pop_back(last_index_kept, &popped);
+    return_memory_log_bytes(popped);
+    begin_rewrite_logs();
+    _last_log_index.store(last_index_kept, butil::memory_order_release);
+    const size_t nterms = _term_starts.size();
+    while (!_term_starts.empty() && _term_starts.back().index > last_index_kept) {
+        _term_starts.pop_back();
     }
-    _last_log_index = last_index_kept;
+    if (_term_starts.size() != nterms) {
+        unsafe_publish_term_starts();
+    }
+    end_rewrite_logs();
     const int64_t last_term_kept = unsafe_get_term(last_index_kept);
     CHECK(last_index_kept == 0 || last_term_kept != 0)
         << "last_index_kept=" << last_index_kept;
     _config_manager->truncate_suffix(last_index_kept);
+    _written_index = std::min(_written_index, last_index_kept);
+    _written_index_cap = std::min(_written_index_cap, last_index_kept);
+    ++_pending_truncations;
     TruncateSuffixClosure* tsc = new
             TruncateSuffixClosure(last_index_kept, last_term_kept);
-    CHECK_EQ(0, bthread::execution_queue_execute(_disk_queue, tsc));
+    tsc->_dropped_entries.swap(popped);
+    CHECK_EQ(0, enqueue(tsc));
 }
 
 int LogManager::check_and_resolve_conflict(
@@ -344,19 +531,23 @@ int LogManager::check_and_resolve_conflict(
         // Node is currently the leader and |entries| are from the user who 
         // don't know the correct indexes the logs should assign to. So we have
         // to assign indexes to the appending entries
+        int64_t last_log_index = _last_log_index.load(butil::memory_order_relaxed);
         for (size_t i = 0; i < entries->size(); ++i) {
-            (*entries)[i]->id.index = ++_last_log_index;
+            (*entries)[i]->id.index = ++last_log_index;
         }
+        unsafe_append_term_starts(*entries, 0);
+        _last_log_index.store(last_log_index, butil::memory_order_release);
         done_guard.release();
         return 0;
     } else {
         // Node is currently a follower and |entries| are from the leader. We 
         // should check and resolve the confliction between the local logs and
         // |entries|
-        if (entries->front()->id.index > _last_log_index + 1) {
+        const int64_t last_log_index = _last_log_index.load(butil::memory_order_relaxed);
+        if (entries->front()->id.index > last_log_index + 1) {
             done->status().set_error(EINVAL, "There's gap between first_index=%" PRId64
                                      " and last_log_index=%" PRId64,
-                                     entries->front()->id.index, _last_log_index);
+                                     entries->front()->id.index, last_log_index);
             return -1;
         }
         const int64_t applied_index = _applied_id.index;
@@ -368,9 +559,11 @@ int LogManager::check_and_resolve_conflict(
             return 1;
         }
 
-        if (entries->front()->id.index == _last_log_index + 1) {
+        if (entries->front()->id.index == last_log_index + 1) {
             // Fast path
-            _last_log_index = entries->back()->id.index;
+            unsafe_append_term_starts(*entries, 0);
+            _last_log_index.store(entries->back()->id.index,
+                                  butil::memory_order_release);
         } else {
             // Appending entries overlap the local ones. We should find if there
             // is a conflicting index from which we should truncate the local
@@ -383,13 +576,15 @@ int LogManager::check_and_resolve_conflict(
                 }
             }
             if (conflicting_index != entries->size()) {
-                if ((*entries)[conflicting_index]->id.index <= _last_log_index) {
+                if ((*entries)[conflicting_index]->id.index <= last_log_index) {
                     // Truncate all the conflicting entries to make local logs
                     // consensus with the leader.
                     unsafe_truncate_suffix(
                             (*entries)[conflicting_index]->id.index - 1);
                 }
-                _last_log_index = entries->back()->id.index;
+                unsafe_append_term_starts(*entries, conflicting_index);
+                _last_log_index.store(entries->back()->id.index,
+                                      butil::memory_order_release);
             }  // else this is a duplicated AppendEntriesRequest, we have 
                // nothing to do besides releasing all the entries
             
@@ -432,9 +627,9 @@ void LogManager::append_entries(
         return;
     }
 
+    // The disk thread doesn't reference the entries, which stay referenced by
+    // _logs_in_memory until written or dropped by a task after them
     for (size_t i = 0; i < entries->size(); ++i) {
-        // Add ref for disk_thread
-        (*entries)[i]->AddRef();
         if ((*entries)[i]->type == ENTRY_TYPE_CONFIGURATION) {
             ConfigurationEntry conf_entry(*((*entries)[i]));
             _config_manager->add(conf_entry);
@@ -443,11 +638,14 @@ void LogManager::append_entries(
 
     if (!entries->empty()) {
         done->_first_log_index = entries->front()->id.index;
-        _logs_in_memory.insert(_logs_in_memory.end(), entries->begin(), entries->end());
+        _logs_in_memory.append(&(*entries)[0], entries->size());
+        const int64_t bytes = data_bytes(*entries);
+        _memory_log_bytes.fetch_add(bytes, butil::memory_order_relaxed);
+        g_memory_log_bytes.fetch_add(bytes, butil::memory_order_relaxed);
     }
 
     done->_entries.swap(*entries);
-    int ret = bthread::execution_queue_execute(_disk_queue, done);
+    int ret = enqueue(done);
     CHECK_EQ(0, ret) << "execq execute failed, ret: " << ret << " err: " << berror();
     wakeup_all_waiter(lck);
 }
@@ -482,7 +680,10 @@ void LogManager::append_to_storage(std::vector<LogEntry*>* to_append,
         }
     }
     for (size_t j = 0; j < to_append->size(); ++j) {
-        (*to_append)[j]->Release();
+        LogEntry* entry = (*to_append)[j];
+        // Don't keep the serialized copy along with the entry in memory
+        entry->encoded.clear();
+        entry->encoded_format = 0;
     }
     to_append->clear();
 }
@@ -490,97 +691,336 @@ void LogManager::append_to_storage(std::vector<LogEntry*>* to_append,
 DEFINE_int32(raft_max_append_buffer_size, 256 * 1024, 
              "Flush buffer to LogStorage if the buffer size reaches the limit");
 
+DEFINE_bool(raft_adaptive_append_batch, false,
+            "Size the appending batches by the observed write latency, "
+            "starting from raft_max_append_buffer_size");
+DEFINE_int32(raft_append_batch_target_latency_us, 2000,
+             "The adaptive batches grow while writing one takes less than "
+             "this and shrink by half once it takes more");
+BRPC_VALIDATE_GFLAG(raft_append_batch_target_latency_us, ::brpc::PositiveInteger);
+DEFINE_int32(raft_append_batch_max_linger_us, 0,
+             "Max time that the adaptive batcher holds a batch smaller than "
+             "its target for the logs expected to arrive, 0 to never hold");
+BRPC_VALIDATE_GFLAG(raft_append_batch_max_linger_us, ::brpc::NonNegativeInteger);
+
+static bvar::CounterRecorder g_append_batch_target_bytes(
+                                        "raft_append_batch_target_bytes");
+static bvar::CounterRecorder g_append_batch_linger_us(
+                                        "raft_append_batch_linger_us");
+
+// Collects the appending closures of the disk thread into batches for
+// LogStorage. It lives across the runs of the disk thread so that a batch
+// may linger for the following logs, see raft_append_batch_max_linger_us.
+//
+// With raft_adaptive_append_batch, the target size of a batch follows the
+// write latency like AIMD: it grows by a step when a full batch is written
+// within raft_append_batch_target_latency_us, and is halved when a batch
+// takes longer.
+static const size_t MIN_APPEND_BATCH_BYTES = 4 * 1024;
+static const size_t MAX_APPEND_BATCH_BYTES = 64 * 1024 * 1024;
+static const size_t APPEND_BATCH_BYTES_STEP = 64 * 1024;
+
 class AppendBatcher {
 public:
-    AppendBatcher(LogManager::StableClosure* storage[], size_t cap, LogId* last_id, 
-                 LogManager* lm)
-        : _storage(storage)
-        , _cap(cap)
-        , _size(0)
+    AppendBatcher(size_t cap, LogManager* lm)
+        : _cap(cap)
         , _buffer_size(0)
-        , _last_id(last_id)
+        , _target_bytes(FLAGS_raft_max_append_buffer_size)
+        , _last_arrival_us(0)
+        , _arrival_interval_us(0)
+        , _arrival_bytes(0)
         , _lm(lm)
     {
+        _closures.reserve(cap);
         _to_append.reserve(1024);
     }
-    ~AppendBatcher() { flush(); }
 
-    void flush() {
-        if (_size > 0) {
+    void flush(LogId* last_id) {
+        if (!_closures.empty()) {
             IOMetric metric;
-            _lm->append_to_storage(&_to_append, _last_id, &metric);
-            g_storage_flush_batch_counter << _size;
-            for (size_t i = 0; i < _size; ++i) {
-                _storage[i]->_entries.clear();
-                if (_lm->_has_error.load(butil::memory_order_relaxed)) {
-                    _storage[i]->status().set_error(
-                            EIO, "Corrupted LogStorage");
-                }
-                _storage[i]->update_metric(&metric);
-                _storage[i]->Run();
-            }
-            for (size_t i = 0; i < _dynamic_storage.size(); ++i) {
-                _dynamic_storage[i]->_entries.clear();
-                if (_lm->_has_error.load(butil::memory_order_relaxed)) {
-                    _dynamic_storage[i]->status().set_error(
-                            EIO, "Corrupted LogStorage");
-                }
-                _dynamic_storage[i]->update_metric(&metric);
-                _dynamic_storage[i]->Run();
+            const size_t bytes = _buffer_size;
+            const int64_t start_us = butil::monotonic_time_us();
+            _lm->append_to_storage(&_to_append, last_id, &metric);
+            adjust_target(bytes, butil::monotonic_time_us() - start_us);
+            g_storage_flush_batch_counter << _closures.size();
+            for (size_t i = 0; i < _closures.size(); ++i) {
+                finish(_closures[i], &metric);
             }
-            _dynamic_storage.clear();
+            _closures.clear();
             _to_append.clear();
         }
-        _size = 0;
         _buffer_size = 0;
     }
 
-    void append(LogManager::StableClosure* done) {
+    void append(LogManager::StableClosure* done, LogId* last_id) {
         // TODO(zkl): trigger flush by FLAGS_append_batcher_capacity
-        if (!FLAGS_unlimit_append_batcher &&
-            (_size == _cap || _buffer_size >= (size_t)FLAGS_raft_max_append_buffer_size)) {
-            flush();
-        }
-        if (_size == _cap) {
-            assert(FLAGS_unlimit_append_batcher);
-            // Emplace into the dynamic storage if the static storage is full.
-            if (_dynamic_storage.empty()) {
-                _dynamic_storage.reserve(1024);
+        if (FLAGS_raft_adaptive_append_batch) {
+            // The closures are bounded as well for the tiny or empty entries
+            if ((!FLAGS_unlimit_append_batcher && _closures.size() >= _cap)
+                    || _buffer_size >= _target_bytes) {
+                flush(last_id);
             }
-            _dynamic_storage.emplace_back(done);
-        } else {
-            _storage[_size++] = done;
+        } else if (!FLAGS_unlimit_append_batcher &&
+            (_closures.size() >= _cap
+                || _buffer_size >= (size_t)FLAGS_raft_max_append_buffer_size)) {
+            flush(last_id);
         }
+        _closures.push_back(done);
 
         _to_append.insert(_to_append.end(),
                          done->_entries.begin(), done->_entries.end());
+        size_t bytes = 0;
         for (size_t i = 0; i < done->_entries.size(); ++i) {
-            _buffer_size += done->_entries[i]->data.length();
+            bytes += done->_entries[i]->data.length();
+        }
+        _buffer_size += bytes;
+        record_arrival(done->metric.start_time_us, bytes);
+    }
+
+    // Returns how long the current batch should wait for more logs before
+    // being written, 0 to write it right now. It only waits when the logs
+    // arrive fast enough to fill the batch soon, so that the latency of
+    // sparse appends is not affected
+    int64_t linger_us() const {
+        const int64_t max_linger_us = FLAGS_raft_append_batch_max_linger_us;
+        if (!FLAGS_raft_adaptive_append_batch || max_linger_us <= 0
+                || _closures.empty() || _buffer_size >= _target_bytes
+                || (!FLAGS_unlimit_append_batcher && _closures.size() >= _cap)
+                || _arrival_interval_us <= 0
+                || _arrival_interval_us > max_linger_us) {
+            return 0;
         }
+        const int64_t missing_tasks = (int64_t)(_target_bytes - _buffer_size)
+                / std::max<int64_t>(_arrival_bytes, 1) + 1;
+        const int64_t linger_us = std::min(max_linger_us,
+                                           missing_tasks * _arrival_interval_us);
+        g_append_batch_linger_us << linger_us;
+        return linger_us;
     }
 
 private:
-    LogManager::StableClosure** _storage;
-    std::vector<LogManager::StableClosure*> _dynamic_storage;
+    void adjust_target(size_t bytes, int64_t write_us) {
+        if (!FLAGS_raft_adaptive_append_batch) {
+            return;
+        }
+        if (write_us > FLAGS_raft_append_batch_target_latency_us) {
+            _target_bytes = std::max(_target_bytes / 2, MIN_APPEND_BATCH_BYTES);
+        } else if (bytes >= _target_bytes) {
+            // Only a batch cut by the target tells that it's too small
+            _target_bytes = std::min(_target_bytes + APPEND_BATCH_BYTES_STEP,
+                                     MAX_APPEND_BATCH_BYTES);
+        }
+        g_append_batch_target_bytes << _target_bytes;
+    }
+
+    // Moving averages of the interval and the size of the appending tasks,
+    // by the time they were submitted
+    void record_arrival(int64_t start_time_us, size_t bytes) {
+        if (_last_arrival_us > 0 && start_time_us >= _last_arrival_us) {
+            const int64_t interval = start_time_us - _last_arrival_us;
+            _arrival_interval_us = _arrival_interval_us <= 0 ? interval
+                    : (_arrival_interval_us * 7 + interval) / 8;
+        }
+        _last_arrival_us = start_time_us;
+        _arrival_bytes = (_arrival_bytes * 7 + (int64_t)bytes) / 8;
+    }
+
+    void finish(LogManager::StableClosure* done, IOMetric* metric) {
+        done->_entries.clear();
+        if (_lm->_has_error.load(butil::memory_order_relaxed)) {
+            done->status().set_error(EIO, "Corrupted LogStorage");
+        }
+        done->update_metric(metric);
+        // Keep the order with the held closures if the policy was changed
+        if (sync_by_time() || !_lm->_unsynced_closures.empty()) {
+            _lm->wait_for_sync(done);
+        } else {
+            done->Run();
+        }
+    }
+
+    std::vector<LogManager::StableClosure*> _closures;
     size_t _cap;
-    size_t _size;
     size_t _buffer_size;
+    size_t _target_bytes;
+    int64_t _last_arrival_us;
+    int64_t _arrival_interval_us;
+    int64_t _arrival_bytes;
     std::vector<LogEntry*> _to_append;
-    LogId *_last_id;
     LogManager* _lm;
 };
 
+// Pushed into the disk queue to sync the logs held by RAFT_SYNC_BY_TIME
+class SyncLogsClosure : public LogManager::StableClosure {
+public:
+    void Run() {
+        delete this;
+    }
+};
+
+// Pushed into the disk queue to write the lingering batch, see
+// raft_append_batch_max_linger_us
+class FlushLogsClosure : public LogManager::StableClosure {
+public:
+    void Run() {
+        delete this;
+    }
+};
+
+// Push a |T| into the disk queue when the timer fires. Only the id of the
+// queue is captured as the LogManager may be destroyed before the timer
+// fires, in which case the queue is stopped and refuses the task
+template <typename T>
+static void on_disk_timer(void* arg) {
+    bthread::ExecutionQueueId<LogManager::StableClosure*> queue_id =
+            { (uint64_t)arg };
+    T* done = new T;
+    if (bthread::execution_queue_execute(queue_id, done) != 0) {
+        delete done;
+    }
+}
+
+void LogManager::wait_for_sync(StableClosure* done) {
+    if (_unsynced_closures.empty()) {
+        _first_unsynced_us = butil::monotonic_time_us();
+    }
+    _unsynced_closures.push_back(done);
+}
+
+void LogManager::sync_written_logs(const LogId& last_id) {
+    if (_unsynced_closures.empty()) {
+        return;
+    }
+    butil::Timer timer;
+    timer.start();
+    if (!_has_error.load(butil::memory_order_relaxed)
+            && _log_storage->sync_appended() != 0) {
+        report_error(EIO, "Fail to sync LogStorage");
+    }
+    timer.stop();
+    g_storage_sync_latency << timer.u_elapsed();
+    g_storage_sync_batch_counter << _unsynced_closures.size();
+    const bool has_error = _has_error.load(butil::memory_order_relaxed);
+    if (!has_error) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        _durable_id = std::max(_durable_id, last_id);
+    }
+    // Run in the order of appending, which is relied on by the replies of
+    // the follower
+    for (size_t i = 0; i < _unsynced_closures.size(); ++i) {
+        StableClosure* done = _unsynced_closures[i];
+        if (has_error && done->status().ok()) {
+            done->status().set_error(EIO, "Corrupted LogStorage");
+        }
+        done->metric.sync_segment_time_us += timer.u_elapsed();
+        done->Run();
+    }
+    _unsynced_closures.clear();
+}
+
+void LogManager::schedule_sync(const LogId& last_id) {
+    if (_unsynced_closures.empty()) {
+        return;
+    }
+    const int64_t wait_us = _first_unsynced_us + FLAGS_raft_sync_interval_us
+                            - butil::monotonic_time_us();
+    if (wait_us <= 0 || _has_error.load(butil::memory_order_relaxed)) {
+        return sync_written_logs(last_id);
+    }
+    if (_sync_timer_armed) {
+        return;
+    }
+    if (bthread_timer_add(&_sync_timer, butil::microseconds_from_now(wait_us),
+                          on_disk_timer<SyncLogsClosure>,
+                          (void*)_disk_queue.value) != 0) {
+        LOG(WARNING) << "Fail to add timer, sync the logs right now";
+        return sync_written_logs(last_id);
+    }
+    _sync_timer_armed = true;
+}
+
+int LogManager::enqueue(StableClosure* done) {
+    if (!_encode_stage) {
+        return bthread::execution_queue_execute(_disk_queue, done);
+    }
+    const int rc = bthread::execution_queue_execute(_encode_queue, done);
+    if (rc == 0) {
+        g_log_encode_queue_depth << 1;
+    }
+    return rc;
+}
+
+int LogManager::encode_thread(void* meta,
+                              bthread::TaskIterator<StableClosure*>& iter) {
+    LogManager* log_manager = static_cast<LogManager*>(meta);
+    if (iter.is_queue_stopped()) {
+        return 0;
+    }
+    for (; iter; ++iter) {
+        StableClosure* done = *iter;
+        g_log_encode_queue_depth << -1;
+        if (!done->_entries.empty()) {
+            if (!log_manager->_has_error.load(butil::memory_order_relaxed)) {
+                butil::Timer timer;
+                timer.start();
+                log_manager->_log_storage->encode_entries(done->_entries);
+                timer.stop();
+                g_log_encode_latency << timer.u_elapsed();
+            }
+            // Don't encode too far ahead of the disk thread
+            std::unique_lock<raft_mutex_t> lck(log_manager->_disk_queue_mutex);
+            while (log_manager->_disk_queue_depth.load(butil::memory_order_relaxed)
+                        >= FLAGS_raft_disk_queue_max_batches) {
+                log_manager->_disk_queue_cond.wait(lck);
+            }
+            log_manager->_disk_queue_depth.fetch_add(
+                    1, butil::memory_order_relaxed);
+            g_disk_queue_depth << 1;
+        }
+        const int rc = bthread::execution_queue_execute(
+                log_manager->_disk_queue, done);
+        CHECK_EQ(0, rc) << "execq execute failed, ret: " << rc
+                        << " err: " << berror();
+    }
+    return 0;
+}
+
+int LogManager::schedule_flush(int64_t linger_us) {
+    if (_linger_timer_armed) {
+        return 0;
+    }
+    if (bthread_timer_add(&_linger_timer, butil::microseconds_from_now(linger_us),
+                          on_disk_timer<FlushLogsClosure>,
+                          (void*)_disk_queue.value) != 0) {
+        LOG(WARNING) << "Fail to add timer, write the logs right now";
+        return -1;
+    }
+    _linger_timer_armed = true;
+    return 0;
+}
+
 int LogManager::disk_thread(void* meta,
                             bthread::TaskIterator<StableClosure*>& iter) {
+    LogManager* log_manager = static_cast<LogManager*>(meta);
     if (iter.is_queue_stopped()) {
+        // Don't leave the lingering or the written logs behind
+        if (log_manager->_append_batcher) {
+            LogId last_id = log_manager->_disk_id;
+            log_manager->_append_batcher->flush(&last_id);
+            log_manager->set_disk_id(last_id);
+            delete log_manager->_append_batcher;
+            log_manager->_append_batcher = NULL;
+        }
+        log_manager->sync_written_logs(log_manager->_disk_id);
         return 0;
     }
 
-    LogManager* log_manager = static_cast<LogManager*>(meta);
     // FIXME(chenzhangyi01): it's buggy
     LogId last_id = log_manager->_disk_id;
-    StableClosure* storage[256];
-    AppendBatcher ab(storage, ARRAY_SIZE(storage), &last_id, log_manager);
+    if (!log_manager->_append_batcher) {
+        log_manager->_append_batcher = new AppendBatcher(256, log_manager);
+    }
+    AppendBatcher& ab = *log_manager->_append_batcher;
 
     for (; iter; ++iter) {
                 // ^^^ Must iterate to the end to release to corresponding
@@ -589,9 +1029,21 @@ int LogManager::disk_thread(void* meta,
         done->metric.bthread_queue_time_us = butil::cpuwide_time_us() - 
                                             done->metric.start_time_us;
         if (!done->_entries.empty()) {
-            ab.append(done);
+            if (log_manager->_encode_stage) {
+                log_manager->take_encoded_task();
+            }
+            ab.append(done, &last_id);
         } else {
-            ab.flush();
+            ab.flush(&last_id);
+            // The other operations are done after the logs written before
+            // them are durable, so that last_id reported is durable as well
+            log_manager->sync_written_logs(last_id);
+            if (dynamic_cast<SyncLogsClosure*>(done)) {
+                log_manager->_sync_timer_armed = false;
+            }
+            if (dynamic_cast<FlushLogsClosure*>(done)) {
+                log_manager->_linger_timer_armed = false;
+            }
             int ret = 0;
             do {
                 LastLogIdClosure* llic =
@@ -626,6 +1078,7 @@ int LogManager::disk_thread(void* meta,
                         CHECK(last_id.index == 0 || last_id.term != 0)
                                 << "last_id=" << last_id;
                     }
+                    log_manager->finish_truncation();
                     break;
                 }
                 ResetClosure* rc = dynamic_cast<ResetClosure*>(done);
@@ -633,6 +1086,7 @@ int LogManager::disk_thread(void* meta,
                     LOG(INFO) << "Reseting storage to next_log_index="
                               << rc->next_log_index();
                     ret = log_manager->_log_storage->reset(rc->next_log_index());
+                    log_manager->finish_truncation();
                     break;
                 }
             } while (0);
@@ -640,15 +1094,31 @@ int LogManager::disk_thread(void* meta,
             if (ret != 0) {
                 log_manager->report_error(ret, "Failed operation on LogStorage");
             }
+            // The tasks before which may write them are all done
+            log_manager->_logs_in_memory.release(done->_dropped_entries);
+            done->_dropped_entries.clear();
             done->Run();
         }
     }
     CHECK(!iter) << "Must iterate to the end";
-    ab.flush();
+    const int64_t linger_us = ab.linger_us();
+    if (linger_us <= 0 || log_manager->schedule_flush(linger_us) != 0) {
+        ab.flush(&last_id);
+    }
     log_manager->set_disk_id(last_id);
+    log_manager->schedule_sync(last_id);
     return 0;
 }
 
+void LogManager::take_encoded_task() {
+    g_disk_queue_depth << -1;
+    BAIDU_SCOPED_LOCK(_disk_queue_mutex);
+    if (_disk_queue_depth.fetch_sub(1, butil::memory_order_relaxed)
+            >= FLAGS_raft_disk_queue_max_batches) {
+        _disk_queue_cond.notify_one();
+    }
+}
+
 void LogManager::set_snapshot(const SnapshotMeta* meta) {
     BRAFT_VLOG << "Set snapshot last_included_index="
               << meta->last_included_index()
@@ -717,19 +1187,6 @@ void LogManager::clear_bufferred_logs() {
     }
 }
 
-LogEntry* LogManager::get_entry_from_memory(const int64_t index) {
-    LogEntry* entry = NULL;
-    if (!_logs_in_memory.empty()) {
-        int64_t first_index = _logs_in_memory.front()->id.index;
-        int64_t last_index = _logs_in_memory.back()->id.index;
-        CHECK_EQ(last_index - first_index + 1, static_cast<int64_t>(_logs_in_memory.size()));
-        if (index >= first_index && index <= last_index) {
-            entry = _logs_in_memory[index - first_index];
-        }
-    }
-    return entry;
-}
-
 int64_t LogManager::unsafe_get_term(const int64_t index) {
     if (index == 0) {
         return 0;
@@ -745,14 +1202,19 @@ int64_t LogManager::unsafe_get_term(const int64_t index) {
     // out of range, direct return NULL
     // check this after check last_snapshot_id, because it is likely that
     // last_snapshot_id < first_log_index
-    if (index > _last_log_index || index < _first_log_index) {
+    if (index > _last_log_index.load(butil::memory_order_relaxed)
+            || index < _first_log_index.load(butil::memory_order_relaxed)) {
         return 0;
     }
 
-    LogEntry* entry = get_entry_from_memory(index);
+    LogEntry* entry = _logs_in_memory.unsafe_get_entry(index);
     if (entry) {
         return entry->id.term;
     }
+    const int64_t term = find_term(_term_starts, index);
+    if (term != 0) {
+        return term;
+    }
     g_read_term_from_storage << 1;
     return _log_storage->get_term(index);
 }
@@ -761,6 +1223,28 @@ int64_t LogManager::get_term(const int64_t index) {
     if (index == 0) {
         return 0;
     }
+    // Most of the lookups hit the logs in memory or the term starts, neither
+    // of which blocks the appenders
+    int64_t term = _logs_in_memory.get_term(index);
+    if (term != 0) {
+        return term;
+    }
+    const int64_t seq = _rewrite_seq.load(butil::memory_order_acquire);
+    if (!(seq & 1)
+            && index >= _first_log_index.load(butil::memory_order_acquire)
+            && index <= _last_log_index.load(butil::memory_order_acquire)) {
+        {
+            butil::DoublyBufferedData<TermStarts>::ScopedPtr ptr;
+            if (_published_term_starts.Read(&ptr) == 0) {
+                term = find_term(*ptr, index);
+            }
+        }
+        // The result is valid only if the logs were not rewritten meanwhile
+        butil::atomic_thread_fence(butil::memory_order_acquire);
+        if (term != 0 && _rewrite_seq.load(butil::memory_order_relaxed) == seq) {
+            return term;
+        }
+    }
     std::unique_lock<raft_mutex_t> lck(_mutex);
     // check virtual first log
     if (index == _virtual_first_log_id.index) {
@@ -773,28 +1257,105 @@ int64_t LogManager::get_term(const int64_t index) {
     // out of range, direct return NULL
     // check this after check last_snapshot_id, because it is likely that
     // last_snapshot_id < first_log_index
-    if (index > _last_log_index || index < _first_log_index) {
+    if (index > _last_log_index.load(butil::memory_order_relaxed)
+            || index < _first_log_index.load(butil::memory_order_relaxed)) {
         return 0;
     }
 
-    LogEntry* entry = get_entry_from_memory(index);
+    LogEntry* entry = _logs_in_memory.unsafe_get_entry(index);
     if (entry) {
         return entry->id.term;
     }
+    term = find_term(_term_starts, index);
+    if (term != 0) {
+        return term;
+    }
     lck.unlock();
     g_read_term_from_storage << 1;
     return _log_storage->get_term(index);
 }
 
+int64_t LogManager::find_term(const TermStarts& starts, const int64_t index) {
+    // Find the last term starting at or before |index|
+    size_t lo = 0;
+    size_t hi = starts.size();
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (starts[mid].index <= index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo == 0 ? 0 : starts[lo - 1].term;
+}
+
+size_t LogManager::assign_term_starts(TermStarts& bg, const TermStarts& starts) {
+    bg = starts;
+    return 1;
+}
+
+void LogManager::load_term_starts(int64_t first, int64_t first_term,
+                                  int64_t last, int64_t last_term) {
+    // Terms never decrease along the log, so there's no term starting in
+    // (first, last] if they have the same term
+    if (first_term == last_term) {
+        return;
+    }
+    if (last == first + 1) {
+        _term_starts.push_back(TermStart(last, last_term));
+        return;
+    }
+    const int64_t mid = first + (last - first) / 2;
+    const int64_t mid_term = _log_storage->get_term(mid);
+    load_term_starts(first, first_term, mid, mid_term);
+    load_term_starts(mid, mid_term, last, last_term);
+}
+
+void LogManager::unsafe_append_term_starts(const std::vector<LogEntry*>& entries,
+                                           size_t from) {
+    bool changed = false;
+    for (size_t i = from; i < entries.size(); ++i) {
+        const LogId& id = entries[i]->id;
+        if (_term_starts.empty() || _term_starts.back().term != id.term) {
+            _term_starts.push_back(TermStart(id.index, id.term));
+            changed = true;
+        }
+    }
+    if (changed) {
+        unsafe_publish_term_starts();
+    }
+}
+
+void LogManager::unsafe_publish_term_starts() {
+    _published_term_starts.Modify(assign_term_starts, _term_starts);
+}
+
+void LogManager::begin_rewrite_logs() {
+    // get_term reading the term starts without _mutex sees the odd sequence
+    // or a different one after, and retries with the lock
+    _rewrite_seq.fetch_add(1, butil::memory_order_acq_rel);
+}
+
+void LogManager::end_rewrite_logs() {
+    _rewrite_seq.fetch_add(1, butil::memory_order_release);
+}
+
 LogEntry* LogManager::get_entry(const int64_t index) {
+    LogEntry* entry = _logs_in_memory.get_entry(index);
+    if (entry) {
+        return entry;
+    }
     std::unique_lock<raft_mutex_t> lck(_mutex);
 
     // out of range, direct return NULL
-    if (index > _last_log_index || index < _first_log_index) {
+    if (index > _last_log_index.load(butil::memory_order_relaxed)
+            || index < _first_log_index.load(butil::memory_order_relaxed)) {
         return NULL;
     }
 
-    LogEntry* entry = get_entry_from_memory(index);
+    // The logs may have been appended after the lookup above
+    entry = _logs_in_memory.unsafe_get_entry(index);
     if (entry) {
         entry->AddRef();
         return entry;
@@ -808,6 +1369,39 @@ LogEntry* LogManager::get_entry(const int64_t index) {
     return entry;
 }
 
+int LogManager::get_entries(const int64_t first_index, const int64_t last_index,
+                            size_t max_bytes, std::vector<LogEntry*>* entries) {
+    const int nread = _logs_in_memory.get_entries(
+            first_index, last_index, max_bytes, entries);
+    if (nread > 0) {
+        return nread;
+    }
+    std::unique_lock<raft_mutex_t> lck(_mutex);
+
+    // out of range, direct return
+    const int64_t last_log_index = _last_log_index.load(butil::memory_order_relaxed);
+    if (first_index > last_log_index
+            || first_index < _first_log_index.load(butil::memory_order_relaxed)) {
+        return 0;
+    }
+    const int64_t last = std::min(last_index, last_log_index);
+    const int64_t first_in_memory = _logs_in_memory.empty()
+            ? last_log_index + 1 : _logs_in_memory.first_index();
+    if (first_index >= first_in_memory) {
+        return _logs_in_memory.get_entries(first_index, last, max_bytes, entries);
+    }
+    lck.unlock();
+    // The logs before the memory window are all on disk, read them together
+    // and leave the ones in memory to the next call
+    const int n = _log_storage->get_entries(
+            first_index, std::min(last, first_in_memory - 1), max_bytes, entries);
+    g_read_entry_from_storage << n;
+    if (n <= 0) {
+        report_error(EIO, "Corrupted entry at index=%" PRId64, first_index);
+    }
+    return n;
+}
+
 void LogManager::get_configuration(const int64_t index, ConfigurationEntry* conf) {
     BAIDU_SCOPED_LOCK(_mutex);
     return _config_manager->get(index, conf);
@@ -830,22 +1424,34 @@ bool LogManager::check_and_set_configuration(ConfigurationEntry* current) {
 
 void LogManager::set_disk_id(const LogId& disk_id) {
     std::unique_lock<raft_mutex_t> lck(_mutex);  // Race with set_applied_id
-    if (disk_id < _disk_id) {
-        return;
+    // The logs written after a truncate_suffix may be of lower terms
+    _written_index = std::max(_written_index,
+                              std::min(disk_id.index, _written_index_cap));
+    if (disk_id >= _disk_id) {
+        _disk_id = disk_id;
+        if (_unsynced_closures.empty()) {
+            _durable_id = disk_id;
+        }
     }
-    _disk_id = disk_id;
-    LogId clear_id = std::min(_disk_id, _applied_id);
+    LogId clear_id = unsafe_memory_logs_clear_id();
     lck.unlock();
     return clear_memory_logs(clear_id);
 }
 
+void LogManager::finish_truncation() {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (--_pending_truncations == 0) {
+        _written_index_cap = INT64_MAX;
+    }
+}
+
 void LogManager::set_applied_id(const LogId& applied_id) {
     std::unique_lock<raft_mutex_t> lck(_mutex);  // Race with set_disk_id
     if (applied_id < _applied_id) {
         return;
     }
     _applied_id = applied_id;
-    LogId clear_id = std::min(_disk_id, _applied_id);
+    LogId clear_id = unsafe_memory_logs_clear_id();
     lck.unlock();
     return clear_memory_logs(clear_id);
 }
@@ -863,6 +1469,15 @@ void* LogManager::run_on_new_log(void *arg) {
     return NULL;
 }
 
+void* LogManager::run_on_new_logs(void* arg) {
+    std::vector<WaitMeta*>* batch = (std::vector<WaitMeta*>*)arg;
+    for (size_t i = 0; i < batch->size(); ++i) {
+        run_on_new_log((*batch)[i]);
+    }
+    delete batch;
+    return NULL;
+}
+
 LogManager::WaitId LogManager::wait(
         int64_t expected_last_log_index, 
         int (*on_new_log)(void *arg, int error_code), void *arg) {
@@ -881,7 +1496,8 @@ LogManager::WaitId LogManager::wait(
 LogManager::WaitId LogManager::notify_on_new_log(
         int64_t expected_last_log_index, WaitMeta* wm) {
     std::unique_lock<raft_mutex_t> lck(_mutex);
-    if (expected_last_log_index != _last_log_index || _stopped) {
+    if (expected_last_log_index != _last_log_index.load(butil::memory_order_relaxed)
+            || _stopped) {
         wm->error_code = _stopped ? ESTOP : 0;
         lck.unlock();
         bthread_t tid;
@@ -928,6 +1544,18 @@ void LogManager::wakeup_all_waiter(std::unique_lock<raft_mutex_t>& lck) {
     _wait_map.clear();
     const int error_code = _stopped ? ESTOP : 0;
     lck.unlock();
+    if (FLAGS_raft_notify_waiters_in_batch && nwm > 1) {
+        std::vector<WaitMeta*>* batch = new std::vector<WaitMeta*>(wm, wm + nwm);
+        for (size_t i = 0; i < nwm; ++i) {
+            wm[i]->error_code = error_code;
+        }
+        bthread_t tid;
+        if (bthread_start_background(&tid, NULL, run_on_new_logs, batch) != 0) {
+            PLOG(ERROR) << "Fail to start bthread";
+            run_on_new_logs(batch);
+        }
+        return;
+    }
     for (size_t i = 0; i < nwm; ++i) {
         wm[i]->error_code = error_code;
         bthread_t tid;
@@ -948,8 +1576,13 @@ void LogManager::describe(std::ostream& os, bool use_html) {
     int64_t last_index = _log_storage->last_log_index();
     os << "storage: [" << first_index << ", " << last_index << ']' << newline;
     os << "disk_index: " << _disk_id.index << newline;
+    os << "durable_index: " << _durable_id.index << newline;
     os << "known_applied_index: " << _applied_id.index << newline;
     os << "last_log_id: " << last_log_id() << newline;
+    os << "memory_log_bytes: "
+       << _memory_log_bytes.load(butil::memory_order_relaxed) << newline;
+    os << "memory_log_rejected: "
+       << _memory_log_rejected.load(butil::memory_order_relaxed) << newline;
 }
 
 void LogManager::get_status(LogManagerStatus* status) {
@@ -960,6 +1593,7 @@ void LogManager::get_status(LogManagerStatus* status) {
     status->first_index = _log_storage->first_log_index();
     status->last_index = _log_storage->last_log_index();
     status->disk_index = _disk_id.index;
+    status->durable_index = _durable_id.index;
     status->known_applied_index = _applied_id.index;
 }
 
@@ -976,22 +1610,24 @@ void LogManager::report_error(int error_code, const char* fmt, ...) {
 
 butil::Status LogManager::check_consistency() {
     BAIDU_SCOPED_LOCK(_mutex);
-    CHECK_GT(_first_log_index, 0);
-    CHECK_GE(_last_log_index, 0);
+    const int64_t first_log_index = _first_log_index.load(butil::memory_order_relaxed);
+    const int64_t last_log_index = _last_log_index.load(butil::memory_order_relaxed);
+    CHECK_GT(first_log_index, 0);
+    CHECK_GE(last_log_index, 0);
     if (_last_snapshot_id == LogId(0, 0)) {
-        if (_first_log_index == 1) {
+        if (first_log_index == 1) {
             return butil::Status::OK();
         }
-        return butil::Status(EIO, "Missing logs in (0, %" PRId64 ")", _first_log_index);
+        return butil::Status(EIO, "Missing logs in (0, %" PRId64 ")", first_log_index);
     } else {
-        if (_last_snapshot_id.index >= _first_log_index - 1
-                && _last_snapshot_id.index <= _last_log_index) {
+        if (_last_snapshot_id.index >= first_log_index - 1
+                && _last_snapshot_id.index <= last_log_index) {
             return butil::Status::OK();
         }
         return butil::Status(EIO, "There's a gap between snapshot={%" PRId64 ", %" PRId64 "}"
                                  " and log=[%" PRId64 ", %" PRId64 "] ",
                             _last_snapshot_id.index, _last_snapshot_id.term,
-                            _first_log_index, _last_log_index);
+                            first_log_index, last_log_index);
     }
     CHECK(false) << "Can't reach here";
     return butil::Status(-1, "Impossible condition");
@@ -20,12 +20,14 @@
 
 #include <butil/macros.h>                        // BAIDU_CACHELINE_ALIGNMENT
 #include <butil/containers/flat_map.h>           // butil::FlatMap
-#include <deque>                                // std::deque
+#include <butil/containers/doubly_buffered_data.h>  // butil::DoublyBufferedData
 #include <bthread/execution_queue.h>            // bthread::ExecutionQueueId
+#include <bthread/condition_variable.h>         // bthread::ConditionVariable
 
 #include "braft/raft.h"                          // Closure
 #include "braft/util.h"                          // raft_mutex_t
 #include "braft/log_entry.h"                     // LogEntry
+#include "braft/log_entry_ring.h"                // LogEntryRing
 #include "braft/configuration_manager.h"         // ConfigurationManager
 #include "braft/storage.h"                       // Storage
 
@@ -33,6 +35,7 @@ namespace braft {
 
 class LogStorage;
 class FSMCaller;
+class AppendBatcher;
 
 struct LogManagerOptions {
     LogManagerOptions();
@@ -43,11 +46,15 @@ struct LogManagerOptions {
 
 struct LogManagerStatus {
     LogManagerStatus()
-        : first_index(1), last_index(0), disk_index(0), known_applied_index(0)
+        : first_index(1), last_index(0), disk_index(0), durable_index(0)
+        , known_applied_index(0)
     {}
     int64_t first_index;
     int64_t last_index;
     int64_t disk_index;
+    // the logs after disk_index are written but not synced yet, see
+    // RAFT_SYNC_BY_TIME
+    int64_t durable_index;
     int64_t known_applied_index;
 };
 
@@ -68,6 +75,9 @@ public:
     friend class LogManager;
     friend class AppendBatcher;
         std::vector<LogEntry*> _entries;
+        // The entries dropped from memory before this task, released by
+        // the disk thread after the former tasks which may write them
+        std::vector<LogEntry*> _dropped_entries;
     };
 
     LogManager();
@@ -94,6 +104,15 @@ public:
     //  success return ptr, fail return null
     LogEntry* get_entry(const int64_t index);
 
+    // Get the logs in [first_index, last_index] until the data size exceeds
+    // |max_bytes|, the logs are appended to |entries| with a reference which
+    // should be released by the caller
+    // Returns:
+    //  the number of logs got, which may be less than requested, 0 if the
+    //  log at |first_index| doesn't exist
+    int get_entries(const int64_t first_index, const int64_t last_index,
+                    size_t max_bytes, std::vector<LogEntry*>* entries);
+
     // Get the log term at |index|
     // Returns:
     //  success return term > 0, fail return 0
@@ -135,6 +154,12 @@ public:
     // can be droped from memory logs
     void set_applied_id(const LogId& applied_id);
 
+    // Wait at most |timeout_ms| until the logs in memory fit in
+    // raft_max_memory_log_bytes and raft_max_total_memory_log_bytes
+    // Returns:
+    //  0 if they fit, EBUSY otherwise
+    int wait_for_memory_budget(int64_t timeout_ms);
+
     // Check the consistency between log and snapshot, which must satisfy ANY
     // one of the following condition
     //   - Log starts from 1. OR
@@ -161,6 +186,13 @@ friend class AppendBatcher;
 
     static int disk_thread(void* meta,
                            bthread::TaskIterator<StableClosure*>& iter);
+    // The encode stage before disk_thread, see raft_log_encode_stage
+    static int encode_thread(void* meta,
+                             bthread::TaskIterator<StableClosure*>& iter);
+    // Pass |done| to the disk thread, through the encode stage if enabled
+    int enqueue(StableClosure* done);
+    // Called by the disk thread for each appending task from the encode stage
+    void take_encoded_task();
     
     // delete logs from storage's head, [1, first_index_kept) will be discarded
     // Returns:
@@ -174,8 +206,20 @@ friend class AppendBatcher;
     // Must be called in the disk thread, otherwise the
     // behavior is undefined
     void set_disk_id(const LogId& disk_id);
-
-    LogEntry* get_entry_from_memory(const int64_t index);
+    // Called in the disk thread once a truncate_suffix or reset is done on
+    // _log_storage
+    void finish_truncation();
+
+    // RAFT_SYNC_BY_TIME, called in the disk thread.
+    // Hold |done| until the fsync covering its logs
+    void wait_for_sync(StableClosure* done);
+    // Sync the logs written up to |last_id| and run the held closures
+    void sync_written_logs(const LogId& last_id);
+    // Sync now if the oldest held closure has waited long enough, otherwise
+    // wake up the disk thread when it has
+    void schedule_sync(const LogId& last_id);
+    // Wake up the disk thread to write the lingering batch after |linger_us|
+    int schedule_flush(int64_t linger_us);
 
     WaitId notify_on_new_log(int64_t expected_last_log_index, WaitMeta* wm);
 
@@ -184,17 +228,53 @@ friend class AppendBatcher;
 
     void unsafe_truncate_suffix(const int64_t last_index_kept);
 
-    // Clear the logs in memory whose id <= the given |id|
+    // Clear the logs in memory whose id <= the given |id| and which are
+    // written, see _written_index
     void clear_memory_logs(const LogId& id);
+    // The logs in memory may be cleared once they are on disk and applied,
+    // or only on disk if they exceed the budget
+    LogId unsafe_memory_logs_clear_id() const;
+    bool memory_logs_full() const;
+    // Release the entries popped from _logs_in_memory and return their bytes
+    // to the budget
+    void release_memory_logs(const std::vector<LogEntry*>& entries);
+    void return_memory_log_bytes(const std::vector<LogEntry*>& entries);
 
     int64_t unsafe_get_term(const int64_t index);
 
+    // The first index of each term in the log, in ascending order, so that
+    // the term of any log is found by a binary search over a few elements
+    struct TermStart {
+        TermStart(int64_t index_, int64_t term_) : index(index_), term(term_) {}
+        int64_t index;
+        int64_t term;
+    };
+    typedef std::vector<TermStart> TermStarts;
+
+    // Returns the term of |index| in |starts|, 0 if it's before all of them
+    static int64_t find_term(const TermStarts& starts, const int64_t index);
+    static size_t assign_term_starts(TermStarts& bg, const TermStarts& starts);
+    // Find the terms starting in (first, last] of _log_storage by bisection
+    void load_term_starts(int64_t first, int64_t first_term,
+                          int64_t last, int64_t last_term);
+    // Record the terms started by entries[from, end), must be called before
+    // _last_log_index covers them
+    void unsafe_append_term_starts(const std::vector<LogEntry*>& entries,
+                                   size_t from);
+    void unsafe_publish_term_starts();
+    // Around the modifications which may remove logs or change their terms,
+    // see get_term
+    void begin_rewrite_logs();
+    void end_rewrite_logs();
+
     // Start a independent thread to append log to LogStorage
     int start_disk_thread();
     int stop_disk_thread();
 
     void wakeup_all_waiter(std::unique_lock<raft_mutex_t>& lck);
     static void *run_on_new_log(void* arg);
+    // Run the WaitMetas in a std::vector, see raft_notify_waiters_in_batch
+    static void* run_on_new_logs(void* arg);
 
     void report_error(int error_code, const char* fmt, ...);
 
@@ -211,11 +291,31 @@ friend class AppendBatcher;
     WaitId _next_wait_id;
 
     LogId _disk_id;
+    LogId _durable_id;
     LogId _applied_id;
-    // TODO(chenzhangyi01): replace deque with a thread-safe data structure
-    std::deque<LogEntry* /*FIXME*/> _logs_in_memory;
-    int64_t _first_log_index;
-    int64_t _last_log_index;
+    // The logs up to _written_index are in _log_storage, only those may be
+    // cleared from memory. Unlike _disk_id it goes back on truncate_suffix and
+    // reset, and stays below _written_index_cap until the disk thread has
+    // done all the _pending_truncations, as the logs it wrote before them
+    // may be replaced by the ones not written yet.
+    int64_t _written_index;
+    int64_t _written_index_cap;
+    int _pending_truncations;
+    // The logs not yet both on disk and applied. Modified with _mutex held,
+    // while get_entry, get_term and get_entries read it without the lock.
+    LogEntryRing _logs_in_memory;
+    // The data bytes of _logs_in_memory, and the appends rejected for it
+    butil::atomic<int64_t> _memory_log_bytes;
+    butil::atomic<int64_t> _memory_log_rejected;
+    // Modified with _mutex held, readable without it
+    butil::atomic<int64_t> _first_log_index;
+    butil::atomic<int64_t> _last_log_index;
+    // Modified with _mutex held and published to _published_term_starts
+    // for get_term which doesn't lock
+    TermStarts _term_starts;
+    butil::DoublyBufferedData<TermStarts> _published_term_starts;
+    // Odd while the logs are being rewritten, see begin_rewrite_logs()
+    butil::atomic<int64_t> _rewrite_seq;
     // the last snapshot's log_id
     LogId _last_snapshot_id;
     // the virtual first log, for finding next_index of replicator, which 
@@ -226,6 +326,27 @@ friend class AppendBatcher;
     LogId _virtual_first_log_id;
 
     bthread::ExecutionQueueId<StableClosure*> _disk_queue;
+    // Serializes the appended entries ahead of _disk_queue so that the
+    // encoding overlaps the I/O of the former logs, see raft_log_encode_stage
+    bool _encode_stage;
+    bthread::ExecutionQueueId<StableClosure*> _encode_queue;
+    // The appending tasks passed to _disk_queue by the encode stage and not
+    // yet taken, bounded by raft_disk_queue_max_batches
+    butil::atomic<int> _disk_queue_depth;
+    raft_mutex_t _disk_queue_mutex;
+    bthread::ConditionVariable _disk_queue_cond;
+
+    // The closures of the logs written but not synced, only accessed by the
+    // disk thread, see RAFT_SYNC_BY_TIME
+    std::vector<StableClosure*> _unsynced_closures;
+    int64_t _first_unsynced_us;
+    bool _sync_timer_armed;
+    bthread_timer_t _sync_timer;
+    // Created and destroyed by the disk thread, the appending closures not
+    // yet written are kept in it between the runs
+    AppendBatcher* _append_batcher;
+    bool _linger_timer_armed;
+    bthread_timer_t _linger_timer;
 };
 
 }  //  namespace braft
@@ -18,40 +18,35 @@
 #define BRAFT_MEMORY_LOG_H
 
 #include <vector>
-#include <deque>
-#include <butil/atomicops.h>
 #include <butil/iobuf.h>
 #include <butil/logging.h>
 #include "braft/log_entry.h"
+#include "braft/log_entry_ring.h"
 #include "braft/storage.h"
 #include "braft/util.h"
 
 namespace braft {
 
-class BAIDU_CACHELINE_ALIGNMENT MemoryLogStorage : public LogStorage {
+// Keeps the logs in a LogEntryRing. The writer (the disk thread of
+// LogManager) appends and truncates with a mutex held while the readers
+// never lock.
+class MemoryLogStorage : public LogStorage {
 public:
-    typedef std::deque<LogEntry*> MemoryData;
+    MemoryLogStorage(const std::string& path);
+    MemoryLogStorage();
 
-    MemoryLogStorage(const std::string& path)
-            : _path(path),
-            _first_log_index(1),
-            _last_log_index(0) {}
-    MemoryLogStorage()
-            : _first_log_index(1),
-            _last_log_index(0) {}
-
-    virtual ~MemoryLogStorage() { reset(1); }
+    virtual ~MemoryLogStorage();
 
     virtual int init(ConfigurationManager* configuration_manager);
 
     // first log index in log
     virtual int64_t first_log_index() {
-        return _first_log_index.load(butil::memory_order_acquire);
+        return _ring.first_index();
     }
 
     // last log index in log
     virtual int64_t last_log_index() {
-        return _last_log_index.load(butil::memory_order_acquire);
+        return _ring.last_index();
     }
 
     // get logentry by index
@@ -89,9 +84,8 @@ public:
 
 private:
     std::string _path;
-    butil::atomic<int64_t> _first_log_index;
-    butil::atomic<int64_t> _last_log_index;
-    MemoryData _log_entry_data;
+    LogEntryRing _ring;
+    // serializes the writers
     raft_mutex_t _mutex;
 };
 
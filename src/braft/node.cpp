@@ -667,6 +667,13 @@ DEFINE_int32(raft_apply_batch, 32, "Max number of tasks that can be applied "
                                    " in a single batch");
 BRPC_VALIDATE_GFLAG(raft_apply_batch, ::brpc::PositiveInteger);
 
+DEFINE_int32(raft_apply_wait_memory_budget_ms, 0,
+             "How long Node::apply blocks the caller while the logs in memory "
+             "exceed raft_max_memory_log_bytes or "
+             "raft_max_total_memory_log_bytes, before failing the task with "
+             "EBUSY. 0 to fail at once");
+BRPC_VALIDATE_GFLAG(raft_apply_wait_memory_budget_ms, ::brpc::NonNegativeInteger);
+
 int NodeImpl::execute_applying_tasks(
         void* meta, bthread::TaskIterator<LogEntryAndClosure>& iter) {
     if (iter.is_queue_stopped()) {
@@ -692,6 +699,14 @@ int NodeImpl::execute_applying_tasks(
 }
 
 void NodeImpl::apply(const Task& task) {
+    if (_log_manager->wait_for_memory_budget(
+                FLAGS_raft_apply_wait_memory_budget_ms) != 0) {
+        if (task.done) {
+            task.done->status().set_error(EBUSY, "Too many logs in memory");
+            run_closure_in_bthread(task.done);
+        }
+        return;
+    }
     LogEntry* entry = new LogEntry;
     entry->AddRef();
     entry->data.swap(*task.data);
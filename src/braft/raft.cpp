@@ -25,6 +25,7 @@
 #include "braft/node_manager.h"
 #include "braft/log.h"
 #include "braft/memory_log.h"
+#include "braft/shared_wal.h"
 #include "braft/raft_meta.h"
 #include "braft/snapshot.h"
 #include "braft/fsm_caller.h"            // IteratorImpl
@@ -48,6 +49,8 @@ static pthread_once_t global_init_once = PTHREAD_ONCE_INIT;
 struct GlobalExtension {
     SegmentLogStorage local_log;
     MemoryLogStorage memory_log;
+    // logs of many raft instances in a single WAL
+    SharedWalLogStorage shared_wal_log;
     
     // manage only one raft instance
     FileBasedSingleMetaStorage single_meta;
@@ -64,6 +67,8 @@ static void global_init_or_die_impl() {
 
     log_storage_extension()->RegisterOrDie("local", &s_ext.local_log);
     log_storage_extension()->RegisterOrDie("memory", &s_ext.memory_log);
+    // uri = shared-wal://{wal_path}&&group={group}
+    log_storage_extension()->RegisterOrDie("shared-wal", &s_ext.shared_wal_log);
   
     // uri = local://{single_path}
     // |single_path| usually ends with `/meta'
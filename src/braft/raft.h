@@ -679,6 +679,9 @@ public:
     //              will pass the ownership to StateMachine::on_apply.
     //              Otherwise we will specify the error and call it.
     //
+    // While the logs in memory exceed raft_max_memory_log_bytes or
+    // raft_max_total_memory_log_bytes, it blocks for at most
+    // raft_apply_wait_memory_budget_ms and then fails |task.done| with EBUSY.
     void apply(const Task& task);
 
     // list peers of this raft group, only leader retruns ok
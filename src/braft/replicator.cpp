@@ -606,15 +606,10 @@ void Replicator::_send_empty_entries(bool is_heartbeat) {
     CHECK_EQ(0, bthread_id_unlock(_id)) << "Fail to unlock " << _id;
 }
 
-int Replicator::_prepare_entry(int offset, EntryMeta* em, butil::IOBuf *data) {
-    if (data->length() >= (size_t)FLAGS_raft_max_body_size) {
-        return ERANGE;
-    }
+int Replicator::_prepare_entry(int offset, LogEntry* entry, EntryMeta* em,
+                               butil::IOBuf *data) {
     const int64_t log_index = _next_index + offset;
-    LogEntry *entry = _options.log_manager->get_entry(log_index);
-    if (entry == NULL) {
-        return ENOENT;
-    }
+    DCHECK_EQ(log_index, entry->id.index);
     // When leader become readonly, no new user logs can submit. On the other side,
     // if any user log are accepted after this replicator become readonly, the leader
     // still have enough followers to commit logs, we can safely stop waiting new logs
@@ -644,7 +639,6 @@ int Replicator::_prepare_entry(int offset, EntryMeta* em, butil::IOBuf *data) {
         em->set_data_len(entry->data.length());
         data->append(entry->data);
     }
-    entry->Release();
     return 0;
 }
 
@@ -671,13 +665,40 @@ void Replicator::_send_entries() {
     const int max_entries_size = FLAGS_raft_max_entries_size - _flying_append_entries_size;
     int prepare_entry_rc = 0;
     CHECK_GT(max_entries_size, 0);
+    // Entries are fetched from LogManager in ranges bounded by the remaining
+    // body size, so that the ones not in memory are read from disk with a
+    // few large reads instead of one read per entry.
+    std::vector<LogEntry*> entries;
+    size_t pos = 0;
+    butil::IOBuf& attachment = cntl->request_attachment();
     for (int i = 0; i < max_entries_size; ++i) {
-        prepare_entry_rc = _prepare_entry(i, &em, &cntl->request_attachment());
+        if (attachment.length() >= (size_t)FLAGS_raft_max_body_size) {
+            prepare_entry_rc = ERANGE;
+            break;
+        }
+        if (pos == entries.size()) {
+            for (size_t j = 0; j < entries.size(); ++j) {
+                entries[j]->Release();
+            }
+            entries.clear();
+            pos = 0;
+            const int n = _options.log_manager->get_entries(
+                    _next_index + i, _next_index + max_entries_size - 1,
+                    FLAGS_raft_max_body_size - attachment.length(), &entries);
+            if (n <= 0) {
+                prepare_entry_rc = ENOENT;
+                break;
+            }
+        }
+        prepare_entry_rc = _prepare_entry(i, entries[pos++], &em, &attachment);
         if (prepare_entry_rc != 0) {
             break;
         }
         request->add_entries()->Swap(&em);
     }
+    for (size_t j = 0; j < entries.size(); ++j) {
+        entries[j]->Release();
+    }
     if (request->entries_size() == 0) {
         // _id is unlock in _wait_more
         if (_next_index < _options.log_manager->first_log_index()) {
@@ -150,7 +150,8 @@ private:
     Replicator();
     ~Replicator();
 
-    int _prepare_entry(int offset, EntryMeta* em, butil::IOBuf* data);
+    int _prepare_entry(int offset, LogEntry* entry, EntryMeta* em,
+                       butil::IOBuf* data);
     void _wait_more_entries();
     void _send_empty_entries(bool is_heartbeat);
     void _send_entries();
@@ -0,0 +1,1136 @@
+// Copyright (c) 2026 Baidu.com, Inc. All Rights Reserved
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
+
+#include "braft/shared_wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <gflags/gflags.h>
+#include <butil/files/dir_reader_posix.h>            // butil::DirReaderPosix
+#include <butil/file_util.h>                         // butil::CreateDirectory
+#include <butil/string_printf.h>                     // butil::string_appendf
+#include <butil/raw_pack.h>                          // butil::RawPacker
+#include <butil/fd_utility.h>                        // butil::make_close_on_exec
+#include <butil/time.h>
+#include <bvar/bvar.h>
+#include <brpc/reloadable_flags.h>
+#include "braft/local_storage.pb.h"
+#include "braft/protobuf_file.h"
+#include "braft/configuration_manager.h"
+#include "braft/fsync.h"
+
+#define BRAFT_SHARED_WAL_SEGMENT_PATTERN "wal_%010" PRIu32
+#define BRAFT_SHARED_WAL_META_FILE "wal_meta"
+
+namespace braft {
+
+DEFINE_int32(raft_shared_wal_segment_size, 64 * 1024 * 1024,
+             "Max size of a segment file of the shared WAL");
+BRPC_VALIDATE_GFLAG(raft_shared_wal_segment_size, brpc::PositiveInteger);
+
+static bvar::LatencyRecorder g_shared_wal_append_latency(
+        "raft_shared_wal_append");
+static bvar::LatencyRecorder g_shared_wal_sync_latency(
+        "raft_shared_wal_sync");
+static bvar::CounterRecorder g_shared_wal_append_batch(
+        "raft_shared_wal_append_batch");
+static bvar::Adder<int64_t> g_shared_wal_segment_count(
+        "raft_shared_wal_segment_count");
+
+// Format of a record in the segments of the shared WAL:
+// | group_id (64bits) | term (64bits) | index (64bits) |
+// | type (8bits) | reserved (24bits) | data_len (32bits) |
+// | data_checksum (32bits) | header_checksum (32bits) |
+// The checksums are crc32c, the header checksum covers the first 36 bytes.
+static const size_t WAL_RECORD_HEADER_SIZE = 40;
+// The logs of the group after |index| are discarded
+static const uint8_t WAL_RECORD_TOMBSTONE = 0xFF;
+
+struct WalRecordHeader {
+    uint64_t group_id;
+    int64_t term;
+    int64_t index;
+    uint8_t type;
+    uint32_t data_len;
+    uint32_t data_checksum;
+};
+
+static void pack_record(uint64_t group_id, int64_t term, int64_t index,
+                        uint8_t type, const butil::IOBuf& data,
+                        butil::IOBuf* buf) {
+    char header_buf[WAL_RECORD_HEADER_SIZE];
+    butil::RawPacker packer(header_buf);
+    packer.pack64(group_id)
+          .pack64(term)
+          .pack64(index)
+          .pack32((uint32_t)type << 24)
+          .pack32(data.size())
+          .pack32(crc32(data));
+    packer.pack32(crc32(header_buf, WAL_RECORD_HEADER_SIZE - 4));
+    buf->append(header_buf, WAL_RECORD_HEADER_SIZE);
+    buf->append(data);
+}
+
+static int unpack_record_header(const char* buf, WalRecordHeader* header) {
+    butil::RawUnpacker unpacker(buf);
+    uint64_t term = 0;
+    uint64_t index = 0;
+    uint32_t meta_field = 0;
+    uint32_t header_checksum = 0;
+    unpacker.unpack64(header->group_id)
+            .unpack64(term)
+            .unpack64(index)
+            .unpack32(meta_field)
+            .unpack32(header->data_len)
+            .unpack32(header->data_checksum)
+            .unpack32(header_checksum);
+    if (header_checksum != crc32(buf, WAL_RECORD_HEADER_SIZE - 4)) {
+        return -1;
+    }
+    header->term = term;
+    header->index = index;
+    header->type = meta_field >> 24;
+    return 0;
+}
+
+class SharedWalFile : public butil::RefCountedThreadSafe<SharedWalFile> {
+public:
+    SharedWalFile(const std::string& path, uint32_t id, int fd)
+        : _path(path), _id(id), _fd(fd) {}
+
+    uint32_t id() const { return _id; }
+    int fd() const { return _fd; }
+    const std::string& path() const { return _path; }
+
+private:
+friend class butil::RefCountedThreadSafe<SharedWalFile>;
+    ~SharedWalFile() {
+        if (_fd >= 0) {
+            ::close(_fd);
+        }
+    }
+
+    std::string _path;
+    uint32_t _id;
+    int _fd;
+};
+
+class SharedWal : public butil::RefCountedThreadSafe<SharedWal> {
+public:
+    explicit SharedWal(const std::string& path)
+        : _path(path)
+        , _open_size(0)
+        , _written(0)
+        , _synced(0)
+        , _next_group_id(1)
+    {}
+
+    // Load the meta and rebuild the index of all the groups
+    int open();
+
+    // Take the index of |group|, which is registered if it's new
+    int attach(const std::string& group, SharedWalGroupIndex* index);
+    // Give back the index of a group which is not used any more
+    void detach(SharedWalGroupIndex* index);
+    int remove_group(const std::string& group);
+    int set_first_index(const std::string& group, int64_t first_index);
+
+    // Append |records| which contain |nentries| log entries, returns the
+    // location of the first record and the sequence to be passed to sync()
+    int append(const butil::IOBuf& records, int64_t nentries,
+               uint32_t* segment_id, uint32_t* offset, int64_t* seq);
+    // Wait until all the records before |seq| are durable
+    int sync(int64_t seq);
+
+    int read(const SharedWalLocation& location, WalRecordHeader* header,
+             butil::IOBuf* data);
+
+    // Release the references to the segments and remove the ones which
+    // are not needed any more
+    void release(const std::map<uint32_t, int64_t>& refs);
+
+private:
+friend class butil::RefCountedThreadSafe<SharedWal>;
+    ~SharedWal() {
+        for (std::map<uint64_t, SharedWalGroupIndex*>::iterator
+                it = _detached.begin(); it != _detached.end(); ++it) {
+            delete it->second;
+        }
+    }
+
+    struct GroupMeta {
+        uint64_t id;
+        int64_t first_index;
+    };
+
+    int load_meta();
+    // Called with _meta_mutex held
+    int save_meta();
+    // A broken tail is only tolerated and cut off in the |last| segment,
+    // which was being appended when the previous process exited
+    int replay(const scoped_refptr<SharedWalFile>& file, bool last);
+    int apply(const WalRecordHeader& header, uint32_t segment_id,
+              uint32_t offset);
+    // Called with _mutex held
+    int open_segment(uint32_t id);
+
+    std::string _path;
+
+    raft_mutex_t _mutex;
+    std::map<uint32_t, scoped_refptr<SharedWalFile> > _files;
+    // number of the live entries in each segment
+    std::map<uint32_t, int64_t> _refs;
+    scoped_refptr<SharedWalFile> _open_file;
+    uint32_t _open_size;
+    // total bytes appended since the WAL was opened
+    int64_t _written;
+
+    raft_mutex_t _sync_mutex;
+    int64_t _synced;
+
+    raft_mutex_t _meta_mutex;
+    std::map<std::string, GroupMeta> _groups;
+    uint64_t _next_group_id;
+    // index of the groups not attached by any LogStorage, keyed by group id
+    std::map<uint64_t, SharedWalGroupIndex*> _detached;
+    std::set<uint64_t> _attached;
+};
+
+int SharedWal::open() {
+    butil::FilePath dir_path(_path);
+    butil::File::Error e;
+    if (!butil::CreateDirectoryAndGetError(
+                dir_path, &e, FLAGS_raft_create_parent_directories)) {
+        LOG(ERROR) << "Fail to create " << dir_path.value() << " : " << e;
+        return -1;
+    }
+    if (load_meta() != 0) {
+        return -1;
+    }
+    for (std::map<std::string, GroupMeta>::iterator
+            it = _groups.begin(); it != _groups.end(); ++it) {
+        SharedWalGroupIndex* index = new SharedWalGroupIndex;
+        index->id = it->second.id;
+        index->first_index = it->second.first_index;
+        _detached[index->id] = index;
+    }
+
+    butil::DirReaderPosix dir_reader(_path.c_str());
+    if (!dir_reader.IsValid()) {
+        LOG(ERROR) << "Fail to read directory " << _path;
+        return -1;
+    }
+    std::set<uint32_t> segment_ids;
+    while (dir_reader.Next()) {
+        uint32_t id = 0;
+        int match = sscanf(dir_reader.name(), BRAFT_SHARED_WAL_SEGMENT_PATTERN,
+                           &id);
+        if (match == 1) {
+            segment_ids.insert(id);
+        }
+    }
+    butil::Timer timer;
+    timer.start();
+    for (std::set<uint32_t>::iterator
+            it = segment_ids.begin(); it != segment_ids.end(); ++it) {
+        std::string path(_path);
+        butil::string_appendf(&path, "/" BRAFT_SHARED_WAL_SEGMENT_PATTERN, *it);
+        const int fd = ::open(path.c_str(), O_RDWR);
+        if (fd < 0) {
+            PLOG(ERROR) << "Fail to open " << path;
+            return -1;
+        }
+        butil::make_close_on_exec(fd);
+        scoped_refptr<SharedWalFile> file = new SharedWalFile(path, *it, fd);
+        if (replay(file, *it == *segment_ids.rbegin()) != 0) {
+            return -1;
+        }
+        _files[*it] = file;
+        g_shared_wal_segment_count << 1;
+    }
+    for (std::map<uint64_t, SharedWalGroupIndex*>::iterator
+            it = _detached.begin(); it != _detached.end(); ++it) {
+        const std::deque<SharedWalLocation>& locations = it->second->locations;
+        for (size_t i = 0; i < locations.size(); ++i) {
+            ++_refs[locations[i].segment_id];
+        }
+    }
+    timer.stop();
+    LOG(INFO) << "Replayed shared wal " << _path << " segments: "
+              << segment_ids.size() << " groups: " << _groups.size()
+              << " time: " << timer.u_elapsed();
+
+    {
+        // Never append to the segments left by the previous process, their
+        // tails might be broken
+        BAIDU_SCOPED_LOCK(_mutex);
+        const uint32_t next_id =
+                segment_ids.empty() ? 1 : *segment_ids.rbegin() + 1;
+        if (open_segment(next_id) != 0) {
+            return -1;
+        }
+    }
+    // Remove the segments whose entries were all discarded before restart
+    release(std::map<uint32_t, int64_t>());
+    return 0;
+}
+
+int SharedWal::replay(const scoped_refptr<SharedWalFile>& file, bool last) {
+    const size_t CHUNK_SIZE = 1024 * 1024;
+    butil::IOPortal buf;
+    off_t read_end = 0;
+    off_t offset = 0;
+    bool eof = false;
+    while (true) {
+        if (buf.size() < WAL_RECORD_HEADER_SIZE && !eof) {
+            const ssize_t n = file_pread(&buf, file->fd(), read_end, CHUNK_SIZE);
+            if (n < 0) {
+                return -1;
+            }
+            read_end += n;
+            eof = (n < (ssize_t)CHUNK_SIZE);
+            continue;
+        }
+        if (buf.size() < WAL_RECORD_HEADER_SIZE) {
+            break;
+        }
+        char header_buf[WAL_RECORD_HEADER_SIZE];
+        buf.copy_to(header_buf, WAL_RECORD_HEADER_SIZE);
+        WalRecordHeader header;
+        if (unpack_record_header(header_buf, &header) != 0) {
+            break;
+        }
+        const size_t record_size = WAL_RECORD_HEADER_SIZE + header.data_len;
+        while (buf.size() < record_size && !eof) {
+            const ssize_t n = file_pread(&buf, file->fd(), read_end,
+                                         std::max(CHUNK_SIZE, record_size));
+            if (n < 0) {
+                return -1;
+            }
+            read_end += n;
+            eof = ((size_t)n < std::max(CHUNK_SIZE, record_size));
+        }
+        if (buf.size() < record_size) {
+            break;
+        }
+        buf.pop_front(WAL_RECORD_HEADER_SIZE);
+        butil::IOBuf data;
+        buf.cutn(&data, header.data_len);
+        if (crc32(data) != header.data_checksum) {
+            break;
+        }
+        if (apply(header, file->id(), offset) != 0) {
+            LOG(ERROR) << "Invalid record of group_id=" << header.group_id
+                       << " index=" << header.index << " at offset " << offset
+                       << " of " << file->path();
+            return -1;
+        }
+        offset += record_size;
+    }
+    if (offset != read_end || !eof) {
+        if (!last) {
+            // The records after are acked, don't drop them silently
+            LOG(ERROR) << "Found corrupted record at offset " << offset
+                       << " of " << file->path() << " which is not the last"
+                       " segment";
+            return -1;
+        }
+        // Cut off the broken tail, so that the segment is intact once the
+        // following ones are created
+        LOG(WARNING) << "Truncate the broken tail of " << file->path()
+                     << " since offset " << offset;
+        int rc = 0;
+        do {
+            rc = ::ftruncate(file->fd(), offset);
+        } while (rc != 0 && errno == EINTR);
+        if (rc != 0 || raft_fsync(file->fd()) != 0) {
+            PLOG(ERROR) << "Fail to truncate " << file->path();
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int SharedWal::apply(const WalRecordHeader& header, uint32_t segment_id,
+                     uint32_t offset) {
+    std::map<uint64_t, SharedWalGroupIndex*>::iterator
+            it = _detached.find(header.group_id);
+    if (it == _detached.end()) {
+        // the group has been removed
+        return 0;
+    }
+    SharedWalGroupIndex* index = it->second;
+    const int64_t last_index = index->first_index + index->locations.size() - 1;
+    int64_t last_index_kept = last_index;
+    if (header.type == WAL_RECORD_TOMBSTONE) {
+        last_index_kept = header.index;
+    } else if (header.index < index->first_index) {
+        // discarded by truncate_prefix or reset
+        return 0;
+    } else if (header.index <= last_index) {
+        last_index_kept = header.index - 1;
+    } else if (header.index > last_index + 1) {
+        return -1;
+    }
+    if (last_index_kept < last_index) {
+        index->locations.resize(
+                std::max(last_index_kept - index->first_index + 1, (int64_t)0));
+        while (!index->conf_indexes.empty() &&
+                index->conf_indexes.back() > last_index_kept) {
+            index->conf_indexes.pop_back();
+        }
+    }
+    if (header.type == WAL_RECORD_TOMBSTONE) {
+        return 0;
+    }
+    SharedWalLocation location = { segment_id, offset, header.term };
+    index->locations.push_back(location);
+    if (header.type == ENTRY_TYPE_CONFIGURATION) {
+        index->conf_indexes.push_back(header.index);
+    }
+    return 0;
+}
+
+int SharedWal::open_segment(uint32_t id) {
+    std::string path(_path);
+    butil::string_appendf(&path, "/" BRAFT_SHARED_WAL_SEGMENT_PATTERN, id);
+    const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        PLOG(ERROR) << "Fail to create " << path;
+        return -1;
+    }
+    butil::make_close_on_exec(fd);
+    // Make the new file visible after restart
+    if (raft_sync_meta()) {
+        butil::FilePath dir(_path);
+        const int dir_fd = ::open(dir.value().c_str(), O_RDONLY);
+        if (dir_fd >= 0) {
+            raft_fsync(dir_fd);
+            ::close(dir_fd);
+        }
+    }
+    _open_file = new SharedWalFile(path, id, fd);
+    _files[id] = _open_file;
+    _open_size = 0;
+    g_shared_wal_segment_count << 1;
+    return 0;
+}
+
+int SharedWal::load_meta() {
+    std::string meta_path(_path);
+    meta_path.append("/" BRAFT_SHARED_WAL_META_FILE);
+    ProtoBufFile pb_file(meta_path);
+    SharedWalPBMeta meta;
+    if (0 != pb_file.load(&meta)) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        PLOG(ERROR) << "Fail to load meta from " << meta_path;
+        return -1;
+    }
+    _next_group_id = meta.next_group_id();
+    for (int i = 0; i < meta.groups_size(); ++i) {
+        const SharedWalPBMeta::Group& group = meta.groups(i);
+        GroupMeta& group_meta = _groups[group.name()];
+        group_meta.id = group.id();
+        group_meta.first_index = group.first_log_index();
+    }
+    return 0;
+}
+
+int SharedWal::save_meta() {
+    butil::Timer timer;
+    timer.start();
+    std::string meta_path(_path);
+    meta_path.append("/" BRAFT_SHARED_WAL_META_FILE);
+    SharedWalPBMeta meta;
+    meta.set_next_group_id(_next_group_id);
+    for (std::map<std::string, GroupMeta>::iterator
+            it = _groups.begin(); it != _groups.end(); ++it) {
+        SharedWalPBMeta::Group* group = meta.add_groups();
+        group->set_name(it->first);
+        group->set_id(it->second.id);
+        group->set_first_log_index(it->second.first_index);
+    }
+    ProtoBufFile pb_file(meta_path);
+    const int ret = pb_file.save(&meta, raft_sync_meta());
+    timer.stop();
+    PLOG_IF(ERROR, ret != 0) << "Fail to save meta to " << meta_path;
+    BRAFT_VLOG << "shared wal save_meta " << meta_path << " groups: "
+               << _groups.size() << " time: " << timer.u_elapsed();
+    return ret;
+}
+
+int SharedWal::attach(const std::string& group, SharedWalGroupIndex* index) {
+    BAIDU_SCOPED_LOCK(_meta_mutex);
+    std::map<std::string, GroupMeta>::iterator it = _groups.find(group);
+    if (it == _groups.end()) {
+        GroupMeta group_meta;
+        group_meta.id = _next_group_id++;
+        group_meta.first_index = 1;
+        _groups[group] = group_meta;
+        if (save_meta() != 0) {
+            _groups.erase(group);
+            return -1;
+        }
+        index->id = group_meta.id;
+        index->first_index = 1;
+        index->locations.clear();
+        index->conf_indexes.clear();
+        _attached.insert(index->id);
+        return 0;
+    }
+    const uint64_t id = it->second.id;
+    if (_attached.count(id)) {
+        LOG(ERROR) << "Group " << group << " of shared wal " << _path
+                   << " is in use";
+        return -1;
+    }
+    std::map<uint64_t, SharedWalGroupIndex*>::iterator
+            dit = _detached.find(id);
+    CHECK(dit != _detached.end());
+    SharedWalGroupIndex* detached = dit->second;
+    _detached.erase(dit);
+    index->id = detached->id;
+    index->first_index = detached->first_index;
+    index->locations.swap(detached->locations);
+    index->conf_indexes.swap(detached->conf_indexes);
+    delete detached;
+    _attached.insert(id);
+    return 0;
+}
+
+void SharedWal::detach(SharedWalGroupIndex* index) {
+    std::map<uint32_t, int64_t> refs;
+    {
+        BAIDU_SCOPED_LOCK(_meta_mutex);
+        _attached.erase(index->id);
+        bool exists = false;
+        for (std::map<std::string, GroupMeta>::iterator
+                it = _groups.begin(); it != _groups.end(); ++it) {
+            if (it->second.id == index->id) {
+                exists = true;
+                break;
+            }
+        }
+        if (exists) {
+            // The entries are still referenced until the group is removed
+            SharedWalGroupIndex* detached = new SharedWalGroupIndex;
+            detached->id = index->id;
+            detached->first_index = index->first_index;
+            detached->locations.swap(index->locations);
+            detached->conf_indexes.swap(index->conf_indexes);
+            _detached[detached->id] = detached;
+            return;
+        }
+    }
+    for (size_t i = 0; i < index->locations.size(); ++i) {
+        ++refs[index->locations[i].segment_id];
+    }
+    index->locations.clear();
+    index->conf_indexes.clear();
+    release(refs);
+}
+
+int SharedWal::remove_group(const std::string& group) {
+    std::map<uint32_t, int64_t> refs;
+    {
+        BAIDU_SCOPED_LOCK(_meta_mutex);
+        std::map<std::string, GroupMeta>::iterator it = _groups.find(group);
+        if (it == _groups.end()) {
+            return 0;
+        }
+        const uint64_t id = it->second.id;
+        if (_attached.count(id)) {
+            LOG(ERROR) << "Fail to remove group " << group << " of shared wal "
+                       << _path << " which is in use";
+            errno = EBUSY;
+            return -1;
+        }
+        const GroupMeta saved = it->second;
+        _groups.erase(it);
+        if (save_meta() != 0) {
+            _groups[group] = saved;
+            return -1;
+        }
+        std::map<uint64_t, SharedWalGroupIndex*>::iterator
+                dit = _detached.find(id);
+        if (dit != _detached.end()) {
+            const std::deque<SharedWalLocation>& locations =
+                    dit->second->locations;
+            for (size_t i = 0; i < locations.size(); ++i) {
+                ++refs[locations[i].segment_id];
+            }
+            delete dit->second;
+            _detached.erase(dit);
+        }
+    }
+    release(refs);
+    return 0;
+}
+
+int SharedWal::set_first_index(const std::string& group, int64_t first_index) {
+    BAIDU_SCOPED_LOCK(_meta_mutex);
+    std::map<std::string, GroupMeta>::iterator it = _groups.find(group);
+    if (it == _groups.end()) {
+        LOG(ERROR) << "Unknown group " << group << " of shared wal " << _path;
+        return -1;
+    }
+    const int64_t saved = it->second.first_index;
+    it->second.first_index = first_index;
+    if (save_meta() != 0) {
+        it->second.first_index = saved;
+        return -1;
+    }
+    return 0;
+}
+
+int SharedWal::append(const butil::IOBuf& records, int64_t nentries,
+                      uint32_t* segment_id, uint32_t* offset, int64_t* seq) {
+    const int64_t start_us = butil::cpuwide_time_us();
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (_open_size > 0 && _open_size + records.size() >
+            (size_t)FLAGS_raft_shared_wal_segment_size) {
+        // The records written to the closed segment are made durable here, as
+        // sync() only flushes the open one
+        if (FLAGS_raft_sync && raft_fsync(_open_file->fd()) != 0) {
+            PLOG(ERROR) << "Fail to sync " << _open_file->path();
+            return -1;
+        }
+        if (open_segment(_open_file->id() + 1) != 0) {
+            return -1;
+        }
+    }
+    const ssize_t written = file_pwrite(records, _open_file->fd(), _open_size);
+    if (written != (ssize_t)records.size()) {
+        // The partial record is overwritten by the next append
+        PLOG(ERROR) << "Fail to write to " << _open_file->path()
+                    << " offset " << _open_size;
+        return -1;
+    }
+    *segment_id = _open_file->id();
+    *offset = _open_size;
+    _open_size += written;
+    _written += written;
+    *seq = _written;
+    if (nentries > 0) {
+        _refs[*segment_id] += nentries;
+    }
+    g_shared_wal_append_latency << butil::cpuwide_time_us() - start_us;
+    g_shared_wal_append_batch << nentries;
+    return 0;
+}
+
+int SharedWal::sync(int64_t seq) {
+    if (!FLAGS_raft_sync) {
+        return 0;
+    }
+    // Group commit: the appenders waiting here are all covered by the
+    // following fsync once the ongoing one finishes
+    BAIDU_SCOPED_LOCK(_sync_mutex);
+    if (_synced >= seq) {
+        return 0;
+    }
+    const int64_t start_us = butil::cpuwide_time_us();
+    int64_t written = 0;
+    scoped_refptr<SharedWalFile> file;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        written = _written;
+        file = _open_file;
+    }
+    const int rc = raft_fsync(file->fd());
+    if (rc != 0) {
+        PLOG(ERROR) << "Fail to sync " << file->path();
+        return rc;
+    }
+    _synced = written;
+    g_shared_wal_sync_latency << butil::cpuwide_time_us() - start_us;
+    return 0;
+}
+
+int SharedWal::read(const SharedWalLocation& location, WalRecordHeader* header,
+                    butil::IOBuf* data) {
+    scoped_refptr<SharedWalFile> file;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::map<uint32_t, scoped_refptr<SharedWalFile> >::iterator
+                it = _files.find(location.segment_id);
+        if (it == _files.end()) {
+            return -1;
+        }
+        file = it->second;
+    }
+    butil::IOPortal buf;
+    if (file_pread(&buf, file->fd(), location.offset, WAL_RECORD_HEADER_SIZE)
+            != (ssize_t)WAL_RECORD_HEADER_SIZE) {
+        return -1;
+    }
+    char header_buf[WAL_RECORD_HEADER_SIZE];
+    buf.copy_to(header_buf, WAL_RECORD_HEADER_SIZE);
+    if (unpack_record_header(header_buf, header) != 0) {
+        LOG(ERROR) << "Found corrupted header at offset " << location.offset
+                   << " of " << file->path();
+        return -1;
+    }
+    butil::IOPortal body;
+    if (file_pread(&body, file->fd(), location.offset + WAL_RECORD_HEADER_SIZE,
+                   header->data_len) != (ssize_t)header->data_len) {
+        return -1;
+    }
+    if (crc32(body) != header->data_checksum) {
+        LOG(ERROR) << "Found corrupted data at offset "
+                   << location.offset + WAL_RECORD_HEADER_SIZE
+                   << " of " << file->path();
+        return -1;
+    }
+    data->swap(body);
+    return 0;
+}
+
+void SharedWal::release(const std::map<uint32_t, int64_t>& refs) {
+    std::vector<scoped_refptr<SharedWalFile> > removed;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        for (std::map<uint32_t, int64_t>::const_iterator
+                it = refs.begin(); it != refs.end(); ++it) {
+            std::map<uint32_t, int64_t>::iterator rit = _refs.find(it->first);
+            CHECK(rit != _refs.end() && rit->second >= it->second);
+            rit->second -= it->second;
+            if (rit->second == 0) {
+                _refs.erase(rit);
+            }
+        }
+        // Remove the segments from the oldest one, a tombstone must not be
+        // removed before the entries discarded by it
+        while (!_files.empty()) {
+            std::map<uint32_t, scoped_refptr<SharedWalFile> >::iterator
+                    it = _files.begin();
+            if (it->second == _open_file || _refs.count(it->first)) {
+                break;
+            }
+            removed.push_back(it->second);
+            _files.erase(it);
+        }
+    }
+    for (size_t i = 0; i < removed.size(); ++i) {
+        // readers holding the file can still read from it
+        ::unlink(removed[i]->path().c_str());
+        g_shared_wal_segment_count << -1;
+        BRAFT_VLOG << "Removed " << removed[i]->path();
+    }
+}
+
+// SharedWalManager
+//
+// The WALs opened by this process, keyed by the wal path
+class SharedWalManager {
+public:
+    static SharedWalManager* GetInstance() {
+        return Singleton<SharedWalManager>::get();
+    }
+
+    scoped_refptr<SharedWal> get(const std::string& path) {
+        BAIDU_SCOPED_LOCK(_mutex);
+        std::map<std::string, scoped_refptr<SharedWal> >::iterator
+                it = _wals.find(path);
+        if (it != _wals.end()) {
+            return it->second;
+        }
+        scoped_refptr<SharedWal> wal = new SharedWal(path);
+        if (wal->open() != 0) {
+            LOG(ERROR) << "Fail to open shared wal " << path;
+            return NULL;
+        }
+        _wals[path] = wal;
+        return wal;
+    }
+
+private:
+    SharedWalManager() {}
+    ~SharedWalManager() {}
+    DISALLOW_COPY_AND_ASSIGN(SharedWalManager);
+    friend struct DefaultSingletonTraits<SharedWalManager>;
+
+    raft_mutex_t _mutex;
+    std::map<std::string, scoped_refptr<SharedWal> > _wals;
+};
+
+SharedWalLogStorage::SharedWalLogStorage(const std::string& wal_path,
+                                         const std::string& group)
+    : _wal_path(wal_path)
+    , _group(group)
+    , _first_log_index(1)
+    , _last_log_index(0)
+{}
+
+SharedWalLogStorage::SharedWalLogStorage()
+    : _first_log_index(1)
+    , _last_log_index(0)
+{}
+
+SharedWalLogStorage::~SharedWalLogStorage() {
+    if (_wal) {
+        _wal->detach(&_index);
+    }
+}
+
+int SharedWalLogStorage::parse_uri(const std::string& uri,
+                                   std::string* wal_path, std::string* group) {
+    // {wal_path}&&group={group}
+    const size_t pos = uri.find("&&group=");
+    if (pos == std::string::npos) {
+        return -1;
+    }
+    wal_path->assign(uri, 0, pos);
+    group->assign(uri, pos + strlen("&&group="), std::string::npos);
+    if (wal_path->empty() || group->empty()) {
+        return -1;
+    }
+    return 0;
+}
+
+int SharedWalLogStorage::init(ConfigurationManager* configuration_manager) {
+    if (_wal_path.empty() || _group.empty()) {
+        LOG(ERROR) << "Invalid shared wal log storage, wal_path: " << _wal_path
+                   << " group: " << _group;
+        return -1;
+    }
+    scoped_refptr<SharedWal> wal = SharedWalManager::GetInstance()->get(_wal_path);
+    if (!wal) {
+        return -1;
+    }
+    if (wal->attach(_group, &_index) != 0) {
+        return -1;
+    }
+    _wal = wal;
+    _first_log_index.store(_index.first_index, butil::memory_order_release);
+    _last_log_index.store(_index.first_index + _index.locations.size() - 1,
+                          butil::memory_order_release);
+    // The configuration entries are kept in the index, so that they are
+    // loaded again when the group is attached by another LogStorage of this
+    // process
+    std::vector<int64_t>& conf_indexes = _index.conf_indexes;
+    conf_indexes.erase(conf_indexes.begin(),
+                       std::lower_bound(conf_indexes.begin(), conf_indexes.end(),
+                                        _index.first_index));
+    for (size_t i = 0; i < conf_indexes.size(); ++i) {
+        LogEntry* entry = get_entry(conf_indexes[i]);
+        if (entry == NULL || entry->type != ENTRY_TYPE_CONFIGURATION) {
+            LOG(ERROR) << "Fail to load configuration at index="
+                       << conf_indexes[i] << " of group " << _group
+                       << " in shared wal " << _wal_path;
+            if (entry) {
+                entry->Release();
+            }
+            return -1;
+        }
+        ConfigurationEntry conf_entry(*entry);
+        configuration_manager->add(conf_entry);
+        entry->Release();
+    }
+    LOG(INFO) << "Attached group " << _group << " to shared wal " << _wal_path
+              << " first_log_index: " << first_log_index()
+              << " last_log_index: " << last_log_index();
+    return 0;
+}
+
+LogEntry* SharedWalLogStorage::get_entry(const int64_t index) {
+    SharedWalLocation location;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        if (index < _index.first_index ||
+                index >= _index.first_index + (int64_t)_index.locations.size()) {
+            return NULL;
+        }
+        location = _index.locations[index - _index.first_index];
+    }
+    WalRecordHeader header;
+    butil::IOBuf data;
+    if (_wal->read(location, &header, &data) != 0) {
+        return NULL;
+    }
+    if (header.group_id != _index.id || header.index != index ||
+            header.term != location.term) {
+        LOG(ERROR) << "Found mismatched record of group_id=" << header.group_id
+                   << " index=" << header.index << " term=" << header.term
+                   << " while reading index=" << index << " of group "
+                   << _group << " in shared wal " << _wal_path;
+        return NULL;
+    }
+    LogEntry* entry = new LogEntry();
+    entry->AddRef();
+    entry->id.index = index;
+    entry->id.term = header.term;
+    entry->type = (EntryType)header.type;
+    switch (header.type) {
+    case ENTRY_TYPE_DATA:
+        entry->data.swap(data);
+        break;
+    case ENTRY_TYPE_NO_OP:
+        CHECK(data.empty()) << "Data of NO_OP must be empty";
+        break;
+    case ENTRY_TYPE_CONFIGURATION:
+        {
+            butil::Status status = parse_configuration_meta(data, entry);
+            if (!status.ok()) {
+                LOG(WARNING) << "Fail to parse ConfigurationPBMeta at index="
+                             << index << " of group " << _group;
+                entry->Release();
+                return NULL;
+            }
+        }
+        break;
+    default:
+        LOG(ERROR) << "Unknown entry type=" << (int)header.type << " at index="
+                   << index << " of group " << _group;
+        entry->Release();
+        return NULL;
+    }
+    return entry;
+}
+
+int64_t SharedWalLogStorage::get_term(const int64_t index) {
+    BAIDU_SCOPED_LOCK(_mutex);
+    if (index < _index.first_index ||
+            index >= _index.first_index + (int64_t)_index.locations.size()) {
+        return 0;
+    }
+    return _index.locations[index - _index.first_index].term;
+}
+
+int SharedWalLogStorage::append_entry(const LogEntry* entry) {
+    std::vector<LogEntry*> entries(1, const_cast<LogEntry*>(entry));
+    return append_entries(entries, NULL) == 1 ? 0 : -1;
+}
+
+int SharedWalLogStorage::append_entries(const std::vector<LogEntry*>& entries,
+                                        IOMetric* metric) {
+    if (entries.empty()) {
+        return 0;
+    }
+    if (_last_log_index.load(butil::memory_order_relaxed) + 1
+            != entries.front()->id.index) {
+        LOG(FATAL) << "There's gap between appending entries and _last_log_index"
+                   << " group: " << _group;
+        return -1;
+    }
+    int64_t now = butil::cpuwide_time_us();
+    butil::IOBuf records;
+    std::vector<uint32_t> offsets(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const LogEntry* entry = entries[i];
+        offsets[i] = records.size();
+        butil::IOBuf data;
+        switch (entry->type) {
+        case ENTRY_TYPE_DATA:
+            data.append(entry->data);
+            break;
+        case ENTRY_TYPE_NO_OP:
+            break;
+        case ENTRY_TYPE_CONFIGURATION:
+            {
+                butil::Status status = serialize_configuration_meta(entry, data);
+                if (!status.ok()) {
+                    LOG(ERROR) << "Fail to serialize ConfigurationPBMeta, group: "
+                               << _group;
+                    return -1;
+                }
+            }
+            break;
+        default:
+            LOG(FATAL) << "unknow entry type: " << entry->type
+                       << ", group: " << _group;
+            return -1;
+        }
+        pack_record(_index.id, entry->id.term, entry->id.index, entry->type,
+                    data, &records);
+    }
+    uint32_t segment_id = 0;
+    uint32_t base_offset = 0;
+    int64_t seq = 0;
+    if (_wal->append(records, entries.size(), &segment_id, &base_offset,
+                     &seq) != 0) {
+        return -1;
+    }
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            SharedWalLocation location = { segment_id, base_offset + offsets[i],
+                                           entries[i]->id.term };
+            _index.locations.push_back(location);
+            if (entries[i]->type == ENTRY_TYPE_CONFIGURATION) {
+                _index.conf_indexes.push_back(entries[i]->id.index);
+            }
+        }
+        _last_log_index.fetch_add(entries.size(), butil::memory_order_release);
+    }
+    if (metric) {
+        metric->append_entry_time_us += butil::cpuwide_time_us() - now;
+        now = butil::cpuwide_time_us();
+    }
+    if (_wal->sync(seq) != 0) {
+        return -1;
+    }
+    if (metric) {
+        metric->sync_segment_time_us += butil::cpuwide_time_us() - now;
+    }
+    return entries.size();
+}
+
+int SharedWalLogStorage::append_entries_in_batch(
+        const std::vector<LogEntry*>& entries, IOMetric* metric) {
+    // Entries are always written with a single write
+    return append_entries(entries, metric);
+}
+
+void SharedWalLogStorage::drop_locations(int64_t first_index,
+                                         int64_t last_index) {
+    std::map<uint32_t, int64_t> refs;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        while (!_index.locations.empty() && _index.first_index < first_index) {
+            ++refs[_index.locations.front().segment_id];
+            _index.locations.pop_front();
+            ++_index.first_index;
+        }
+        if (_index.locations.empty()) {
+            _index.first_index = std::max(_index.first_index, first_index);
+        }
+        while (!_index.locations.empty() && _index.first_index +
+                (int64_t)_index.locations.size() - 1 > last_index) {
+            ++refs[_index.locations.back().segment_id];
+            _index.locations.pop_back();
+        }
+        std::vector<int64_t>& conf_indexes = _index.conf_indexes;
+        conf_indexes.erase(conf_indexes.begin(),
+                           std::lower_bound(conf_indexes.begin(),
+                                            conf_indexes.end(),
+                                            _index.first_index));
+        while (!conf_indexes.empty() && conf_indexes.back() >
+                _index.first_index + (int64_t)_index.locations.size() - 1) {
+            conf_indexes.pop_back();
+        }
+        _first_log_index.store(_index.first_index, butil::memory_order_release);
+        _last_log_index.store(_index.first_index + _index.locations.size() - 1,
+                              butil::memory_order_release);
+    }
+    _wal->release(refs);
+}
+
+int SharedWalLogStorage::truncate_prefix(const int64_t first_index_kept) {
+    if (_first_log_index.load(butil::memory_order_acquire) >= first_index_kept) {
+        return 0;
+    }
+    // See the comments in SegmentLogStorage::truncate_prefix
+    if (_wal->set_first_index(_group, first_index_kept) != 0) {
+        LOG(ERROR) << "Fail to save first_log_index of group " << _group
+                   << " in shared wal " << _wal_path;
+        return -1;
+    }
+    drop_locations(first_index_kept, INT64_MAX);
+    return 0;
+}
+
+int SharedWalLogStorage::truncate_suffix(const int64_t last_index_kept) {
+    // The tombstone must be durable before the discarded logs are
+    // overwritten
+    butil::IOBuf record;
+    pack_record(_index.id, 0, last_index_kept, WAL_RECORD_TOMBSTONE,
+                butil::IOBuf(), &record);
+    uint32_t segment_id = 0;
+    uint32_t offset = 0;
+    int64_t seq = 0;
+    if (_wal->append(record, 0, &segment_id, &offset, &seq) != 0 ||
+            _wal->sync(seq) != 0) {
+        return -1;
+    }
+    drop_locations(0, last_index_kept);
+    return 0;
+}
+
+int SharedWalLogStorage::reset(const int64_t next_log_index) {
+    if (next_log_index <= 0) {
+        LOG(ERROR) << "Invalid next_log_index=" << next_log_index
+                   << " group: " << _group;
+        return EINVAL;
+    }
+    // Discard all the logs with a tombstone before moving the first index, so
+    // that the logs after |next_log_index| of the current term never come
+    // back after restart
+    if (truncate_suffix(std::min(next_log_index - 1,
+                        _last_log_index.load(butil::memory_order_acquire))) != 0) {
+        return -1;
+    }
+    if (_wal->set_first_index(_group, next_log_index) != 0) {
+        LOG(ERROR) << "Fail to save first_log_index of group " << _group
+                   << " in shared wal " << _wal_path;
+        return -1;
+    }
+    std::map<uint32_t, int64_t> refs;
+    {
+        BAIDU_SCOPED_LOCK(_mutex);
+        for (size_t i = 0; i < _index.locations.size(); ++i) {
+            ++refs[_index.locations[i].segment_id];
+        }
+        _index.locations.clear();
+        _index.conf_indexes.clear();
+        _index.first_index = next_log_index;
+        _first_log_index.store(next_log_index, butil::memory_order_release);
+        _last_log_index.store(next_log_index - 1, butil::memory_order_release);
+    }
+    _wal->release(refs);
+    return 0;
+}
+
+LogStorage* SharedWalLogStorage::new_instance(const std::string& uri) const {
+    std::string wal_path;
+    std::string group;
+    if (parse_uri(uri, &wal_path, &group) != 0) {
+        LOG(ERROR) << "Invalid shared wal uri " << uri;
+        return NULL;
+    }
+    return new SharedWalLogStorage(wal_path, group);
+}
+
+butil::Status SharedWalLogStorage::gc_instance(const std::string& uri) const {
+    butil::Status status;
+    std::string wal_path;
+    std::string group;
+    if (parse_uri(uri, &wal_path, &group) != 0) {
+        status.set_error(EINVAL, "Invalid shared wal uri %s", uri.c_str());
+        return status;
+    }
+    scoped_refptr<SharedWal> wal = SharedWalManager::GetInstance()->get(wal_path);
+    if (!wal || wal->remove_group(group) != 0) {
+        LOG(WARNING) << "Fail to gc group " << group << " from shared wal "
+                     << wal_path;
+        status.set_error(EINVAL, "Fail to gc group %s from shared wal %s",
+                         group.c_str(), wal_path.c_str());
+        return status;
+    }
+    LOG(INFO) << "Succeed to gc group " << group << " from shared wal " << wal_path;
+    return status;
+}
+
+}  //  namespace braft
@@ -0,0 +1,125 @@
+// Copyright (c) 2026 Baidu.com, Inc. All Rights Reserved
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
+
+#ifndef  BRAFT_SHARED_WAL_H
+#define  BRAFT_SHARED_WAL_H
+
+#include <deque>
+#include <vector>
+#include <butil/atomicops.h>
+#include <butil/memory/ref_counted.h>
+#include "braft/log_entry.h"
+#include "braft/storage.h"
+#include "braft/util.h"
+
+namespace braft {
+
+class SharedWal;
+
+// Location of a log entry in the shared WAL
+struct SharedWalLocation {
+    uint32_t segment_id;
+    uint32_t offset;
+    int64_t term;
+};
+
+// The logs of a raft group in the shared WAL
+struct SharedWalGroupIndex {
+    SharedWalGroupIndex() : id(0), first_index(1) {}
+    uint64_t id;
+    // index of locations[0]
+    int64_t first_index;
+    std::deque<SharedWalLocation> locations;
+    // indexes of the configuration entries within locations, in ascending
+    // order
+    std::vector<int64_t> conf_indexes;
+};
+
+// A LogStorage which appends the logs of many raft groups into one WAL shared
+// by all the groups using the same wal path, so that the device sees a single
+// sequential writer and a single stream of fsync.
+//
+// uri = shared-wal://{wal_path}&&group={group}
+//
+// Each group keeps the locations of its logs in memory, which are rebuilt by
+// scanning the WAL at startup. truncate_suffix and reset append a tombstone
+// record, while truncate_prefix and reset persist the first log index of the
+// group in the meta file of the WAL. A WAL segment file is removed once none
+// of the groups references any entry in it and all the segments before it
+// are removed.
+class SharedWalLogStorage : public LogStorage {
+public:
+    SharedWalLogStorage(const std::string& wal_path, const std::string& group);
+    SharedWalLogStorage();
+    virtual ~SharedWalLogStorage();
+
+    // init logstorage, check consistency and integrity
+    virtual int init(ConfigurationManager* configuration_manager);
+
+    // first log index in log
+    virtual int64_t first_log_index() {
+        return _first_log_index.load(butil::memory_order_acquire);
+    }
+
+    // last log index in log
+    virtual int64_t last_log_index() {
+        return _last_log_index.load(butil::memory_order_acquire);
+    }
+
+    // get logentry by index
+    virtual LogEntry* get_entry(const int64_t index);
+
+    // get logentry's term by index
+    virtual int64_t get_term(const int64_t index);
+
+    // append entry to log
+    virtual int append_entry(const LogEntry* entry);
+
+    // append entries to log and update IOMetric, return success append number
+    virtual int append_entries(const std::vector<LogEntry*>& entries, IOMetric* metric);
+    virtual int append_entries_in_batch(const std::vector<LogEntry*>& entries, IOMetric* metric);
+
+    // delete logs from storage's head, [1, first_index_kept) will be discarded
+    virtual int truncate_prefix(const int64_t first_index_kept);
+
+    // delete uncommitted logs from storage's tail, (last_index_kept, infinity) will be discarded
+    virtual int truncate_suffix(const int64_t last_index_kept);
+
+    virtual int reset(const int64_t next_log_index);
+
+    virtual LogStorage* new_instance(const std::string& uri) const;
+
+    virtual butil::Status gc_instance(const std::string& uri) const;
+
+    static int parse_uri(const std::string& uri, std::string* wal_path,
+                         std::string* group);
+
+private:
+    // Drop the locations of the logs out of [first_index, last_index]
+    void drop_locations(int64_t first_index, int64_t last_index);
+
+    std::string _wal_path;
+    std::string _group;
+    scoped_refptr<SharedWal> _wal;
+    butil::atomic<int64_t> _first_log_index;
+    butil::atomic<int64_t> _last_log_index;
+    raft_mutex_t _mutex;
+    SharedWalGroupIndex _index;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_SHARED_WAL_H
@@ -37,7 +37,11 @@ DEFINE_bool(raft_create_parent_directories, true,
             "Create parent directories of the path in local storage if true");
 DEFINE_int32(raft_sync_policy, 0,
              "raft sync policy when raft_sync set to true, 0 mean sync immediately, 1 mean sync by "
-             "writed bytes");
+             "writed bytes, 2 mean sync the logs written in raft_sync_interval_us at once");
+DEFINE_int32(raft_sync_interval_us, 1000,
+             "Max microseconds a log waits for the fsync covering it when"
+             " raft_sync_policy is 2");
+BRPC_VALIDATE_GFLAG(raft_sync_interval_us, ::brpc::NonNegativeInteger);
 DEFINE_bool(raft_sync_meta, false, "sync log meta, snapshot meta and raft meta");
 BRPC_VALIDATE_GFLAG(raft_sync_meta, ::brpc::PassValidate);
 
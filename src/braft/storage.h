@@ -40,8 +40,18 @@ DECLARE_bool(raft_sync);
 DECLARE_bool(raft_sync_meta);
 DECLARE_int32(raft_sync_per_bytes);
 DECLARE_int32(raft_sync_policy);
+DECLARE_int32(raft_sync_interval_us);
 DECLARE_bool(raft_create_parent_directories);
 
+enum RaftSyncPolicy {
+    RAFT_SYNC_IMMEDIATELY = 0,
+    RAFT_SYNC_BY_BYTES = 1,
+    // The log storage doesn't sync when appending, LogManager syncs the logs
+    // written in the last raft_sync_interval_us at once and reports them
+    // stable afterwards, see LogStorage::sync_appended
+    RAFT_SYNC_BY_TIME = 2,
+};
+
 struct LogEntry;
 
 struct IOMetric {
@@ -140,6 +150,26 @@ public:
     // get logentry's term by index
     virtual int64_t get_term(const int64_t index) = 0;
 
+    // get the logentries in [first_index, last_index], stop once the data of
+    // the got entries exceeds |max_bytes| (at least one entry is got). The
+    // entries are appended to |entries| with a reference held by the caller.
+    // Returns the number of entries got, which is 0 if the entry at
+    // |first_index| doesn't exist
+    virtual int get_entries(const int64_t first_index, const int64_t last_index,
+                            size_t max_bytes, std::vector<LogEntry*>* entries) {
+        size_t bytes = 0;
+        int64_t index = first_index;
+        for (; index <= last_index && bytes < max_bytes; ++index) {
+            LogEntry* entry = get_entry(index);
+            if (entry == NULL) {
+                break;
+            }
+            bytes += entry->data.length();
+            entries->push_back(entry);
+        }
+        return index - first_index;
+    }
+
     // append entries to log
     virtual int append_entry(const LogEntry* entry) = 0;
 
@@ -147,6 +177,17 @@ public:
     virtual int append_entries(const std::vector<LogEntry*>& entries, IOMetric* metric) = 0;
     virtual int append_entries_in_batch(const std::vector<LogEntry*>& entries, IOMetric* metric) = 0;
 
+    // Serialize |entries| ahead of appending them into LogEntry::encoded,
+    // so that appending only writes. Called by LogManager with
+    // raft_log_encode_stage concurrently with the appending of the former
+    // logs. Storages which don't implement it serialize when appending
+    virtual void encode_entries(const std::vector<LogEntry*>& entries) {}
+
+    // Make all the appended logs durable, called by LogManager with
+    // RAFT_SYNC_BY_TIME. Storages which always sync when appending don't
+    // have to implement it
+    virtual int sync_appended() { return 0; }
+
     // delete logs from storage's head, [first_log_index, first_index_kept) will be discarded
     virtual int truncate_prefix(const int64_t first_index_kept) = 0;
 
@@ -0,0 +1,154 @@
+// Copyright (c) 2026 Baidu.com, Inc. All Rights Reserved
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
+
+#include "braft/uring_writer.h"
+
+#include <errno.h>
+#include <limits.h>                              // IOV_MAX
+#include <algorithm>
+#include <butil/errno.h>                          // berror
+#include <butil/logging.h>
+#if BRAFT_WITH_IO_URING
+#include <liburing.h>
+#endif
+#include "braft/fsync.h"
+
+namespace braft {
+
+#if BRAFT_WITH_IO_URING
+// The lowest bit of user_data marks the linked fsync, the data pointers
+// passed to submit() are at least 2-byte aligned.
+static const uintptr_t URING_SYNC_TAG = 1;
+#endif
+
+UringWriter::UringWriter()
+    : _ring(NULL)
+    , _depth(0)
+    , _inflight(0)
+{}
+
+UringWriter::~UringWriter() {
+#if BRAFT_WITH_IO_URING
+    if (_ring) {
+        LOG_IF(ERROR, _inflight != 0) << "Destroying UringWriter with "
+                                      << _inflight << " requests in flight";
+        io_uring_queue_exit(_ring);
+        delete _ring;
+        _ring = NULL;
+    }
+#endif
+}
+
+int UringWriter::init(unsigned queue_depth) {
+#if BRAFT_WITH_IO_URING
+    CHECK(_ring == NULL);
+    _ring = new struct io_uring;
+    const int rc = io_uring_queue_init(queue_depth, _ring, 0);
+    if (rc < 0) {
+        LOG(WARNING) << "Fail to init io_uring with depth=" << queue_depth
+                     << ", " << berror(-rc);
+        delete _ring;
+        _ring = NULL;
+        return -1;
+    }
+    _depth = queue_depth;
+    return 0;
+#else
+    LOG(WARNING) << "braft is built without io_uring, set WITH_IO_URING=ON"
+                    " in cmake to enable it";
+    return -1;
+#endif
+}
+
+int UringWriter::submit(int fd, off_t offset, const struct iovec* iov,
+                        size_t iovcnt, bool sync, void* data) {
+#if BRAFT_WITH_IO_URING
+    CHECK(_ring != NULL);
+    DCHECK_EQ(0u, (uintptr_t)data & URING_SYNC_TAG);
+    const size_t nwrite = (iovcnt + IOV_MAX - 1) / IOV_MAX;
+    const size_t nreq = nwrite + (sync ? 1 : 0);
+    if (nreq == 0 || nreq > _depth) {
+        return -1;
+    }
+    // A linked chain must be submitted in one go, make room for it first
+    if (io_uring_sq_space_left(_ring) < nreq) {
+        io_uring_submit(_ring);
+        if (io_uring_sq_space_left(_ring) < nreq) {
+            return -1;
+        }
+    }
+    off_t cur = offset;
+    for (size_t i = 0; i < nwrite; ++i) {
+        const size_t start = i * IOV_MAX;
+        const size_t n = std::min(iovcnt - start, (size_t)IOV_MAX);
+        struct io_uring_sqe* sqe = io_uring_get_sqe(_ring);
+        io_uring_prep_writev(sqe, fd, iov + start, n, cur);
+        io_uring_sqe_set_data(sqe, data);
+        if (i + 1 != nreq) {
+            sqe->flags |= IOSQE_IO_LINK;
+        }
+        for (size_t j = start; j < start + n; ++j) {
+            cur += iov[j].iov_len;
+        }
+    }
+    if (sync) {
+        struct io_uring_sqe* sqe = io_uring_get_sqe(_ring);
+        io_uring_prep_fsync(sqe, fd, FLAGS_raft_use_fsync_rather_than_fdatasync
+                                     ? 0 : IORING_FSYNC_DATASYNC);
+        // The fsync must cover the unlinked writes submitted before as well
+        sqe->flags |= IOSQE_IO_DRAIN;
+        io_uring_sqe_set_data(sqe, (void*)((uintptr_t)data | URING_SYNC_TAG));
+    }
+    const int rc = io_uring_submit(_ring);
+    if (rc < 0) {
+        // The prepared sqes are still in the ring and will be flushed by the
+        // next successful submission, so they must be reaped anyway.
+        LOG(WARNING) << "Fail to submit to io_uring, " << berror(-rc);
+    }
+    _inflight += nreq;
+    return nreq;
+#else
+    return -1;
+#endif
+}
+
+int UringWriter::wait(Completion* c) {
+#if BRAFT_WITH_IO_URING
+    CHECK_GT(_inflight, 0);
+    struct io_uring_cqe* cqe = NULL;
+    while (io_uring_peek_cqe(_ring, &cqe) != 0) {
+        // Also flushes the sqes left by a failed submission
+        const int rc = io_uring_submit_and_wait(_ring, 1);
+        if (rc < 0 && rc != -EINTR && rc != -EAGAIN && rc != -EBUSY) {
+            LOG(ERROR) << "Fail to wait io_uring completion, " << berror(-rc);
+            errno = -rc;
+            return -1;
+        }
+    }
+    const uintptr_t user_data = (uintptr_t)io_uring_cqe_get_data(cqe);
+    c->data = (void*)(user_data & ~URING_SYNC_TAG);
+    c->is_sync = (user_data & URING_SYNC_TAG);
+    c->res = cqe->res;
+    io_uring_cqe_seen(_ring, cqe);
+    --_inflight;
+    return 0;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+}  //  namespace braft
@@ -0,0 +1,74 @@
+// Copyright (c) 2026 Baidu.com, Inc. All Rights Reserved
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Authors: Zhangyi Chen(chenzhangyi01@baidu.com)
+
+#ifndef  BRAFT_URING_WRITER_H
+#define  BRAFT_URING_WRITER_H
+
+#include <sys/types.h>
+#include <sys/uio.h>                        // iovec
+#include <butil/macros.h>
+
+struct io_uring;
+
+namespace braft {
+
+// Submit vectored writes (optionally linked with an fsync) to an io_uring
+// instance without waiting for the kernel.
+// NOTE: Not thread safe, the owner (e.g. the disk thread of a LogStorage) must
+// be the only submitter and reaper.
+class UringWriter {
+public:
+    struct Completion {
+        void* data;
+        // bytes written or -errno
+        int res;
+        // whether this completion belongs to the linked fsync
+        bool is_sync;
+    };
+
+    UringWriter();
+    ~UringWriter();
+
+    // Returns 0 on success, -1 if io_uring is not available
+    int init(unsigned queue_depth);
+
+    // Submit a write of |iov| at |offset| of |fd|. The write is split into
+    // several linked requests if |iovcnt| exceeds IOV_MAX. If |sync| is true,
+    // an fsync is issued after all the writes submitted so far. The memory
+    // referenced by |iov| must be kept valid until all the completions have
+    // been reaped.
+    // Returns the number of completions to reap, -1 if nothing was submitted
+    int submit(int fd, off_t offset, const struct iovec* iov, size_t iovcnt,
+               bool sync, void* data);
+
+    // Block until one of the submitted requests completes
+    // Returns 0 on success, -1 with errno set if the ring failed, in which
+    // case the requests in flight can't be reaped any more
+    int wait(Completion* c);
+
+    int inflight() const { return _inflight; }
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(UringWriter);
+
+    struct io_uring* _ring;
+    unsigned _depth;
+    int _inflight;
+};
+
+}  //  namespace braft
+
+#endif  //BRAFT_URING_WRITER_H
@@ -21,6 +21,9 @@
 #include <butil/macros.h>
 #include <butil/raw_pack.h>                     // butil::RawPacker
 #include <butil/file_util.h>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>                          // _mm_crc32_u64
+#endif
 #include "braft/raft.h"
 
 namespace bvar {
@@ -283,6 +286,100 @@ void run_closure_in_bthread_nosig(google::protobuf::Closure* closure,
     }
 }
 
+// CRC32C polynomial in reversed bit order
+static const uint32_t CRC32C_POLY = 0x82f63b78;
+// Bytes of each stream in one round of the interleaved crc32c
+static const size_t CRC32C_STREAM_BYTES = 1024;
+
+// a * b mod CRC32C_POLY over GF(2), in reversed bit order
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+    while (true) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return p;
+}
+
+// x^(8 * n) mod CRC32C_POLY, multiplying the crc register by which is the
+// same as feeding n zero bytes
+static uint32_t crc32c_zeros_operator(size_t n) {
+    // x^(2^k) mod CRC32C_POLY
+    uint32_t x2n[32];
+    x2n[0] = 1u << 30;  // x^1
+    for (int k = 1; k < 32; ++k) {
+        x2n[k] = crc32c_multmodp(x2n[k - 1], x2n[k - 1]);
+    }
+    uint32_t p = 1u << 31;  // x^0
+    for (int k = 3; n != 0; n >>= 1, ++k) {
+        if (n & 1) {
+            p = crc32c_multmodp(x2n[k & 31], p);
+        }
+    }
+    return p;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+static const bool s_fast_crc32 = butil::crc32c::IsFastCrc32Supported();
+static const uint32_t s_crc32c_stream_shift =
+        crc32c_zeros_operator(CRC32C_STREAM_BYTES);
+
+// |crc| is the raw crc register without the pre and post inversion
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const char* data, size_t len) {
+    uint64_t c0 = crc;
+    // Three independent streams of CRC32C_STREAM_BYTES each round, the
+    // registers of the latter two are merged by shifting the former ones
+    // over their length
+    while (len >= 3 * CRC32C_STREAM_BYTES) {
+        const char* p0 = data;
+        const char* p1 = data + CRC32C_STREAM_BYTES;
+        const char* p2 = data + 2 * CRC32C_STREAM_BYTES;
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+        for (size_t i = 0; i < CRC32C_STREAM_BYTES; i += 8) {
+            uint64_t v0, v1, v2;
+            memcpy(&v0, p0 + i, 8);
+            memcpy(&v1, p1 + i, 8);
+            memcpy(&v2, p2 + i, 8);
+            c0 = _mm_crc32_u64(c0, v0);
+            c1 = _mm_crc32_u64(c1, v1);
+            c2 = _mm_crc32_u64(c2, v2);
+        }
+        c0 = crc32c_multmodp(s_crc32c_stream_shift, (uint32_t)c0) ^ (uint32_t)c1;
+        c0 = crc32c_multmodp(s_crc32c_stream_shift, (uint32_t)c0) ^ (uint32_t)c2;
+        data += 3 * CRC32C_STREAM_BYTES;
+        len -= 3 * CRC32C_STREAM_BYTES;
+    }
+    for (; len >= 8; data += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, data, 8);
+        c0 = _mm_crc32_u64(c0, v);
+    }
+    uint32_t c = (uint32_t)c0;
+    for (; len > 0; ++data, --len) {
+        c = _mm_crc32_u8(c, (uint8_t)*data);
+    }
+    return c;
+}
+#endif
+
+uint32_t crc32c_extend(uint32_t crc, const char* data, size_t len) {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (s_fast_crc32) {
+        return ~crc32c_sse42(~crc, data, len);
+    }
+#endif
+    return butil::crc32c::Extend(crc, data, len);
+}
+
 ssize_t file_pread(butil::IOPortal* portal, int fd, off_t offset, size_t size) {
     off_t orig_offset = offset;
     ssize_t left = size;
@@ -0,0 +1,23 @@
+// Copyright (c) 2026 Baidu.com, Inc. All Rights Reserved
+
+// Author: Zhangyi Chen (chenzhangyi01@baidu.com)
+
+#ifndef  BRAFT_TEST_DIR_UTIL_H
+#define  BRAFT_TEST_DIR_UTIL_H
+
+#include <string.h>
+#include <butil/files/dir_reader_posix.h>
+
+// Number of the files in |path| whose names start with |prefix|
+inline int count_files_with_prefix(const char* path, const char* prefix) {
+    int count = 0;
+    butil::DirReaderPosix dir_reader(path);
+    while (dir_reader.Next()) {
+        if (strncmp(dir_reader.name(), prefix, strlen(prefix)) == 0) {
+            ++count;
+        }
+    }
+    return count;
+}
+
+#endif  // BRAFT_TEST_DIR_UTIL_H
@@ -39,3 +39,42 @@ TEST_F(ChecksumTest, benchmark) {
     LOG(INFO) << "base_is_fast_crc32_support=" << butil::crc32c::IsFastCrc32Supported();
 
 }
+
+TEST_F(ChecksumTest, interleaved_crc32c) {
+    std::string data;
+    data.resize(64 * 1024);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = butil::fast_rand_in(0, 255);
+    }
+    // unaligned starts and the lengths around the interleaved rounds
+    for (size_t offset = 0; offset < 8; ++offset) {
+        for (size_t len = 0; len + offset <= data.size();
+                len += (len < 4096 ? 1 : 1021)) {
+            ASSERT_EQ(butil::crc32c::Extend(12345, data.data() + offset, len),
+                      braft::crc32c_extend(12345, data.data() + offset, len))
+                << "offset=" << offset << " len=" << len;
+        }
+    }
+    butil::IOBuf buf;
+    for (size_t i = 0; i < data.size(); i += 3000) {
+        buf.append(data.data() + i, std::min((size_t)3000, data.size() - i));
+    }
+    ASSERT_EQ(butil::crc32c::Value(data.data(), data.size()), braft::crc32(buf));
+
+    butil::Timer timer;
+    const size_t N = 10000;
+    timer.start();
+    for (size_t i = 0; i < N; ++i) {
+        butil::crc32c::Value(data.data(), 16 * 1024);
+    }
+    timer.stop();
+    const long base_elp = timer.u_elapsed();
+    timer.start();
+    for (size_t i = 0; i < N; ++i) {
+        braft::crc32(data.data(), 16 * 1024);
+    }
+    timer.stop();
+    const long crc_elp = timer.u_elapsed();
+    LOG(INFO) << "base_crc32_TP=" << 16 * 1024 * N / (double)base_elp << "MB/s"
+              << " interleaved_crc32_TP=" << 16 * 1024 * N / (double)crc_elp << "MB/s";
+}
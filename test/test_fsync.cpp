@@ -7,10 +7,21 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <gflags/gflags.h>
 #include <gtest/gtest.h>
 #include <butil/fd_guard.h>
 #include <butil/time.h>
 #include <butil/logging.h>
+#include <butil/string_printf.h>
+#include <bthread/bthread.h>
+#include <bvar/variable.h>
+#include "braft/fsync.h"
+
+namespace braft {
+DECLARE_bool(raft_sync_coordinator_use_syncfs);
+}
 
 class FsyncTest : public testing::Test {
 };
@@ -55,3 +66,78 @@ TEST_F(FsyncTest, benchmark_append) {
 
 TEST_F(FsyncTest, benchmark_randomly_write) {
 }
+
+struct CoordinatedSyncArg {
+    int fd;
+    int rounds;
+    int failed;
+};
+
+static void* coordinated_sync(void* arg) {
+    CoordinatedSyncArg* a = (CoordinatedSyncArg*)arg;
+    char buf[1024];
+    memset(buf, 'a', sizeof(buf));
+    for (int i = 0; i < a->rounds; ++i) {
+        if (write(a->fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf) ||
+                braft::coordinated_fsync(a->fd) != 0) {
+            ++a->failed;
+        }
+    }
+    return NULL;
+}
+
+static int64_t coordinated_fsync_count() {
+    return strtoll(bvar::Variable::describe_exposed(
+                "raft_sync_coordinator_fsync_count").c_str(), NULL, 10);
+}
+
+TEST_F(FsyncTest, coordinated_fsync) {
+    // Several groups may share a segment file, e.g. the ones in a shared WAL
+    const size_t N = 64;
+    const size_t NFILES = 8;
+    const int rounds = 100;
+    for (int use_syncfs = 0; use_syncfs < 2; ++use_syncfs) {
+        braft::FLAGS_raft_sync_coordinator_use_syncfs = use_syncfs;
+        std::vector<int> fds(NFILES);
+        for (size_t i = 0; i < NFILES; ++i) {
+            std::string path;
+            butil::string_printf(&path, "coordinated_fsync.%lu", i);
+            fds[i] = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            ASSERT_NE(-1, fds[i]);
+        }
+        std::vector<CoordinatedSyncArg> args(N);
+        std::vector<bthread_t> tids(N);
+        for (size_t i = 0; i < N; ++i) {
+            args[i].fd = fds[i % NFILES];
+            args[i].rounds = rounds;
+            args[i].failed = 0;
+        }
+        const int64_t saved_count = coordinated_fsync_count();
+        butil::Timer timer;
+        timer.start();
+        for (size_t i = 0; i < N; ++i) {
+            ASSERT_EQ(0, bthread_start_background(&tids[i], NULL,
+                                                  coordinated_sync, &args[i]));
+        }
+        for (size_t i = 0; i < N; ++i) {
+            bthread_join(tids[i], NULL);
+        }
+        timer.stop();
+        const int64_t nsync = coordinated_fsync_count() - saved_count;
+        LOG(INFO) << "coordinated fsync of " << NFILES << " files by " << N
+                  << " bthreads with syncfs=" << use_syncfs << " takes "
+                  << timer.u_elapsed() << " with " << nsync << " sync calls";
+        for (size_t i = 0; i < N; ++i) {
+            ASSERT_EQ(0, args[i].failed);
+        }
+        // the concurrent requests of the same file or filesystem are merged
+        ASSERT_LT(nsync, (int64_t)(N * rounds));
+        for (size_t i = 0; i < NFILES; ++i) {
+            ::close(fds[i]);
+            std::string path;
+            butil::string_printf(&path, "coordinated_fsync.%lu", i);
+            ::unlink(path.c_str());
+        }
+    }
+    braft::FLAGS_raft_sync_coordinator_use_syncfs = false;
+}
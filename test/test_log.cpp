@@ -18,9 +18,21 @@
 #include "braft/util.h"
 #include "braft/log.h"
 #include "braft/storage.h"
+#include "dir_util.h"
 
 namespace braft {
 DECLARE_bool(raft_trace_append_entry_latency);
+DECLARE_int32(raft_max_segment_size);
+DECLARE_bool(raft_segment_use_io_uring);
+DECLARE_int32(raft_segment_pool_size);
+DECLARE_bool(raft_segment_direct_io);
+DECLARE_bool(raft_segment_mmap_read);
+DECLARE_bool(raft_segment_index_file);
+DECLARE_int32(raft_load_segment_concurrency);
+DECLARE_bool(raft_segment_batch_header);
+DECLARE_int64(raft_segment_reclaim_bytes_per_second);
+DECLARE_int64(raft_segment_reclaim_truncate_step);
+DECLARE_int64(raft_segment_cold_index_distance);
 }
 
 class LogStorageTest : public testing::Test {
@@ -1281,3 +1293,1120 @@ TEST_F(LogStorageTest, append_close_load_append_with_io_metric) {
     delete storage;
     delete configuration_manager;
 }
+
+#if BRAFT_WITH_IO_URING
+TEST_F(LogStorageTest, append_entries_in_batch_with_io_uring) {
+    ::system("rm -rf data");
+    const int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    braft::FLAGS_raft_segment_use_io_uring = true;
+    braft::FLAGS_raft_sync = true;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_TRUE(storage->_uring_writer.get() != NULL);
+
+    // batches larger than log_segment_data_list_batch_size are flushed in
+    // several writes and cross segment boundaries
+    for (int i = 0; i < 20; i++) {
+        std::vector<braft::LogEntry*> entries;
+        for (int j = 0; j < 600; j++) {
+            int64_t index = 600*i + j + 1;
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id.term = 1;
+            entry->id.index = index;
+
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+            entry->data.append(data_buf);
+            entries.push_back(entry);
+        }
+
+        ASSERT_EQ(600, storage->append_entries_in_batch(entries, NULL));
+        ASSERT_EQ(600*(i + 1), storage->last_log_index());
+
+        for (size_t j = 0; j < entries.size(); j++) {
+            delete entries[j];
+        }
+    }
+    delete storage;
+    delete configuration_manager;
+
+    // reload
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(1, storage->first_log_index());
+    ASSERT_EQ(600*20, storage->last_log_index());
+    for (int i = 0; i < 600*20; i++) {
+        int64_t index = i + 1;
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(1, entry->id.term);
+        ASSERT_EQ(index, entry->id.index);
+
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entry->Release();
+    }
+
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_segment_use_io_uring = false;
+    braft::FLAGS_raft_sync = false;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+#endif  // BRAFT_WITH_IO_URING
+
+static int count_pool_files(const char* path) {
+    return count_files_with_prefix(path, "log_pool_");
+}
+
+TEST_F(LogStorageTest, segment_pool) {
+    ::system("rm -rf data");
+    const int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    braft::FLAGS_raft_segment_pool_size = 2;
+    braft::LogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+
+    for (int i = 0; i < 20; i++) {
+        std::vector<braft::LogEntry*> entries;
+        for (int j = 0; j < 500; j++) {
+            int64_t index = 500*i + j + 1;
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id.term = 1;
+            entry->id.index = index;
+
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+            entry->data.append(data_buf);
+            entries.push_back(entry);
+        }
+
+        ASSERT_EQ(500, storage->append_entries(entries, NULL));
+        for (size_t j = 0; j < entries.size(); j++) {
+            delete entries[j];
+        }
+        // let the pool be filled
+        usleep(20 * 1000);
+    }
+    ASSERT_EQ(500*20, storage->last_log_index());
+    ASSERT_EQ(2, count_pool_files("./data"));
+
+    // removed segments are recycled into the pool
+    braft::FLAGS_raft_segment_pool_size = 4;
+    ASSERT_EQ(0, storage->truncate_prefix(5000));
+    ASSERT_EQ(5000, storage->first_log_index());
+    usleep(100 * 1000);
+    ASSERT_EQ(4, count_pool_files("./data"));
+
+    // the open segment is preallocated and not closed
+    delete storage;
+    delete configuration_manager;
+
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(5000, storage->first_log_index());
+    ASSERT_EQ(500*20, storage->last_log_index());
+    for (int64_t index = 5000; index <= 500*20; index++) {
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(1, entry->id.term);
+        ASSERT_EQ(index, entry->id.index);
+
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entry->Release();
+    }
+
+    // append after reload
+    braft::LogEntry* entry = new braft::LogEntry();
+    entry->type = braft::ENTRY_TYPE_DATA;
+    entry->id.term = 2;
+    entry->id.index = 500*20 + 1;
+    entry->data.append("hello");
+    ASSERT_EQ(0, storage->append_entry(entry));
+    entry->Release();
+    ASSERT_EQ(2, storage->get_term(500*20 + 1));
+
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_segment_pool_size = 0;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+static std::string open_segment_path(const char* path) {
+    butil::DirReaderPosix dir_reader(path);
+    while (dir_reader.Next()) {
+        int64_t first_index = 0;
+        if (sscanf(dir_reader.name(), "log_inprogress_%020ld", &first_index) == 1) {
+            std::string segment_path;
+            butil::string_printf(&segment_path, "%s/%s", path, dir_reader.name());
+            return segment_path;
+        }
+    }
+    return std::string();
+}
+
+// Flip the byte at |pos| relative to the data of the entry at |index|
+static void corrupt_entry(const std::string& path, int64_t index, int pos) {
+    std::string content;
+    ASSERT_TRUE(butil::ReadFileToString(butil::FilePath(path), &content));
+    char data_buf[128];
+    snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+    const size_t data_off = content.rfind(data_buf);
+    ASSERT_NE(std::string::npos, data_off);
+    const char c = content[data_off + pos] ^ 0xFF;
+    const int fd = ::open(path.c_str(), O_WRONLY);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(1, ::pwrite(fd, &c, 1, data_off + pos));
+    ::close(fd);
+}
+
+TEST_F(LogStorageTest, torn_tail_of_preallocated_segment) {
+    ::system("rm -rf data");
+    const int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    braft::FLAGS_raft_segment_pool_size = 1;
+    braft::LogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+
+    // the segments after the first one are taken from the pool
+    const int64_t last_index = 3000;
+    for (int64_t index = 1; index <= last_index; index++) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.term = 1;
+        entry->id.index = index;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+        entry->data.append(data_buf);
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+        if (index % 100 == 0) {
+            // let the pool be filled
+            usleep(20 * 1000);
+        }
+    }
+    ASSERT_EQ(last_index, storage->last_log_index());
+    delete storage;
+    delete configuration_manager;
+
+    const std::string path = open_segment_path("./data");
+    ASSERT_FALSE(path.empty());
+    ASSERT_EQ(64 * 1024, file_size(path.c_str()));
+
+    // a torn data within the preallocated size
+    corrupt_entry(path, last_index, 0);
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(last_index - 1, storage->last_log_index());
+    delete storage;
+    delete configuration_manager;
+
+    // a torn header, the entries after it are dropped as well
+    braft::FLAGS_raft_segment_pool_size = 0;
+    corrupt_entry(path, last_index - 3, -1);
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(last_index - 4, storage->last_log_index());
+    for (int64_t index = 1; index <= last_index - 4; index++) {
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL);
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entry->Release();
+    }
+
+    // append after the truncated tail
+    braft::LogEntry* entry = new braft::LogEntry();
+    entry->type = braft::ENTRY_TYPE_DATA;
+    entry->id.term = 2;
+    entry->id.index = last_index - 3;
+    entry->data.append("hello");
+    ASSERT_EQ(0, storage->append_entry(entry));
+    entry->Release();
+    ASSERT_EQ(2, storage->get_term(last_index - 3));
+
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+TEST_F(LogStorageTest, direct_io) {
+    ::system("rm -rf data");
+    const int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    braft::FLAGS_raft_segment_direct_io = true;
+    braft::FLAGS_raft_sync = true;
+    braft::LogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+
+    // entries are not aligned to blocks, the partial block is rewritten by
+    // the following writes
+    for (int i = 0; i < 10; i++) {
+        std::vector<braft::LogEntry*> entries;
+        for (int j = 0; j < 300; j++) {
+            int64_t index = 300*i + j + 1;
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id.term = 1;
+            entry->id.index = index;
+
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+            entry->data.append(data_buf);
+            entries.push_back(entry);
+        }
+
+        if (i % 2 == 0) {
+            ASSERT_EQ(300, storage->append_entries(entries, NULL));
+        } else {
+            ASSERT_EQ(300, storage->append_entries_in_batch(entries, NULL));
+        }
+        for (size_t j = 0; j < entries.size(); j++) {
+            delete entries[j];
+        }
+    }
+    ASSERT_EQ(3000, storage->last_log_index());
+
+    // truncate in the middle of a block and overwrite
+    ASSERT_EQ(0, storage->truncate_suffix(2990));
+    for (int64_t index = 2991; index <= 3000; index++) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.term = 2;
+        entry->id.index = index;
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+        entry->data.append(data_buf);
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+
+    // the padding of the open segment is left on disk
+    delete storage;
+    delete configuration_manager;
+
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(1, storage->first_log_index());
+    ASSERT_EQ(3000, storage->last_log_index());
+    for (int64_t index = 1; index <= 3000; index++) {
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(index <= 2990 ? 1 : 2, entry->id.term);
+        ASSERT_EQ(index, entry->id.index);
+
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entry->Release();
+    }
+
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_segment_direct_io = false;
+    braft::FLAGS_raft_sync = false;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+TEST_F(LogStorageTest, mmap_read) {
+    ::system("rm -rf data");
+    const int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    braft::FLAGS_raft_segment_mmap_read = true;
+    braft::LogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+
+    for (int i = 0; i < 10; i++) {
+        std::vector<braft::LogEntry*> entries;
+        for (int j = 0; j < 500; j++) {
+            int64_t index = 500*i + j + 1;
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id.term = 1;
+            entry->id.index = index;
+
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+            entry->data.append(data_buf);
+            entries.push_back(entry);
+        }
+        ASSERT_EQ(500, storage->append_entries(entries, NULL));
+        for (size_t j = 0; j < entries.size(); j++) {
+            delete entries[j];
+        }
+    }
+
+    // both closed (mapped) and open segments are readable
+    for (int64_t index = 1; index <= 5000; index++) {
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(index, entry->id.index);
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+        entry->Release();
+    }
+
+    // the mapped pages referenced by entries survive unlinking
+    braft::LogEntry* first = storage->get_entry(1);
+    ASSERT_TRUE(first != NULL);
+    ASSERT_EQ(0, storage->truncate_prefix(2000));
+    ASSERT_EQ("hello, world: 1", first->data.to_string());
+    first->Release();
+
+    // and truncating the closed segment in the middle
+    braft::LogEntry* last = storage->get_entry(2500);
+    ASSERT_TRUE(last != NULL);
+    ASSERT_EQ(0, storage->truncate_suffix(2400));
+    ASSERT_EQ(2400, storage->last_log_index());
+    ASSERT_EQ("hello, world: 2500", last->data.to_string());
+    last->Release();
+    for (int64_t index = 2401; index <= 2500; index++) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.term = 2;
+        entry->id.index = index;
+        entry->data.append("truncated");
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    delete storage;
+    delete configuration_manager;
+
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(2000, storage->first_log_index());
+    ASSERT_EQ(2500, storage->last_log_index());
+    for (int64_t index = 2000; index <= 2500; index++) {
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL);
+        if (index <= 2400) {
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+            ASSERT_EQ(data_buf, entry->data.to_string());
+        } else {
+            ASSERT_EQ(2, entry->id.term);
+            ASSERT_EQ("truncated", entry->data.to_string());
+        }
+        entry->Release();
+    }
+
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_segment_mmap_read = false;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+static int count_index_files(const char* path) {
+    return count_files_with_prefix(path, "log_index_");
+}
+
+TEST_F(LogStorageTest, segment_index_file) {
+    ::system("rm -rf data");
+    const int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    braft::FLAGS_raft_segment_index_file = true;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+
+    for (int64_t index = 1; index <= 5000; index++) {
+        braft::LogEntry entry;
+        entry.id.term = index / 1000 + 1;
+        entry.id.index = index;
+        if (index % 1200 == 0) {
+            entry.type = braft::ENTRY_TYPE_CONFIGURATION;
+            entry.peers = new std::vector<braft::PeerId>;
+            entry.peers->push_back(braft::PeerId("1.1.1.1:1000:0"));
+            entry.peers->push_back(braft::PeerId("1.1.1.1:2000:0"));
+        } else {
+            entry.type = braft::ENTRY_TYPE_DATA;
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+            entry.data.append(data_buf);
+        }
+        ASSERT_EQ(0, storage->append_entry(&entry));
+    }
+    std::vector<std::string> seg_files;
+    storage->list_files(&seg_files);
+    // the meta file, closed segments and the open one
+    const int closed_count = seg_files.size() - 2;
+    ASSERT_GT(closed_count, 1);
+    ASSERT_EQ(closed_count, count_index_files("./data"));
+    delete storage;
+    delete configuration_manager;
+
+    // closed segments are loaded from index files
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(5000, storage->last_log_index());
+    for (int64_t index = 1; index <= 5000; index++) {
+        ASSERT_EQ(index / 1000 + 1, storage->get_term(index));
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(index, entry->id.index);
+        if (index % 1200 == 0) {
+            ASSERT_EQ(braft::ENTRY_TYPE_CONFIGURATION, entry->type);
+        } else {
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+            ASSERT_EQ(data_buf, entry->data.to_string());
+        }
+        entry->Release();
+    }
+    for (int64_t index = 1200; index <= 4800; index += 1200) {
+        braft::ConfigurationEntry conf;
+        configuration_manager->get(index, &conf);
+        ASSERT_EQ(index, conf.id.index);
+    }
+
+    // truncating a closed segment invalidates its index
+    ASSERT_EQ(0, storage->truncate_suffix(2000));
+    seg_files.clear();
+    storage->list_files(&seg_files);
+    ASSERT_EQ((int)seg_files.size() - 2, count_index_files("./data"));
+    delete storage;
+    delete configuration_manager;
+
+    // corrupted index files are ignored
+    {
+        butil::DirReaderPosix dir_reader("./data");
+        while (dir_reader.Next()) {
+            if (strncmp(dir_reader.name(), "log_index_", strlen("log_index_")) == 0) {
+                std::string path("./data/");
+                path.append(dir_reader.name());
+                ASSERT_EQ(0, truncate(path.c_str(), 10));
+            }
+        }
+    }
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(2000, storage->last_log_index());
+    for (int64_t index = 1; index <= 2000; index++) {
+        ASSERT_EQ(index / 1000 + 1, storage->get_term(index));
+    }
+    braft::ConfigurationEntry conf;
+    configuration_manager->get(2000, &conf);
+    ASSERT_EQ(1200, conf.id.index);
+
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_segment_index_file = false;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+TEST_F(LogStorageTest, parallel_load_segments) {
+    ::system("rm -rf data");
+    const int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    const int32_t saved_concurrency = braft::FLAGS_raft_load_segment_concurrency;
+    braft::FLAGS_raft_max_segment_size = 16 * 1024;
+    braft::SegmentLogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+
+    // a configuration in every few segments
+    for (int64_t index = 1; index <= 20000; index++) {
+        braft::LogEntry entry;
+        entry.id.term = 1;
+        entry.id.index = index;
+        if (index % 1000 == 0) {
+            entry.type = braft::ENTRY_TYPE_CONFIGURATION;
+            entry.peers = new std::vector<braft::PeerId>;
+            entry.peers->push_back(braft::PeerId("1.1.1.1:1000:0"));
+            entry.peers->push_back(braft::PeerId(butil::EndPoint(
+                            butil::IP_ANY, 1000 + index / 1000)));
+        } else {
+            entry.type = braft::ENTRY_TYPE_DATA;
+            entry.data.append("hello, world");
+        }
+        ASSERT_EQ(0, storage->append_entry(&entry));
+    }
+    delete storage;
+    delete configuration_manager;
+
+    braft::FLAGS_raft_load_segment_concurrency = 8;
+    storage = new braft::SegmentLogStorage("./data");
+    configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(20000, storage->last_log_index());
+    for (int64_t index = 1000; index <= 20000; index += 1000) {
+        braft::ConfigurationEntry conf;
+        configuration_manager->get(index + 999, &conf);
+        ASSERT_EQ(index, conf.id.index);
+        ASSERT_TRUE(conf.conf.contains(braft::PeerId(butil::EndPoint(
+                            butil::IP_ANY, 1000 + index / 1000))));
+    }
+    ASSERT_EQ(20000, configuration_manager->last_configuration().id.index);
+
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_load_segment_concurrency = saved_concurrency;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+TEST_F(LogStorageTest, segment_offset_index) {
+    braft::SegmentOffsetIndex index;
+    ASSERT_TRUE(index.empty());
+    for (int i = 0; i < 1000; i++) {
+        index.push_back(i * 100, i / 300 + 1);
+    }
+    ASSERT_EQ(1000u, index.size());
+    ASSERT_EQ(4u, index.term_changes().size());
+    for (int i = 0; i < 1000; i++) {
+        ASSERT_EQ(i * 100, index.offset(i));
+        ASSERT_EQ(i / 300 + 1, index.term(i));
+    }
+
+    index.resize(600);
+    ASSERT_EQ(600u, index.size());
+    ASSERT_EQ(2u, index.term_changes().size());
+    ASSERT_EQ(2, index.term(599));
+    index.push_back(600 * 100, 5);
+    ASSERT_EQ(5, index.term(600));
+    ASSERT_EQ(2, index.term(599));
+
+    index.shrink_to_fit();
+    ASSERT_EQ(601u * sizeof(uint32_t) + 3 * sizeof(std::pair<uint32_t, int64_t>),
+              index.memory_usage());
+    index.resize(0);
+    ASSERT_TRUE(index.empty());
+    ASSERT_TRUE(index.term_changes().empty());
+}
+
+TEST_F(LogStorageTest, segment_offset_index_over_4g) {
+    braft::SegmentOffsetIndex index;
+    const int64_t big = (int64_t)UINT32_MAX + 100;
+    index.push_back(0, 1);
+    index.push_back(1000, 1);
+    index.push_back(big, 2);
+    index.push_back(big * 2, 2);
+    ASSERT_EQ(4u, index.size());
+    ASSERT_EQ(0, index.offset(0));
+    ASSERT_EQ(1000, index.offset(1));
+    ASSERT_EQ(big, index.offset(2));
+    ASSERT_EQ(big * 2, index.offset(3));
+    ASSERT_EQ(1, index.term(1));
+    ASSERT_EQ(2, index.term(3));
+
+    index.resize(2);
+    ASSERT_EQ(1000, index.offset(1));
+    index.push_back(2000, 3);
+    ASSERT_EQ(2000, index.offset(2));
+    ASSERT_EQ(3, index.term(2));
+
+    index.shrink_to_fit();
+    ASSERT_EQ(3u * sizeof(int64_t) + 2 * sizeof(std::pair<uint32_t, int64_t>),
+              index.memory_usage());
+
+    braft::SegmentOffsetIndex other;
+    other.push_back(10, 1);
+    other.swap(index);
+    ASSERT_EQ(1u, index.size());
+    ASSERT_EQ(10, index.offset(0));
+    ASSERT_EQ(3u, other.size());
+    ASSERT_EQ(2000, other.offset(2));
+    other.push_back(big, 3);
+    ASSERT_EQ(big, other.offset(3));
+}
+
+TEST_F(LogStorageTest, get_entries_in_range) {
+    const int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    for (int mmap_read = 0; mmap_read < 2; mmap_read++) {
+        ::system("rm -rf data");
+        braft::FLAGS_raft_segment_mmap_read = mmap_read;
+        braft::LogStorage* storage = new braft::SegmentLogStorage("./data");
+        braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+        ASSERT_EQ(0, storage->init(configuration_manager));
+
+        for (int i = 0; i < 10; i++) {
+            std::vector<braft::LogEntry*> entries;
+            for (int j = 0; j < 500; j++) {
+                int64_t index = 500*i + j + 1;
+                braft::LogEntry* entry = new braft::LogEntry();
+                entry->type = braft::ENTRY_TYPE_DATA;
+                entry->id.term = 1;
+                entry->id.index = index;
+
+                char data_buf[128];
+                snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+                entry->data.append(data_buf);
+                entries.push_back(entry);
+            }
+            ASSERT_EQ(500, storage->append_entries(entries, NULL));
+            for (size_t j = 0; j < entries.size(); j++) {
+                delete entries[j];
+            }
+        }
+
+        // read everything across the closed and open segments
+        int64_t index = 1;
+        while (index <= 5000) {
+            std::vector<braft::LogEntry*> entries;
+            const int n = storage->get_entries(index, 5000, 16 * 1024, &entries);
+            ASSERT_GT(n, 0);
+            ASSERT_EQ((size_t)n, entries.size());
+            for (int i = 0; i < n; i++, index++) {
+                ASSERT_EQ(index, entries[i]->id.index);
+                ASSERT_EQ(1, entries[i]->id.term);
+                char data_buf[128];
+                snprintf(data_buf, sizeof(data_buf), "hello, world: %ld", index);
+                ASSERT_EQ(data_buf, entries[i]->data.to_string());
+                entries[i]->Release();
+            }
+        }
+
+        // at least one entry is got even if max_bytes is tiny
+        std::vector<braft::LogEntry*> entries;
+        ASSERT_EQ(1, storage->get_entries(100, 200, 1, &entries));
+        ASSERT_EQ(100, entries[0]->id.index);
+        entries[0]->Release();
+        entries.clear();
+
+        // the range is clamped by the last index
+        ASSERT_EQ(10, storage->get_entries(4991, 6000, 1024 * 1024, &entries));
+        for (size_t i = 0; i < entries.size(); i++) {
+            entries[i]->Release();
+        }
+        entries.clear();
+
+        // out of range
+        ASSERT_EQ(0, storage->get_entries(5001, 6000, 1024 * 1024, &entries));
+        ASSERT_EQ(0, storage->truncate_prefix(1000));
+        ASSERT_EQ(0, storage->get_entries(1, 2000, 1024 * 1024, &entries));
+        ASSERT_TRUE(entries.empty());
+
+        delete storage;
+        delete configuration_manager;
+    }
+    braft::FLAGS_raft_segment_mmap_read = false;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+static std::string compressible_data(int64_t index) {
+    std::string data;
+    char buf[64];
+    snprintf(buf, sizeof(buf), "compressible entry %ld;", index);
+    // large entries are compressed, the small ones are kept as they are
+    const int repeat = index % 3 == 0 ? 1 : 100;
+    for (int i = 0; i < repeat; ++i) {
+        data.append(buf);
+    }
+    return data;
+}
+
+TEST_F(LogStorageTest, compressed_entries) {
+    const int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    const char* types[] = { "snappy", "zlib" };
+    for (size_t t = 0; t < ARRAY_SIZE(types); ++t) {
+        ::system("rm -rf data");
+        braft::SegmentLogStorage factory;
+        ASSERT_TRUE(factory.new_instance("./data&&compress=lz77") == NULL);
+        const std::string uri = std::string("./data&&compress=") + types[t];
+        braft::LogStorage* storage = factory.new_instance(uri);
+        ASSERT_TRUE(storage != NULL);
+        braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+        ASSERT_EQ(0, storage->init(configuration_manager));
+
+        braft::LogEntry* conf = new braft::LogEntry();
+        conf->AddRef();
+        conf->type = braft::ENTRY_TYPE_CONFIGURATION;
+        conf->id.term = 1;
+        conf->id.index = 1;
+        conf->peers = new std::vector<braft::PeerId>;
+        conf->peers->push_back(braft::PeerId("1.1.1.1:1000:0"));
+        ASSERT_EQ(0, storage->append_entry(conf));
+        conf->Release();
+        // half of the entries go through Segment::append and the others
+        // through the batched writes
+        for (int64_t index = 2; index <= 500; ++index) {
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->AddRef();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id.term = 1;
+            entry->id.index = index;
+            entry->data.append(compressible_data(index));
+            ASSERT_EQ(0, storage->append_entry(entry));
+            entry->Release();
+        }
+        std::vector<braft::LogEntry*> entries;
+        for (int64_t index = 501; index <= 1000; ++index) {
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->AddRef();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id.term = 1;
+            entry->id.index = index;
+            entry->data.append(compressible_data(index));
+            entries.push_back(entry);
+        }
+        ASSERT_EQ(500, storage->append_entries_in_batch(entries, NULL));
+        for (size_t i = 0; i < entries.size(); ++i) {
+            entries[i]->Release();
+        }
+        entries.clear();
+
+        // the compressed entries take much less space than the raw data
+        size_t raw_bytes = 0;
+        for (int64_t index = 2; index <= 1000; ++index) {
+            raw_bytes += compressible_data(index).size();
+        }
+        int64_t disk_bytes = 0;
+        butil::FileEnumerator dir(butil::FilePath("./data"), false,
+                                  butil::FileEnumerator::FILES);
+        for (butil::FilePath path = dir.Next(); !path.empty(); path = dir.Next()) {
+            disk_bytes += dir.GetInfo().GetSize();
+        }
+        ASSERT_LT(disk_bytes, (int64_t)raw_bytes / 4);
+
+        for (int round = 0; round < 2; ++round) {
+            for (int64_t index = 2; index <= 1000; ++index) {
+                braft::LogEntry* entry = storage->get_entry(index);
+                ASSERT_TRUE(entry != NULL);
+                ASSERT_EQ(compressible_data(index), entry->data.to_string());
+                entry->Release();
+            }
+            ASSERT_EQ(999, storage->get_entries(2, 1000, 64 * 1024 * 1024, &entries));
+            for (size_t i = 0; i < entries.size(); ++i) {
+                ASSERT_EQ(compressible_data(i + 2), entries[i]->data.to_string());
+                entries[i]->Release();
+            }
+            entries.clear();
+
+            // entries written with compression are readable whatever the
+            // compress type of the reader is
+            delete storage;
+            delete configuration_manager;
+            storage = factory.new_instance("./data&&compress=none");
+            configuration_manager = new braft::ConfigurationManager;
+            ASSERT_EQ(0, storage->init(configuration_manager));
+            braft::ConfigurationEntry conf_entry;
+            configuration_manager->get(1, &conf_entry);
+            ASSERT_EQ(1u, conf_entry.conf.size());
+            ASSERT_EQ(1000, storage->last_log_index());
+        }
+        delete storage;
+        delete configuration_manager;
+        ASSERT_TRUE(factory.gc_instance(uri).ok());
+        ASSERT_FALSE(butil::PathExists(butil::FilePath("./data")));
+    }
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+static int64_t term_before_truncate(int64_t index);
+static int64_t term_after_truncate(int64_t index);
+
+static void append_batch(braft::LogStorage* storage, int64_t first_index,
+                         int64_t last_index, int64_t (*term_of)(int64_t)) {
+    std::vector<braft::LogEntry*> entries;
+    for (int64_t index = first_index; index <= last_index; ++index) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->AddRef();
+        entry->id.term = term_of(index);
+        entry->id.index = index;
+        if (index % 97 == 0) {
+            entry->type = braft::ENTRY_TYPE_CONFIGURATION;
+            entry->peers = new std::vector<braft::PeerId>;
+            entry->peers->push_back(braft::PeerId("1.1.1.1:1000:0"));
+        } else if (index % 89 == 0) {
+            // larger than raft_segment_batch_max_bytes
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->data.append(std::string(64 * 1024, 'a' + index % 26));
+        } else {
+            entry->type = braft::ENTRY_TYPE_DATA;
+            char data_buf[128];
+            snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+            entry->data.append(data_buf);
+        }
+        entries.push_back(entry);
+    }
+    ASSERT_EQ((int)entries.size(), storage->append_entries_in_batch(entries, NULL));
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i]->Release();
+    }
+}
+
+static void check_batch(braft::LogEntry* entry, int64_t index) {
+    ASSERT_EQ(index, entry->id.index);
+    if (index % 97 == 0) {
+        ASSERT_EQ(braft::ENTRY_TYPE_CONFIGURATION, entry->type);
+    } else if (index % 89 == 0) {
+        ASSERT_EQ(std::string(64 * 1024, 'a' + index % 26), entry->data.to_string());
+    } else {
+        char data_buf[128];
+        snprintf(data_buf, sizeof(data_buf), "hello, world: %" PRId64, index);
+        ASSERT_EQ(data_buf, entry->data.to_string());
+    }
+}
+
+static void check_batches(braft::LogStorage* storage, int64_t last_index,
+                          int64_t (*term_of)(int64_t)) {
+    ASSERT_EQ(last_index, storage->last_log_index());
+    for (int64_t index = 1; index <= last_index; ++index) {
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL) << "index=" << index;
+        ASSERT_EQ(term_of(index), entry->id.term);
+        ASSERT_EQ(term_of(index), storage->get_term(index));
+        check_batch(entry, index);
+        entry->Release();
+    }
+    for (int64_t first = 1; first <= last_index; first += 37) {
+        std::vector<braft::LogEntry*> entries;
+        const int n = storage->get_entries(first, last_index, 4096, &entries);
+        ASSERT_GT(n, 0);
+        for (int i = 0; i < n; ++i) {
+            ASSERT_EQ(term_of(first + i), entries[i]->id.term);
+            check_batch(entries[i], first + i);
+            entries[i]->Release();
+        }
+    }
+}
+
+static int64_t term_before_truncate(int64_t index) {
+    return index <= 1600 ? 1 : 2;
+}
+
+static int64_t term_after_truncate(int64_t index) {
+    return index <= 1600 ? 1 : (index <= 1750 ? 2 : 3);
+}
+
+TEST_F(LogStorageTest, batch_header) {
+    const int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 256 * 1024;
+    braft::FLAGS_raft_segment_batch_header = true;
+    for (int index_file = 0; index_file < 2; ++index_file) {
+        ::system("rm -rf data");
+        braft::FLAGS_raft_segment_index_file = index_file;
+        braft::LogStorage* storage = new braft::SegmentLogStorage("./data");
+        braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+        ASSERT_EQ(0, storage->init(configuration_manager));
+        // the term changes in the middle of [1501, 1800]
+        for (int64_t index = 1; index <= 3000; index += 300) {
+            append_batch(storage, index, index + 299, term_before_truncate);
+        }
+        check_batches(storage, 3000, term_before_truncate);
+
+        // truncate to the middle of a batch
+        ASSERT_EQ(0, storage->truncate_suffix(1750));
+        check_batches(storage, 1750, term_after_truncate);
+        append_batch(storage, 1751, 2000, term_after_truncate);
+        check_batches(storage, 2000, term_after_truncate);
+        delete storage;
+        delete configuration_manager;
+
+        // entries in the batches are restored at startup
+        braft::FLAGS_raft_segment_batch_header = false;
+        storage = new braft::SegmentLogStorage("./data");
+        configuration_manager = new braft::ConfigurationManager;
+        ASSERT_EQ(0, storage->init(configuration_manager));
+        check_batches(storage, 2000, term_after_truncate);
+        braft::ConfigurationEntry conf_entry;
+        configuration_manager->get(2000, &conf_entry);
+        ASSERT_EQ(97 * 20, conf_entry.id.index);
+        // v1 entries are appended after the batches
+        append_batch(storage, 2001, 2100, term_after_truncate);
+        check_batches(storage, 2100, term_after_truncate);
+        delete storage;
+        delete configuration_manager;
+        braft::FLAGS_raft_segment_batch_header = true;
+    }
+    braft::FLAGS_raft_segment_batch_header = false;
+    braft::FLAGS_raft_segment_index_file = false;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+static int count_segment_files(const char* path) {
+    // log_meta, the pooled files and the index files are not segments
+    return count_files_with_prefix(path, "log_")
+            - count_files_with_prefix(path, "log_meta")
+            - count_pool_files(path)
+            - count_index_files(path);
+}
+
+TEST_F(LogStorageTest, reclaim_segments_in_background) {
+    ::system("rm -rf data");
+    const int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    braft::FLAGS_raft_segment_reclaim_bytes_per_second = 16 * 1024 * 1024;
+    braft::FLAGS_raft_segment_reclaim_truncate_step = 16 * 1024;
+    braft::LogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    const std::string data(1024, 'a');
+    for (int64_t index = 1; index <= 2000; ++index) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.term = 1;
+        entry->id.index = index;
+        entry->data.append(data);
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    ASSERT_GT(count_segment_files("./data"), 20);
+
+    ASSERT_EQ(0, storage->truncate_prefix(1900));
+    // the logs are removed from the storage right away
+    ASSERT_EQ(1900, storage->first_log_index());
+    ASSERT_TRUE(storage->get_entry(1899) == NULL);
+    braft::LogEntry* entry = storage->get_entry(1900);
+    ASSERT_TRUE(entry != NULL);
+    entry->Release();
+
+    // and the files are freed gradually
+    for (int i = 0; i < 100 && count_segment_files("./data") > 3; ++i) {
+        usleep(100 * 1000);
+    }
+    ASSERT_LE(count_segment_files("./data"), 3);
+
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_segment_reclaim_bytes_per_second = 0;
+    braft::FLAGS_raft_segment_reclaim_truncate_step = 0;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+TEST_F(LogStorageTest, reclaim_mapped_segments) {
+    ::system("rm -rf data");
+    const int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    braft::FLAGS_raft_segment_mmap_read = true;
+    braft::FLAGS_raft_segment_reclaim_truncate_step = 4 * 1024;
+    braft::LogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    const std::string data(1024, 'a');
+    for (int64_t index = 1; index <= 200; ++index) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.term = 1;
+        entry->id.index = index;
+        entry->data.append(data);
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+
+    // The entry references the mapped pages of the first segment, which
+    // must not be truncated by the reclaimer
+    braft::LogEntry* first = storage->get_entry(1);
+    ASSERT_TRUE(first != NULL);
+    ASSERT_EQ(0, storage->truncate_prefix(150));
+    for (int i = 0; i < 100 && count_segment_files("./data") > 2; ++i) {
+        usleep(10 * 1000);
+    }
+    ASSERT_EQ(data, first->data.to_string());
+    first->Release();
+
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_segment_reclaim_truncate_step = 0;
+    braft::FLAGS_raft_segment_mmap_read = false;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
+
+static bool cold_segments_migrated(braft::SegmentLogStorage* storage,
+                                   int64_t last_cold_index) {
+    braft::SegmentLogStorage::SegmentMap segments = storage->segments();
+    for (braft::SegmentLogStorage::SegmentMap::iterator
+            it = segments.begin(); it != segments.end(); ++it) {
+        if (it->second->last_index() <= last_cold_index
+                && !it->second->is_migrated()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST_F(LogStorageTest, cold_segments) {
+    ::system("rm -rf data data_cold");
+    const int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    braft::FLAGS_raft_segment_cold_index_distance = 500;
+    braft::SegmentLogStorage factory;
+    ASSERT_TRUE(factory.new_instance("./data&&cold=./data_cold") == NULL);
+    ASSERT_TRUE(factory.new_instance("./data&&cold_path=") == NULL);
+    const std::string uri = "./data&&compress=none&&cold_path=./data_cold";
+    braft::SegmentLogStorage* storage =
+            dynamic_cast<braft::SegmentLogStorage*>(factory.new_instance(uri));
+    ASSERT_TRUE(storage != NULL);
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    for (int64_t index = 1; index <= 2000; ++index) {
+        braft::LogEntry* entry = new braft::LogEntry();
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id.term = 1;
+        entry->id.index = index;
+        entry->data.append(butil::string_printf("%01024" PRId64, index));
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    for (int i = 0; i < 100 && !cold_segments_migrated(storage, 1500); ++i) {
+        usleep(100 * 1000);
+    }
+    ASSERT_TRUE(cold_segments_migrated(storage, 1500));
+    ASSERT_GT(count_segment_files("./data_cold"), 20);
+    ASSERT_FALSE(storage->segments().rbegin()->second->is_migrated());
+
+    // the cold segments are read transparently
+    for (int64_t index = 1; index <= 2000; ++index) {
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL) << "index=" << index;
+        ASSERT_EQ(butil::string_printf("%01024" PRId64, index), entry->data.to_string());
+        entry->Release();
+    }
+    ASSERT_EQ(0, storage->truncate_prefix(1000));
+    delete storage;
+
+    // the copies left in the primary path by a crash after the migration are
+    // dropped at startup
+    ::system("cp data_cold/log_0* data/");
+    storage = dynamic_cast<braft::SegmentLogStorage*>(factory.new_instance(uri));
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    ASSERT_EQ(1000, storage->first_log_index());
+    ASSERT_EQ(2000, storage->last_log_index());
+    int ncold = 0;
+    butil::DirReaderPosix dir_reader("./data_cold");
+    while (dir_reader.Next()) {
+        if (strncmp(dir_reader.name(), "log_0", strlen("log_0")) == 0) {
+            ++ncold;
+            ASSERT_FALSE(butil::PathExists(butil::FilePath(
+                        std::string("./data/") + dir_reader.name())));
+        }
+    }
+    ASSERT_GT(ncold, 5);
+    for (int64_t index = 1000; index <= 2000; ++index) {
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL) << "index=" << index;
+        ASSERT_EQ(butil::string_printf("%01024" PRId64, index), entry->data.to_string());
+        entry->Release();
+    }
+    delete storage;
+    delete configuration_manager;
+
+    ASSERT_TRUE(braft::LogStorage::destroy("local://" + uri).ok());
+    ASSERT_FALSE(butil::PathExists(butil::FilePath("./data_cold")));
+    braft::FLAGS_raft_segment_cold_index_distance = 0;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
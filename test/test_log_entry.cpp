@@ -49,3 +49,23 @@ TEST_F(TestUsageSuits, LogEntry) {
 
     entry->Release();
 }
+
+TEST_F(TestUsageSuits, reuse_released_entry) {
+    braft::LogEntry* entry = new braft::LogEntry();
+    entry->AddRef();
+    entry->type = braft::ENTRY_TYPE_CONFIGURATION;
+    entry->peers = new std::vector<braft::PeerId>(
+            1, braft::PeerId("1.2.3.4:1000"));
+    entry->data.append("hello, world");
+    braft::LogEntry* const released = entry;
+    entry->Release();
+
+    // The memory is recycled by the same thread, as a brand new entry
+    entry = new braft::LogEntry();
+    ASSERT_EQ(released, entry);
+    ASSERT_EQ(braft::ENTRY_TYPE_UNKNOWN, entry->type);
+    ASSERT_TRUE(entry->peers == NULL);
+    ASSERT_TRUE(entry->data.empty());
+    entry->AddRef();
+    entry->Release();
+}
@@ -0,0 +1,164 @@
+// Copyright (c) 2026 Baidu.com, Inc. All Rights Reserved
+
+// Author: Zhangyi Chen (chenzhangyi01@baidu.com)
+
+#include <gtest/gtest.h>
+#include <butil/logging.h>
+#include <butil/atomicops.h>
+#include <bthread/bthread.h>
+#include "braft/log_entry_cache.h"
+#include "braft/log.h"
+#include "braft/configuration_manager.h"
+
+namespace braft {
+DECLARE_int32(raft_max_segment_size);
+}
+
+class LogEntryCacheTest : public testing::Test {
+protected:
+    void SetUp() {
+        _saved_cache_bytes = braft::FLAGS_raft_log_entry_cache_bytes;
+        braft::FLAGS_raft_log_entry_cache_bytes = 16 * 1024 * 1024;
+    }
+    void TearDown() {
+        braft::FLAGS_raft_log_entry_cache_bytes = _saved_cache_bytes;
+    }
+
+    int64_t _saved_cache_bytes;
+};
+
+static braft::LogEntry* make_entry(int64_t index, int64_t term,
+                                   const std::string& data) {
+    braft::LogEntry* entry = new braft::LogEntry();
+    entry->AddRef();
+    entry->type = braft::ENTRY_TYPE_DATA;
+    entry->id.term = term;
+    entry->id.index = index;
+    entry->data.append(data);
+    return entry;
+}
+
+TEST_F(LogEntryCacheTest, get_and_evict) {
+    braft::LogEntryCache* cache = braft::LogEntryCache::GetInstance();
+    const uint64_t owner = cache->new_owner();
+    int nload = 0;
+    for (int round = 0; round < 2; ++round) {
+        for (int64_t index = 1; index <= 100; ++index) {
+            braft::LogEntry* entry = cache->get(owner, index, [&] {
+                ++nload;
+                return make_entry(index, 1, "hello");
+            });
+            ASSERT_TRUE(entry != NULL);
+            ASSERT_EQ(index, entry->id.index);
+            entry->Release();
+        }
+    }
+    // the second round hits
+    ASSERT_EQ(100, nload);
+
+    // failed loads are not cached
+    braft::LogEntry* entry = cache->get(owner, 1000, [] {
+        return (braft::LogEntry*)NULL;
+    });
+    ASSERT_TRUE(entry == NULL);
+    ASSERT_TRUE(cache->lookup(owner, 1000) == NULL);
+
+    // a different owner never sees the entries
+    ASSERT_TRUE(cache->lookup(cache->new_owner(), 1) == NULL);
+
+    // large entries evict the old ones
+    braft::FLAGS_raft_log_entry_cache_bytes = 16 * 64 * 1024;
+    const std::string large(32 * 1024, 'a');
+    for (int64_t index = 1; index <= 1000; ++index) {
+        braft::LogEntry* entry = make_entry(index, 1, large);
+        cache->insert(owner, entry);
+        entry->Release();
+    }
+    ASSERT_LE(cache->bytes(), (size_t)braft::FLAGS_raft_log_entry_cache_bytes);
+    entry = cache->lookup(owner, 1000);
+    ASSERT_TRUE(entry != NULL);
+    entry->Release();
+}
+
+struct LoadArg {
+    uint64_t owner;
+    butil::atomic<int>* nload;
+    butil::atomic<int>* nok;
+};
+
+static void* concurrent_get(void* arg) {
+    LoadArg* la = (LoadArg*)arg;
+    braft::LogEntry* entry = braft::LogEntryCache::GetInstance()->get(
+            la->owner, 1, [la] {
+        la->nload->fetch_add(1);
+        bthread_usleep(100 * 1000);
+        return make_entry(1, 1, "single flight");
+    });
+    if (entry != NULL && entry->data.to_string() == "single flight") {
+        la->nok->fetch_add(1);
+    }
+    if (entry) {
+        entry->Release();
+    }
+    return NULL;
+}
+
+TEST_F(LogEntryCacheTest, single_flight) {
+    butil::atomic<int> nload(0);
+    butil::atomic<int> nok(0);
+    LoadArg arg = { braft::LogEntryCache::GetInstance()->new_owner(),
+                    &nload, &nok };
+    bthread_t tids[32];
+    for (size_t i = 0; i < ARRAY_SIZE(tids); ++i) {
+        ASSERT_EQ(0, bthread_start_background(&tids[i], NULL,
+                                              concurrent_get, &arg));
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(tids); ++i) {
+        bthread_join(tids[i], NULL);
+    }
+    ASSERT_EQ(1, nload.load());
+    ASSERT_EQ((int)ARRAY_SIZE(tids), nok.load());
+}
+
+TEST_F(LogEntryCacheTest, segment_log_storage) {
+    ::system("rm -rf data");
+    const int32_t saved_max_segment_size = braft::FLAGS_raft_max_segment_size;
+    braft::FLAGS_raft_max_segment_size = 64 * 1024;
+    braft::LogStorage* storage = new braft::SegmentLogStorage("./data");
+    braft::ConfigurationManager* configuration_manager = new braft::ConfigurationManager;
+    ASSERT_EQ(0, storage->init(configuration_manager));
+    for (int64_t index = 1; index <= 2000; ++index) {
+        braft::LogEntry* entry = make_entry(index, 1, "term 1");
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    for (int64_t index = 1; index <= 2000; ++index) {
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL);
+        entry->Release();
+    }
+    // the rewritten logs are not served from the cache
+    ASSERT_EQ(0, storage->truncate_suffix(1000));
+    for (int64_t index = 1001; index <= 2000; ++index) {
+        braft::LogEntry* entry = make_entry(index, 2, "term 2");
+        ASSERT_EQ(0, storage->append_entry(entry));
+        entry->Release();
+    }
+    for (int64_t index = 1; index <= 2000; ++index) {
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(index <= 1000 ? 1 : 2, entry->id.term);
+        ASSERT_EQ(index <= 1000 ? "term 1" : "term 2", entry->data.to_string());
+        entry->Release();
+    }
+    std::vector<braft::LogEntry*> entries;
+    ASSERT_EQ(2000, storage->get_entries(1, 2000, 1024 * 1024, &entries));
+    for (size_t i = 0; i < entries.size(); ++i) {
+        ASSERT_EQ((int64_t)i + 1, entries[i]->id.index);
+        ASSERT_EQ(i < 1000 ? 1 : 2, entries[i]->id.term);
+        entries[i]->Release();
+    }
+    delete storage;
+    delete configuration_manager;
+    braft::FLAGS_raft_max_segment_size = saved_max_segment_size;
+}
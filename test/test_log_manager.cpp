@@ -5,7 +5,9 @@
 
 #include <gtest/gtest.h>
 
+#include <pthread.h>
 #include <butil/memory/scoped_ptr.h>
+#include <butil/fast_rand.h>
 #include <butil/string_printf.h>
 #include <butil/macros.h>
 
@@ -548,6 +550,38 @@ TEST_F(LogManagerTest, wait) {
     ASSERT_NE(0, lm->remove_waiter(wait_id));
 }
 
+namespace braft {
+DECLARE_bool(raft_notify_waiters_in_batch);
+}
+
+TEST_F(LogManagerTest, wait_in_batch) {
+    system("rm -rf ./data");
+    const bool saved_in_batch = braft::FLAGS_raft_notify_waiters_in_batch;
+    braft::FLAGS_raft_notify_waiters_in_batch = true;
+    scoped_ptr<braft::ConfigurationManager> cm(
+                                new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+                                new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    SyncClosure sc[5];
+    braft::LogManager::WaitId wait_ids[ARRAY_SIZE(sc)];
+    for (size_t i = 0; i < ARRAY_SIZE(sc); ++i) {
+        wait_ids[i] = lm->wait(lm->last_log_index(), on_new_log, &sc[i]);
+        ASSERT_NE(0, wait_ids[i]);
+    }
+    ASSERT_EQ(0, lm->remove_waiter(wait_ids[0]));
+    ASSERT_EQ(0, append_entry(lm.get(), "hello", 1));
+    for (size_t i = 1; i < ARRAY_SIZE(sc); ++i) {
+        sc[i].join();
+        ASSERT_NE(0, lm->remove_waiter(wait_ids[i]));
+    }
+    braft::FLAGS_raft_notify_waiters_in_batch = saved_in_batch;
+}
+
 TEST_F(LogManagerTest, flush_and_get_last_id) {
     system("rm -rf ./data");
     {
@@ -681,3 +715,609 @@ TEST_F(LogManagerTest, set_snapshot_and_get_log_term) {
     ASSERT_EQ(1L, lm->get_term(N - 1));
     LOG(INFO) << "Last_index=" << lm->last_log_index();
 }
+
+namespace braft {
+DECLARE_int32(raft_sync_interval_us);
+}
+
+TEST_F(LogManagerTest, sync_by_time) {
+    system("rm -rf ./data");
+    const int32_t saved_sync_policy = braft::FLAGS_raft_sync_policy;
+    const int32_t saved_sync_interval_us = braft::FLAGS_raft_sync_interval_us;
+    braft::FLAGS_raft_sync_policy = braft::RAFT_SYNC_BY_TIME;
+    braft::FLAGS_raft_sync_interval_us = 500 * 1000;
+    scoped_ptr<braft::ConfigurationManager> cm(
+            new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+            new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+
+    const int N = 10;
+    std::vector<SyncClosure*> closures;
+    const int64_t start_us = butil::monotonic_time_us();
+    for (int i = 0; i < N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->data.append("test");
+        entry->id = braft::LogId(i + 1, 1);
+        std::vector<braft::LogEntry*> entries(1, entry);
+        closures.push_back(new SyncClosure);
+        lm->append_entries(&entries, closures.back());
+    }
+    // The logs are written at once, but not reported stable until the fsync
+    // covering all of them
+    braft::LogManagerStatus status;
+    for (int i = 0; i < 100; ++i) {
+        lm->get_status(&status);
+        if (status.disk_index == N) {
+            break;
+        }
+        usleep(1000);
+    }
+    ASSERT_EQ(N, status.disk_index);
+    ASSERT_EQ(0, status.durable_index);
+    for (size_t i = 0; i < closures.size(); ++i) {
+        closures[i]->join();
+        ASSERT_TRUE(closures[i]->status().ok());
+        delete closures[i];
+    }
+    ASSERT_GE(butil::monotonic_time_us() - start_us, 400 * 1000);
+    lm->get_status(&status);
+    ASSERT_EQ(N, status.durable_index);
+
+    // The other operations sync the written logs first
+    braft::LogEntry* entry = new braft::LogEntry;
+    entry->AddRef();
+    entry->type = braft::ENTRY_TYPE_DATA;
+    entry->data.append("test");
+    entry->id = braft::LogId(N + 1, 1);
+    std::vector<braft::LogEntry*> entries(1, entry);
+    SyncClosure sc;
+    const int64_t append_us = butil::monotonic_time_us();
+    lm->append_entries(&entries, &sc);
+    ASSERT_EQ(braft::LogId(N + 1, 1), lm->last_log_id(true));
+    sc.join();
+    ASSERT_LT(butil::monotonic_time_us() - append_us, 400 * 1000);
+    lm->get_status(&status);
+    ASSERT_EQ(N + 1, status.durable_index);
+
+    braft::FLAGS_raft_sync_policy = saved_sync_policy;
+    braft::FLAGS_raft_sync_interval_us = saved_sync_interval_us;
+}
+
+struct LogReaderArg {
+    braft::LogManager* lm;
+    butil::atomic<bool>* stop;
+    int64_t nread;
+    int64_t nerror;
+};
+
+static void* read_logs(void* arg) {
+    LogReaderArg* ra = (LogReaderArg*)arg;
+    while (!ra->stop->load(butil::memory_order_relaxed)) {
+        const int64_t last_index = ra->lm->last_log_index();
+        if (last_index == 0) {
+            continue;
+        }
+        const int64_t index = butil::fast_rand_less_than(last_index) + 1;
+        std::string expected;
+        butil::string_printf(&expected, "hello_%" PRId64, index);
+        braft::LogEntry* entry = ra->lm->get_entry(index);
+        if (entry == NULL || entry->id.index != index
+                || entry->data.to_string() != expected) {
+            ++ra->nerror;
+        }
+        if (entry) {
+            entry->Release();
+        }
+        if (ra->lm->get_term(index) != 1) {
+            ++ra->nerror;
+        }
+        std::vector<braft::LogEntry*> entries;
+        const int n = ra->lm->get_entries(index, last_index, 1024 * 1024, &entries);
+        if (n <= 0 || (size_t)n != entries.size()) {
+            ++ra->nerror;
+        }
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i]->id.index != index + (int64_t)i) {
+                ++ra->nerror;
+            }
+            entries[i]->Release();
+        }
+        ++ra->nread;
+    }
+    return NULL;
+}
+
+TEST_F(LogManagerTest, read_while_appending) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+            new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+            new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+
+    butil::atomic<bool> stop(false);
+    const int NREADER = 4;
+    pthread_t readers[NREADER];
+    LogReaderArg args[NREADER];
+    for (int i = 0; i < NREADER; ++i) {
+        args[i].lm = lm.get();
+        args[i].stop = &stop;
+        args[i].nread = 0;
+        args[i].nerror = 0;
+        ASSERT_EQ(0, pthread_create(&readers[i], NULL, read_logs, &args[i]));
+    }
+
+    // Appending and clearing the logs in memory race with the readers, which
+    // either see the logs in memory or read them from disk
+    const int64_t N = 20000;
+    for (int64_t i = 1; i <= N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->id = braft::LogId(i, 1);
+        std::string buf;
+        butil::string_printf(&buf, "hello_%" PRId64, i);
+        entry->data.append(buf);
+        std::vector<braft::LogEntry*> entries(1, entry);
+        lm->append_entries(&entries, new StuckClosure);
+        if (i % 100 == 0) {
+            lm->set_applied_id(braft::LogId(i - 50, 1));
+        }
+    }
+    ASSERT_EQ(braft::LogId(N, 1), lm->last_log_id(true));
+
+    stop.store(true);
+    int64_t nread = 0;
+    for (int i = 0; i < NREADER; ++i) {
+        pthread_join(readers[i], NULL);
+        ASSERT_EQ(0, args[i].nerror);
+        nread += args[i].nread;
+    }
+    ASSERT_GT(nread, 0);
+}
+
+TEST_F(LogManagerTest, term_starts) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+            new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+            new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    ASSERT_TRUE(lm->_term_starts.empty());
+
+    // Terms 1, 2 and 3 start at 1, 11 and 21
+    for (int64_t i = 1; i <= 30; ++i) {
+        ASSERT_EQ(0, append_entry(lm.get(), "hello", i, (i - 1) / 10 + 1));
+    }
+    ASSERT_EQ(3u, lm->_term_starts.size());
+    ASSERT_EQ(21, lm->_term_starts[2].index);
+    ASSERT_EQ(3, lm->_term_starts[2].term);
+
+    braft::LogManagerStatus status;
+    for (int i = 0; i < 100; ++i) {
+        lm->get_status(&status);
+        if (status.disk_index == 30) {
+            break;
+        }
+        usleep(1000);
+    }
+    ASSERT_EQ(30, status.disk_index);
+
+    // The logs before 15 are no longer in memory, their terms come from
+    // _term_starts
+    lm->set_applied_id(braft::LogId(14, 2));
+    ASSERT_EQ(16u, lm->_logs_in_memory.size());
+    for (int64_t i = 1; i <= 30; ++i) {
+        ASSERT_EQ((i - 1) / 10 + 1, lm->get_term(i)) << "i=" << i;
+    }
+    ASSERT_EQ(0, lm->get_term(31));
+
+    // A conflicting log from a new leader truncates the terms after it
+    ASSERT_EQ(0, append_entry(lm.get(), "hello", 15, 4));
+    ASSERT_EQ(3u, lm->_term_starts.size());
+    ASSERT_EQ(15, lm->_term_starts[2].index);
+    ASSERT_EQ(4, lm->_term_starts[2].term);
+    ASSERT_EQ(2, lm->get_term(14));
+    ASSERT_EQ(4, lm->get_term(15));
+    ASSERT_EQ(0, lm->get_term(16));
+    ASSERT_EQ(braft::LogId(15, 4), lm->last_log_id(true));
+
+    // Rebuilt from the log storage on restart
+    lm.reset(new braft::LogManager());
+    storage.reset(new braft::SegmentLogStorage("./data"));
+    cm.reset(new braft::ConfigurationManager);
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    ASSERT_EQ(3u, lm->_term_starts.size());
+    ASSERT_EQ(1, lm->_term_starts[0].index);
+    ASSERT_EQ(11, lm->_term_starts[1].index);
+    ASSERT_EQ(15, lm->_term_starts[2].index);
+    for (int64_t i = 1; i <= 15; ++i) {
+        ASSERT_EQ(i <= 10 ? 1 : (i < 15 ? 2 : 4), lm->get_term(i)) << "i=" << i;
+    }
+
+    // Truncating the prefix keeps the term of the first log
+    braft::SnapshotMeta meta;
+    meta.set_last_included_index(12);
+    meta.set_last_included_term(2);
+    lm->set_snapshot(&meta);
+    meta.set_last_included_index(13);
+    lm->set_snapshot(&meta);
+    ASSERT_EQ(13, lm->first_log_index());
+    ASSERT_EQ(2u, lm->_term_starts.size());
+    ASSERT_EQ(11, lm->_term_starts[0].index);
+    ASSERT_EQ(2, lm->get_term(13));
+    ASSERT_EQ(4, lm->get_term(15));
+}
+
+namespace braft {
+DECLARE_bool(raft_log_encode_stage);
+DECLARE_int32(raft_disk_queue_max_batches);
+}
+
+TEST_F(LogManagerTest, encode_stage) {
+    system("rm -rf ./data");
+    const bool saved_encode_stage = braft::FLAGS_raft_log_encode_stage;
+    const int32_t saved_max_batches = braft::FLAGS_raft_disk_queue_max_batches;
+    braft::FLAGS_raft_log_encode_stage = true;
+    braft::FLAGS_raft_disk_queue_max_batches = 2;
+    scoped_ptr<braft::ConfigurationManager> cm(
+            new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+            new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+
+    const int N = 1000;
+    std::vector<SyncClosure*> closures;
+    for (int i = 0; i < N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->data.append(butil::string_printf("hello_%d", i + 1));
+        entry->id = braft::LogId(i + 1, 1);
+        std::vector<braft::LogEntry*> entries(1, entry);
+        closures.push_back(new SyncClosure);
+        lm->append_entries(&entries, closures.back());
+    }
+    for (size_t i = 0; i < closures.size(); ++i) {
+        closures[i]->join();
+        ASSERT_TRUE(closures[i]->status().ok());
+        delete closures[i];
+    }
+    // The other operations are ordered with the appended logs
+    ASSERT_EQ(braft::LogId(N, 1), lm->last_log_id(true));
+    ASSERT_EQ(0, append_entry(lm.get(), "hello", N / 2, 2));
+    ASSERT_EQ(braft::LogId(N / 2, 2), lm->last_log_id(true));
+
+    // The records written by the encode stage are read back
+    lm.reset(new braft::LogManager());
+    storage.reset(new braft::SegmentLogStorage("./data"));
+    cm.reset(new braft::ConfigurationManager);
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    ASSERT_EQ(N / 2, lm->last_log_index());
+    for (int i = 1; i < N / 2; ++i) {
+        braft::LogEntry* entry = lm->get_entry(i);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(butil::string_printf("hello_%d", i), entry->data.to_string());
+        ASSERT_EQ(1, entry->id.term);
+        entry->Release();
+    }
+    ASSERT_EQ(2, lm->get_term(N / 2));
+
+    lm.reset();
+    braft::FLAGS_raft_log_encode_stage = saved_encode_stage;
+    braft::FLAGS_raft_disk_queue_max_batches = saved_max_batches;
+}
+
+namespace braft {
+DECLARE_bool(raft_adaptive_append_batch);
+DECLARE_int32(raft_append_batch_max_linger_us);
+}
+
+TEST_F(LogManagerTest, adaptive_append_batch) {
+    system("rm -rf ./data");
+    const bool saved_adaptive = braft::FLAGS_raft_adaptive_append_batch;
+    const int32_t saved_max_linger_us = braft::FLAGS_raft_append_batch_max_linger_us;
+    braft::FLAGS_raft_adaptive_append_batch = true;
+    braft::FLAGS_raft_append_batch_max_linger_us = 100 * 1000;
+    scoped_ptr<braft::ConfigurationManager> cm(
+            new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+            new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+
+    // A sparse append is written at once
+    const int64_t start_us = butil::monotonic_time_us();
+    ASSERT_EQ(0, append_entry(lm.get(), "hello", 1));
+    ASSERT_LT(butil::monotonic_time_us() - start_us, 50 * 1000);
+
+    // A burst of small appends may linger for more, but never beyond the
+    // limit or the other operations
+    const int N = 200;
+    std::vector<SyncClosure*> closures;
+    for (int i = 2; i <= N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->data.append("hello");
+        entry->id = braft::LogId(i, 1);
+        std::vector<braft::LogEntry*> entries(1, entry);
+        closures.push_back(new SyncClosure);
+        lm->append_entries(&entries, closures.back());
+    }
+    for (size_t i = 0; i < closures.size(); ++i) {
+        closures[i]->join();
+        ASSERT_TRUE(closures[i]->status().ok());
+        delete closures[i];
+    }
+    ASSERT_EQ(0, append_entry(lm.get(), "hello", N + 1));
+    ASSERT_EQ(braft::LogId(N + 1, 1), lm->last_log_id(true));
+    braft::LogManagerStatus status;
+    lm->get_status(&status);
+    ASSERT_EQ(N + 1, status.disk_index);
+
+    // Empty entries never reach the target bytes, the batches are still cut
+    // by the number of the closures
+    closures.clear();
+    for (int i = N + 2; i <= 4 * N; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_NO_OP;
+        entry->id = braft::LogId(i, 1);
+        std::vector<braft::LogEntry*> entries(1, entry);
+        closures.push_back(new SyncClosure);
+        lm->append_entries(&entries, closures.back());
+    }
+    for (size_t i = 0; i < closures.size(); ++i) {
+        closures[i]->join();
+        ASSERT_TRUE(closures[i]->status().ok());
+        delete closures[i];
+    }
+    ASSERT_EQ(braft::LogId(4 * N, 1), lm->last_log_id(true));
+    ASSERT_EQ(256u, lm->_append_batcher->_closures.capacity());
+
+    lm.reset();
+    braft::FLAGS_raft_adaptive_append_batch = saved_adaptive;
+    braft::FLAGS_raft_append_batch_max_linger_us = saved_max_linger_us;
+}
+
+namespace braft {
+DECLARE_int64(raft_max_memory_log_bytes);
+}
+
+static void* wait_for_memory_budget(void* arg) {
+    braft::LogManager* lm = (braft::LogManager*)arg;
+    return (void*)(intptr_t)lm->wait_for_memory_budget(5000);
+}
+
+TEST_F(LogManagerTest, memory_budget) {
+    system("rm -rf ./data");
+    const int64_t saved_max_bytes = braft::FLAGS_raft_max_memory_log_bytes;
+    scoped_ptr<braft::ConfigurationManager> cm(
+            new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+            new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+
+    // Nothing is applied, all the logs stay in memory
+    const std::string data(100, 'a');
+    for (int64_t i = 1; i <= 20; ++i) {
+        ASSERT_EQ(0, append_entry(lm.get(), data, i));
+    }
+    ASSERT_EQ(20u, lm->_logs_in_memory.size());
+    ASSERT_EQ(2000, lm->_memory_log_bytes.load());
+    ASSERT_EQ(0, lm->wait_for_memory_budget(0));
+
+    braft::FLAGS_raft_max_memory_log_bytes = 1000;
+    ASSERT_EQ(EBUSY, lm->wait_for_memory_budget(0));
+    ASSERT_EQ(1, lm->_memory_log_rejected.load());
+    std::ostringstream os;
+    lm->describe(os, false);
+    ASSERT_NE(std::string::npos, os.str().find("memory_log_rejected: 1"));
+
+    // The logs on disk are dropped from memory and read from the storage
+    pthread_t tid;
+    ASSERT_EQ(0, pthread_create(&tid, NULL, wait_for_memory_budget, lm.get()));
+    usleep(10 * 1000);
+    lm->set_applied_id(braft::LogId(1, 1));
+    void* ret = NULL;
+    pthread_join(tid, &ret);
+    ASSERT_EQ(0, (int)(intptr_t)ret);
+    ASSERT_EQ(0u, lm->_logs_in_memory.size());
+    ASSERT_EQ(0, lm->_memory_log_bytes.load());
+    braft::LogEntry* entry = lm->get_entry(5);
+    ASSERT_TRUE(entry != NULL);
+    ASSERT_EQ(data, entry->data.to_string());
+    entry->Release();
+
+    braft::FLAGS_raft_max_memory_log_bytes = saved_max_bytes;
+}
+
+static braft::LogId disk_id_of(braft::LogManager* lm) {
+    BAIDU_SCOPED_LOCK(lm->_mutex);
+    return lm->_disk_id;
+}
+
+static int64_t written_index_of(braft::LogManager* lm) {
+    BAIDU_SCOPED_LOCK(lm->_mutex);
+    return lm->_written_index;
+}
+
+// Blocks the disk thread while it's run
+class BlockingClosure : public braft::LogManager::StableClosure {
+public:
+    BlockingClosure() : _running(false), _blocked(true) {}
+    void Run() {
+        _running = true;
+        while (_blocked) {
+            bthread_usleep(100);
+        }
+        delete this;
+    }
+    volatile bool _running;
+    volatile bool _blocked;
+};
+
+// A follower truncates the logs of term 3 on disk, and appends the ones of
+// term 2 from the new leader, which are applied before being written
+TEST_F(LogManagerTest, apply_lower_term_logs_before_written) {
+    system("rm -rf ./data");
+    scoped_ptr<braft::ConfigurationManager> cm(
+            new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+            new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    for (int64_t i = 1; i <= 100; ++i) {
+        ASSERT_EQ(0, append_entry(lm.get(), "old", i, i <= 90 ? 2 : 3));
+    }
+    while (disk_id_of(lm.get()) != braft::LogId(100, 3)) {
+        usleep(100);
+    }
+
+    BlockingClosure* blocking = new BlockingClosure;
+    std::vector<braft::LogEntry*> entries;
+    lm->append_entries(&entries, blocking);
+    while (!blocking->_running) {
+        usleep(100);
+    }
+    for (int64_t i = 91; i <= 95; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->data.append("new");
+        entry->id = braft::LogId(i, 2);
+        entries.push_back(entry);
+    }
+    SyncClosure sc;
+    lm->append_entries(&entries, &sc);
+    ASSERT_EQ(95, lm->last_log_index());
+
+    // Only the written logs are cleared
+    lm->set_applied_id(braft::LogId(95, 2));
+    ASSERT_EQ(91, lm->_logs_in_memory.first_index());
+    for (int64_t i = 91; i <= 95; ++i) {
+        braft::LogEntry* entry = lm->get_entry(i);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(braft::LogId(i, 2), entry->id);
+        ASSERT_EQ("new", entry->data.to_string());
+        entry->Release();
+    }
+
+    blocking->_blocked = false;
+    sc.join();
+    ASSERT_TRUE(sc.status().ok()) << sc.status();
+    ASSERT_EQ(95, storage->last_log_index());
+    for (int64_t i = 91; i <= 95; ++i) {
+        braft::LogEntry* entry = storage->get_entry(i);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(braft::LogId(i, 2), entry->id);
+        ASSERT_EQ("new", entry->data.to_string());
+        entry->Release();
+    }
+    // Cleared once written
+    while (written_index_of(lm.get()) != 95) {
+        usleep(100);
+    }
+    lm->set_applied_id(braft::LogId(95, 2));
+    ASSERT_EQ(0u, lm->_logs_in_memory.size());
+}
+
+// The logs appended after a truncate_suffix are below the stale _disk_id,
+// but must be kept in memory until written even if the budget is exceeded
+TEST_F(LogManagerTest, memory_budget_after_truncate_suffix) {
+    system("rm -rf ./data");
+    const int64_t saved_max_bytes = braft::FLAGS_raft_max_memory_log_bytes;
+    scoped_ptr<braft::ConfigurationManager> cm(
+            new braft::ConfigurationManager);
+    scoped_ptr<braft::SegmentLogStorage> storage(
+            new braft::SegmentLogStorage("./data"));
+    scoped_ptr<braft::LogManager> lm(new braft::LogManager());
+    braft::LogManagerOptions opt;
+    opt.log_storage = storage.get();
+    opt.configuration_manager = cm.get();
+    ASSERT_EQ(0, lm->init(opt));
+    for (int64_t i = 1; i <= 20; ++i) {
+        ASSERT_EQ(0, append_entry(lm.get(), "old", i, i <= 10 ? 2 : 3));
+    }
+    while (disk_id_of(lm.get()) != braft::LogId(20, 3)) {
+        usleep(100);
+    }
+
+    BlockingClosure* blocking = new BlockingClosure;
+    std::vector<braft::LogEntry*> entries;
+    lm->append_entries(&entries, blocking);
+    while (!blocking->_running) {
+        usleep(100);
+    }
+    for (int64_t i = 11; i <= 15; ++i) {
+        braft::LogEntry* entry = new braft::LogEntry;
+        entry->AddRef();
+        entry->type = braft::ENTRY_TYPE_DATA;
+        entry->data.append(std::string(100, 'n'));
+        entry->id = braft::LogId(i, 2);
+        entries.push_back(entry);
+    }
+    SyncClosure sc;
+    lm->append_entries(&entries, &sc);
+
+    braft::FLAGS_raft_max_memory_log_bytes = 100;
+    lm->set_applied_id(braft::LogId(1, 2));
+    ASSERT_EQ(11, lm->_logs_in_memory.first_index());
+    ASSERT_EQ(15, lm->_logs_in_memory.last_index());
+    for (int64_t i = 11; i <= 15; ++i) {
+        braft::LogEntry* entry = lm->get_entry(i);
+        ASSERT_TRUE(entry != NULL);
+        ASSERT_EQ(braft::LogId(i, 2), entry->id);
+        entry->Release();
+    }
+    ASSERT_FALSE(lm->_has_error.load());
+
+    blocking->_blocked = false;
+    sc.join();
+    ASSERT_TRUE(sc.status().ok()) << sc.status();
+    while (written_index_of(lm.get()) != 15) {
+        usleep(100);
+    }
+    lm->set_applied_id(braft::LogId(1, 2));
+    ASSERT_EQ(0u, lm->_logs_in_memory.size());
+    braft::LogEntry* entry = lm->get_entry(13);
+    ASSERT_TRUE(entry != NULL);
+    ASSERT_EQ(braft::LogId(13, 2), entry->id);
+    entry->Release();
+
+    braft::FLAGS_raft_max_memory_log_bytes = saved_max_bytes;
+}
@@ -4,6 +4,8 @@
 // Date: 2017/05/23
 
 #include <gtest/gtest.h>
+#include <pthread.h>
+#include <butil/string_printf.h>
 #include "braft/memory_log.h"
 
 namespace braft {
@@ -95,3 +97,81 @@ TEST_F(MemStorageTest, trunk_operation) {
     entry1->Release();
     delete log_storage;
 }
+
+struct ReadArg {
+    braft::LogStorage* storage;
+    butil::atomic<bool>* stop;
+    int64_t nread;
+};
+
+static void* read_entries(void* arg) {
+    ReadArg* ra = (ReadArg*)arg;
+    while (!ra->stop->load(butil::memory_order_relaxed)) {
+        const int64_t first = ra->storage->first_log_index();
+        const int64_t last = ra->storage->last_log_index();
+        for (int64_t index = last; index >= first && index > last - 100; --index) {
+            braft::LogEntry* entry = ra->storage->get_entry(index);
+            // the entries may be truncated concurrently
+            if (entry == NULL) {
+                continue;
+            }
+            EXPECT_EQ(index, entry->id.index);
+            EXPECT_EQ(butil::string_printf("%" PRId64, index), entry->data.to_string());
+            entry->Release();
+            ++ra->nread;
+        }
+    }
+    return NULL;
+}
+
+TEST_F(MemStorageTest, concurrent_read_and_write) {
+    braft::LogStorage* log_storage = braft::LogStorage::create("memory://data/log");
+    ASSERT_TRUE(log_storage);
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, log_storage->init(&cm));
+    butil::atomic<bool> stop(false);
+    ReadArg args[4];
+    pthread_t tids[ARRAY_SIZE(args)];
+    for (size_t i = 0; i < ARRAY_SIZE(args); ++i) {
+        args[i].storage = log_storage;
+        args[i].stop = &stop;
+        args[i].nread = 0;
+        ASSERT_EQ(0, pthread_create(&tids[i], NULL, read_entries, &args[i]));
+    }
+    // append in batches large enough to grow the ring, and truncate both
+    // ends meanwhile
+    int64_t next_index = 1;
+    for (int round = 0; round < 200; ++round) {
+        std::vector<braft::LogEntry*> entries;
+        for (int i = 0; i < round * 10 + 1; ++i) {
+            braft::LogEntry* entry = new braft::LogEntry();
+            entry->AddRef();
+            entry->type = braft::ENTRY_TYPE_DATA;
+            entry->id = braft::LogId(next_index, 1);
+            entry->data.append(butil::string_printf("%" PRId64, next_index));
+            entries.push_back(entry);
+            ++next_index;
+        }
+        ASSERT_EQ((int)entries.size(), log_storage->append_entries_in_batch(entries, NULL));
+        for (size_t i = 0; i < entries.size(); ++i) {
+            entries[i]->Release();
+        }
+        if (round % 3 == 2) {
+            ASSERT_EQ(0, log_storage->truncate_suffix(next_index - 6));
+            next_index -= 5;
+        }
+        ASSERT_EQ(0, log_storage->truncate_prefix(
+                    std::max(log_storage->first_log_index(), next_index - 3000)));
+    }
+    ASSERT_EQ(next_index - 1, log_storage->last_log_index());
+    ASSERT_EQ(next_index - 3000, log_storage->first_log_index());
+    stop.store(true);
+    for (size_t i = 0; i < ARRAY_SIZE(args); ++i) {
+        pthread_join(tids[i], NULL);
+        ASSERT_GT(args[i].nread, 0);
+    }
+    ASSERT_EQ(0, log_storage->reset(next_index + 100));
+    ASSERT_TRUE(log_storage->get_entry(next_index - 1) == NULL);
+    ASSERT_EQ(0, log_storage->get_term(next_index - 1));
+    delete log_storage;
+}
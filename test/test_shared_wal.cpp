@@ -0,0 +1,318 @@
+// Copyright (c) 2026 Baidu.com, Inc. All Rights Reserved
+
+// Author: Zhangyi Chen (chenzhangyi01@baidu.com)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <butil/file_util.h>
+#include "braft/shared_wal.h"
+#include "braft/configuration_manager.h"
+#include "dir_util.h"
+
+namespace braft {
+extern void global_init_once_or_die();
+DECLARE_int32(raft_shared_wal_segment_size);
+}
+
+class SharedWalTest : public testing::Test {
+protected:
+    void SetUp() {
+        system("rm -rf data");
+        braft::global_init_once_or_die();
+    }
+    void TearDown() {}
+};
+
+static int append(braft::LogStorage* storage, int64_t index, int64_t term,
+                  const std::string& data) {
+    braft::LogEntry* entry = new braft::LogEntry();
+    entry->AddRef();
+    entry->type = braft::ENTRY_TYPE_DATA;
+    entry->id.index = index;
+    entry->id.term = term;
+    entry->data.append(data);
+    std::vector<braft::LogEntry*> entries(1, entry);
+    const int rc = storage->append_entries(entries, NULL);
+    entry->Release();
+    return rc == 1 ? 0 : -1;
+}
+
+static std::string data_of(const std::string& group, int64_t index) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s: %ld", group.c_str(), index);
+    return buf;
+}
+
+static void check(braft::LogStorage* storage, const std::string& group,
+                  int64_t first, int64_t last, int64_t term) {
+    ASSERT_EQ(first, storage->first_log_index());
+    ASSERT_EQ(last, storage->last_log_index());
+    for (int64_t index = first; index <= last; ++index) {
+        braft::LogEntry* entry = storage->get_entry(index);
+        ASSERT_TRUE(entry != NULL) << "index=" << index;
+        ASSERT_EQ(index, entry->id.index);
+        ASSERT_EQ(term, entry->id.term);
+        ASSERT_EQ(term, storage->get_term(index));
+        ASSERT_EQ(data_of(group, index), entry->data.to_string());
+        entry->Release();
+    }
+    ASSERT_TRUE(storage->get_entry(first - 1) == NULL);
+    ASSERT_TRUE(storage->get_entry(last + 1) == NULL);
+}
+
+static size_t count_segments(const std::string& path) {
+    return count_files_with_prefix(path.c_str(), "wal_0");
+}
+
+TEST_F(SharedWalTest, append_read_and_restart) {
+    ASSERT_FALSE(braft::LogStorage::create("shared-wal://data/wal"));
+    ASSERT_FALSE(braft::LogStorage::create("shared-wal://data/wal&&group="));
+
+    braft::LogStorage* s1 =
+            braft::LogStorage::create("shared-wal://data/wal&&group=g1");
+    braft::LogStorage* s2 =
+            braft::LogStorage::create("shared-wal://data/wal&&group=g2");
+    ASSERT_TRUE(s1 && s2);
+    braft::ConfigurationManager cm1;
+    braft::ConfigurationManager cm2;
+    ASSERT_EQ(0, s1->init(&cm1));
+    ASSERT_EQ(0, s2->init(&cm2));
+    // a group can't be used twice
+    braft::LogStorage* dup =
+            braft::LogStorage::create("shared-wal://data/wal&&group=g1");
+    braft::ConfigurationManager cm;
+    ASSERT_NE(0, dup->init(&cm));
+    delete dup;
+
+    braft::LogEntry* conf = new braft::LogEntry();
+    conf->AddRef();
+    conf->type = braft::ENTRY_TYPE_CONFIGURATION;
+    conf->id.index = 1;
+    conf->id.term = 1;
+    conf->peers = new std::vector<braft::PeerId>;
+    conf->peers->push_back(braft::PeerId("127.0.0.1:8000"));
+    conf->peers->push_back(braft::PeerId("127.0.0.1:8001"));
+    ASSERT_EQ(0, s1->append_entry(conf));
+    conf->Release();
+    for (int64_t index = 1; index <= 1000; ++index) {
+        if (index > 1) {
+            ASSERT_EQ(0, append(s1, index, 1, data_of("g1", index)));
+        }
+        ASSERT_EQ(0, append(s2, index, 1, data_of("g2", index)));
+    }
+    check(s2, "g2", 1, 1000, 1);
+
+    // discard the uncommitted logs of g1 and write the ones of a new term
+    ASSERT_EQ(0, s1->truncate_suffix(500));
+    ASSERT_EQ(500, s1->last_log_index());
+    ASSERT_EQ(1, s1->get_term(500));
+    ASSERT_EQ(0, s1->get_term(501));
+    for (int64_t index = 501; index <= 800; ++index) {
+        ASSERT_EQ(0, append(s1, index, 2, data_of("g1", index)));
+    }
+    ASSERT_EQ(0, s2->truncate_prefix(301));
+    check(s2, "g2", 301, 1000, 1);
+    delete s1;
+    delete s2;
+
+    // Open the same WAL in another path as the WAL is kept opened in this
+    // process
+    ASSERT_EQ(0, system("cp -r data/wal data/wal_restart"));
+    s1 = braft::LogStorage::create("shared-wal://data/wal_restart&&group=g1");
+    s2 = braft::LogStorage::create("shared-wal://data/wal_restart&&group=g2");
+    ASSERT_EQ(0, s1->init(&cm1));
+    ASSERT_EQ(0, s2->init(&cm2));
+    braft::ConfigurationEntry conf_entry;
+    cm1.get(1, &conf_entry);
+    ASSERT_EQ(2u, conf_entry.conf.size());
+    ASSERT_EQ(800, s1->last_log_index());
+    ASSERT_EQ(1, s1->get_term(500));
+    ASSERT_EQ(2, s1->get_term(501));
+    check(s2, "g2", 301, 1000, 1);
+
+    // reset drops everything
+    ASSERT_EQ(0, s2->reset(2000));
+    ASSERT_EQ(2000, s2->first_log_index());
+    ASSERT_EQ(1999, s2->last_log_index());
+    for (int64_t index = 2000; index <= 2100; ++index) {
+        ASSERT_EQ(0, append(s2, index, 3, data_of("g2", index)));
+    }
+    check(s2, "g2", 2000, 2100, 3);
+    delete s1;
+    delete s2;
+
+    ASSERT_EQ(0, system("cp -r data/wal_restart data/wal_restart2"));
+    s2 = braft::LogStorage::create("shared-wal://data/wal_restart2&&group=g2");
+    ASSERT_EQ(0, s2->init(&cm2));
+    check(s2, "g2", 2000, 2100, 3);
+    delete s2;
+}
+
+static int append_conf(braft::LogStorage* storage, int64_t index,
+                       int64_t term, size_t npeers) {
+    braft::LogEntry* conf = new braft::LogEntry();
+    conf->AddRef();
+    conf->type = braft::ENTRY_TYPE_CONFIGURATION;
+    conf->id.index = index;
+    conf->id.term = term;
+    conf->peers = new std::vector<braft::PeerId>;
+    for (size_t i = 0; i < npeers; ++i) {
+        conf->peers->push_back(braft::PeerId(butil::EndPoint(
+                        butil::IP_ANY, 8000 + i)));
+    }
+    const int rc = storage->append_entry(conf);
+    conf->Release();
+    return rc;
+}
+
+TEST_F(SharedWalTest, reattach_in_process) {
+    const std::string uri = "shared-wal://data/wal_reattach&&group=g1";
+    braft::LogStorage* s1 = braft::LogStorage::create(uri);
+    ASSERT_TRUE(s1);
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, s1->init(&cm));
+    ASSERT_EQ(0, append_conf(s1, 1, 1, 1));
+    for (int64_t index = 2; index <= 10; ++index) {
+        ASSERT_EQ(0, append(s1, index, 1, data_of("g1", index)));
+    }
+    ASSERT_EQ(0, append_conf(s1, 11, 1, 3));
+    for (int64_t index = 12; index <= 20; ++index) {
+        ASSERT_EQ(0, append(s1, index, 1, data_of("g1", index)));
+    }
+    ASSERT_EQ(0, append_conf(s1, 21, 1, 5));
+    // drops the configurations at 1 and 21
+    ASSERT_EQ(0, s1->truncate_prefix(5));
+    ASSERT_EQ(0, s1->truncate_suffix(20));
+    delete s1;
+
+    // The WAL is still opened by this process, the group is attached from
+    // the index kept in memory
+    s1 = braft::LogStorage::create(uri);
+    braft::ConfigurationManager cm1;
+    ASSERT_EQ(0, s1->init(&cm1));
+    ASSERT_EQ(5, s1->first_log_index());
+    ASSERT_EQ(20, s1->last_log_index());
+    ASSERT_EQ(11, cm1.last_configuration().id.index);
+    braft::ConfigurationEntry conf_entry;
+    cm1.get(20, &conf_entry);
+    ASSERT_EQ(11, conf_entry.id.index);
+    ASSERT_EQ(3u, conf_entry.conf.size());
+
+    // attached again after a configuration appended and a reset
+    ASSERT_EQ(0, append_conf(s1, 21, 2, 5));
+    delete s1;
+    s1 = braft::LogStorage::create(uri);
+    braft::ConfigurationManager cm2;
+    ASSERT_EQ(0, s1->init(&cm2));
+    ASSERT_EQ(21, cm2.last_configuration().id.index);
+    ASSERT_EQ(5u, cm2.last_configuration().conf.size());
+    ASSERT_EQ(0, s1->reset(100));
+    delete s1;
+    s1 = braft::LogStorage::create(uri);
+    braft::ConfigurationManager cm3;
+    ASSERT_EQ(0, s1->init(&cm3));
+    ASSERT_EQ(100, s1->first_log_index());
+    ASSERT_TRUE(cm3.last_configuration().empty());
+    delete s1;
+}
+
+TEST_F(SharedWalTest, segment_gc) {
+    const int32_t saved_segment_size = braft::FLAGS_raft_shared_wal_segment_size;
+    braft::FLAGS_raft_shared_wal_segment_size = 16 * 1024;
+    braft::LogStorage* s1 =
+            braft::LogStorage::create("shared-wal://data/wal_gc&&group=g1");
+    braft::LogStorage* s2 =
+            braft::LogStorage::create("shared-wal://data/wal_gc&&group=g2");
+    braft::ConfigurationManager cm1;
+    braft::ConfigurationManager cm2;
+    ASSERT_EQ(0, s1->init(&cm1));
+    ASSERT_EQ(0, s2->init(&cm2));
+    for (int64_t index = 1; index <= 2000; ++index) {
+        ASSERT_EQ(0, append(s1, index, 1, data_of("g1", index)));
+        ASSERT_EQ(0, append(s2, index, 1, data_of("g2", index)));
+    }
+    const size_t nsegments = count_segments("data/wal_gc");
+    ASSERT_GT(nsegments, 5u);
+
+    // segments are kept as long as any group references them
+    ASSERT_EQ(0, s1->truncate_prefix(1900));
+    ASSERT_EQ(nsegments, count_segments("data/wal_gc"));
+    ASSERT_EQ(0, s2->truncate_prefix(1900));
+    ASSERT_LT(count_segments("data/wal_gc"), 4u);
+    check(s1, "g1", 1900, 2000, 1);
+    check(s2, "g2", 1900, 2000, 1);
+
+    // the logs of a removed group don't hold the segments
+    for (int64_t index = 2001; index <= 3000; ++index) {
+        ASSERT_EQ(0, append(s2, index, 1, data_of("g2", index)));
+    }
+    delete s1;
+    ASSERT_TRUE(braft::LogStorage::destroy(
+                "shared-wal://data/wal_gc&&group=g1").ok());
+    ASSERT_FALSE(braft::LogStorage::destroy(
+                "shared-wal://data/wal_gc&&group=g2").ok());
+    ASSERT_EQ(0, s2->truncate_prefix(2990));
+    ASSERT_LT(count_segments("data/wal_gc"), 3u);
+    check(s2, "g2", 2990, 3000, 1);
+    delete s2;
+    braft::FLAGS_raft_shared_wal_segment_size = saved_segment_size;
+}
+
+static int write_file_at(const std::string& path, off_t offset,
+                         const std::string& data) {
+    const int fd = ::open(path.c_str(), O_WRONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    const ssize_t n = offset < 0
+            ? ::pwrite(fd, data.data(), data.size(), ::lseek(fd, 0, SEEK_END))
+            : ::pwrite(fd, data.data(), data.size(), offset);
+    ::close(fd);
+    return n == (ssize_t)data.size() ? 0 : -1;
+}
+
+TEST_F(SharedWalTest, corrupted_segments) {
+    const int32_t saved_segment_size = braft::FLAGS_raft_shared_wal_segment_size;
+    braft::FLAGS_raft_shared_wal_segment_size = 16 * 1024;
+    braft::LogStorage* s1 =
+            braft::LogStorage::create("shared-wal://data/wal_corrupt&&group=g1");
+    braft::ConfigurationManager cm;
+    ASSERT_EQ(0, s1->init(&cm));
+    for (int64_t index = 1; index <= 200; ++index) {
+        ASSERT_EQ(0, append(s1, index, 1, data_of("g1", index)
+                                          + std::string(200, 'a')));
+    }
+    delete s1;
+    const size_t nsegments = count_segments("data/wal_corrupt");
+    ASSERT_GT(nsegments, 2u);
+
+    // The broken tail of the last segment is cut off
+    ASSERT_EQ(0, system("cp -r data/wal_corrupt data/wal_broken_tail"));
+    char last_segment[64];
+    snprintf(last_segment, sizeof(last_segment),
+             "data/wal_broken_tail/wal_%010lu", nsegments);
+    int64_t size = 0;
+    ASSERT_TRUE(butil::GetFileSize(butil::FilePath(last_segment), &size));
+    ASSERT_EQ(0, write_file_at(last_segment, -1, std::string(100, 'x')));
+    s1 = braft::LogStorage::create("shared-wal://data/wal_broken_tail&&group=g1");
+    braft::ConfigurationManager cm1;
+    ASSERT_EQ(0, s1->init(&cm1));
+    ASSERT_EQ(200, s1->last_log_index());
+    int64_t truncated_size = 0;
+    ASSERT_TRUE(butil::GetFileSize(butil::FilePath(last_segment),
+                                   &truncated_size));
+    ASSERT_EQ(size, truncated_size);
+    delete s1;
+
+    // The records in the segments before are acked
+    ASSERT_EQ(0, system("cp -r data/wal_corrupt data/wal_broken_middle"));
+    ASSERT_EQ(0, write_file_at("data/wal_broken_middle/wal_0000000001", 100,
+                               "xxxx"));
+    s1 = braft::LogStorage::create("shared-wal://data/wal_broken_middle&&group=g1");
+    braft::ConfigurationManager cm2;
+    ASSERT_NE(0, s1->init(&cm2));
+    delete s1;
+
+    braft::FLAGS_raft_shared_wal_segment_size = saved_segment_size;
+}